@@ -4,27 +4,32 @@ import sys
 
 NUM_SLOTS = 32
 
+# bp_test_pi builds on the Pi. The pi_hpread fork only has the original menu,
+# R, U and C are in the pi/pi_dwords build.
+PI_HPREAD_DIR = "/home/pi/Desktop/pi_hpread"
+PI_DWORDS_DIR = "/home/pi/Desktop/pi_dwords"
+
 # connect to pi, navigate to program and execute it
-def executeConnection():
+def executeConnection(directory="/home/pi/Desktop/BP_SPI_interface"):
     # Start ssh application
     ssh = pexpect.spawn('ssh pi@172.17.2.6', timeout=50)
     ssh.expect('$')
     # Navigate to directory
     # ssh.sendline("cd /home/pi/Desktop/BP_SPI_interface")
-    ssh.sendline("cd /home/pi/Desktop/BP_SPI_interface")
+    ssh.sendline("cd " + directory)
     ssh.expect('$')
     # Execute program
     ssh.sendline("sudo ./bp_test_pi")
     ssh.expect('exit')  # last line of program prompt
     return ssh
 
-def executeConnectionForHitpattern():
+def executeConnectionForHitpattern(directory=PI_HPREAD_DIR):
     # Start ssh application
     ssh = pexpect.spawn('ssh pi@172.17.2.6', timeout=50)
     ssh.expect('$')
     # Navigate to directory
     # ssh.sendline("cd /home/pi/Desktop/BP_SPI_interface")
-    ssh.sendline("cd /home/pi/Desktop/pi_hpread")
+    ssh.sendline("cd " + directory)
     ssh.expect('$')
     # Execute program
     ssh.sendline("sudo ./bp_test_pi")
@@ -50,6 +55,21 @@ def recordHitpatternFile(ssh, rate, duration):
     ssh.sendline(str(duration))
     print("recordHitpatternFile() executed")
 
+# hit patterns at a rate following the trigger rate, bounds in hp_rate.yml on the Pi.
+# Menu 'R' is only in the pi_dwords build, so ssh has to come from
+# executeConnectionForHitpattern(PI_DWORDS_DIR); fmt '9' writes hitpattern.txt
+# like recordHitpatternFile
+def recordHitpatternAdaptive(ssh, duration, fmt="9"):
+    ssh.sendline("R")
+    # Prompt for the format, or the older builds' answer to a key they do not know
+    if ssh.expect(["Enter", "unused key"]) == 1:
+        raise RuntimeError("bp_test_pi on the Pi has no menu R (adaptive hit pattern rate), "
+                           "connect with executeConnectionForHitpattern(PI_DWORDS_DIR)")
+    ssh.sendline(fmt)
+    ssh.expect("Enter")  # Prompt for the duration in s
+    ssh.sendline(str(duration))
+    print("recordHitpatternAdaptive() executed")
+
 def moveHitpatternFile(ssh, runID):
     print("Trying moveHitpatternFile()")
     ssh.sendline("x")
@@ -94,17 +114,42 @@ def getTimingInformation(ssh):
     clock_time = ssh.before.decode().strip().split(' ')
     return int(clock_time[-1])
 
+def requestChangedHousekeeping(ssh):
+    '''FEE I/V and ENV values that moved past their deadband, raised or
+    cleared an alarm, or are due a heartbeat since the last call (menu C,
+    hskp_deadband.yml on the Pi). Returns {channel: (value, reason)}.'''
+    values = {}
+    ssh.sendline("C")
+    while True:
+        ssh.expect(r"HK (\S+) (\S+) ([^\r\n]*)\r?\n")
+        name, value, reason = [g.decode() for g in ssh.match.groups()]
+        if name == "end":
+            return values
+        values[name] = (float(value), reason)
+
 def setTrigAtTime(ssh, des_time, until=True):
     '''
     Args:
     ssh: duh
-    until(int): time until the desired trigger, in ns
+    until(int): time until the desired trigger, in ns. The Pi schedules
+    it from its own nsTimer read (menu U), and never sooner than the safe
+    lead of its trigger_at_time.yml (menu L). Menu U is only in the
+    pi_dwords build, connect with executeConnection(PI_DWORDS_DIR) if
+    BP_SPI_interface holds an older one. Raises RuntimeError if the Pi
+    does not know menu U or did not schedule the trigger.
     '''
     if until:
-        current_time = getTimingInformation(ssh)
-        trigger_time = current_time + des_time
-    else:
-        trigger_time = des_time
+        ssh.sendline("U")
+        if ssh.expect([r"\[ns\]: ", "unused key"]) == 1:
+            raise RuntimeError("bp_test_pi on the Pi has no menu U (trigger at time after a lead), "
+                               "connect with executeConnection(PI_DWORDS_DIR)")
+        ssh.sendline(str(int(des_time)))
+        if ssh.expect(["Trigger at nsTimer ([0-9]+) ns", "Trigger at time refused: ([^\r\n]*)"]) == 1:
+            raise RuntimeError("trigger at time refused by the Pi: " + ssh.match.group(1).decode())
+        trigger_time = int(ssh.match.group(1))
+        print("The time: ", trigger_time, hex(trigger_time))
+        return trigger_time
+    trigger_time = des_time
     trigger_time_hex = hex(trigger_time)[2:]
     trigger_time_hex = "0"*(16-len(trigger_time_hex))+trigger_time_hex
     ssh.sendline("d")
@@ -120,7 +165,7 @@ def setTrigAtTime(ssh, des_time, until=True):
     ssh.expect("hex: ")
     #print(trigger_time_hex[12:16]
     ssh.sendline(trigger_time_hex[12:16])
-    print("The times: ", current_time, trigger_time, hex(trigger_time))
+    print("The time: ", trigger_time, hex(trigger_time))
 
     #do something afterwards? No, that will be in brendan_DataGathering.py
     return trigger_time
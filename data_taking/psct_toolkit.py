@@ -841,7 +841,8 @@ class DataTaker(PsctTool):
                  triggerDly=648, addBias=0, packetSeparation=1000,
                  packetDelay=0, read_adc_period=30, read_temperatures=False,
                  read_currents=False, pSocketBufferSize=999424, run_info=None,
-                 retry=False, n_retry=1, tuning_temp=None, new_tune=False, pmtref4voltage=1.25, thresh_type="static_thresh"):
+                 retry=False, n_retry=1, tuning_temp=None, new_tune=False, pmtref4voltage=1.25, thresh_type="static_thresh",
+                 hitpattern_rate=10):
         super().__init__(moduleIDList, trigger_modules, HVon=HVon,
                          numBlock=numBlock, static_threshold_us=static_threshold_us, static_threshold_infn = static_threshold_infn, 
                          pe_threshold_us=pe_threshold_us, pe_threshold_infn=pe_threshold_infn,
@@ -869,7 +870,11 @@ class DataTaker(PsctTool):
         self.calFrequency = 100
         self.runDuration = run_duration
         self.actual_duration = 0
-        self.pi_hitpattern = piCom.executeConnectionForHitpattern()
+        # hit pattern snapshots per second, or "adaptive" to follow the trigger rate
+        self.hitpatternRate = hitpattern_rate
+        # the adaptive rate (menu R) needs the pi_dwords build of bp_test_pi
+        self.pi_hitpattern = piCom.executeConnectionForHitpattern(
+            piCom.PI_DWORDS_DIR if hitpattern_rate == "adaptive" else piCom.PI_HPREAD_DIR)
 
         self.run_info = run_info
         if self.run_info is None:
@@ -939,7 +944,10 @@ class DataTaker(PsctTool):
 
     def prepareReadout(self):
         self.listener = target_io.DataListener(self.kBufferDepth, self.packetsPerEvent, self.kPacketSize)
-        piCom.recordHitpatternFile(self.pi_hitpattern, 10, self.runDuration-1)
+        if self.hitpatternRate == "adaptive":
+            piCom.recordHitpatternAdaptive(self.pi_hitpattern, self.runDuration-1)
+        else:
+            piCom.recordHitpatternFile(self.pi_hitpattern, self.hitpatternRate, self.runDuration-1)
         #piCom.recordHitpatternFile(self.pi, 100, self.runDuration-1)
         for module in self.moduleList:
             module.DataPortPing()
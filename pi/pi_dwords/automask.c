@@ -0,0 +1,252 @@
+/*
+ ============================================================================
+ Name        : automask.c
+ Description : Closed-loop masking of noisy trigger pixels.
+               The hit pattern latched at a trigger shows which trigger
+               pixels took part, so a pixel's trigger rate is estimated as
+               its occupancy over the window times the HW trigger rate from
+               the TFPGA counters. A pixel above the configured rate has its
+               group masked by resending only the SPI_TRIGGERMASK*_TFPGA frame
+               holding its word. Actions are rate limited, auto-masked pixels
+               are unmasked again after a hold time, bits set in the mask the
+               loop started from are never touched, every action is logged
+               and the effective mask is exported in the schema of
+               data_taking/masked_trigger_pixels.yml.
+ ============================================================================
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "spicomms.h"
+#include "bp_config.h"
+#include "bp_fault.h"
+#include "automask.h"
+
+static void log_line(struct automask *am, const char *fmt_action, int slot, int bit, double rate) {
+	char buff[32];
+	time_t t = time(NULL);
+
+	strftime(buff, sizeof(buff), "%Y-%m-%d %H:%M:%S", gmtime(&t));
+	printf("automask %s UTC %s module %d (slot %d) pixel %d rate %.1f Hz, HW trigger rate %.1f Hz\n",
+		buff, fmt_action, am->fpm.module_id[slot], slot, bit, rate, am->trigger_rate_hz);
+	if (am->log != NULL) {
+		fprintf(am->log, "%s %s module %d slot %d pixel %d rate %.1f trigger_rate %.1f\n",
+			buff, fmt_action, am->fpm.module_id[slot], slot, bit, rate, am->trigger_rate_hz);
+		fflush(am->log);
+	}
+}
+
+int automask_init(struct automask *am, const char *config_file) {
+	struct bp_config cfg;
+
+	memset(am, 0, sizeof(*am));
+	if (bp_config_load(&cfg, config_file) != 0)
+		return -1;
+	am->pixel_rate_hz = bp_config_double(&cfg, "pixel_rate_hz", 50);
+	am->min_trigger_rate_hz = bp_config_double(&cfg, "min_trigger_rate_hz", 0);
+	am->window_s = bp_config_double(&cfg, "window_s", 10);
+	am->min_samples = bp_config_double(&cfg, "min_samples", 200);
+	am->min_pixel_hits = bp_config_double(&cfg, "min_pixel_hits", 10);
+	am->eval_interval_s = bp_config_double(&cfg, "eval_interval_s", 1);
+	am->max_actions_per_min = bp_config_double(&cfg, "max_actions_per_min", 4);
+	am->unmask_hold_s = bp_config_double(&cfg, "unmask_hold_s", 300);
+	snprintf(am->log_file, sizeof(am->log_file), "%s", bp_config_string(&cfg, "log_file", "automask.log"));
+	snprintf(am->export_file, sizeof(am->export_file), "%s",
+		bp_config_string(&cfg, "export_file", "masked_trigger_pixels_auto.yml"));
+	if (am->window_s < 1 || am->window_s > HP_OCC_NSLICES)
+		am->window_s = 10;
+	if (am->max_actions_per_min > AUTOMASK_MAX_ACTIONS)
+		am->max_actions_per_min = AUTOMASK_MAX_ACTIONS;
+
+	if (fpm_config_load(&am->fpm, bp_config_string(&cfg, "fpm_config", "FPM_config.csv")) != 0)
+		return -1;
+	if (!trigger_mask_valid) {
+		printf("Set the trigger mask ('j', '5' or '8') before enabling automatic masking\n");
+		return -1;
+	}
+	memcpy(am->base_mask, trigger_mask, sizeof(am->base_mask));
+
+	am->log = fopen(am->log_file, "a");
+	if (am->log == NULL)
+		perror(am->log_file);
+	printf("Automatic masking above %.1f Hz per pixel over %d s, HW trigger rate above %.1f Hz,\n",
+		am->pixel_rate_hz, am->window_s, am->min_trigger_rate_hz);
+	printf("once the window holds %d hit patterns and the pixel %d hits,\n", am->min_samples, am->min_pixel_hits);
+	printf("at most %d actions per minute, unmask after %.0f s, log %s, mask exported to %s\n",
+		am->max_actions_per_min, am->unmask_hold_s, am->log_file, am->export_file);
+	return 0;
+}
+
+static void read_trigger_rate(struct automask *am) {
+	unsigned short spi_message[11], data[11];
+	unsigned long long nstime;
+	unsigned long hwtriggers;
+	int i;
+
+	spi_message[0] = SPI_SOM_TFPGA; //som
+	spi_message[1] = SPI_READ_nsTimer_TFPGA; //cw
+	for (i = 2; i < 10; i++)
+		spi_message[i] = i - 1;
+	spi_message[10] = SPI_EOM_TFPGA; //not used
+	if (transfer_checked("automask", spi_message, data) != 0) {
+		am->have_counts = 0;   // no rate until two good reads in a row
+		return;
+	}
+
+	nstime = ( ((unsigned long long) data[2] << 48) |
+		   ((unsigned long long) data[3] << 32) |
+		   ((unsigned long long) data[4] << 16) |
+		   ((unsigned long long) data[5]      ));
+	hwtriggers = ((unsigned long) data[8] << 16) | data[9];
+	if (am->have_counts && nstime > am->last_nstime) {
+		am->trigger_rate_hz = (double) ((hwtriggers - am->last_hwtriggers) & 0xffffffffUL)
+			/ ((nstime - am->last_nstime) * 1e-9);
+		am->have_counts = 2;
+	} else {
+		am->have_counts = 1; // first read or the TFPGA counters were reset
+	}
+	am->last_nstime = nstime;
+	am->last_hwtriggers = hwtriggers;
+}
+
+static int rate_limited(const struct automask *am, unsigned long long now_ns) {
+	int i, recent = 0;
+	for (i = 0; i < AUTOMASK_MAX_ACTIONS; i++)
+		if (am->action_ns[i] != 0 && now_ns - am->action_ns[i] < 60000000000ULL)
+			recent++;
+	return recent >= am->max_actions_per_min;
+}
+
+static void record_action(struct automask *am, unsigned long long now_ns) {
+	am->action_ns[am->naction % AUTOMASK_MAX_ACTIONS] = now_ns;
+	am->naction++;
+}
+
+void automask_step(struct automask *am, const struct hp_occupancy *occ, unsigned long long now_ns) {
+	unsigned long long counts[HP_NPIXELS], nsamples, best;
+	int b, word, bit, slot, p, best_p, changed = 0;
+	double rate;
+
+	if (am->last_eval_ns != 0 && now_ns - am->last_eval_ns < am->eval_interval_s * 1e9)
+		return;
+	am->last_eval_ns = now_ns;
+	read_trigger_rate(am);
+	if (am->have_counts < 2)
+		return;
+
+	// Retry auto-masked pixels whose hold time is over
+	for (b = 0; b < 16 * TRIGGER_MASK_NWORDS; b++) {
+		if (am->masked_ns[b] == 0 || now_ns - am->masked_ns[b] < am->unmask_hold_s * 1e9)
+			continue;
+		if (rate_limited(am, now_ns))
+			break;
+		word = b / 16;
+		bit = b % 16;
+		if (am->base_mask[word] & (1 << bit)) {
+			am->masked_ns[b] = 0;   // masked on entry as well, left to the operator
+			continue;
+		}
+		trigger_mask[word] &= ~(1 << bit);
+		if (trigger_mask_write_frame(word / 8) != 0) {
+			trigger_mask[word] |= 1 << bit;   // still masked in the TFPGA, retried next time
+			break;
+		}
+		am->masked_ns[b] = 0;
+		record_action(am, now_ns);
+		log_line(am, "unmask", fpm_config_slot_of_mask_word(&am->fpm, word), bit, 0);
+		changed = 1;
+	}
+
+	if (am->trigger_rate_hz >= am->min_trigger_rate_hz) {
+		// Too few patterns and a few chance hits look like a hot pixel
+		nsamples = hp_occupancy_window(occ, am->window_s, now_ns, counts);
+		if (nsamples < (unsigned long long) am->min_samples)
+			nsamples = 0;
+		while (nsamples > 0 && !rate_limited(am, now_ns)) {
+			// hottest pixel that is mapped to a trigger mask word and still enabled
+			best = 0;
+			best_p = -1;
+			for (p = 0; p < HP_NPIXELS; p++) {
+				slot = p / 16;
+				word = am->fpm.mask_word[slot];
+				if (counts[p] <= best || word < 0 || word >= TRIGGER_MASK_NWORDS)
+					continue;
+				if ((trigger_mask[word] | am->base_mask[word]) & (1 << (p % 16)))
+					continue;
+				best = counts[p];
+				best_p = p;
+			}
+			if (best_p < 0 || best < (unsigned long long) am->min_pixel_hits)
+				break;
+			rate = (double) best / nsamples * am->trigger_rate_hz;
+			if (rate <= am->pixel_rate_hz)
+				break;
+			slot = best_p / 16;
+			bit = best_p % 16;
+			word = am->fpm.mask_word[slot];
+			trigger_mask[word] |= 1 << bit;
+			if (trigger_mask_write_frame(word / 8) != 0) {
+				trigger_mask[word] &= ~(1 << bit);
+				break;
+			}
+			am->masked_ns[16 * word + bit] = now_ns;
+			record_action(am, now_ns);
+			log_line(am, "mask", slot, bit, rate);
+			changed = 1;
+		}
+	}
+
+	if (changed)
+		automask_export(am, am->export_file);
+}
+
+/* Write the effective mask as module_id: [masked pixels], modules with
+   nothing masked omitted, the schema of masked_trigger_pixels*.yml. */
+int automask_export(const struct automask *am, const char *filename) {
+	int order[FPM_NSLOTS], n = 0, i, j, slot, word, bit, first;
+	char buff[32];
+	time_t t = time(NULL);
+	FILE *fptr;
+
+	for (slot = 0; slot < FPM_NSLOTS; slot++) {
+		if (am->fpm.module_id[slot] < 0 || am->fpm.mask_word[slot] < 0)
+			continue;
+		for (i = n; i > 0 && am->fpm.module_id[order[i-1]] > am->fpm.module_id[slot]; i--)
+			order[i] = order[i-1];
+		order[i] = slot;
+		n++;
+	}
+
+	fptr = fopen(filename, "w");
+	if (fptr == NULL) {
+		perror(filename);
+		return -1;
+	}
+	strftime(buff, sizeof(buff), "%Y-%m-%d %H:%M:%S", gmtime(&t));
+	fprintf(fptr, "# Effective trigger mask %s UTC, written by bp_test_pi automatic masking\n", buff);
+	for (j = 0; j < n; j++) {
+		slot = order[j];
+		word = am->fpm.mask_word[slot];
+		if (trigger_mask[word] == 0)
+			continue;
+		fprintf(fptr, "%d: [", am->fpm.module_id[slot]);
+		for (bit = 0, first = 1; bit < 16; bit++) {
+			if (trigger_mask[word] & (1 << bit)) {
+				fprintf(fptr, first ? "%d" : ",%d", bit);
+				first = 0;
+			}
+		}
+		fprintf(fptr, "]\n");
+	}
+	return fclose(fptr);
+}
+
+void automask_close(struct automask *am) {
+	automask_export(am, am->export_file);
+	if (am->log != NULL)
+		fclose(am->log);
+	am->log = NULL;
+	printf("Automatic masking off after %d actions, mask exported to %s\n", am->naction, am->export_file);
+}
@@ -0,0 +1,50 @@
+/*
+ ============================================================================
+ Name        : automask.h
+ Description : Closed-loop masking of noisy trigger pixels
+ ============================================================================
+ */
+#ifndef AUTOMASK_H
+#define AUTOMASK_H
+
+#include <stdio.h>
+
+#include "fpm_config.h"
+#include "hp_occupancy.h"
+#include "trigger_mask.h"
+
+#define AUTOMASK_MAX_ACTIONS 64
+
+struct automask {
+	/* configuration, see automask.yml */
+	double pixel_rate_hz;        // mask a pixel whose trigger rate exceeds this
+	double min_trigger_rate_hz;  // only act while the HW trigger rate is above this
+	int window_s;                // occupancy window the pixel rate is taken over
+	int min_samples;             // hit patterns the window must hold before the loop acts
+	int min_pixel_hits;          // and hits of a pixel before it can be masked
+	double eval_interval_s;
+	int max_actions_per_min;
+	double unmask_hold_s;        // time an auto-masked pixel stays masked
+	char log_file[208];
+	char export_file[208];
+	struct fpm_config fpm;
+
+	/* state */
+	unsigned short base_mask[TRIGGER_MASK_NWORDS];  // mask when enabled, never cleared by the loop
+	unsigned long long masked_ns[16 * TRIGGER_MASK_NWORDS]; // when the loop masked mask bit 16*word+bit, 0 if not
+	unsigned long long action_ns[AUTOMASK_MAX_ACTIONS];     // ring of recent action times for rate limiting
+	int naction;
+	unsigned long long last_eval_ns;
+	unsigned long long last_nstime;
+	unsigned long last_hwtriggers;
+	double trigger_rate_hz;
+	int have_counts;
+	FILE *log;
+};
+
+int automask_init(struct automask *am, const char *config_file);
+void automask_step(struct automask *am, const struct hp_occupancy *occ, unsigned long long now_ns);
+int automask_export(const struct automask *am, const char *filename);
+void automask_close(struct automask *am);
+
+#endif
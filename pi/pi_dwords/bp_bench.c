@@ -0,0 +1,376 @@
+/*
+ ============================================================================
+ Name        : bp_bench.c
+ Description : Benchmarks of the Pi control stack, run off the telescope
+               against a loopback link and the emulated backplane, with
+               the results as JSON tagged with the git revision and CPU so
+               that commits, and a Pi against a PC, can be compared.
+
+               bp_bench [-c hp_gen.yml] [-f faults.yml] [-t seconds]
+                        [-n samples] [-d dir] [-o bench.json]
+
+               Measures transfer_message() frames/s (loopback and
+               emulated), hit pattern reads/s (the 5 frames of a read),
+               latest-state snapshots/s from the acquisition threads, FEE
+               housekeeping sweep latency, formatter and recording
+               throughput per output format ('$' binary, '*' dwords, '9'
+               picture) and hp_file_load() decoding throughput of the
+               recordings. -f puts the fault injection layer in front of
+               the emulator. Recordings go to dir (default /tmp) and are
+               removed afterwards, the JSON to bench.json ("-o -" for
+               stdout).
+ ============================================================================
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/utsname.h>
+
+#include "spicomms.h"
+#include "bp_emulator.h"
+#include "bp_fault.h"
+#include "bp_live.h"
+#include "hskp_burst.h"
+#include "hp_file.h"
+#include "hp_format.h"
+
+#ifndef BP_GIT_REV
+#define BP_GIT_REV "unknown"
+#endif
+
+#define NFRAMESETS 4096   // recorded hit pattern reads replayed by the formatter runs
+
+static const unsigned short hit_pattern_cw[4] = {
+	SPI_READ_HIT_PATTERN, SPI_READ_HIT_PATTERN1, SPI_READ_HIT_PATTERN2, SPI_READ_HIT_PATTERN3
+};
+
+static const int formats[3] = { HP_FILE_BINARY, HP_FILE_DWORDS, HP_FILE_PICTURE };
+
+static bp_transfer_fn backend;
+static FILE *out;
+static int nresults;
+static double seconds = 1.0;
+
+/* The pieces of bp_test_pi the library objects call */
+void transfer_message(unsigned short *message, unsigned short *data) {
+	if (bp_fault_enabled)
+		bp_fault_transfer(message, data);
+	else
+		backend(message, data);
+}
+
+unsigned long long monotonic_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void us_sleep(int us) {
+	struct timespec ts;
+	ts.tv_sec = 0;
+	ts.tv_nsec = us * 1000L;
+	nanosleep(&ts, NULL);
+}
+
+/* The FPGA as seen with SPI_WRAP_AROUND: the message comes back */
+static void loopback(const unsigned short *message, unsigned short *data) {
+	memcpy(data, message, 10 * sizeof(*data));
+	data[10] = message[0] == SPI_SOM_TFPGA ? SPI_EOM_TFPGA : SPI_EOM_HKFPGA;
+}
+
+static void tfpga_message(unsigned short *spi_message, unsigned short cw) {
+	int i;
+
+	spi_message[0] = SPI_SOM_TFPGA; // som
+	spi_message[1] = cw; // cw
+	for (i = 2; i < 10; i++)
+		spi_message[i] = i - 1;
+	spi_message[10] = SPI_EOM_TFPGA; // not used
+}
+
+/* One "name": {fields} entry of "results" */
+static void result(const char *name, const char *fmt, ...) {
+	va_list ap;
+
+	fprintf(out, "%s\n    \"%s\": {", nresults++ ? "," : "", name);
+	va_start(ap, fmt);
+	vfprintf(out, fmt, ap);
+	va_end(ap);
+	fprintf(out, "}");
+	fflush(out);
+}
+
+static double elapsed_s(unsigned long long t0) {
+	return (monotonic_ns() - t0) * 1e-9;
+}
+
+static void cpu_model(char *model, int size) {
+	char line[256], *v;
+	FILE *fptr = fopen("/proc/cpuinfo", "r");
+
+	snprintf(model, size, "unknown");
+	if (fptr == NULL)
+		return;
+	while (fgets(line, sizeof(line), fptr) != NULL) {
+		// "model name" on x86, "Model" (board) on a Pi, first one wins
+		if ((strncmp(line, "model name", 10) == 0 || strncmp(line, "Model", 5) == 0) &&
+		    (v = strchr(line, ':')) != NULL) {
+			v += 1 + strspn(v + 1, " \t");
+			v[strcspn(v, "\n\"\\")] = '\0';
+			snprintf(model, size, "%s", v);
+			break;
+		}
+	}
+	fclose(fptr);
+}
+
+static void bench_transfer(const char *name, bp_transfer_fn fn, unsigned short cw) {
+	unsigned short spi_message[11], data[11];
+	unsigned long long t0, n = 0;
+	bp_transfer_fn saved = backend;
+	int i;
+
+	backend = fn;
+	tfpga_message(spi_message, cw);
+	t0 = monotonic_ns();
+	do {
+		for (i = 0; i < 256; i++)
+			transfer_message(spi_message, data);
+		n += 256;
+	} while (elapsed_s(t0) < seconds);
+	result(name, "\"frames\": %llu, \"frames_per_s\": %.0f", n, n / elapsed_s(t0));
+	backend = saved;
+}
+
+/* nsTimer/counters frame and the four hit pattern frames, as bp_live reads */
+static int read_pattern(unsigned short frames[4][11]) {
+	unsigned short spi_message[11], counters[11];
+	int f;
+
+	tfpga_message(spi_message, SPI_READ_nsTimer_TFPGA);
+	if (transfer_checked("bench", spi_message, counters) != 0)
+		return -1;
+	for (f = 0; f < 4; f++) {
+		spi_message[1] = hit_pattern_cw[f];
+		if (transfer_checked("bench", spi_message, frames[f]) != 0)
+			return -1;
+	}
+	return 0;
+}
+
+static void bench_hit_pattern_read(void) {
+	unsigned short frames[4][11];
+	unsigned long long t0, n = 0, failed = 0;
+
+	t0 = monotonic_ns();
+	do {
+		failed += read_pattern(frames) != 0;
+		n++;
+	} while ((n & 63) || elapsed_s(t0) < seconds);
+	result("hit_pattern_read", "\"reads\": %llu, \"reads_per_s\": %.0f, \"failed\": %llu", n, n / elapsed_s(t0), failed);
+}
+
+static void bench_live_snapshot(void) {
+	static struct bp_live live;
+	struct bp_live_trigger st;
+	unsigned long long t0, n = 0;
+	volatile unsigned long long sink;   // every copy is read, LTO cannot drop it
+
+	memset(&live, 0, sizeof(live));
+	live.trigger_period_ms = 1;
+	live.hskp_period_ms = 100;
+	live.hskp_settle_ms = 1;
+	live.rate_window_s = 1;
+	if (bp_live_start(&live) != 0) {
+		result("live_snapshot", "\"error\": \"threads not started\"");
+		return;
+	}
+	t0 = monotonic_ns();
+	do {
+		bp_live_trigger(&live, &st);
+		sink = st.nreads + st.hit_pattern[n % HP_NWORDS];
+		n++;
+	} while ((n & 1023) || elapsed_s(t0) < seconds);
+	result("live_snapshot", "\"snapshots\": %llu, \"snapshots_per_s\": %.0f, \"thread_reads_per_s\": %.0f",
+		n, n / elapsed_s(t0), st.nreads / elapsed_s(t0));
+	bp_live_stop(&live);
+}
+
+static int cmp_double(const void *a, const void *b) {
+	double x = *(const double *) a, y = *(const double *) b;
+	return x < y ? -1 : x > y;
+}
+
+static void bench_hskp_sweep(void) {
+	unsigned short row[HSKP_NCHAN];
+	unsigned long long t0, t;
+	double *lat, sum = 0;
+	int n = 0, cap = 1 << 20, failed = 0;
+
+	lat = malloc(cap * sizeof(*lat));
+	if (lat == NULL)
+		return;
+	t0 = monotonic_ns();
+	do {
+		t = monotonic_ns();
+		failed += hskp_trigger_adcs() != 0 || hskp_read_adcs(row) != 0;
+		lat[n] = (monotonic_ns() - t) * 1e-3;
+		sum += lat[n++];
+	} while (n < cap && elapsed_s(t0) < seconds);
+	qsort(lat, n, sizeof(*lat), cmp_double);
+	result("hskp_sweep", "\"sweeps\": %d, \"failed\": %d, \"mean_us\": %.2f, \"p50_us\": %.2f, \"p99_us\": %.2f,"
+		" \"max_us\": %.2f", n, failed, sum / n, lat[n / 2], lat[(int) (n * 0.99)], lat[n - 1]);
+	free(lat);
+}
+
+static void bench_format(int format, unsigned short (*framesets)[4][11]) {
+	static char buff[1 << 20];
+	char name[32];
+	struct timespec ts;
+	unsigned long long t0, n = 0, bytes = 0;
+	FILE *fptr = fmemopen(buff, sizeof(buff), "w");
+
+	if (fptr == NULL)
+		return;
+	timespec_get(&ts, TIME_UTC);
+	t0 = monotonic_ns();
+	do {
+		hp_format_record(fptr, format, framesets[n % NFRAMESETS], n, &ts);
+		n++;
+		if (ftell(fptr) > (long) sizeof(buff) / 2) {
+			bytes += ftell(fptr);
+			rewind(fptr);
+		}
+	} while ((n & 255) || elapsed_s(t0) < seconds);
+	bytes += ftell(fptr);
+	snprintf(name, sizeof(name), "format_%s", hp_file_format_name(format));
+	result(name, "\"records\": %llu, \"records_per_s\": %.0f, \"mb_per_s\": %.2f, \"bytes_per_record\": %.1f",
+		n, n / elapsed_s(t0), bytes / elapsed_s(t0) * 1e-6, (double) bytes / n);
+	fclose(fptr);
+}
+
+/* Emulated read, format and write of nsamples records, then the file is
+   read back with hp_file_load() */
+static void bench_record_decode(int format, int nsamples, const char *dir) {
+	unsigned short frames[4][11];
+	char filename[512], name[32];
+	struct timespec ts;
+	struct hp_file hf;
+	struct stat sb;
+	unsigned long long t0;
+	double t_rec, t_dec;
+	int n, failed = 0;
+	FILE *fptr;
+
+	snprintf(filename, sizeof(filename), "%s/bp_bench_%d.%s", dir, (int) getpid(),
+		format == HP_FILE_BINARY ? "bin" : "txt");
+	t0 = monotonic_ns();
+	fptr = fopen(filename, "wb");
+	if (fptr == NULL) {
+		perror(filename);
+		return;
+	}
+	hp_format_header(fptr, format, nsamples, 1000);
+	for (n = 0; n < nsamples; n++) {
+		failed += read_pattern(frames) != 0;
+		timespec_get(&ts, TIME_UTC);
+		hp_format_record(fptr, format, frames, n, &ts);
+	}
+	if (fclose(fptr) != 0)
+		perror(filename);
+	t_rec = elapsed_s(t0);
+	stat(filename, &sb);
+	snprintf(name, sizeof(name), "record_%s", hp_file_format_name(format));
+	result(name, "\"samples\": %d, \"samples_per_s\": %.0f, \"mb_per_s\": %.2f, \"failed_reads\": %d",
+		nsamples, nsamples / t_rec, sb.st_size / t_rec * 1e-6, failed);
+
+	t0 = monotonic_ns();
+	n = hp_file_load(&hf, filename) == 0 ? hf.nsamples : -1;
+	t_dec = elapsed_s(t0);
+	snprintf(name, sizeof(name), "decode_%s", hp_file_format_name(format));
+	if (n >= 0) {
+		result(name, "\"samples\": %d, \"samples_per_s\": %.0f, \"mb_per_s\": %.2f", n, n / t_dec,
+			sb.st_size / t_dec * 1e-6);
+		hp_file_free(&hf);
+	} else {
+		result(name, "\"error\": \"hp_file_load failed\"");
+	}
+	unlink(filename);
+}
+
+int main(int argc, char **argv) {
+	const char *config_file = "hp_gen.yml", *fault_file = NULL, *out_file = "bench.json", *dir = "/tmp";
+	static unsigned short framesets[NFRAMESETS][4][11];
+	struct utsname un;
+	char model[128], date[32];
+	time_t t = time(NULL);
+	int opt, nsamples = 20000, i;
+
+	while ((opt = getopt(argc, argv, "c:f:t:n:d:o:")) != -1) {
+		switch (opt) {
+		case 'c': config_file = optarg; break;
+		case 'f': fault_file = optarg; break;
+		case 't': seconds = atof(optarg); break;
+		case 'n': nsamples = atoi(optarg); break;
+		case 'd': dir = optarg; break;
+		case 'o': out_file = optarg; break;
+		default:
+			fprintf(stderr, "usage: %s [-c hp_gen.yml] [-f faults.yml] [-t seconds] [-n samples] [-d dir] [-o bench.json]\n",
+				argv[0]);
+			return 1;
+		}
+	}
+	if (nsamples < 1)
+		nsamples = 1;
+
+	if (bp_emulator_init(config_file) != 0)
+		return 1;
+	backend = bp_emulator_transfer;
+	if (fault_file != NULL && bp_fault_init(fault_file, bp_emulator_transfer) != 0)
+		return 1;
+	// "-o -" for stdout
+	out = strcmp(out_file, "-") == 0 ? stdout : fopen(out_file, "w");
+	if (out == NULL) {
+		perror(out_file);
+		return 1;
+	}
+
+	uname(&un);
+	cpu_model(model, sizeof(model));
+	strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%SZ", gmtime(&t));
+	fprintf(out, "{\n  \"git_rev\": \"%s\",\n  \"date\": \"%s\",\n", BP_GIT_REV, date);
+	fprintf(out, "  \"cpu\": {\"model\": \"%s\", \"machine\": \"%s\", \"ncpu\": %ld, \"kernel\": \"%s\"},\n",
+		model, un.machine, sysconf(_SC_NPROCESSORS_ONLN), un.release);
+	fprintf(out, "  \"compiler\": \"%s\",\n  \"workload\": \"%s\",\n  \"faults\": ", __VERSION__, config_file);
+	if (fault_file != NULL)
+		fprintf(out, "\"%s\",\n", fault_file);
+	else
+		fprintf(out, "null,\n");
+	fprintf(out, "  \"seconds_per_test\": %g,\n  \"results\": {", seconds);
+
+	bench_transfer("transfer_loopback", loopback, SPI_WRAP_AROUND);
+	bench_transfer("transfer_emulated", bp_emulator_transfer, SPI_READ_nsTimer_TFPGA);
+	bench_hit_pattern_read();
+	bench_live_snapshot();
+	bench_hskp_sweep();
+	for (i = 0; i < NFRAMESETS; i++)
+		read_pattern(framesets[i]);
+	for (i = 0; i < 3; i++)
+		bench_format(formats[i], framesets);
+	for (i = 0; i < 3; i++)
+		bench_record_decode(formats[i], nsamples, dir);
+
+	fprintf(out, "\n  }\n}\n");
+	if (out != stdout) {
+		if (fclose(out) != 0) {
+			perror(out_file);
+			return 1;
+		}
+		printf("Results written to %s\n", out_file);
+	}
+	return 0;
+}
@@ -0,0 +1,78 @@
+/*
+ ============================================================================
+ Name        : bp_config.c
+ Description : Flat "key: value" configuration files, one key per line,
+               '#' starts a comment. Enough YAML for the Pi-side tools while
+               keeping the files readable by yaml.safe_load on the DAQ host.
+ ============================================================================
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bp_config.h"
+
+static char *trim(char *s) {
+	char *end;
+
+	while (*s == ' ' || *s == '\t')
+		s++;
+	end = s + strlen(s);
+	while (end > s && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\r' || end[-1] == '\n'))
+		end--;
+	*end = '\0';
+	if (end - s >= 2 && (*s == '"' || *s == '\'') && end[-1] == *s) {
+		end[-1] = '\0';
+		s++;
+	}
+	return s;
+}
+
+int bp_config_load(struct bp_config *cfg, const char *filename) {
+	char line[256], *colon, *hash, *key, *value;
+	FILE *fptr;
+
+	memset(cfg, 0, sizeof(*cfg));
+	fptr = fopen(filename, "r");
+	if (fptr == NULL) {
+		perror(filename);
+		return -1;
+	}
+	while (fgets(line, sizeof(line), fptr) != NULL) {
+		hash = strchr(line, '#');
+		if (hash != NULL)
+			*hash = '\0';
+		colon = strchr(line, ':');
+		if (colon == NULL)
+			continue;
+		*colon = '\0';
+		key = trim(line);
+		value = trim(colon + 1);
+		if (*key == '\0' || cfg->nkeys == BP_CONFIG_MAXKEYS)
+			continue;
+		snprintf(cfg->key[cfg->nkeys], sizeof(cfg->key[0]), "%s", key);
+		snprintf(cfg->value[cfg->nkeys], sizeof(cfg->value[0]), "%s", value);
+		cfg->nkeys++;
+	}
+	fclose(fptr);
+	return 0;
+}
+
+const char *bp_config_string(const struct bp_config *cfg, const char *key, const char *def) {
+	int i;
+	for (i = cfg->nkeys - 1; i >= 0; i--)
+		if (strcmp(cfg->key[i], key) == 0)
+			return cfg->value[i];
+	return def;
+}
+
+double bp_config_double(const struct bp_config *cfg, const char *key, double def) {
+	const char *value = bp_config_string(cfg, key, NULL);
+	char *end;
+	double d;
+
+	if (value == NULL || *value == '\0')
+		return def;
+	d = strtod(value, &end);
+	return end == value ? def : d;
+}
@@ -0,0 +1,22 @@
+/*
+ ============================================================================
+ Name        : bp_config.h
+ Description : Flat "key: value" configuration files (a YAML subset)
+ ============================================================================
+ */
+#ifndef BP_CONFIG_H
+#define BP_CONFIG_H
+
+#define BP_CONFIG_MAXKEYS 64
+
+struct bp_config {
+	int nkeys;
+	char key[BP_CONFIG_MAXKEYS][48];
+	char value[BP_CONFIG_MAXKEYS][208];
+};
+
+int bp_config_load(struct bp_config *cfg, const char *filename);
+const char *bp_config_string(const struct bp_config *cfg, const char *key, const char *def);
+double bp_config_double(const struct bp_config *cfg, const char *key, double def);
+
+#endif
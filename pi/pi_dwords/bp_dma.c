@@ -0,0 +1,498 @@
+/*
+ ============================================================================
+ Name        : bp_dma.c
+ Description : DMA frame engine for the SPI0 controller of the BCM2835 and
+               its successors up to the BCM2711 (BP_DMA=bp_dma.yml).
+               Experimental: it has not run on a Pi yet. Only the legacy
+               DMA engines are driven; channels 11-14 of the BCM2711 are
+               DMA4 engines with another register and control block layout
+               and are refused there.
+               transfer_message() moves every byte through the SPI FIFO
+               from the CPU, which spins for the whole frame. Here a batch
+               of frames, e.g. the nsTimer frame and the four hit pattern
+               frames of a read, goes out as one chain of DMA control
+               blocks in uncached VideoCore memory. The RX channel paces
+               the chain: for each transfer it clears the FIFOs, restarts
+               the TX channel on that transfer's words and then waits for
+               the answer on the SPI RX DREQ, so the whole batch runs on
+               the bus without the CPU. The caller sleeps for as long as
+               the last batch of that size took and only then looks at the
+               END bit of the RX channel.
+
+               A transfer is words_per_cs words under one chip select: 1
+               toggles CS per word as spi_tword() does, 12 holds it for the
+               whole frame. The words are those of spi_transfer(): SOM, CW,
+               8 data words, a null word and EOM, one word ahead of the
+               answer.
+
+               Answers are checked as transfer_checked() does and frames
+               that fail go again through transfer_checked() if
+               bp_frame_repeatable() allows it. Without
+               /dev/mem and /dev/vcio (not a Pi, not root), with the
+               emulated backplane or fault injection in use, or after
+               max_timeouts batches that did not finish, bp_dma_checked()
+               is transfer_checked() frame by frame.
+ ============================================================================
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#include "spicomms.h"
+#include "bp_config.h"
+#include "bp_emulator.h"
+#include "bp_fault.h"
+#include "bp_dma.h"
+
+#define BUS_WORDS  12                                  // on the bus per frame
+#define MAX_XFERS  (BP_DMA_MAX_FRAMES * BUS_WORDS)     // at one word per CS
+
+/* Bus addresses (the same on every Pi up to the 4) and offsets from the
+   ARM physical peripheral base */
+#define BUS_SPI0     0x7e204000
+#define BUS_DMA      0x7e007000
+#define SPI0_OFFSET  0x204000
+#define DMA_OFFSET   0x7000
+#define DMA_ENABLE   (0xff0 / 4)                       // in the DMA page
+
+/* SPI0 registers and CS bits */
+#define SPI_CS         0
+#define SPI_FIFO       1
+#define SPI_CS_MODE    0x00e0004f                      // CS, CPHA, CPOL, CSPOL, CSPOL0-2 as libbcm2835 set them
+#define SPI_CS_CLEAR   0x00000030
+#define SPI_CS_TA      0x00000080
+#define SPI_CS_DMAEN   0x00000100
+#define SPI_CS_ADCS    0x00000800
+#define DREQ_SPI_TX    6
+#define DREQ_SPI_RX    7
+
+/* DMA channel registers, CS and TI bits */
+#define DMA_CS         0
+#define DMA_CONBLK_AD  1
+#define DMA_DEBUG      8
+#define DMA_ACTIVE     (1u << 0)
+#define DMA_END        (1u << 1)
+#define DMA_INT        (1u << 2)
+#define DMA_ERROR      (1u << 8)
+#define DMA_PRIORITY   ((8u << 16) | (8u << 20) | (1u << 28))   // and panic priority, wait for outstanding writes
+#define DMA_RESET      (1u << 31)
+#define TI_WAIT_RESP   (1u << 3)
+#define TI_DEST_INC    (1u << 4)
+#define TI_DEST_DREQ   (1u << 6)
+#define TI_SRC_INC     (1u << 8)
+#define TI_SRC_DREQ    (1u << 10)
+#define TI_PERMAP(p)   ((uint32_t) (p) << 16)
+
+/* VideoCore mailbox */
+#define IOCTL_MBOX_PROPERTY _IOWR(100, 0, char *)
+#define MBOX_MEM_ALLOC   0x3000c
+#define MBOX_MEM_LOCK    0x3000d
+#define MBOX_MEM_UNLOCK  0x3000e
+#define MBOX_MEM_RELEASE 0x3000f
+
+struct dma_cb {
+	uint32_t ti, source_ad, dest_ad, txfr_len, stride, nextconbk, pad[2];
+};
+
+/* Everything the DMA engine reads or writes, in one uncached allocation */
+struct dma_mem {
+	struct dma_cb rx_cb[MAX_XFERS][4];   // clear FIFOs, point TX at its block, start TX, read the answer
+	struct dma_cb tx_cb[MAX_XFERS];
+	uint32_t tx[MAX_XFERS][8];           // DLEN/CS word, then the bytes in FIFO order
+	uint32_t rx[MAX_XFERS][8];
+	uint32_t tx_cb_ad[MAX_XFERS];
+	uint32_t spi_cs;                     // written to SPI CS before every transfer
+	uint32_t active;                     // written to the TX channel CS
+};
+
+int bp_dma_enabled = 0;
+
+static struct {
+	int rx_channel;
+	int tx_channel;
+	int words_per_cs;
+	int poll_us;
+	int timeout_ms;
+	int max_timeouts;
+} cfg;
+
+static int mem_fd = -1, vcio_fd = -1;
+static volatile uint32_t *spi, *dma, *rx_ch, *tx_ch;
+static volatile struct dma_mem *mem;
+static uint32_t mem_handle, mem_bus, mem_size, spi_mode;
+static int xfers_per_frame, fifo_words;
+static unsigned long long est_ns[BP_DMA_MAX_FRAMES + 1];   // last batch time by size
+static char why[96] = "BP_DMA not set";
+static unsigned long long nbatches, nframes, nresent, ntimeouts, nwakeups, bus_ns;
+
+#define BUS(p) (mem_bus + (uint32_t) ((volatile char *) (p) - (volatile char *) mem))
+
+static uint32_t mbox_call(uint32_t tag, int nargs, uint32_t a0, uint32_t a1, uint32_t a2) {
+	uint32_t p[10] __attribute__((aligned(16)));
+	int i = 0;
+
+	p[i++] = 0;             // size, below
+	p[i++] = 0;             // request
+	p[i++] = tag;
+	p[i++] = 4 * nargs;     // value buffer
+	p[i++] = 4 * nargs;
+	p[i++] = a0;
+	if (nargs > 1)
+		p[i++] = a1;
+	if (nargs > 2)
+		p[i++] = a2;
+	p[i++] = 0;             // end tag
+	p[0] = i * sizeof(*p);
+	if (ioctl(vcio_fd, IOCTL_MBOX_PROPERTY, p) < 0)
+		return 0;
+	return p[5];
+}
+
+/* ARM physical address of the peripherals, 0 if this is not a BCM2835-2711 */
+static uint32_t peripheral_base(void) {
+	unsigned char r[12];
+	uint32_t base = 0;
+	size_t n;
+	FILE *fptr = fopen("/proc/device-tree/soc/ranges", "rb");
+
+	if (fptr == NULL)
+		return 0;
+	n = fread(r, 1, sizeof(r), fptr);
+	fclose(fptr);
+	if (n >= 8)
+		base = (uint32_t) r[4] << 24 | r[5] << 16 | r[6] << 8 | r[7];
+	if (base == 0 && n >= 12)   // BCM2711, 64-bit parent address
+		base = (uint32_t) r[8] << 24 | r[9] << 16 | r[10] << 8 | r[11];
+	return base == 0x20000000 || base == 0x3f000000 || base == 0xfe000000 ? base : 0;
+}
+
+static volatile uint32_t *map(off_t phys, size_t size) {
+	void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, mem_fd, phys);
+	return p == MAP_FAILED ? NULL : p;
+}
+
+static void reset_channels(void) {
+	rx_ch[DMA_CS] = DMA_RESET;
+	tx_ch[DMA_CS] = DMA_RESET;
+	usleep(10);
+	rx_ch[DMA_CS] = DMA_END | DMA_INT;
+	tx_ch[DMA_CS] = DMA_END | DMA_INT;
+	rx_ch[DMA_DEBUG] = 7;   // clear the error flags
+	tx_ch[DMA_DEBUG] = 7;
+}
+
+/* Back to what libbcm2835 polling expects: no DMA, no auto CS */
+static void restore_spi(void) {
+	spi[SPI_CS] = spi_mode | SPI_CS_CLEAR;
+}
+
+/* The chain for BP_DMA_MAX_FRAMES frames, a batch cuts it short */
+static void build_chain(void) {
+	uint32_t tx_base = BUS_DMA + 0x100 * cfg.tx_channel;
+	int x;
+
+	mem->spi_cs = spi_mode | SPI_CS_CLEAR | SPI_CS_DMAEN | SPI_CS_ADCS;
+	mem->active = DMA_ACTIVE | DMA_PRIORITY;
+	for (x = 0; x < MAX_XFERS; x++) {
+		volatile struct dma_cb *cb = mem->rx_cb[x];
+
+		cb[0].ti = TI_WAIT_RESP;
+		cb[0].source_ad = BUS(&mem->spi_cs);
+		cb[0].dest_ad = BUS_SPI0 + 4 * SPI_CS;
+		cb[0].txfr_len = 4;
+		cb[0].nextconbk = BUS(&cb[1]);
+		cb[1].ti = TI_WAIT_RESP;
+		cb[1].source_ad = BUS(&mem->tx_cb_ad[x]);
+		cb[1].dest_ad = tx_base + 4 * DMA_CONBLK_AD;
+		cb[1].txfr_len = 4;
+		cb[1].nextconbk = BUS(&cb[2]);
+		cb[2].ti = TI_WAIT_RESP;
+		cb[2].source_ad = BUS(&mem->active);
+		cb[2].dest_ad = tx_base + 4 * DMA_CS;
+		cb[2].txfr_len = 4;
+		cb[2].nextconbk = BUS(&cb[3]);
+		cb[3].ti = TI_SRC_DREQ | TI_PERMAP(DREQ_SPI_RX) | TI_DEST_INC | TI_WAIT_RESP;
+		cb[3].source_ad = BUS_SPI0 + 4 * SPI_FIFO;
+		cb[3].dest_ad = BUS(mem->rx[x]);
+		cb[3].txfr_len = 4 * fifo_words;
+		cb[3].nextconbk = x + 1 < MAX_XFERS ? BUS(mem->rx_cb[x + 1]) : 0;
+
+		mem->tx_cb[x].ti = TI_DEST_DREQ | TI_PERMAP(DREQ_SPI_TX) | TI_SRC_INC | TI_WAIT_RESP;
+		mem->tx_cb[x].source_ad = BUS(mem->tx[x]);
+		mem->tx_cb[x].dest_ad = BUS_SPI0 + 4 * SPI_FIFO;
+		mem->tx_cb[x].txfr_len = 4 * (1 + fifo_words);
+		mem->tx_cb[x].nextconbk = 0;
+		mem->tx_cb_ad[x] = BUS(&mem->tx_cb[x]);
+		// transfer length and the CS bits that start it, TA set
+		mem->tx[x][0] = (uint32_t) (2 * cfg.words_per_cs) << 16 | (spi_mode & 0x4f) | SPI_CS_TA;
+	}
+}
+
+static void release(void) {
+	if (mem != NULL)
+		munmap((void *) mem, mem_size);
+	if (mem_bus != 0)
+		mbox_call(MBOX_MEM_UNLOCK, 1, mem_handle, 0, 0);
+	if (mem_handle != 0)
+		mbox_call(MBOX_MEM_RELEASE, 1, mem_handle, 0, 0);
+	if (spi != NULL)
+		munmap((void *) spi, 4096);
+	if (dma != NULL)
+		munmap((void *) dma, 4096);
+	if (vcio_fd >= 0)
+		close(vcio_fd);
+	if (mem_fd >= 0)
+		close(mem_fd);
+	mem = NULL;
+	spi = dma = rx_ch = tx_ch = NULL;
+	mem_handle = mem_bus = 0;
+	vcio_fd = mem_fd = -1;
+}
+
+static int open_hardware(void) {
+	uint32_t base = peripheral_base();
+
+	if (base == 0) {
+		snprintf(why, sizeof(why), "no BCM2835-2711 peripherals in the device tree");
+		return -1;
+	}
+	mem_fd = open("/dev/mem", O_RDWR | O_SYNC);
+	vcio_fd = open("/dev/vcio", 0);
+	if (mem_fd < 0 || vcio_fd < 0) {
+		snprintf(why, sizeof(why), "cannot open %s (root needed)", mem_fd < 0 ? "/dev/mem" : "/dev/vcio");
+		return -1;
+	}
+	spi = map(base + SPI0_OFFSET, 4096);
+	dma = map(base + DMA_OFFSET, 4096);
+	if (spi == NULL || dma == NULL) {
+		snprintf(why, sizeof(why), "cannot map the SPI0 and DMA registers");
+		return -1;
+	}
+	rx_ch = dma + 0x100 / 4 * cfg.rx_channel;
+	tx_ch = dma + 0x100 / 4 * cfg.tx_channel;
+	if (base == 0xfe000000 && (cfg.rx_channel > 10 || cfg.tx_channel > 10)) {
+		snprintf(why, sizeof(why), "DMA channels 11-14 of the BCM2711 are DMA4 engines, use two of 0-6");
+		return -1;
+	}
+	if ((rx_ch[DMA_CS] | tx_ch[DMA_CS]) & DMA_ACTIVE) {
+		snprintf(why, sizeof(why), "DMA channel %d or %d is in use", cfg.rx_channel, cfg.tx_channel);
+		return -1;
+	}
+
+	// Uncached (L1 non-allocating on the BCM2835), so neither side needs cache maintenance
+	mem_size = (sizeof(struct dma_mem) + 4095) & ~4095u;
+	mem_handle = mbox_call(MBOX_MEM_ALLOC, 3, mem_size, 4096, base == 0x20000000 ? 0xc : 0x4);
+	if (mem_handle != 0)
+		mem_bus = mbox_call(MBOX_MEM_LOCK, 1, mem_handle, 0, 0);
+	if (mem_bus != 0)
+		mem = (volatile struct dma_mem *) map(mem_bus & ~0xc0000000, mem_size);
+	if (mem == NULL) {
+		snprintf(why, sizeof(why), "no uncached memory from the VideoCore mailbox");
+		return -1;
+	}
+	memset((void *) mem, 0, sizeof(struct dma_mem));
+
+	spi_mode = spi[SPI_CS] & SPI_CS_MODE;
+	dma[DMA_ENABLE] |= 1u << cfg.rx_channel | 1u << cfg.tx_channel;
+	reset_channels();
+	build_chain();
+	return 0;
+}
+
+/*
+	bp_dma_init()
+
+	Channels and framing from config_file, then the registers, the
+	uncached memory and the chain. Call after the SPI clock and mode are
+	set (bcm2835_spi_begin() and friends): the engine takes the mode from
+	the SPI CS register and runs at whatever clock divider is set.
+	Returns -1 if there is no hardware engine, frames then go by polling.
+*/
+int bp_dma_init(const char *config_file) {
+	struct bp_config c;
+
+	if (bp_config_load(&c, config_file) != 0)
+		return -1;
+	cfg.rx_channel = bp_config_double(&c, "rx_channel", 5);
+	cfg.tx_channel = bp_config_double(&c, "tx_channel", 4);
+	cfg.words_per_cs = bp_config_double(&c, "words_per_cs", 1);
+	cfg.poll_us = bp_config_double(&c, "poll_us", 10);
+	cfg.timeout_ms = bp_config_double(&c, "timeout_ms", 50);
+	cfg.max_timeouts = bp_config_double(&c, "max_timeouts", 3);
+	if (cfg.rx_channel < 0 || cfg.rx_channel > 14 || cfg.tx_channel < 0 || cfg.tx_channel > 14 ||
+	    cfg.rx_channel == cfg.tx_channel) {
+		snprintf(why, sizeof(why), "rx_channel and tx_channel must be two of DMA channels 0-14");
+		printf("SPI frames by polling: %s\n", why);
+		return -1;
+	}
+	if (cfg.words_per_cs < 1 || cfg.words_per_cs > BUS_WORDS || BUS_WORDS % cfg.words_per_cs != 0) {
+		snprintf(why, sizeof(why), "words_per_cs must divide %d", BUS_WORDS);
+		printf("SPI frames by polling: %s\n", why);
+		return -1;
+	}
+	xfers_per_frame = BUS_WORDS / cfg.words_per_cs;
+	fifo_words = (2 * cfg.words_per_cs + 3) / 4;
+
+	if (open_hardware() != 0) {
+		release();
+		printf("SPI frames by polling: %s\n", why);
+		return -1;
+	}
+	bp_dma_enabled = 1;
+	atexit(bp_dma_close);   // the VideoCore memory outlives the process otherwise
+	printf("SPI frames by DMA, channels %d (RX) and %d (TX), %d word%s per CS\n", cfg.rx_channel, cfg.tx_channel,
+		cfg.words_per_cs, cfg.words_per_cs > 1 ? "s" : "");
+	return 0;
+}
+
+void bp_dma_close(void) {
+	if (bp_dma_enabled) {
+		reset_channels();
+		restore_spi();
+	}
+	bp_dma_enabled = 0;
+	release();
+}
+
+static void sleep_ns(unsigned long long ns) {
+	struct timespec ts;
+
+	ts.tv_sec = ns / 1000000000ULL;
+	ts.tv_nsec = ns % 1000000000ULL;
+	nanosleep(&ts, NULL);
+}
+
+/* One batch on the bus, 0 or -1 if the chain did not finish */
+static int run_batch(unsigned short (*message)[11], unsigned short (*data)[11], int n) {
+	unsigned short words[BUS_WORDS];
+	unsigned char *b;
+	unsigned long long t0, t;
+	uint32_t v[8], cs;
+	int nx = n * xfers_per_frame, f, x, k, i;
+
+	for (f = 0; f < n; f++) {
+		memcpy(words, message[f], 10 * sizeof(*words));
+		words[10] = 0x0000;          // the null word, then EOM, as spi_transfer()
+		words[11] = message[f][10];
+		for (x = 0; x < xfers_per_frame; x++) {
+			memset(v, 0, sizeof(v));
+			b = (unsigned char *) v;   // little endian: the first byte out is bits 7:0
+			for (k = 0; k < cfg.words_per_cs; k++) {
+				b[2 * k] = words[x * cfg.words_per_cs + k] >> 8;
+				b[2 * k + 1] = words[x * cfg.words_per_cs + k] & 0xff;
+			}
+			for (i = 0; i < fifo_words; i++)
+				mem->tx[f * xfers_per_frame + x][1 + i] = v[i];
+		}
+	}
+	mem->rx_cb[nx - 1][3].nextconbk = 0;
+	__sync_synchronize();
+
+	t0 = monotonic_ns();
+	rx_ch[DMA_CS] = DMA_END | DMA_INT;
+	tx_ch[DMA_CS] = DMA_END | DMA_INT;
+	rx_ch[DMA_CONBLK_AD] = BUS(mem->rx_cb[0]);
+	rx_ch[DMA_CS] = DMA_ACTIVE | DMA_PRIORITY;
+
+	// Sleep through most of what this batch size took last time, then poll
+	if (est_ns[n] > 0)
+		sleep_ns(est_ns[n] - est_ns[n] / 8);
+	for (;;) {
+		nwakeups++;
+		cs = rx_ch[DMA_CS];
+		if ((cs & DMA_END) || (cs & DMA_ERROR))
+			break;
+		if ((t = monotonic_ns() - t0) > cfg.timeout_ms * 1000000ULL)
+			break;
+		sleep_ns(cfg.poll_us * 1000ULL);
+	}
+	t = monotonic_ns() - t0;
+	if (nx < MAX_XFERS)
+		mem->rx_cb[nx - 1][3].nextconbk = BUS(mem->rx_cb[nx]);
+	if (!(cs & DMA_END) || (cs & DMA_ERROR)) {
+		reset_channels();
+		restore_spi();
+		ntimeouts++;
+		if (cfg.max_timeouts > 0 && ntimeouts >= (unsigned long long) cfg.max_timeouts) {
+			snprintf(why, sizeof(why), "%llu DMA batches did not finish (last CS %08x)", ntimeouts, cs);
+			printf("SPI frames by polling from now on: %s\n", why);
+			bp_dma_enabled = 0;
+		}
+		return -1;
+	}
+	restore_spi();
+	est_ns[n] = est_ns[n] ? (3 * est_ns[n] + t) / 4 : t;
+	bus_ns += t;
+	nbatches++;
+	nframes += n;
+
+	for (f = 0; f < n; f++) {
+		for (x = 0; x < xfers_per_frame; x++) {
+			for (i = 0; i < fifo_words; i++)
+				v[i] = mem->rx[f * xfers_per_frame + x][i];
+			b = (unsigned char *) v;
+			for (k = 0; k < cfg.words_per_cs; k++)
+				words[x * cfg.words_per_cs + k] = b[2 * k] << 8 | b[2 * k + 1];
+		}
+		memcpy(data[f], words + 1, 11 * sizeof(*words));   // the first word back is the dummy
+	}
+	return 0;
+}
+
+/*
+	bp_dma_checked()
+
+	transfer_checked() for a batch of frames: all of them in one DMA chain
+	if the engine is up, each answer checked with bp_frame_ok() and any
+	that fail sent again through transfer_checked(). Without the engine, or
+	if the chain does not finish, every frame goes through
+	transfer_checked(). A frame that may have reached the FPGA already is
+	not sent again unless bp_frame_repeatable() allows it. Returns 0, or
+	-1 as soon as a frame has no valid answer. Callers serialise as they
+	do for transfer_message().
+*/
+int bp_dma_checked(const char *component, unsigned short (*message)[11], unsigned short (*data)[11], int n) {
+	int f, sent, dma_ok;
+
+	sent = bp_dma_enabled && !bp_emulator_enabled && !bp_fault_enabled && n > 0 && n <= BP_DMA_MAX_FRAMES;
+	dma_ok = sent && run_batch(message, data, n) == 0;
+	for (f = 0; f < n; f++) {
+		if (dma_ok && bp_frame_ok(message[f], data[f]))
+			continue;
+		if (sent && !bp_frame_repeatable(message[f]))
+			return -1;
+		nresent += dma_ok;
+		if (transfer_checked(component, message[f], data[f]) != 0)
+			return -1;
+	}
+	return 0;
+}
+
+const char *bp_dma_engine(void) {
+	static char name[128];
+
+	if (bp_dma_enabled && !bp_emulator_enabled && !bp_fault_enabled)
+		snprintf(name, sizeof(name), "DMA, channels %d/%d, %d word%s per CS", cfg.rx_channel, cfg.tx_channel,
+			cfg.words_per_cs, cfg.words_per_cs > 1 ? "s" : "");
+	else
+		snprintf(name, sizeof(name), "polling, %s", bp_emulator_enabled ? "emulated backplane" :
+			bp_fault_enabled ? "fault injection in use" : why);
+	return name;
+}
+
+void bp_dma_report(FILE *fptr) {
+	fprintf(fptr, "SPI frame engine: %s\n", bp_dma_engine());
+	if (nbatches == 0 && ntimeouts == 0)
+		return;
+	fprintf(fptr, "DMA: %llu batches, %llu frames, %.0f frames/s on the bus, %.1f us and %.2f wakeups per batch,"
+		" %llu frames resent, %llu batches timed out\n", nbatches, nframes,
+		bus_ns ? nframes / (bus_ns * 1e-9) : 0.0, nbatches ? bus_ns * 1e-3 / nbatches : 0.0,
+		nbatches ? (double) nwakeups / nbatches : 0.0, nresent, ntimeouts);
+}
@@ -0,0 +1,23 @@
+/*
+ ============================================================================
+ Name        : bp_dma.h
+ Description : DMA frame engine for the BCM2835 SPI (BP_DMA=bp_dma.yml),
+               batches of frames on the bus without the CPU
+ ============================================================================
+ */
+#ifndef BP_DMA_H
+#define BP_DMA_H
+
+#include <stdio.h>
+
+#define BP_DMA_MAX_FRAMES 16   // frames in one batch
+
+extern int bp_dma_enabled;
+
+int bp_dma_init(const char *config_file);
+void bp_dma_close(void);
+int bp_dma_checked(const char *component, unsigned short (*message)[11], unsigned short (*data)[11], int nframes);
+void bp_dma_report(FILE *fptr);
+const char *bp_dma_engine(void);
+
+#endif
@@ -0,0 +1,286 @@
+/*
+ ============================================================================
+ Name        : bp_emulator.c
+ Description : Emulated backplane behind transfer_message(), so bp_test_pi and
+               everything built on it run off the telescope
+               (BP_EMULATE=hp_gen.yml ./bp_test_pi, or make bp_test_emu).
+               The TFPGA part runs the hp_generator workload in real time:
+               counters and nsTimer advance with CLOCK_MONOTONIC whenever
+               they are read, SPI_READ_HIT_PATTERN latches a fresh pattern
+               if a trigger happened since the last one, and trigger mask
+               writes take effect on both the patterns and the trigger rate.
+               SPI_SET_TRIG_AT_TIME fires a trigger tat_offset_ns (plus
+               up to tat_jitter_ns) after the time asked for, if that is
+               still tat_latency_ns ahead when the frame comes in.
+               The HKFPGA part answers FEE present/power and current/voltage
+               reads for the modules in the FPM config, and the ENV frame. Commands it does not
+               model are answered with the message words echoed back.
+ ============================================================================
+ */
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include "spicomms.h"
+#include "bp_config.h"
+#include "hskp_burst.h"
+#include "hskp_archive.h"
+#include "hp_generator.h"
+#include "hp_mask.h"
+#include "bp_emulator.h"
+
+int bp_emulator_enabled = 0;
+
+static struct hp_gen gen;
+static struct fpm_config fpm;
+static int have_fpm;
+static unsigned long long last_ns;            // CLOCK_MONOTONIC of the last advance
+static unsigned long long last_trigger_ns;    // nsTimer of the last trigger
+static unsigned short latched[HP_NWORDS];
+static unsigned long latched_at = (unsigned long) -1;
+static unsigned short mask[HP_MASK_NWORDS];
+static unsigned short trigger_enable = 0x7f;  // SPI_L1_TRIGGER_EN bits, all on
+static unsigned long fee_present, fee_power;
+static double fee_current_a, fee_voltage_v, hskp_noise;
+static double tat_latency_ns, tat_offset_ns, tat_jitter_ns;
+static int tat_armed;
+static unsigned long long tat_ns;               // time asked for with SPI_SET_TRIG_AT_TIME
+static unsigned long long tat_fire_ns;          // nsTimer the trigger comes at
+static unsigned long long tat_from_ns;          // the comparator sees the nsTimer from here on
+static unsigned long long noise_state = 0x853c49e6748fea9bULL;
+
+/* Small generator for ADC noise, kept apart so housekeeping reads do not
+   shift the workload stream */
+static double noise(void) {
+	double u1, u2;
+
+	noise_state ^= noise_state << 13;
+	noise_state ^= noise_state >> 7;
+	noise_state ^= noise_state << 17;
+	u1 = ((noise_state >> 11) + 1) * 0x1.0p-53;
+	noise_state ^= noise_state << 13;
+	noise_state ^= noise_state >> 7;
+	noise_state ^= noise_state << 17;
+	u2 = (noise_state >> 11) * 0x1.0p-53;
+	return sqrt(-2 * log(u1)) * cos(2 * M_PI * u2);
+}
+
+/* Uniform in [0, 1), from the same generator as noise() */
+static double uniform(void) {
+	noise_state ^= noise_state << 13;
+	noise_state ^= noise_state >> 7;
+	noise_state ^= noise_state << 17;
+	return (noise_state >> 11) * 0x1.0p-53;
+}
+
+static void advance(void) {
+	unsigned long long now = monotonic_ns();
+	unsigned long tacks = gen.tacks;
+	unsigned long n;
+
+	if (trigger_enable & 0x1f) {
+		n = hp_gen_advance(&gen, now - last_ns);
+		// the last of n triggers spread evenly over the step
+		if (n > 0)
+			last_trigger_ns = gen.nstime - (unsigned long long) ((now - last_ns) * (1 - pow(uniform(), 1.0 / n)));
+		if (!(trigger_enable & 0x60))
+			gen.tacks = tacks;   // TACK messages disabled
+	} else {
+		gen.nstime += now - last_ns;
+	}
+	if (tat_armed && tat_ns >= tat_from_ns && gen.nstime >= tat_fire_ns) {
+		gen.hwtriggers++;
+		if (tat_fire_ns > last_trigger_ns)
+			last_trigger_ns = tat_fire_ns;
+		tat_armed = 0;
+	}
+	last_ns = now;
+}
+
+static void apply_mask(void) {
+	unsigned short keep[HP_NWORDS];
+	int w;
+
+	if (have_fpm) {
+		hp_mask_keep(keep, mask, &fpm);
+	} else {
+		for (w = 0; w < HP_NWORDS; w++)
+			keep[w] = ~mask[w];   // no FPM config, mask word w taken as slot w
+	}
+	hp_gen_set_keep(&gen, keep);
+}
+
+static void put_u64(unsigned short *data, unsigned long long v) {
+	data[2] = v >> 48;
+	data[3] = v >> 32;
+	data[4] = v >> 16;
+	data[5] = v;
+}
+
+static void tfpga(const unsigned short *message, unsigned short *data) {
+	unsigned long long t;
+	int f, k;
+
+	switch (message[1]) {
+	case SPI_READ_nsTimer_TFPGA:
+		advance();
+		put_u64(data, gen.nstime);
+		data[6] = (gen.tacks + 1) >> 16;          // the TFPGA counts one extra from reset
+		data[7] = gen.tacks + 1;
+		data[8] = (gen.hwtriggers + 1) >> 16;
+		data[9] = gen.hwtriggers + 1;
+		break;
+	case SPI_SET_nsTimer_TFPGA:
+		advance();
+		gen.nstime = ((unsigned long long) message[2] << 48) | ((unsigned long long) message[3] << 32) |
+			((unsigned long long) message[4] << 16) | message[5];
+		tat_from_ns = gen.nstime;
+		break;
+	case RESET_TRIGGER_COUNT_AND_NSTIMER:
+		advance();
+		gen.nstime = 0;
+		gen.hwtriggers = 0;
+		gen.tacks = 0;
+		last_trigger_ns = 0;
+		tat_from_ns = 0;
+		latched_at = (unsigned long) -1;
+		break;
+	case SPI_READ_TRIGGER_NSTIMER_TFPGA:
+		advance();
+		put_u64(data, last_trigger_ns);
+		break;
+	case SPI_SET_TRIG_AT_TIME:
+		advance();
+		t = ((unsigned long long) message[2] << 48) | ((unsigned long long) message[3] << 32) |
+			((unsigned long long) message[4] << 16) | message[5];
+		// a time the comparator has passed is only met again after a reset (SYNC)
+		tat_armed = 1;
+		tat_ns = t;
+		tat_from_ns = gen.nstime + (unsigned long long) tat_latency_ns;
+		tat_fire_ns = t + (unsigned long long) (tat_offset_ns + tat_jitter_ns * uniform());
+		break;
+	case SPI_L1_TRIGGER_EN:
+		advance();
+		trigger_enable = message[2];
+		break;
+	case SPI_TRIGGERMASK_TFPGA:
+	case SPI_TRIGGERMASK1_TFPGA:
+	case SPI_TRIGGERMASK2_TFPGA:
+	case SPI_TRIGGERMASK3_TFPGA:
+		advance();   // triggers so far happened under the old mask
+		f = (message[1] - SPI_TRIGGERMASK_TFPGA) >> 8;
+		memcpy(&mask[8 * f], &message[2], 8 * sizeof(*mask));
+		apply_mask();
+		break;
+	case SPI_READ_HIT_PATTERN:
+		advance();
+		if (gen.hwtriggers != latched_at) {
+			hp_gen_pattern(&gen, latched);
+			latched_at = gen.hwtriggers;
+		}
+		// fall through
+	case SPI_READ_HIT_PATTERN1:
+	case SPI_READ_HIT_PATTERN2:
+	case SPI_READ_HIT_PATTERN3:
+		f = (message[1] - SPI_READ_HIT_PATTERN) >> 8;
+		for (k = 0; k < 8; k++)
+			data[k+2] = latched[HP_NWORDS - 1 - 8*f - k];
+		break;
+	}
+}
+
+/* CW_RD_ENV: DACQ1/2 and FEE 3.3 V currents [A], FEE 3.3 V [V], ENV1-4 */
+static const double env_value[HSKP_ENV_NCHAN] = { 1.0, 1.0, 2.0, 3.3, 0.30, 0.31, 0.29, 0.30 };
+
+static void hkfpga(const unsigned short *message, unsigned short *data) {
+	int f, k, slot, on;
+	double v;
+
+	switch (message[1]) {
+	case CW_FEEs_PRESENT:
+		data[2] = fee_present;
+		data[3] = fee_present >> 16;
+		data[4] = fee_power >> 16;
+		data[5] = fee_power;
+		break;
+	case CW_FEE_POWER_CTL:
+		fee_power = ((unsigned long) message[2] << 16 | message[3]) & 0xffffffffUL;
+		break;
+	case CW_RD_FEE0_I: case CW_RD_FEE8_I: case CW_RD_FEE16_I: case CW_RD_FEE24_I:
+	case CW_RD_FEE0_V: case CW_RD_FEE8_V: case CW_RD_FEE16_V: case CW_RD_FEE24_V:
+		f = (message[1] & 0xff) == 0 ? 0 : (message[1] & 0xff) == 0x07 ? 1 : (message[1] & 0xff) == 0x0f ? 2 : 3;
+		for (k = 0; k < 8; k++) {
+			slot = fee_hskp_slot[f][k];
+			on = (fee_present >> slot) & (fee_power >> slot) & 1;
+			if ((message[1] & 0xff00) == (CW_RD_FEE0_I & 0xff00))
+				v = on ? fee_current_a * (1 + hskp_noise * noise()) / HSKP_AMPS_PER_LSB : 0;
+			else
+				v = on ? fee_voltage_v * (1 + hskp_noise * noise()) / HSKP_VOLTS_PER_LSB : 0;
+			data[k+2] = v < 0 ? 0 : v > 0xffff ? 0xffff : (unsigned short) (v + 0.5);
+		}
+		break;
+	case CW_RD_ENV:
+		for (k = 0; k < HSKP_ENV_NCHAN; k++) {
+			v = env_value[k] * (1 + hskp_noise * noise()) / hskp_env_scale[k];
+			data[k+2] = v < 0 ? 0 : v > 0xffff ? 0xffff : (unsigned short) (v + 0.5);
+		}
+		break;
+	}
+}
+
+/*
+	bp_emulator_init()
+
+	Workload from the hp_gen.yml style config_file, plus the emulator keys
+	fpm_config, fee_current_a, fee_voltage_v, hskp_noise (relative rms)
+	and the trigger at time latency, offset and jitter (tat_latency_ns,
+	tat_offset_ns, tat_jitter_ns).
+*/
+int bp_emulator_init(const char *config_file) {
+	struct bp_config cfg;
+	struct hp_gen_config gen_cfg;
+	struct hp_geometry geo;
+	int slot;
+
+	if (bp_config_load(&cfg, config_file) != 0)
+		return -1;
+	have_fpm = fpm_config_load(&fpm, bp_config_string(&cfg, "fpm_config", "FPM_config.csv")) == 0;
+	if (hp_gen_config_load(&gen_cfg, have_fpm ? &fpm : NULL, config_file) != 0)
+		return -1;
+	fee_current_a = bp_config_double(&cfg, "fee_current_a", 1.5);
+	fee_voltage_v = bp_config_double(&cfg, "fee_voltage_v", 12.0);
+	hskp_noise = bp_config_double(&cfg, "hskp_noise", 0.005);
+	tat_latency_ns = bp_config_double(&cfg, "tat_latency_ns", 2000);
+	tat_offset_ns = bp_config_double(&cfg, "tat_offset_ns", 16);
+	tat_jitter_ns = bp_config_double(&cfg, "tat_jitter_ns", 8);
+
+	if (have_fpm)
+		hp_geometry_from_fpm(&geo, &fpm);
+	else
+		hp_geometry_default(&geo);
+	hp_gen_init(&gen, &gen_cfg, &geo);
+	fee_present = 0;
+	for (slot = 0; slot < HP_NWORDS; slot++)
+		if (geo.x0[slot] >= 0)
+			fee_present |= 1UL << slot;
+	fee_power = fee_present;
+	memset(mask, 0, sizeof(mask));
+	last_ns = monotonic_ns();
+	bp_emulator_enabled = 1;
+	return 0;
+}
+
+/* Answer one frame as transfer_message() would return it */
+void bp_emulator_transfer(const unsigned short *message, unsigned short *data) {
+	int i;
+
+	data[0] = message[0];
+	data[1] = message[1];
+	for (i = 2; i < 10; i++)
+		data[i] = message[i];
+	data[10] = message[0] == SPI_SOM_TFPGA ? SPI_EOM_TFPGA : SPI_EOM_HKFPGA;
+	if (message[0] == SPI_SOM_TFPGA)
+		tfpga(message, data);
+	else if (message[0] == SPI_SOM_HKFPGA)
+		hkfpga(message, data);
+}
@@ -0,0 +1,15 @@
+/*
+ ============================================================================
+ Name        : bp_emulator.h
+ Description : Emulated HKFPGA/TFPGA answering transfer_message() frames
+ ============================================================================
+ */
+#ifndef BP_EMULATOR_H
+#define BP_EMULATOR_H
+
+extern int bp_emulator_enabled;
+
+int bp_emulator_init(const char *config_file);
+void bp_emulator_transfer(const unsigned short *message, unsigned short *data);
+
+#endif
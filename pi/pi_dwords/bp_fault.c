@@ -0,0 +1,323 @@
+/*
+ ============================================================================
+ Name        : bp_fault.c
+ Description : Fault injection for the SPI link (BP_FAULTS=faults.yml).
+               bp_fault_transfer() sits between transfer_message() and the
+               real or emulated backend and corrupts what comes back on
+               MISO: single bit flips per word, a word dropped or read twice
+               (the rest of the frame slips by one), MISO stuck at a value
+               for a run of frames, an FPGA that stops answering (frames
+               are not delivered and read back idle) and latency spikes.
+               All faults are drawn from one seeded generator, so a run is
+               repeatable for a given sequence of frames.
+
+               Components that can recover use transfer_checked(), which
+               checks the SOM, command word echo and EOM of the answer and
+               retries the control words that are safe to send twice
+               (bp_frame_repeatable()). It keeps per component counts of
+               rejected frames, retries, recoveries, give ups and of
+               injected faults that passed the check unnoticed;
+               bp_fault_report() prints them with the frame rate seen
+               through the link.
+ ============================================================================
+ */
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "spicomms.h"
+#include "bp_config.h"
+#include "bp_fault.h"
+
+#define NCOMPONENTS 16
+
+enum { F_BITFLIP, F_DROP, F_DUPLICATE, F_STUCK, F_DEAD, F_LATENCY, F_NKINDS };
+
+static const char *fault_name[F_NKINDS] = {
+	"bit flips", "dropped words", "duplicated words", "stuck runs", "dead runs", "latency spikes"
+};
+
+struct component {
+	const char *name;
+	unsigned long long frames;      // transfers, retries included
+	unsigned long long rejected;    // answers failing bp_frame_ok()
+	unsigned long long recovered;   // good answer after a retry
+	unsigned long long failed;      // gave up after BP_FRAME_TRIES
+	unsigned long long unrepeated;  // of those, not resent as unsafe to repeat
+	unsigned long long faulty;      // answers with an injected fault
+	unsigned long long silent;      // of those, accepted by the check
+	unsigned long long ns;          // time in transfer_checked()
+};
+
+int bp_fault_enabled = 0;
+
+static struct {
+	unsigned long long seed;
+	double bit_flip_rate;    // per received word
+	double drop_rate;        // per frame
+	double duplicate_rate;
+	double stuck_rate;       // per frame, starts a run of stuck_frames
+	int stuck_frames;
+	unsigned short stuck_value;
+	double dead_rate;        // per frame, starts a run of dead_frames
+	int dead_frames;
+	unsigned short idle_value;   // MISO when nothing drives it
+	double latency_rate;
+	int latency_us;
+} cfg;
+
+static bp_transfer_fn backend;
+static unsigned long long rng;
+static int stuck_left, dead_left;
+static int last_faulty;                   // the last answer carries an injected fault
+static unsigned long long nframes, nfaulty, injected[F_NKINDS], link_ns;
+static struct component components[NCOMPONENTS];
+static int ncomponents;
+
+/* xorshift64*, seeded through splitmix64 so that small seeds work */
+static double uniform(void) {
+	rng ^= rng >> 12;
+	rng ^= rng << 25;
+	rng ^= rng >> 27;
+	return ((rng * 0x2545f4914f6cdd1dULL) >> 11) * 0x1.0p-53;
+}
+
+static int below(int n) {
+	return (int) (uniform() * n);
+}
+
+/*
+	bp_fault_init()
+
+	Rates from config_file, all zero by default, and the backend the
+	faulty link is put in front of. transfer_message() then goes through
+	bp_fault_transfer().
+*/
+int bp_fault_init(const char *config_file, bp_transfer_fn inner) {
+	struct bp_config c;
+	unsigned long long z;
+
+	if (bp_config_load(&c, config_file) != 0)
+		return -1;
+	cfg.seed = bp_config_double(&c, "seed", 1);
+	cfg.bit_flip_rate = bp_config_double(&c, "bit_flip_rate", 0);
+	cfg.drop_rate = bp_config_double(&c, "drop_rate", 0);
+	cfg.duplicate_rate = bp_config_double(&c, "duplicate_rate", 0);
+	cfg.stuck_rate = bp_config_double(&c, "stuck_rate", 0);
+	cfg.stuck_frames = bp_config_double(&c, "stuck_frames", 100);
+	cfg.stuck_value = bp_config_double(&c, "stuck_value", 0xffff);
+	cfg.dead_rate = bp_config_double(&c, "dead_rate", 0);
+	cfg.dead_frames = bp_config_double(&c, "dead_frames", 1000);
+	cfg.idle_value = bp_config_double(&c, "idle_value", 0x0000);
+	cfg.latency_rate = bp_config_double(&c, "latency_rate", 0);
+	cfg.latency_us = bp_config_double(&c, "latency_us", 10000);
+
+	z = cfg.seed + 0x9e3779b97f4a7c15ULL;
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	rng = (z ^ (z >> 31)) | 1;
+	stuck_left = dead_left = 0;
+	backend = inner;
+	bp_fault_enabled = 1;
+	printf("SPI faults injected (seed %llu): bit flip %g/word, drop %g, duplicate %g, stuck %g x %d, dead %g x %d,"
+		" latency %g x %d us per frame\n", cfg.seed, cfg.bit_flip_rate, cfg.drop_rate, cfg.duplicate_rate,
+		cfg.stuck_rate, cfg.stuck_frames, cfg.dead_rate, cfg.dead_frames, cfg.latency_rate, cfg.latency_us);
+	return 0;
+}
+
+/* Answer one frame through the backend, with faults applied to the answer */
+void bp_fault_transfer(const unsigned short *message, unsigned short *data) {
+	unsigned long long t0 = monotonic_ns();
+	struct timespec ts;
+	int i, k, faulty = 0;
+
+	if (dead_left == 0 && cfg.dead_rate > 0 && uniform() < cfg.dead_rate) {
+		dead_left = cfg.dead_frames;
+		injected[F_DEAD]++;
+	}
+	if (dead_left > 0) {
+		// the FPGA ignores the frame, nothing drives MISO
+		dead_left--;
+		for (i = 0; i < 11; i++)
+			data[i] = cfg.idle_value;
+		faulty = 1;
+	} else {
+		backend(message, data);
+		if (stuck_left == 0 && cfg.stuck_rate > 0 && uniform() < cfg.stuck_rate) {
+			stuck_left = cfg.stuck_frames;
+			injected[F_STUCK]++;
+		}
+		if (stuck_left > 0) {
+			// the frame is delivered, the answer is lost
+			stuck_left--;
+			for (i = 0; i < 11; i++)
+				data[i] = cfg.stuck_value;
+			faulty = 1;
+		}
+		if (cfg.drop_rate > 0 && uniform() < cfg.drop_rate) {
+			k = below(11);
+			for (i = k; i < 10; i++)
+				data[i] = data[i+1];
+			data[10] = cfg.idle_value;
+			injected[F_DROP]++;
+			faulty = 1;
+		}
+		if (cfg.duplicate_rate > 0 && uniform() < cfg.duplicate_rate) {
+			k = below(10);
+			for (i = 10; i > k; i--)
+				data[i] = data[i-1];
+			injected[F_DUPLICATE]++;
+			faulty = 1;
+		}
+		if (cfg.bit_flip_rate > 0) {
+			for (i = 0; i < 11; i++) {
+				if (uniform() < cfg.bit_flip_rate) {
+					data[i] ^= 1 << below(16);
+					injected[F_BITFLIP]++;
+					faulty = 1;
+				}
+			}
+		}
+	}
+	if (cfg.latency_rate > 0 && uniform() < cfg.latency_rate) {
+		ts.tv_sec = cfg.latency_us / 1000000;
+		ts.tv_nsec = (cfg.latency_us % 1000000) * 1000L;
+		nanosleep(&ts, NULL);
+		injected[F_LATENCY]++;
+	}
+
+	last_faulty = faulty;
+	nfaulty += faulty;
+	nframes++;
+	link_ns += monotonic_ns() - t0;
+}
+
+/* SOM and EOM of the FPGA the message was for, and the command word echoed */
+int bp_frame_ok(const unsigned short *message, const unsigned short *data) {
+	if (message[0] == SPI_SOM_TFPGA)
+		return data[0] == SPI_SOM_TFPGA && data[1] == message[1] && data[10] == SPI_EOM_TFPGA;
+	if (message[0] == SPI_SOM_HKFPGA)
+		return data[0] == SPI_SOM_HKFPGA && data[1] == message[1] && data[10] == SPI_EOM_HKFPGA;
+	return 0;
+}
+
+/*
+	bp_frame_repeatable()
+
+	Whether the frame may be sent a second time when its answer fails the
+	check. The first attempt may have reached the FPGA with only the answer
+	corrupted, so only reads and writes that leave the same state when
+	repeated qualify. Resets, power control, the software and peripheral
+	triggers, timer loads and trigger at time are sent once.
+*/
+int bp_frame_repeatable(const unsigned short *message) {
+	unsigned short cw = message[1];
+
+	if (message[0] == SPI_SOM_TFPGA) {
+		switch (cw & 0xff00) {
+		case SPI_WRAP_AROUND_TFPGA:
+		case SPI_READ_nsTimer_TFPGA:
+		case SPI_TRIGGERMASK_TFPGA:
+		case SPI_TRIGGERMASK1_TFPGA:
+		case SPI_TRIGGERMASK2_TFPGA:
+		case SPI_TRIGGERMASK3_TFPGA:
+		case SPI_READ_TRIGGER_NSTIMER_TFPGA:
+		case SPI_HOLDOFF_TFPGA:
+		case SPI_L1_TRIGGER_EN:
+		case SPI_READ_HIT_PATTERN:
+		case SPI_READ_HIT_PATTERN1:
+		case SPI_READ_HIT_PATTERN2:
+		case SPI_READ_HIT_PATTERN3:
+		case SPI_SET_ARRAY_SERDES_CONFIG:
+		case SPI_SET_TACK_TYPE_MODE:
+		case SPI_READ_DIAT_WORDS:
+			return 1;
+		}
+		return 0;
+	}
+	if (message[0] == SPI_SOM_HKFPGA) {
+		if (cw == CW_RD_PWRSTATUS)   // 0x0B.. is also the SI5338 and I2C resets
+			return 1;
+		switch (cw & 0xff00) {
+		case SPI_WRAP_AROUND:
+		case CW_FEEs_PRESENT:
+		case CW_RD_FEE0_I & 0xff00:
+		case CW_RD_FEE0_V & 0xff00:
+		case CW_RD_ENV:
+		case CW_RD_HKPWB:
+		case CW_TRG_ADCS:            // restarts the conversion the caller waits for
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static struct component *component_stats(const char *name) {
+	int i;
+
+	for (i = 0; i < ncomponents; i++)
+		if (components[i].name == name || strcmp(components[i].name, name) == 0)
+			return &components[i];
+	if (ncomponents == NCOMPONENTS)
+		return &components[NCOMPONENTS - 1];
+	components[ncomponents].name = name;
+	return &components[ncomponents++];
+}
+
+/*
+	transfer_checked()
+
+	transfer_message() for callers that can tell a bad answer from a good
+	one: the frame is resent until the answer passes bp_frame_ok(), at most
+	BP_FRAME_TRIES times, if bp_frame_repeatable() allows it, else it is
+	sent once. Returns 0, or -1 with the last answer in data. Callers
+	serialise as they do for transfer_message().
+*/
+int transfer_checked(const char *component, unsigned short *message, unsigned short *data) {
+	struct component *c = component_stats(component);
+	unsigned long long t0 = monotonic_ns();
+	int tries, ntries = bp_frame_repeatable(message) ? BP_FRAME_TRIES : 1;
+
+	last_faulty = 0;
+	for (tries = 0; tries < ntries; tries++) {
+		transfer_message(message, data);
+		c->frames++;
+		c->faulty += last_faulty;
+		if (bp_frame_ok(message, data)) {
+			c->silent += last_faulty;
+			c->recovered += tries > 0;
+			c->ns += monotonic_ns() - t0;
+			return 0;
+		}
+		c->rejected++;
+	}
+	c->failed++;
+	c->unrepeated += ntries == 1;
+	c->ns += monotonic_ns() - t0;
+	return -1;
+}
+
+void bp_fault_report(FILE *fptr) {
+	unsigned long long checked_faulty = 0;
+	int i;
+
+	if (bp_fault_enabled) {
+		fprintf(fptr, "SPI link (seed %llu): %llu frames in %.3f s, %.0f frames/s, %llu answers corrupted\n",
+			cfg.seed, nframes, link_ns * 1e-9, link_ns ? nframes / (link_ns * 1e-9) : 0.0, nfaulty);
+		fprintf(fptr, "injected:");
+		for (i = 0; i < F_NKINDS; i++)
+			fprintf(fptr, " %llu %s%s", injected[i], fault_name[i], i < F_NKINDS - 1 ? "," : "\n");
+	}
+	fprintf(fptr, "%-14s %10s %9s %9s %9s %7s %7s %9s %9s %10s\n", "component", "frames", "rejected", "retries",
+		"recovered", "failed", "unsafe", "faulty", "silent", "frames/s");
+	for (i = 0; i < ncomponents; i++) {
+		struct component *c = &components[i];
+		fprintf(fptr, "%-14s %10llu %9llu %9llu %9llu %7llu %7llu %9llu %9llu %10.0f\n", c->name, c->frames,
+			c->rejected, c->rejected - c->failed, c->recovered, c->failed, c->unrepeated, c->faulty,
+			c->silent, c->ns ? c->frames / (c->ns * 1e-9) : 0.0);
+		checked_faulty += c->faulty;
+	}
+	if (bp_fault_enabled)
+		fprintf(fptr, "%llu corrupted answers went to unchecked callers (menu commands, recordings)\n",
+			nfaulty - checked_faulty);
+}
@@ -0,0 +1,29 @@
+/*
+ ============================================================================
+ Name        : bp_fault.h
+ Description : Fault injection between transfer_message() and the SPI
+               backend, and the checked transfer for components that can
+               recover from a bad frame
+ ============================================================================
+ */
+#ifndef BP_FAULT_H
+#define BP_FAULT_H
+
+#include <stdio.h>
+
+#define BP_FRAME_TRIES 3   // attempts transfer_checked() makes before giving up
+
+/* A backend answers one frame, as transfer_message() does */
+typedef void (*bp_transfer_fn)(const unsigned short *message, unsigned short *data);
+
+extern int bp_fault_enabled;
+
+int bp_fault_init(const char *config_file, bp_transfer_fn backend);
+void bp_fault_transfer(const unsigned short *message, unsigned short *data);
+void bp_fault_report(FILE *fptr);
+
+int bp_frame_ok(const unsigned short *message, const unsigned short *data);
+int bp_frame_repeatable(const unsigned short *message);
+int transfer_checked(const char *component, unsigned short *message, unsigned short *data);
+
+#endif
@@ -0,0 +1,232 @@
+/*
+ ============================================================================
+ Name        : bp_live.c
+ Description : Acquisition threads and their latest-state buffers.
+               The trigger thread reads the TFPGA nsTimer/counter frame and
+               the four hit pattern frames at a fixed period, as one batch
+               through the DMA frame engine if BP_DMA is set, the
+               housekeeping thread sweeps the FEE current/voltage ADCs.
+               Each keeps its state privately and publishes a copy under a
+               sequence count (odd while it is being written), so any
+               number of readers take the latest state without locks and
+               without extra SPI frames.
+ ============================================================================
+ */
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "spicomms.h"
+#include "bp_fault.h"
+#include "bp_dma.h"
+#include "bp_live.h"
+
+static const unsigned short hit_pattern_cw[4] = {
+	SPI_READ_HIT_PATTERN, SPI_READ_HIT_PATTERN1, SPI_READ_HIT_PATTERN2, SPI_READ_HIT_PATTERN3
+};
+
+static void tfpga_message(unsigned short *spi_message, unsigned short cw) {
+	spi_message[0] = SPI_SOM_TFPGA; // som
+	spi_message[1] = cw; // cw
+	spi_message[2] = 0x0111;
+	spi_message[3] = 0x1222;
+	spi_message[4] = 0x2333;
+	spi_message[5] = 0x3444;
+	spi_message[6] = 0x4555;
+	spi_message[7] = 0x5666;
+	spi_message[8] = 0x6777;
+	spi_message[9] = 0x7888;
+	spi_message[10] = SPI_EOM_TFPGA; // not used
+}
+
+static void publish(unsigned int *seq, void *dst, const void *src, size_t size) {
+	unsigned int s = __atomic_load_n(seq, __ATOMIC_RELAXED);
+
+	__atomic_store_n(seq, s + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy(dst, src, size);
+	__atomic_store_n(seq, s + 2, __ATOMIC_RELEASE);
+}
+
+static void snapshot(unsigned int *seq, void *dst, const void *src, size_t size) {
+	unsigned int s1, s2;
+
+	do {
+		s1 = __atomic_load_n(seq, __ATOMIC_ACQUIRE);
+		memcpy(dst, src, size);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		s2 = __atomic_load_n(seq, __ATOMIC_RELAXED);
+	} while (s1 != s2 || (s1 & 1));
+}
+
+/* Sleep to an absolute CLOCK_MONOTONIC deadline in slices, so bp_live_stop()
+   does not wait out a whole housekeeping period */
+static void sleep_until(struct bp_live *live, unsigned long long deadline) {
+	unsigned long long now, step;
+	struct timespec ts;
+
+	while (live->running && (now = monotonic_ns()) < deadline) {
+		step = deadline - now;
+		if (step > 50000000ULL)
+			step = 50000000ULL;
+		ts.tv_sec = step / 1000000000ULL;
+		ts.tv_nsec = step % 1000000000ULL;
+		nanosleep(&ts, NULL);
+	}
+}
+
+static unsigned long long next_deadline(unsigned long long deadline, int period_ms) {
+	unsigned long long now = monotonic_ns();
+
+	deadline += (unsigned long long) period_ms * 1000000ULL;
+	return deadline < now ? now : deadline;   // fell behind, do not burst to catch up
+}
+
+static void *trigger_main(void *arg) {
+	struct bp_live *live = arg;
+	struct bp_live_trigger st;
+	unsigned short spi_message[5][11], data[5][11], *counters = data[0], word;
+	unsigned short hit_pattern[HP_NWORDS];
+	unsigned long long deadline, ref_nstime = 0;
+	unsigned long ref_tacks = 0, ref_hw = 0, hwtriggers;
+	double dt;
+	int f, w, first = 1, new_trigger, ok;
+
+	memset(&st, 0, sizeof(st));
+	tfpga_message(spi_message[0], SPI_READ_nsTimer_TFPGA);
+	for (f = 0; f < 4; f++)
+		tfpga_message(spi_message[1 + f], hit_pattern_cw[f]);
+	deadline = monotonic_ns();
+	while (live->running) {
+		pthread_mutex_lock(&live->spi_lock);
+		ok = bp_dma_checked("live", spi_message, data, 5) == 0;
+		pthread_mutex_unlock(&live->spi_lock);
+		for (f = 0; ok && f < 4; f++)
+			hit_pattern_from_frame(hit_pattern, f, data[1 + f]);
+		st.spi_frames += 5;
+		if (!ok) {
+			// keep the last good state, a half read pattern would be counted as hits
+			st.spi_failed++;
+			publish(&live->trigger_seq, &live->trigger, &st, sizeof(st));
+			deadline = next_deadline(deadline, live->trigger_period_ms);
+			sleep_until(live, deadline);
+			continue;
+		}
+		st.t_ns = monotonic_ns();
+		st.nstime = ((unsigned long long) counters[2] << 48) | ((unsigned long long) counters[3] << 32) |
+			((unsigned long long) counters[4] << 16) | counters[5];
+		st.tacks = (((unsigned long) counters[6] << 16) | counters[7]) - 1;   // TFPGA adds one extra on reset
+		hwtriggers = (((unsigned long) counters[8] << 16) | counters[9]) - 1;
+		new_trigger = !first && hwtriggers != st.hwtriggers;
+		st.hwtriggers = hwtriggers;
+		memcpy(st.hit_pattern, hit_pattern, sizeof(hit_pattern));
+		st.nreads++;
+
+		// The pattern stays latched until the next trigger, count it once
+		if (new_trigger) {
+			st.ntriggers++;
+			for (w = 0; w < HP_NWORDS; w++)
+				for (word = st.hit_pattern[w]; word; word &= word - 1)
+					st.hits[16 * w + __builtin_ctz(word)]++;
+		}
+
+		if (first || st.nstime < ref_nstime || st.tacks < ref_tacks || st.hwtriggers < ref_hw) {
+			// first read or counters reset ('l')
+			ref_nstime = st.nstime;
+			ref_tacks = st.tacks;
+			ref_hw = st.hwtriggers;
+			st.tack_rate_hz = st.hw_rate_hz = 0;
+		} else if ((dt = (st.nstime - ref_nstime) * 1e-9) >= live->rate_window_s) {
+			st.tack_rate_hz = (st.tacks - ref_tacks) / dt;
+			st.hw_rate_hz = (st.hwtriggers - ref_hw) / dt;
+			ref_nstime = st.nstime;
+			ref_tacks = st.tacks;
+			ref_hw = st.hwtriggers;
+		}
+		first = 0;
+
+		publish(&live->trigger_seq, &live->trigger, &st, sizeof(st));
+		if (live->on_trigger != NULL)
+			live->on_trigger(live->arg, &st, new_trigger);
+		deadline = next_deadline(deadline, live->trigger_period_ms);
+		sleep_until(live, deadline);
+	}
+	return NULL;
+}
+
+static void *hskp_main(void *arg) {
+	struct bp_live *live = arg;
+	struct bp_live_hskp st;
+	unsigned short raw[HSKP_NCHAN];
+	unsigned long long deadline;
+	int ok;
+
+	memset(&st, 0, sizeof(st));
+	deadline = monotonic_ns();
+	while (live->running) {
+		pthread_mutex_lock(&live->spi_lock);
+		ok = hskp_trigger_adcs() == 0;
+		pthread_mutex_unlock(&live->spi_lock);
+		sleep_until(live, monotonic_ns() + (unsigned long long) live->hskp_settle_ms * 1000000ULL);
+		if (!live->running)
+			break;
+		pthread_mutex_lock(&live->spi_lock);
+		ok = ok && hskp_read_adcs(raw) == 0;
+		pthread_mutex_unlock(&live->spi_lock);
+		if (ok) {
+			memcpy(st.raw, raw, sizeof(raw));
+			st.t_ns = monotonic_ns();
+			st.nsweeps++;
+		} else {
+			st.spi_failed++;
+		}
+
+		publish(&live->hskp_seq, &live->hskp, &st, sizeof(st));
+		if (ok && live->on_hskp != NULL)
+			live->on_hskp(live->arg, &st);
+		deadline = next_deadline(deadline, live->hskp_period_ms);
+		sleep_until(live, deadline);
+	}
+	return NULL;
+}
+
+int bp_live_start(struct bp_live *live) {
+	memset(&live->trigger, 0, sizeof(live->trigger));
+	memset(&live->hskp, 0, sizeof(live->hskp));
+	live->trigger_seq = live->hskp_seq = 0;
+	if (live->trigger_period_ms < 1)
+		live->trigger_period_ms = 1;
+	if (live->hskp_period_ms < 1)
+		live->hskp_period_ms = 1;
+	if (live->rate_window_s <= 0)
+		live->rate_window_s = 1;
+	pthread_mutex_init(&live->spi_lock, NULL);
+	live->running = 1;
+	if (pthread_create(&live->trigger_thread, NULL, trigger_main, live) != 0) {
+		live->running = 0;
+		pthread_mutex_destroy(&live->spi_lock);
+		return -1;
+	}
+	if (pthread_create(&live->hskp_thread, NULL, hskp_main, live) != 0) {
+		live->running = 0;
+		pthread_join(live->trigger_thread, NULL);
+		pthread_mutex_destroy(&live->spi_lock);
+		return -1;
+	}
+	return 0;
+}
+
+void bp_live_stop(struct bp_live *live) {
+	live->running = 0;
+	pthread_join(live->trigger_thread, NULL);
+	pthread_join(live->hskp_thread, NULL);
+	pthread_mutex_destroy(&live->spi_lock);
+}
+
+void bp_live_trigger(struct bp_live *live, struct bp_live_trigger *out) {
+	snapshot(&live->trigger_seq, out, &live->trigger, sizeof(*out));
+}
+
+void bp_live_hskp(struct bp_live *live, struct bp_live_hskp *out) {
+	snapshot(&live->hskp_seq, out, &live->hskp, sizeof(*out));
+}
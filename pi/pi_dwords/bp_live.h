@@ -0,0 +1,72 @@
+/*
+ ============================================================================
+ Name        : bp_live.h
+ Description : Acquisition threads and their latest-state buffers
+ ============================================================================
+ */
+#ifndef BP_LIVE_H
+#define BP_LIVE_H
+
+#include <pthread.h>
+
+#include "hp_occupancy.h"
+#include "hskp_burst.h"
+
+/* TFPGA counters and the last latched hit pattern */
+struct bp_live_trigger {
+	unsigned long long t_ns;           // CLOCK_MONOTONIC time of the read
+	unsigned long long nstime;         // TFPGA nsTimer
+	unsigned long tacks;
+	unsigned long hwtriggers;
+	double tack_rate_hz;               // over the last rate window
+	double hw_rate_hz;
+	unsigned short hit_pattern[HP_NWORDS];
+	unsigned long long nreads;         // hit pattern reads since start
+	unsigned long long ntriggers;      // reads that found a new HW trigger
+	unsigned int hits[HP_NPIXELS];     // per pixel, summed over those reads
+	unsigned long long spi_frames;
+	unsigned long long spi_failed;     // reads dropped, a frame got no valid answer
+};
+
+/* FEE current/voltage ADC counts, channel order of struct hskp_burst */
+struct bp_live_hskp {
+	unsigned long long t_ns;
+	unsigned long long nsweeps;
+	unsigned long long spi_failed;     // sweeps dropped, a frame got no valid answer
+	unsigned short raw[HSKP_NCHAN];
+};
+
+/*
+	Set the periods and call bp_live_start(). Each thread owns one buffer
+	and publishes it under a sequence count, readers copy it out with
+	bp_live_trigger()/bp_live_hskp() without ever blocking the thread or
+	touching the bus. The threads share the SPI bus through spi_lock, so
+	nothing else may call transfer_message() until bp_live_stop().
+	on_trigger and on_hskp, if set, see every read as it is published,
+	from the acquisition thread itself, so they must not block.
+*/
+struct bp_live {
+	int trigger_period_ms;   // TFPGA counters + hit pattern, 5 frames per read
+	int hskp_period_ms;      // FEE ADC sweep, 9 frames
+	int hskp_settle_ms;      // between CW_TRG_ADCS and the reads, bus is free meanwhile
+	double rate_window_s;
+	void (*on_trigger)(void *arg, const struct bp_live_trigger *st, int new_trigger);
+	void (*on_hskp)(void *arg, const struct bp_live_hskp *st);
+	void *arg;
+
+	volatile int running;
+	pthread_t trigger_thread;
+	pthread_t hskp_thread;
+	pthread_mutex_t spi_lock;
+	unsigned int trigger_seq;
+	struct bp_live_trigger trigger;
+	unsigned int hskp_seq;
+	struct bp_live_hskp hskp;
+};
+
+int bp_live_start(struct bp_live *live);
+void bp_live_stop(struct bp_live *live);
+void bp_live_trigger(struct bp_live *live, struct bp_live_trigger *out);
+void bp_live_hskp(struct bp_live *live, struct bp_live_hskp *out);
+
+#endif
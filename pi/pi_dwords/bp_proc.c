@@ -0,0 +1,248 @@
+/*
+ ============================================================================
+ Name        : bp_proc.c
+ Description : The multi-step menu procedures as bp_seq procedures. They
+               send the same frames as the blocking menu commands, but
+               wait on the sequencer instead of sleeping, so they can run
+               together and alongside periodic acquisitions (menu 'Q').
+               Where the blocking code used a fixed delay as a stand-in
+               for a condition, the procedure waits for the condition:
+               SYNC waits for the nsTimer to pass the SYNC time before
+               the TACK type is set back, power up waits for the FEE
+               currents to settle.
+ ============================================================================
+ */
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include "spicomms.h"
+#include "hskp_burst.h"
+#include "trigger_mask.h"
+#include "bp_seq.h"
+#include "bp_proc.h"
+
+static const unsigned short trigger_mask_cw[4] = {
+	SPI_TRIGGERMASK_TFPGA, SPI_TRIGGERMASK1_TFPGA, SPI_TRIGGERMASK2_TFPGA, SPI_TRIGGERMASK3_TFPGA
+};
+
+int bp_proc_sync(struct bp_seq_task *t) {
+	struct bp_proc_sync *p = t->ctx;
+	unsigned short *m;
+
+	SEQ_BEGIN(t);
+	p->status = -1;
+	p->sync_ns &= ~7ULL;   // the TFPGA needs the 3 LSBs of the time 000
+
+	bp_seq_log(t, "TYPE 01 MODE 00 for a SYNC message");
+	m = bp_seq_frame(t, SPI_SOM_TFPGA, SPI_SET_TACK_TYPE_MODE);
+	memset(&m[2], 0, 8 * sizeof(*m));
+	m[2] = 0x0004; // TYPE 01 MODE 00
+	SEQ_SPI(t);
+	if (t->spi_status != 0)
+		SEQ_END(t);
+	SEQ_SLEEP_US(t, 20);
+
+	bp_seq_log(t, "SYNC at nsTimer %llu ns", p->sync_ns);
+	m = bp_seq_frame(t, SPI_SOM_TFPGA, SPI_SET_TRIG_AT_TIME);
+	memset(&m[2], 0, 8 * sizeof(*m));
+	m[2] = p->sync_ns >> 48;
+	m[3] = p->sync_ns >> 32;
+	m[4] = p->sync_ns >> 16;
+	m[5] = p->sync_ns;
+	SEQ_SPI(t);
+	if (t->spi_status != 0)
+		SEQ_END(t);
+	SEQ_SLEEP_US(t, 20);
+
+	bp_seq_log(t, "nsTimer reset to 0");
+	bp_seq_frame(t, SPI_SOM_TFPGA, RESET_TRIGGER_COUNT_AND_NSTIMER);
+	SEQ_SPI(t);
+	if (t->spi_status != 0)
+		SEQ_END(t);
+
+	// the TFPGA sends the SYNC when the nsTimer reaches sync_ns
+	p->wait.target = p->sync_ns;
+	p->wait.poll_us = 20;
+	p->wait.timeout_ms = 1000;
+	SEQ_CALL(t, &p->call, bp_seq_wait_nstimer, &p->wait);
+	if (p->wait.status != 0)
+		bp_seq_log(t, "nsTimer did not reach the SYNC time (last %llu ns)", p->wait.nstime);
+
+	bp_seq_log(t, "TYPE 00 MODE 00 so subsequent messages are TACKs");
+	m = bp_seq_frame(t, SPI_SOM_TFPGA, SPI_SET_TACK_TYPE_MODE);
+	memset(&m[2], 0, 8 * sizeof(*m));
+	SEQ_SPI(t);
+	if (t->spi_status == 0 && p->wait.status == 0)
+		p->status = 0;
+	SEQ_END(t);
+}
+
+int bp_proc_power(struct bp_seq_task *t) {
+	struct bp_proc_power *p = t->ctx;
+	unsigned short *m;
+	double amps;
+	int slot, moved, nlow;
+
+	SEQ_BEGIN(t);
+	p->status = -1;
+	bp_seq_frame(t, SPI_SOM_HKFPGA, CW_FEEs_PRESENT);
+	SEQ_SPI(t);
+	if (t->spi_status != 0)
+		SEQ_END(t);
+	p->present = t->data[2] | (unsigned long) t->data[3] << 16;
+
+	m = bp_seq_frame(t, SPI_SOM_HKFPGA, CW_FEE_POWER_CTL);
+	m[2] = p->fees >> 16;
+	m[3] = p->fees & 0x0000ffff;
+	SEQ_SPI(t);
+	if (t->spi_status != 0)
+		SEQ_END(t);
+	p->check = p->fees & p->present;
+	bp_seq_log(t, "FEE power %08lx, waiting for %d FEE currents to settle", p->fees,
+		__builtin_popcountl(p->check));
+
+	p->deadline_ns = monotonic_ns() + (unsigned long long) p->timeout_ms * 1000000ULL;
+	p->stable = p->sweeps = 0;
+	for (slot = 0; slot < 32; slot++)
+		p->last[slot] = -1;
+	while (p->stable < p->settle_sweeps) {
+		if (monotonic_ns() >= p->deadline_ns) {
+			bp_seq_log(t, "currents not settled within %d ms (%d sweeps)", p->timeout_ms, p->sweeps);
+			SEQ_END(t);
+		}
+		SEQ_SLEEP_MS(t, p->sweep_ms);
+		p->hskp.settle_us = HSKP_SETTLE_US;
+		SEQ_CALL(t, &p->call, bp_seq_hskp_sweep, &p->hskp);
+		if (p->hskp.status != 0)
+			continue;
+		p->sweeps++;
+		moved = 0;
+		for (slot = 0; slot < 32; slot++) {
+			if (!((p->check >> slot) & 1))
+				continue;
+			amps = p->hskp.row[slot] * HSKP_AMPS_PER_LSB;
+			if (fabs(amps - p->last[slot]) > p->settle_a)
+				moved = 1;
+			p->last[slot] = amps;
+		}
+		p->stable = moved ? 0 : p->stable + 1;
+	}
+
+	nlow = 0;
+	for (slot = 0; slot < 32; slot++) {
+		if (((p->check >> slot) & 1) && p->last[slot] < p->min_a) {
+			bp_seq_log(t, "FEE j%d draws %.3f A, below %.3f A", slot, p->last[slot], p->min_a);
+			nlow++;
+		}
+	}
+	bp_seq_log(t, "currents settled after %d sweeps, %d of %d FEEs verified", p->sweeps,
+		__builtin_popcountl(p->check) - nlow, __builtin_popcountl(p->check));
+	p->status = nlow == 0 ? 0 : -1;
+	SEQ_END(t);
+}
+
+int bp_proc_reset(struct bp_seq_task *t) {
+	struct bp_proc_reset *p = t->ctx;
+	unsigned short *m;
+	int i;
+
+	SEQ_BEGIN(t);
+	p->status = -1;
+	if (trigger_mask_valid) {
+		memcpy(p->saved, trigger_mask, sizeof(p->saved));
+	} else {
+		memset(p->saved, 0, sizeof(p->saved));
+		bp_seq_log(t, "no trigger mask written yet, all groups are enabled again afterwards");
+	}
+
+	bp_seq_log(t, "masking all trigger groups");
+	for (p->frame = 0; p->frame < 4; p->frame++) {
+		m = bp_seq_frame(t, SPI_SOM_TFPGA, trigger_mask_cw[p->frame]);
+		for (i = 0; i < 8; i++)
+			m[i+2] = 0xffff;
+		SEQ_SPI(t);
+		if (t->spi_status != 0)
+			goto restore;
+	}
+
+	bp_seq_log(t, "resetting FEE j%d, dwell %d ms", p->fee, p->dwell_ms);
+	m = bp_seq_frame(t, SPI_SOM_HKFPGA, CW_RESET_FEE);
+	m[2] = p->fee;
+	SEQ_SPI(t);
+	if (t->spi_status != 0)
+		goto restore;
+	SEQ_SLEEP_MS(t, p->dwell_ms);
+
+	p->hskp.settle_us = HSKP_SETTLE_US;
+	SEQ_CALL(t, &p->call, bp_seq_hskp_sweep, &p->hskp);
+	if (p->hskp.status == 0) {
+		bp_seq_log(t, "FEE j%d after reset: %.3f A, %.3f V", p->fee, p->hskp.row[p->fee] * HSKP_AMPS_PER_LSB,
+			p->hskp.row[HSKP_NSLOTS + p->fee] * HSKP_VOLTS_PER_LSB);
+		p->status = 0;
+	}
+
+restore:
+	for (p->frame = 0; p->frame < 4; p->frame++) {
+		m = bp_seq_frame(t, SPI_SOM_TFPGA, trigger_mask_cw[p->frame]);
+		for (i = 0; i < 8; i++)
+			m[i+2] = p->saved[8*p->frame + i];
+		SEQ_SPI(t);
+		if (t->spi_status != 0) {
+			bp_seq_log(t, "trigger mask frame %d not acknowledged, the mask is NOT restored", p->frame);
+			p->status = -1;
+			SEQ_END(t);
+		}
+	}
+	trigger_mask_set(p->saved);
+	bp_seq_log(t, "trigger mask restored");
+	SEQ_END(t);
+}
+
+int bp_proc_hskp(struct bp_seq_task *t) {
+	struct bp_proc_hskp *p = t->ctx;
+	int row, k, slot;
+
+	SEQ_BEGIN(t);
+	p->hskp.settle_us = p->settle_us;
+	SEQ_CALL(t, &p->call, bp_seq_hskp_sweep, &p->hskp);
+	if (p->hskp.status != 0) {
+		bp_seq_log(t, "no valid answer from the HKFPGA");
+		SEQ_END(t);
+	}
+	bp_seq_log(t, "FEE currents [A] and voltages [V]");
+	for (row = 0; row < 5; row++) {
+		for (k = 0; k < 5; k++) {
+			slot = fee_display_order[5*row + k];
+			printf("  j%-2d %5.3f %5.2f", slot, p->hskp.row[slot] * HSKP_AMPS_PER_LSB,
+				p->hskp.row[HSKP_NSLOTS + slot] * HSKP_VOLTS_PER_LSB);
+		}
+		printf("\n");
+	}
+	SEQ_END(t);
+}
+
+int bp_proc_counters(struct bp_seq_task *t) {
+	struct bp_proc_counters *p = t->ctx;
+
+	SEQ_BEGIN(t);
+	bp_seq_frame(t, SPI_SOM_TFPGA, SPI_READ_nsTimer_TFPGA);
+	SEQ_SPI(t);
+	if (t->spi_status != 0)
+		SEQ_END(t);
+	p->nstime = ((unsigned long long) t->data[2] << 48) | ((unsigned long long) t->data[3] << 32) |
+		((unsigned long long) t->data[4] << 16) | t->data[5];
+	p->tacks = (((unsigned long) t->data[6] << 16) | t->data[7]) - 1;   // TFPGA adds one extra on reset
+	p->hwtriggers = (((unsigned long) t->data[8] << 16) | t->data[9]) - 1;
+	// a SYNC or 'l' resets the counters, start the rate over
+	if (p->have_last && p->nstime > p->last_nstime && p->hwtriggers >= p->last_hwtriggers)
+		p->rate_hz = (p->hwtriggers - p->last_hwtriggers) / ((p->nstime - p->last_nstime) * 1e-9);
+	else
+		p->rate_hz = 0;
+	bp_seq_log(t, "nsTimer %.3f s, %lu TACKs, %lu triggers, %.1f Hz", p->nstime * 1e-9, p->tacks,
+		p->hwtriggers, p->rate_hz);
+	p->last_nstime = p->nstime;
+	p->last_hwtriggers = p->hwtriggers;
+	p->have_last = 1;
+	SEQ_END(t);
+}
@@ -0,0 +1,77 @@
+/*
+ ============================================================================
+ Name        : bp_proc.h
+ Description : Hardware procedures for the bp_seq sequencer
+ ============================================================================
+ */
+#ifndef BP_PROC_H
+#define BP_PROC_H
+
+#include "bp_seq.h"
+#include "trigger_mask.h"
+
+/* 's': TACK type SYNC, SYNC scheduled at sync_ns, nsTimer reset, wait for
+   the nsTimer to pass sync_ns, TACK type back */
+struct bp_proc_sync {
+	unsigned long long sync_ns;
+	struct bp_seq_task call;
+	struct bp_seq_nstimer wait;
+	int status;
+};
+int bp_proc_sync(struct bp_seq_task *t);
+
+/* Power the FEEs in fees on ('n' semantics: the full on/off pattern), then
+   sweep the currents until every powered FEE that is present has moved by
+   less than settle_a over settle_sweeps sweeps, and check each draws at
+   least min_a */
+struct bp_proc_power {
+	unsigned long fees;
+	double settle_a;
+	int settle_sweeps;
+	int sweep_ms;
+	int timeout_ms;
+	double min_a;
+
+	unsigned long present, check;
+	unsigned long long deadline_ns;
+	double last[32];
+	int stable, sweeps;
+	struct bp_seq_task call;
+	struct bp_seq_hskp hskp;
+	int status;                    // 0 settled and verified, -1 otherwise
+};
+int bp_proc_power(struct bp_seq_task *t);
+
+/* Mask every trigger group, reset a FEE ('r'), dwell, read its current
+   and voltage, restore the trigger mask */
+struct bp_proc_reset {
+	int fee;
+	int dwell_ms;
+
+	unsigned short saved[TRIGGER_MASK_NWORDS];
+	int frame;
+	struct bp_seq_task call;
+	struct bp_seq_hskp hskp;
+	int status;
+};
+int bp_proc_reset(struct bp_seq_task *t);
+
+/* One housekeeping sweep, printed as 'i' and 'v' print it */
+struct bp_proc_hskp {
+	int settle_us;
+	struct bp_seq_task call;
+	struct bp_seq_hskp hskp;
+};
+int bp_proc_hskp(struct bp_seq_task *t);
+
+/* Periodic: nsTimer, TACK and hardware trigger counters, and the trigger
+   rate since the previous run */
+struct bp_proc_counters {
+	unsigned long long nstime, last_nstime;
+	unsigned long tacks, hwtriggers, last_hwtriggers;
+	double rate_hz;
+	int have_last;
+};
+int bp_proc_counters(struct bp_seq_task *t);
+
+#endif
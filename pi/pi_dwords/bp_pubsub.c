@@ -0,0 +1,583 @@
+/*
+ ============================================================================
+ Name        : bp_pubsub.c
+ Description : Fan-out of live data to any number of TCP subscribers
+               (menu 'P'), so the run-control GUI, an archiver and the web
+               view share one acquisition instead of an ssh session each.
+
+               A subscriber connects (default port 5700) and sends one line
+
+                 SUB <topics> <policy> [queue] [interval_ms]
+
+               topics a comma list of hp, rate, hskp, event, "all" or
+               "none", policy block, drop or conflate. It gets "OK PUB1
+               <policy> <queue>" back (or "ERR <why>" and the connection
+               closed), then a bp_pub_header and its payload per message.
+               After that it may send requests at any time,
+
+                 REQ <id> <request>
+
+               answered by the frontend's on_request() with a message of
+               topic BP_TOPIC_REPLY and seq id, text starting "OK" or
+               "ERR", to it alone and in order with its stream. Requests
+               are only read while its output buffer has room for the
+               answer, so a client that does not read its answers is held
+               back by TCP and nobody else is.
+
+               Publishers copy each message into one ring, under a lock
+               that is only ever held for that copy or to copy messages
+               out, and wake the server thread. Each subscriber is a
+               cursor into the ring with its own output buffer; the server
+               thread fills the buffers and writes them with MSG_DONTWAIT,
+               so a slow subscriber only ever falls behind in the ring and
+               never holds up the acquisition or the other subscribers
+               (its socket buffer is kept small, so it does fall behind in
+               the ring rather than in the kernel).
+               How far it may fall behind is its queue (at most ring_slots
+               messages), and past it its policy decides:
+
+                 block     nothing is skipped, the subscriber waits instead;
+                           once it is a whole queue behind it is cut off,
+                           never silently thinned (an archiver)
+                 drop      the oldest messages are skipped (a viewer that
+                           wants the recent history)
+                 conflate  only the latest message of each topic is sent,
+                           at most every interval_ms (the GUI, or a
+                           downsampled web view)
+
+               The per-topic sequence numbers of the headers show every
+               skipped message to the subscriber as a gap.
+ ============================================================================
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+#include "bp_config.h"
+#include "hskp_burst.h"
+#include "bp_pubsub.h"
+
+static const char *const topic_name[BP_NTOPICS] = { "hp", "rate", "hskp", "event" };
+static const char *const policy_name[] = { "block", "drop", "conflate" };
+
+/*
+	bp_pubsub_load()
+
+	Defaults if config_file does not exist: port 5700 on 127.0.0.1, no
+	frame requests, 8192 messages in the ring, a queue of 1024, the
+	trigger frames every 10 ms, a FEE sweep a second and a rate message a
+	second.
+*/
+int bp_pubsub_load(struct bp_pubsub_config *cfg, const char *config_file) {
+	struct bp_config c;
+	int status = 0;
+
+	memset(cfg, 0, sizeof(*cfg));
+	memset(&c, 0, sizeof(c));
+	if (access(config_file, R_OK) == 0)
+		status = bp_config_load(&c, config_file);
+	snprintf(cfg->bind, sizeof(cfg->bind), "%s", bp_config_string(&c, "bind", "127.0.0.1"));
+	cfg->port = bp_config_double(&c, "port", BP_PUBSUB_PORT);
+	cfg->allow_frames = bp_config_double(&c, "allow_frames", 0);
+	cfg->ring_slots = bp_config_double(&c, "ring_slots", 8192);
+	cfg->default_queue = bp_config_double(&c, "default_queue", 1024);
+	cfg->trigger_period_ms = bp_config_double(&c, "trigger_period_ms", 10);
+	cfg->hskp_period_ms = bp_config_double(&c, "hskp_period_ms", 1000);
+	cfg->hskp_settle_ms = bp_config_double(&c, "hskp_settle_ms", HSKP_SETTLE_US / 1000);
+	cfg->rate_period_ms = bp_config_double(&c, "rate_period_ms", 1000);
+	cfg->rate_window_s = bp_config_double(&c, "rate_window_s", 1);
+	if (cfg->ring_slots < 16)
+		cfg->ring_slots = 16;
+	if (cfg->default_queue < 1 || cfg->default_queue > cfg->ring_slots)
+		cfg->default_queue = cfg->ring_slots;
+	return status;
+}
+
+/* Wake the server thread, a saturated counter (EAGAIN) has woken it already */
+static void wake(struct bp_pubsub *ps) {
+	uint64_t one = 1;
+
+	if (write(ps->wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		perror("publish wake");
+}
+
+void bp_pubsub_publish(struct bp_pubsub *ps, int topic, const void *payload, int len) {
+	struct bp_pub_slot *slot;
+	struct timespec ts;
+
+	if (len > BP_PUBSUB_MAX_PAYLOAD)
+		len = BP_PUBSUB_MAX_PAYLOAD;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	pthread_mutex_lock(&ps->lock);
+	slot = &ps->ring[ps->head % ps->cfg.ring_slots];
+	slot->h.topic = topic;
+	slot->h.len = len;
+	slot->h.seq = ps->seq[topic]++;
+	slot->h.t_ns = (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	memcpy(slot->payload, payload, len);
+	ps->head++;
+	ps->last[topic] = ps->head;
+	ps->published[topic]++;
+	pthread_mutex_unlock(&ps->lock);
+	wake(ps);
+}
+
+void bp_pubsub_event(struct bp_pubsub *ps, const char *fmt, ...) {
+	char text[BP_PUBSUB_MAX_PAYLOAD];
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(text, sizeof(text), fmt, ap);
+	va_end(ap);
+	bp_pubsub_publish(ps, BP_TOPIC_EVENT, text, strlen(text));
+}
+
+static void copy_out(struct bp_pub_sub *s, const struct bp_pub_slot *slot) {
+	memcpy(s->buf + s->len, slot, sizeof(slot->h) + slot->h.len);
+	s->len += sizeof(slot->h) + slot->h.len;
+	s->sent++;
+}
+
+/* Fill the empty output buffer of s from the ring as its policy says.
+   Returns -1 if a block subscriber is a whole queue behind. */
+static int fill(struct bp_pubsub *ps, struct bp_pub_sub *s, int64_t now_ns) {
+	const struct bp_pub_slot *slot;
+	uint64_t keep;
+	int t, status = 0;
+
+	pthread_mutex_lock(&ps->lock);
+	if (s->topics == 0) {
+		s->next = ps->head;   // requests only
+	} else if (s->policy == BP_POLICY_CONFLATE) {
+		for (t = 0; t < BP_NTOPICS; t++) {
+			if (!(s->topics & (1u << t)) || ps->last[t] <= s->sent_index[t] || now_ns - s->sent_ns[t] < s->interval_ns)
+				continue;
+			if (ps->head - (ps->last[t] - 1) > ps->cfg.ring_slots) {
+				// the slot has been reused since, the next one of t counts this as skipped
+				s->sent_index[t] = ps->last[t];
+				continue;
+			}
+			slot = &ps->ring[(ps->last[t] - 1) % ps->cfg.ring_slots];
+			if (s->sent_index[t] > 0)
+				s->skipped += slot->h.seq - s->sent_seq[t] - 1;
+			copy_out(s, slot);
+			s->sent_index[t] = ps->last[t];
+			s->sent_seq[t] = slot->h.seq;
+			s->sent_ns[t] = now_ns;
+		}
+		s->next = ps->head;
+	} else {
+		if (ps->head - s->next > s->queue) {
+			if (s->policy == BP_POLICY_BLOCK) {
+				status = -1;
+			} else {
+				for (keep = ps->head - s->queue; s->next < keep; s->next++)
+					if (s->topics & (1u << ps->ring[s->next % ps->cfg.ring_slots].h.topic))
+						s->skipped++;
+			}
+		}
+		while (status == 0 && s->next < ps->head && s->len + sizeof(struct bp_pub_slot) <= BP_PUBSUB_BUFSIZE) {
+			slot = &ps->ring[s->next++ % ps->cfg.ring_slots];
+			if (s->topics & (1u << slot->h.topic))
+				copy_out(s, slot);
+		}
+	}
+	pthread_mutex_unlock(&ps->lock);
+	return status;
+}
+
+/* Write to s what its socket takes, refilling from the ring.
+   Returns -1 once it has gone, -2 if it is cut off. */
+static int service(struct bp_pubsub *ps, struct bp_pub_sub *s, int64_t now_ns) {
+	ssize_t n;
+
+	for (;;) {
+		if (s->off == s->len) {
+			s->off = s->len = 0;
+			if (fill(ps, s, now_ns) != 0) {
+				ps->cut++;
+				return -2;
+			}
+			if (s->len == 0)
+				return 0;
+		}
+		n = send(s->fd, s->buf + s->off, s->len - s->off, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return 0;
+		if (n <= 0)
+			return -1;
+		s->off += n;
+	}
+}
+
+static void drop(struct bp_pubsub *ps, struct bp_pub_sub *s, const char *why) {
+	if (s->subscribed)
+		bp_pubsub_event(ps, "subscriber %s %s, %llu sent, %llu skipped", s->peer, why, s->sent, s->skipped);
+	close(s->fd);
+	s->fd = -1;
+	free(s->buf);
+	s->buf = NULL;
+}
+
+/* The first line into an empty socket buffer, it cannot block */
+static void reply(struct bp_pub_sub *s, const char *line) {
+	send(s->fd, line, strlen(line), MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+/* The SUB line. Returns -1 for a bad one, after telling the subscriber. */
+static int subscribe(struct bp_pubsub *ps, struct bp_pub_sub *s, const char *line) {
+	char topics[64], policy[16], *p, *end, answer[96];
+	long queue = ps->cfg.default_queue, interval_ms = 0;
+	int t, n;
+
+	n = sscanf(line, "SUB %63s %15s %ld %ld", topics, policy, &queue, &interval_ms);
+	if (n < 2) {
+		reply(s, "ERR expected SUB <topics> <block|drop|conflate> [queue] [interval_ms]\n");
+		return -1;
+	}
+	s->topics = 0;
+	for (p = topics; *p != '\0'; p = *end ? end + 1 : end) {
+		end = p + strcspn(p, ",");
+		for (t = 0; t < BP_NTOPICS && (strncmp(p, topic_name[t], end - p) != 0 || topic_name[t][end - p] != '\0'); t++)
+			;
+		if (t < BP_NTOPICS)
+			s->topics |= 1u << t;
+		else if (end - p == 3 && strncmp(p, "all", 3) == 0)
+			s->topics = (1u << BP_NTOPICS) - 1;
+		else if (end - p != 4 || strncmp(p, "none", 4) != 0) {
+			reply(s, "ERR topics are hp, rate, hskp, event, all or none\n");
+			return -1;
+		}
+	}
+	for (s->policy = 0; s->policy < 3 && strcmp(policy, policy_name[s->policy]) != 0; s->policy++)
+		;
+	if (s->policy == 3) {
+		reply(s, "ERR policies are block, drop or conflate\n");
+		return -1;
+	}
+	if (queue < 1 || queue > ps->cfg.ring_slots) {
+		snprintf(answer, sizeof(answer), "ERR queue must be 1..%d\n", ps->cfg.ring_slots);
+		reply(s, answer);
+		return -1;
+	}
+	s->queue = queue;
+	s->interval_ns = interval_ms * 1000000LL;
+	pthread_mutex_lock(&ps->lock);
+	s->next = ps->head;   // from now on
+	pthread_mutex_unlock(&ps->lock);
+	snprintf(answer, sizeof(answer), "OK %s %s %ld\n", BP_PUBSUB_MAGIC, policy_name[s->policy], queue);
+	reply(s, answer);
+	s->subscribed = 1;
+	ps->subscribers++;
+	bp_pubsub_event(ps, "subscriber %s %s %s %ld", s->peer, topics, policy_name[s->policy], queue);
+	return 0;
+}
+
+/* Answer one REQ line into the output buffer of s, which has room */
+static void request(struct bp_pubsub *ps, struct bp_pub_sub *s, const char *line, int64_t now_ns) {
+	struct bp_pub_slot answer;
+	char text[BP_PUBSUB_MAX_PAYLOAD - 4];
+	unsigned long id = 0;
+	int n = 0, status = -1;
+
+	text[0] = '\0';
+	if (sscanf(line, "REQ %lu %n", &id, &n) < 1 || n == 0)
+		snprintf(text, sizeof(text), "expected REQ <id> <request>");
+	else if (ps->on_request == NULL)
+		snprintf(text, sizeof(text), "no requests taken");
+	else
+		status = ps->on_request(ps->request_arg, line + n, text, sizeof(text));
+	snprintf((char *) answer.payload, sizeof(answer.payload), "%s%s%s", status == 0 ? "OK" : "ERR",
+		text[0] != '\0' ? " " : "", text);
+	answer.h.topic = BP_TOPIC_REPLY;
+	answer.h.len = strlen((char *) answer.payload);
+	answer.h.seq = id;
+	answer.h.t_ns = now_ns;
+	copy_out(s, &answer);
+	s->sent--;   // not a published message
+}
+
+/* Handle the complete lines received, the first one is the SUB line.
+   Stops while the output buffer has no room for an answer. Returns -1
+   when s has to go. */
+static int handle_lines(struct bp_pubsub *ps, struct bp_pub_sub *s, int64_t now_ns) {
+	char *nl;
+	size_t used;
+
+	while ((nl = memchr(s->request, '\n', s->request_len)) != NULL) {
+		if (s->len + sizeof(struct bp_pub_slot) > BP_PUBSUB_BUFSIZE) {
+			if (s->off == 0)
+				return 0;   // wait for the socket to take some
+			memmove(s->buf, s->buf + s->off, s->len - s->off);
+			s->len -= s->off;
+			s->off = 0;
+			continue;
+		}
+		*nl = '\0';
+		if (nl > s->request && nl[-1] == '\r')
+			nl[-1] = '\0';
+		if (!s->subscribed) {
+			if (subscribe(ps, s, s->request) != 0)
+				return -1;
+		} else {
+			request(ps, s, s->request, now_ns);
+		}
+		used = nl + 1 - s->request;
+		memmove(s->request, nl + 1, s->request_len - used);
+		s->request_len -= used;
+	}
+	return s->request_len < sizeof(s->request) ? 0 : -1;   // a line longer than the buffer
+}
+
+/* Read what s has sent, if its last lines have been handled.
+   Returns -1 when it has gone. */
+static int receive(struct bp_pubsub *ps, struct bp_pub_sub *s, int64_t now_ns) {
+	ssize_t n;
+
+	if (memchr(s->request, '\n', s->request_len) != NULL)
+		return 0;
+	n = recv(s->fd, s->request + s->request_len, sizeof(s->request) - s->request_len, MSG_DONTWAIT);
+	if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+		return -1;
+	if (n > 0)
+		s->request_len += n;
+	return handle_lines(ps, s, now_ns);
+}
+
+static void accept_subscriber(struct bp_pubsub *ps) {
+	struct sockaddr_in addr;
+	socklen_t addrlen = sizeof(addr);
+	struct bp_pub_sub *s = NULL;
+	char host[INET_ADDRSTRLEN];
+	int fd, i, one = 1, sndbuf = BP_PUBSUB_SNDBUF;
+
+	fd = accept(ps->listen_fd, (struct sockaddr *) &addr, &addrlen);
+	if (fd < 0)
+		return;
+	for (i = 0; i < BP_PUBSUB_MAX_SUBS && s == NULL; i++)
+		if (ps->sub[i].fd < 0)
+			s = &ps->sub[i];
+	if (s == NULL) {
+		send(fd, "ERR too many subscribers\n", 25, MSG_DONTWAIT | MSG_NOSIGNAL);
+		close(fd);
+		return;
+	}
+	memset(s, 0, sizeof(*s));
+	s->fd = fd;
+	s->buf = malloc(BP_PUBSUB_BUFSIZE);
+	if (s->buf == NULL) {
+		close(fd);
+		s->fd = -1;
+		return;
+	}
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+	inet_ntop(AF_INET, &addr.sin_addr, host, sizeof(host));
+	snprintf(s->peer, sizeof(s->peer), "%s:%d", host, ntohs(addr.sin_port));
+}
+
+static int64_t realtime_ns(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (int64_t) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void *server_main(void *arg) {
+	struct bp_pubsub *ps = arg;
+	struct pollfd p[2 + BP_PUBSUB_MAX_SUBS];
+	struct bp_pub_sub *s;
+	int who[2 + BP_PUBSUB_MAX_SUBS];
+	int i, n, status, conflating;
+	int64_t now_ns;
+	uint64_t count;
+
+	while (ps->running) {
+		n = 0;
+		p[n].fd = ps->listen_fd;
+		p[n++].events = POLLIN;
+		p[n].fd = ps->wake_fd;
+		p[n++].events = POLLIN;
+		conflating = 0;
+		now_ns = realtime_ns();
+		for (i = 0; i < BP_PUBSUB_MAX_SUBS; i++) {
+			s = &ps->sub[i];
+			if (s->fd < 0)
+				continue;
+			// requests held back for room first, then the stream
+			status = s->subscribed ? handle_lines(ps, s, now_ns) : 0;
+			if (status == 0 && s->subscribed)
+				status = service(ps, s, now_ns);
+			if (status != 0) {
+				drop(ps, s, status == -2 ? "cut off, a whole queue behind" : "gone");
+				continue;
+			}
+			conflating |= s->policy == BP_POLICY_CONFLATE && s->interval_ns > 0;
+			who[n] = i;
+			p[n].fd = s->fd;
+			p[n].events = s->off < s->len ? POLLOUT : 0;
+			if (memchr(s->request, '\n', s->request_len) == NULL)
+				p[n].events |= POLLIN;
+			n++;
+		}
+		// conflated topics may come due without a new publication
+		if (poll(p, n, conflating ? 10 : 200) <= 0)
+			continue;
+		if ((p[1].revents & POLLIN) && read(ps->wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+			perror("publish wake");
+		if (p[0].revents & POLLIN)
+			accept_subscriber(ps);
+		for (i = 2; i < n; i++) {
+			s = &ps->sub[who[i]];
+			if ((p[i].revents & (POLLIN | POLLHUP | POLLERR)) && receive(ps, s, realtime_ns()) != 0)
+				drop(ps, s, "gone");
+		}
+	}
+	return NULL;
+}
+
+int bp_pubsub_start(struct bp_pubsub *ps, const struct bp_pubsub_config *cfg,
+	bp_pubsub_request_fn on_request, void *request_arg) {
+	struct sockaddr_in addr;
+	int i, one = 1;
+
+	memset(ps, 0, sizeof(*ps));
+	ps->cfg = *cfg;
+	ps->on_request = on_request;
+	ps->request_arg = request_arg;
+	for (i = 0; i < BP_PUBSUB_MAX_SUBS; i++)
+		ps->sub[i].fd = -1;
+	ps->ring = calloc(cfg->ring_slots, sizeof(*ps->ring));
+	ps->wake_fd = eventfd(0, EFD_NONBLOCK);
+	ps->listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (ps->ring == NULL || ps->wake_fd < 0 || ps->listen_fd < 0) {
+		perror("publish");
+		goto fail;
+	}
+	setsockopt(ps->listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(cfg->port);
+	if (inet_pton(AF_INET, cfg->bind, &addr.sin_addr) != 1) {
+		fprintf(stderr, "publish: bind address %s is not an IPv4 address\n", cfg->bind);
+		goto fail;
+	}
+	if (bind(ps->listen_fd, (struct sockaddr *) &addr, sizeof(addr)) != 0 || listen(ps->listen_fd, 8) != 0) {
+		perror("publish port");
+		goto fail;
+	}
+	pthread_mutex_init(&ps->lock, NULL);
+	ps->running = 1;
+	if (pthread_create(&ps->thread, NULL, server_main, ps) != 0) {
+		pthread_mutex_destroy(&ps->lock);
+		goto fail;
+	}
+	return 0;
+
+fail:
+	if (ps->listen_fd >= 0)
+		close(ps->listen_fd);
+	if (ps->wake_fd >= 0)
+		close(ps->wake_fd);
+	free(ps->ring);
+	ps->ring = NULL;
+	ps->running = 0;
+	return -1;
+}
+
+/* Stops the server at once, messages still queued for slow subscribers are lost */
+void bp_pubsub_stop(struct bp_pubsub *ps) {
+	int i;
+
+	if (!ps->running)
+		return;
+	ps->running = 0;
+	wake(ps);
+	pthread_join(ps->thread, NULL);
+	for (i = 0; i < BP_PUBSUB_MAX_SUBS; i++) {
+		if (ps->sub[i].fd >= 0)
+			close(ps->sub[i].fd);
+		free(ps->sub[i].buf);
+		ps->sub[i].buf = NULL;
+		ps->sub[i].fd = -1;
+	}
+	close(ps->listen_fd);
+	close(ps->wake_fd);
+	pthread_mutex_destroy(&ps->lock);
+	free(ps->ring);
+	ps->ring = NULL;
+}
+
+/* Published per topic, then sent, skipped and backlog per subscriber */
+void bp_pubsub_report(struct bp_pubsub *ps, FILE *f) {
+	const struct bp_pub_sub *s;
+	int i, t;
+
+	fprintf(f, "Published");
+	for (t = 0; t < BP_NTOPICS; t++)
+		fprintf(f, " %llu %s", ps->published[t], topic_name[t]);
+	fprintf(f, ", %llu subscriptions, %llu cut off\n", ps->subscribers, ps->cut);
+	pthread_mutex_lock(&ps->lock);
+	for (i = 0; i < BP_PUBSUB_MAX_SUBS; i++) {
+		s = &ps->sub[i];
+		if (s->fd < 0 || !s->subscribed)
+			continue;
+		fprintf(f, "  %-21s %-8s", s->peer, policy_name[s->policy]);
+		for (t = 0; t < BP_NTOPICS; t++)
+			if (s->topics & (1u << t))
+				fprintf(f, " %s", topic_name[t]);
+		fprintf(f, ": %llu sent, %llu skipped, %llu behind\n", s->sent, s->skipped,
+			(unsigned long long) (s->policy == BP_POLICY_CONFLATE ? 0 : ps->head - s->next));
+	}
+	pthread_mutex_unlock(&ps->lock);
+}
+
+void bp_pubsub_live_trigger(void *arg, const struct bp_live_trigger *st, int new_trigger) {
+	struct bp_pub_hit_pattern hp;
+
+	if (!new_trigger)
+		return;
+	memset(&hp, 0, sizeof(hp));
+	hp.nstime = st->nstime;
+	hp.hwtriggers = st->hwtriggers;
+	memcpy(hp.hit_pattern, st->hit_pattern, sizeof(hp.hit_pattern));
+	bp_pubsub_publish(arg, BP_TOPIC_HP, &hp, sizeof(hp));
+}
+
+void bp_pubsub_live_hskp(void *arg, const struct bp_live_hskp *st) {
+	struct bp_pub_hskp hk;
+	int c;
+
+	hk.nsweeps = st->nsweeps;
+	hk.spi_failed = st->spi_failed;
+	for (c = 0; c < HSKP_NSLOTS; c++) {
+		hk.v[c] = st->raw[c] * HSKP_AMPS_PER_LSB;
+		hk.v[HSKP_NSLOTS + c] = st->raw[HSKP_NSLOTS + c] * HSKP_VOLTS_PER_LSB;
+	}
+	bp_pubsub_publish(arg, BP_TOPIC_HSKP, &hk, sizeof(hk));
+}
+
+void bp_pubsub_rate(struct bp_pubsub *ps, const struct bp_live_trigger *st) {
+	struct bp_pub_rate r;
+
+	memset(&r, 0, sizeof(r));
+	r.nstime = st->nstime;
+	r.tacks = st->tacks;
+	r.hwtriggers = st->hwtriggers;
+	r.tack_rate_hz = st->tack_rate_hz;
+	r.hw_rate_hz = st->hw_rate_hz;
+	r.spi_failed = st->spi_failed;
+	bp_pubsub_publish(ps, BP_TOPIC_RATE, &r, sizeof(r));
+}
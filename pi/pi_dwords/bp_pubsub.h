@@ -0,0 +1,146 @@
+/*
+ ============================================================================
+ Name        : bp_pubsub.h
+ Description : Topic-based fan-out of live data to TCP subscribers, each
+               with its own queue bound and backpressure policy
+ ============================================================================
+ */
+#ifndef BP_PUBSUB_H
+#define BP_PUBSUB_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "bp_live.h"
+
+#define BP_PUBSUB_MAGIC       "PUB1"
+#define BP_PUBSUB_PORT        5700
+#define BP_PUBSUB_MAX_PAYLOAD 496
+#define BP_PUBSUB_MAX_SUBS    16
+#define BP_PUBSUB_BUFSIZE     (16 * 1024)   // written to a subscriber socket at a time
+#define BP_PUBSUB_SNDBUF      (32 * 1024)   // so a slow subscriber backs up in the ring, not in the kernel
+
+/* Topics, a subscriber asks for any of them by name */
+#define BP_TOPIC_HP    0   // "hp", hit pattern of every new hardware trigger
+#define BP_TOPIC_RATE  1   // "rate", TFPGA counters and rates every rate_period_ms
+#define BP_TOPIC_HSKP  2   // "hskp", every FEE current/voltage sweep
+#define BP_TOPIC_EVENT 3   // "event", one line of text
+#define BP_NTOPICS     4
+#define BP_TOPIC_REPLY 15  // the answer to a REQ line only to its sender, seq is the request id
+
+/* What happens when a subscriber falls queue messages behind */
+#define BP_POLICY_BLOCK    0   // "block", nothing is skipped; past the bound it is cut off
+#define BP_POLICY_DROP     1   // "drop", the oldest are skipped
+#define BP_POLICY_CONFLATE 2   // "conflate", only the latest of each topic, at most every interval_ms
+
+/* Before every payload on the wire, host byte order (the Pis and the DAQ
+   hosts are all little endian) */
+struct bp_pub_header {
+	uint16_t topic;
+	uint16_t len;                // payload bytes that follow
+	uint32_t seq;                // per topic as published, a gap is a message this subscriber skipped
+	uint64_t t_ns;               // CLOCK_REALTIME of the publication
+};
+
+struct bp_pub_hit_pattern {
+	uint64_t nstime;             // TFPGA nsTimer of the read
+	uint32_t hwtriggers;
+	uint32_t pad;
+	uint16_t hit_pattern[HP_NWORDS];
+};
+
+struct bp_pub_rate {
+	uint64_t nstime;
+	uint32_t tacks;
+	uint32_t hwtriggers;
+	float tack_rate_hz;
+	float hw_rate_hz;
+	uint32_t spi_failed;         // reads dropped since the start
+	uint32_t pad;
+};
+
+struct bp_pub_hskp {
+	uint32_t nsweeps;
+	uint32_t spi_failed;
+	float v[HSKP_NCHAN];         // FEE I of slots 0-31 [A], then FEE V [V]
+};
+
+struct bp_pub_slot {
+	struct bp_pub_header h;
+	unsigned char payload[BP_PUBSUB_MAX_PAYLOAD];
+};
+
+/* A subscriber's cursor into the ring and its socket */
+struct bp_pub_sub {
+	int fd;
+	char peer[48];
+	unsigned int topics;         // bit per topic
+	int policy;
+	uint64_t queue;              // messages it may fall behind
+	int64_t interval_ns;         // conflate: at most one message per topic this often
+	uint64_t next;               // ring index of the next message for it
+	uint64_t sent_index[BP_NTOPICS];   // conflate: last[] of the one sent per topic
+	uint32_t sent_seq[BP_NTOPICS];
+	int64_t sent_ns[BP_NTOPICS];
+	int subscribed;              // its SUB line has been answered
+	char request[1024];          // lines received and not handled yet
+	size_t request_len;
+	unsigned char *buf;
+	size_t len, off;
+	unsigned long long sent, skipped;
+};
+
+/* Answers "REQ <id> <request>" with reply text, returns 0 or -1 for an error */
+typedef int (*bp_pubsub_request_fn)(void *arg, const char *request, char *reply, int size);
+
+struct bp_pubsub_config {
+	char bind[64];               // listen address, 127.0.0.1 unless opened up
+	int port;
+	int allow_frames;            // REQ frame may send raw SPI frames
+	int ring_slots;              // messages kept for the subscribers, the longest queue
+	int default_queue;
+	int trigger_period_ms;       // bp_live periods
+	int hskp_period_ms;
+	int hskp_settle_ms;
+	int rate_period_ms;          // between rate messages
+	double rate_window_s;
+};
+
+/*
+	Publishers call bp_pubsub_publish() from any thread, it only copies the
+	message into the ring. The server thread hands it on to the subscribers
+	and never waits for any one of them.
+*/
+struct bp_pubsub {
+	struct bp_pubsub_config cfg;
+	bp_pubsub_request_fn on_request;   // NULL: every request is an error
+	void *request_arg;
+	int listen_fd;
+	int wake_fd;                 // eventfd, written on every publication
+	volatile int running;
+	pthread_t thread;
+	pthread_mutex_t lock;        // ring, head, last and seq
+	struct bp_pub_slot *ring;
+	uint64_t head;               // messages published
+	uint64_t last[BP_NTOPICS];   // +1 of the ring index of the latest per topic, 0 for none
+	uint32_t seq[BP_NTOPICS];
+	struct bp_pub_sub sub[BP_PUBSUB_MAX_SUBS];
+	unsigned long long published[BP_NTOPICS];
+	unsigned long long subscribers, cut;
+};
+
+int bp_pubsub_load(struct bp_pubsub_config *cfg, const char *config_file);
+int bp_pubsub_start(struct bp_pubsub *ps, const struct bp_pubsub_config *cfg,
+	bp_pubsub_request_fn on_request, void *request_arg);
+void bp_pubsub_stop(struct bp_pubsub *ps);
+void bp_pubsub_publish(struct bp_pubsub *ps, int topic, const void *payload, int len);
+void bp_pubsub_event(struct bp_pubsub *ps, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+void bp_pubsub_report(struct bp_pubsub *ps, FILE *f);
+
+/* bp_live hooks (arg is the struct bp_pubsub), and the rate message */
+void bp_pubsub_live_trigger(void *arg, const struct bp_live_trigger *st, int new_trigger);
+void bp_pubsub_live_hskp(void *arg, const struct bp_live_hskp *st);
+void bp_pubsub_rate(struct bp_pubsub *ps, const struct bp_live_trigger *st);
+
+#endif
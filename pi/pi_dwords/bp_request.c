@@ -0,0 +1,127 @@
+/*
+ ============================================================================
+ Name        : bp_request.c
+ Description : Requests of the native protocol, "REQ <id> <request>" on
+               the menu 'P' port, so clients query the backplane over one
+               socket instead of driving the menu through ssh. All but
+               frame are answered from the latest state the bp_live
+               threads have published, without touching the bus, and cost
+               a few microseconds:
+
+                 ping                  OK
+                 trigger               nstime tacks hwtriggers tack_rate_hz
+                                       hw_rate_hz nreads ntriggers spi_failed
+                 hit_pattern           nstime hwtriggers, then the 32 words
+                                       in hex
+                 hskp                  nsweeps spi_failed, then FEE I of
+                                       slots 0-31 [A] and FEE V [V]
+                 frame <w0> [w1..w10]  one SPI frame (hex words, SOM and CW
+                                       first, the rest padded as the menu
+                                       does), the 11 words read back in hex
+
+               frame takes the bus between two reads of the acquisition
+               threads, so it waits at most for one of theirs. It can power
+               FEEs down or reset them, so it is refused unless allow_frames
+               is set, and the frame is sent once, never retried.
+ ============================================================================
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "spicomms.h"
+#include "bp_fault.h"
+#include "bp_request.h"
+
+/* Appends to reply, keeping track of the room left */
+#define APPEND(...) do { \
+		if (len < size) \
+			len += snprintf(reply + len, size - len, __VA_ARGS__); \
+	} while (0)
+
+int bp_request_allow_frames = 0;
+
+static const unsigned short frame_fill[11] = {
+	0, 0, 0x0111, 0x1222, 0x2333, 0x3444, 0x4555, 0x5666, 0x6777, 0x7888, 0
+};
+
+static int frame(struct bp_live *live, const char *args, char *reply, int size) {
+	unsigned short message[11], data[11];
+	unsigned long word;
+	const char *p = args;
+	char *end;
+	int n, k, len = 0, ok;
+
+	if (!bp_request_allow_frames) {
+		snprintf(reply, size, "frame requests are off, allow_frames in bp_pubsub.yml");
+		return -1;
+	}
+	memcpy(message, frame_fill, sizeof(message));
+	for (n = 0; n < 11; n++, p = end) {
+		word = strtoul(p, &end, 16);
+		if (end == p)
+			break;
+		message[n] = word;
+	}
+	if (n < 2) {
+		snprintf(reply, size, "frame needs at least SOM and CW");
+		return -1;
+	}
+	pthread_mutex_lock(&live->spi_lock);
+	transfer_message(message, data);
+	pthread_mutex_unlock(&live->spi_lock);
+	ok = bp_frame_ok(message, data);
+	if (!ok) {
+		snprintf(reply, size, "no valid answer");
+		return -1;
+	}
+	for (k = 0; k < 11; k++)
+		APPEND("%s%04x", k ? " " : "", data[k]);
+	return 0;
+}
+
+int bp_request_live(void *arg, const char *request, char *reply, int size) {
+	struct bp_live *live = arg;
+	struct bp_live_trigger st;
+	struct bp_live_hskp hk;
+	char name[16];
+	int n = 0, c, len = 0;
+
+	reply[0] = '\0';
+	if (!live->running) {
+		snprintf(reply, size, "acquisition not running");
+		return -1;
+	}
+	if (sscanf(request, "%15s %n", name, &n) < 1) {
+		snprintf(reply, size, "empty request");
+		return -1;
+	}
+	if (strcmp(name, "ping") == 0)
+		return 0;
+	if (strcmp(name, "trigger") == 0) {
+		bp_live_trigger(live, &st);
+		APPEND("%llu %lu %lu %.3f %.3f %llu %llu %llu", st.nstime, st.tacks, st.hwtriggers,
+			st.tack_rate_hz, st.hw_rate_hz, st.nreads, st.ntriggers, st.spi_failed);
+		return 0;
+	}
+	if (strcmp(name, "hit_pattern") == 0) {
+		bp_live_trigger(live, &st);
+		APPEND("%llu %lu", st.nstime, st.hwtriggers);
+		for (c = 0; c < HP_NWORDS; c++)
+			APPEND(" %04x", st.hit_pattern[c]);
+		return 0;
+	}
+	if (strcmp(name, "hskp") == 0) {
+		bp_live_hskp(live, &hk);
+		APPEND("%llu %llu", hk.nsweeps, hk.spi_failed);
+		for (c = 0; c < HSKP_NSLOTS; c++)
+			APPEND(" %.4g", hk.raw[c] * HSKP_AMPS_PER_LSB);
+		for (c = 0; c < HSKP_NSLOTS; c++)
+			APPEND(" %.4g", hk.raw[HSKP_NSLOTS + c] * HSKP_VOLTS_PER_LSB);
+		return 0;
+	}
+	if (strcmp(name, "frame") == 0)
+		return frame(live, request + n, reply, size);
+	snprintf(reply, size, "unknown request %s, one of ping trigger hit_pattern hskp frame", name);
+	return -1;
+}
@@ -0,0 +1,18 @@
+/*
+ ============================================================================
+ Name        : bp_request.h
+ Description : Requests of the native protocol (REQ lines on the menu 'P'
+               port) answered from the live acquisition state
+ ============================================================================
+ */
+#ifndef BP_REQUEST_H
+#define BP_REQUEST_H
+
+#include "bp_live.h"
+
+extern int bp_request_allow_frames;   // frame is refused unless set, allow_frames in bp_pubsub.yml
+
+/* bp_pubsub_request_fn with arg the running struct bp_live */
+int bp_request_live(void *arg, const char *request, char *reply, int size);
+
+#endif
@@ -0,0 +1,280 @@
+/*
+ ============================================================================
+ Name        : bp_seq.c
+ Description : Cooperative sequencer. Multi-step procedures (SYNC, ADC
+               trigger then read, power up then verify, mask then reset
+               then dwell then read) are written as straight-line code
+               that waits on SPI frames, timers, conditions and other
+               procedures instead of blocking in us_sleep()/ms_sleep().
+               One event loop on the calling thread runs them all: each
+               turn every procedure that is ready runs until its next
+               wait, a procedure waiting for the bus gets one frame, and
+               when nobody is ready the loop sleeps to the earliest timer.
+               Several procedures and periodic acquisitions therefore
+               interleave frame by frame on one thread, and a 100 ms ADC
+               settle no longer holds up everything else on the bus.
+ ============================================================================
+ */
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+
+#include "spicomms.h"
+#include "bp_fault.h"
+#include "hskp_burst.h"
+#include "bp_seq.h"
+
+#define IDLE_MAX_NS 50000000ULL   // loop wakes at least this often to check stop()
+
+static unsigned long long log_start_ns;
+
+static const unsigned short fee_i_cw[4] = { CW_RD_FEE0_I, CW_RD_FEE8_I, CW_RD_FEE16_I, CW_RD_FEE24_I };
+static const unsigned short fee_v_cw[4] = { CW_RD_FEE0_V, CW_RD_FEE8_V, CW_RD_FEE16_V, CW_RD_FEE24_V };
+
+void bp_seq_init(struct bp_seq *seq) {
+	memset(seq, 0, sizeof(*seq));
+}
+
+/*
+	bp_seq_add()
+
+	Schedule fn(t) with t->ctx = ctx. With period_ms > 0 the procedure
+	is started again period_ms after each start (or at once when it ran
+	longer), like the bp_live threads; otherwise it runs once.
+*/
+int bp_seq_add(struct bp_seq *seq, struct bp_seq_task *t, const char *name, bp_seq_fn fn, void *ctx,
+	int period_ms) {
+	if (seq->ntasks == BP_SEQ_MAX_TASKS)
+		return -1;
+	memset(t, 0, sizeof(*t));
+	t->name = name;
+	t->fn = fn;
+	t->ctx = ctx;
+	t->period_ms = period_ms;
+	t->state = BP_SEQ_READY;
+	seq->tasks[seq->ntasks++] = t;
+	return 0;
+}
+
+/* Fill t->msg with the usual filler words around cw and return it for the
+   procedure to set its data words */
+unsigned short *bp_seq_frame(struct bp_seq_task *t, unsigned short som, unsigned short cw) {
+	static const unsigned short filler[8] = { 0x0111, 0x1222, 0x2333, 0x3444, 0x4555, 0x5666, 0x6777, 0x7888 };
+
+	t->msg[0] = som; // som
+	t->msg[1] = cw; // cw
+	memcpy(&t->msg[2], filler, sizeof(filler));
+	t->msg[10] = som == SPI_SOM_TFPGA ? SPI_EOM_TFPGA : SPI_EOM_HKFPGA; // not used
+	return t->msg;
+}
+
+void bp_seq_call(struct bp_seq_task *t, struct bp_seq_task *child, bp_seq_fn fn, void *ctx) {
+	memset(child, 0, sizeof(*child));
+	child->name = t->name;
+	child->fn = fn;
+	child->ctx = ctx;
+	child->parent = t;
+	child->state = BP_SEQ_READY;
+	t->child = child;
+}
+
+/* Housekeeping frames carry the same words as trig_adcs() and hskp_read_adcs() */
+static void hkfpga_frame(struct bp_seq_task *t, unsigned short cw) {
+	bp_seq_frame(t, SPI_SOM_HKFPGA, cw);
+	t->msg[8] = 0x0000;
+	t->msg[9] = 0x0088;
+}
+
+static struct bp_seq_task *innermost(struct bp_seq_task *t) {
+	while (t->child != NULL)
+		t = t->child;
+	return t;
+}
+
+/* Resume the innermost procedure of t, and its callers as calls end */
+static void step(struct bp_seq_task *top, struct bp_seq_task *c) {
+	unsigned long long t0 = monotonic_ns();
+	int state;
+
+	for (;;) {
+		state = c->fn(c);
+		if (state != BP_SEQ_DONE || c->parent == NULL)
+			break;
+		c = c->parent;
+		c->child = NULL;
+	}
+	top->busy_ns += monotonic_ns() - t0;
+}
+
+/*
+	bp_seq_run()
+
+	Run the event loop until every one-shot procedure has finished, or
+	stop() returns non-zero (checked every turn and at least every 50 ms
+	while idle). Periodic procedures are left where they are; add them
+	again to run them in a later loop. Returns the number of one-shot
+	procedures that did not finish.
+*/
+int bp_seq_run(struct bp_seq *seq, int (*stop)(void)) {
+	struct bp_seq_task *t, *c;
+	unsigned long long now, next, late;
+	struct timespec ts;
+	int i, pending, progressed;
+
+	seq->start_ns = log_start_ns = monotonic_ns();
+	for (i = 0; i < seq->ntasks; i++)
+		seq->tasks[i]->start_ns = seq->start_ns;
+	for (;;) {
+		pending = 0;
+		progressed = 0;
+		now = monotonic_ns();
+		next = now + IDLE_MAX_NS;
+		for (i = 0; i < seq->ntasks; i++) {
+			t = seq->tasks[i];
+			if (t->state == BP_SEQ_DONE && t->period_ms > 0) {
+				if (now < t->start_ns + t->period_ms * 1000000ULL) {
+					if (t->start_ns + t->period_ms * 1000000ULL < next)
+						next = t->start_ns + t->period_ms * 1000000ULL;
+					continue;
+				}
+				// restart, from now if it overran: no burst to catch up
+				t->start_ns = now > t->start_ns + 2 * t->period_ms * 1000000ULL ? now :
+					t->start_ns + t->period_ms * 1000000ULL;
+				t->resume = NULL;
+				t->state = BP_SEQ_READY;
+			}
+			if (t->state == BP_SEQ_DONE)
+				continue;
+			if (t->period_ms == 0)
+				pending++;
+			if (t->state == BP_SEQ_READY)
+				t->runs++;
+
+			c = innermost(t);
+			switch (c->state) {
+			case BP_SEQ_SPI:
+				// one frame per procedure per turn, so procedures interleave on the bus
+				c->spi_status = transfer_checked(t->name, c->msg, c->data);
+				t->frames++;
+				seq->frames++;
+				t->failed += c->spi_status != 0;
+				step(t, c);
+				progressed = 1;
+				break;
+			case BP_SEQ_SLEEP:
+				now = monotonic_ns();
+				if (now < c->wake_ns) {
+					if (c->wake_ns < next)
+						next = c->wake_ns;
+					break;
+				}
+				late = now - c->wake_ns;
+				if (late > t->max_late_ns)
+					t->max_late_ns = late;
+				step(t, c);
+				progressed = 1;
+				break;
+			default:
+				step(t, c);
+				progressed = 1;
+			}
+		}
+		seq->turns++;
+		if (pending == 0 || (stop != NULL && stop()))
+			break;
+		now = monotonic_ns();
+		if (!progressed && next > now) {
+			ts.tv_sec = (next - now) / 1000000000ULL;
+			ts.tv_nsec = (next - now) % 1000000000ULL;
+			nanosleep(&ts, NULL);
+			seq->idle_ns += monotonic_ns() - now;
+		}
+	}
+	return pending;
+}
+
+/* printf() prefixed with the time into the run and the procedure */
+void bp_seq_log(const struct bp_seq_task *t, const char *fmt, ...) {
+	va_list ap;
+
+	printf("%8.3f s %-10s ", (monotonic_ns() - log_start_ns) * 1e-9, t->name);
+	va_start(ap, fmt);
+	vprintf(fmt, ap);
+	va_end(ap);
+	printf("\n");
+}
+
+void bp_seq_report(const struct bp_seq *seq, FILE *fptr) {
+	double elapsed = (monotonic_ns() - seq->start_ns) * 1e-9;
+	int i;
+
+	fprintf(fptr, "sequencer: %.2f s, %llu turns, %llu SPI frames (%.0f/s), idle %.0f%%\n", elapsed, seq->turns,
+		seq->frames, elapsed > 0 ? seq->frames / elapsed : 0.0, elapsed > 0 ? 100 * seq->idle_ns * 1e-9 / elapsed : 0.0);
+	fprintf(fptr, "%-14s %6s %8s %7s %9s %12s\n", "procedure", "runs", "frames", "failed", "busy ms", "worst late ms");
+	for (i = 0; i < seq->ntasks; i++) {
+		struct bp_seq_task *t = seq->tasks[i];
+		fprintf(fptr, "%-14s %6llu %8llu %7llu %9.2f %12.3f\n", t->name, t->runs, t->frames, t->failed,
+			t->busy_ns * 1e-6, t->max_late_ns * 1e-6);
+	}
+}
+
+/*
+	bp_seq_wait_nstimer()
+
+	Poll the TFPGA nsTimer until it reaches target, e.g. before changing
+	the TACK type back after a SYNC scheduled with SPI_SET_TRIG_AT_TIME.
+*/
+int bp_seq_wait_nstimer(struct bp_seq_task *t) {
+	struct bp_seq_nstimer *w = t->ctx;
+
+	SEQ_BEGIN(t);
+	t->deadline_ns = monotonic_ns() + (unsigned long long) w->timeout_ms * 1000000ULL;
+	for (;;) {
+		bp_seq_frame(t, SPI_SOM_TFPGA, SPI_READ_nsTimer_TFPGA);
+		SEQ_SPI(t);
+		if (t->spi_status == 0) {
+			w->nstime = ((unsigned long long) t->data[2] << 48) | ((unsigned long long) t->data[3] << 32) |
+				((unsigned long long) t->data[4] << 16) | t->data[5];
+			if (w->nstime >= w->target) {
+				w->status = 0;
+				break;
+			}
+		}
+		if (monotonic_ns() >= t->deadline_ns) {
+			w->status = -1;
+			break;
+		}
+		SEQ_SLEEP_US(t, w->poll_us);
+	}
+	SEQ_END(t);
+}
+
+/*
+	bp_seq_hskp_sweep()
+
+	hskp_trigger_adcs(), settle_us, then hskp_read_adcs() into w->row, with
+	the bus free for other procedures during the settle time.
+*/
+int bp_seq_hskp_sweep(struct bp_seq_task *t) {
+	struct bp_seq_hskp *w = t->ctx;
+	int k;
+
+	SEQ_BEGIN(t);
+	w->status = -1;
+	hkfpga_frame(t, CW_TRG_ADCS);
+	SEQ_SPI(t);
+	if (t->spi_status != 0)
+		SEQ_END(t);
+	SEQ_SLEEP_US(t, w->settle_us);
+	for (w->frame = 0; w->frame < 8; w->frame++) {
+		hkfpga_frame(t, w->frame < 4 ? fee_i_cw[w->frame] : fee_v_cw[w->frame - 4]);
+		SEQ_SPI(t);
+		if (t->spi_status != 0)
+			SEQ_END(t);
+		for (k = 0; k < 8; k++)
+			w->row[(w->frame < 4 ? 0 : HSKP_NSLOTS) + fee_hskp_slot[w->frame % 4][k]] = t->data[k+2];
+	}
+	w->status = 0;
+	SEQ_END(t);
+}
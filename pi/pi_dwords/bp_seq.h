@@ -0,0 +1,117 @@
+/*
+ ============================================================================
+ Name        : bp_seq.h
+ Description : Cooperative sequencer for multi-step hardware procedures
+ ============================================================================
+ */
+#ifndef BP_SEQ_H
+#define BP_SEQ_H
+
+#include <stdio.h>
+
+#define BP_SEQ_MAX_TASKS 16
+
+/* What a procedure is waiting for, returned each time it gives up control */
+enum { BP_SEQ_READY, BP_SEQ_SPI, BP_SEQ_SLEEP, BP_SEQ_CALL, BP_SEQ_DONE };
+
+struct bp_seq_task;
+typedef int (*bp_seq_fn)(struct bp_seq_task *t);
+
+struct bp_seq_task {
+	const char *name;              // also the transfer_checked() component
+	bp_seq_fn fn;
+	void *ctx;                     // the procedure's state, locals do not survive a wait
+	void *resume;                  // label to continue at, NULL at the start
+	int state;
+	unsigned long long wake_ns;    // BP_SEQ_SLEEP until this CLOCK_MONOTONIC time
+	unsigned long long deadline_ns;
+	int timed_out;                 // SEQ_UNTIL gave up
+	unsigned short msg[11];        // BP_SEQ_SPI: the frame to send
+	unsigned short data[11];       // and its answer
+	int spi_status;                // transfer_checked() result for it
+	struct bp_seq_task *parent, *child;
+	int period_ms;                 // restarted this often, 0 runs once
+	unsigned long long start_ns;
+
+	unsigned long long runs, frames, failed;
+	unsigned long long busy_ns;    // time spent inside the procedure and its frames
+	unsigned long long max_late_ns;   // worst delay between wake_ns and resuming
+};
+
+struct bp_seq {
+	struct bp_seq_task *tasks[BP_SEQ_MAX_TASKS];
+	int ntasks;
+	unsigned long long turns, frames, idle_ns, start_ns;
+};
+
+/*
+	Procedures are written as straight-line code between SEQ_BEGIN and
+	SEQ_END and give up control at each SEQ_ wait, which returns to the
+	event loop. Anything that must survive a wait lives in t->ctx. The
+	resume points are GCC label addresses, so waits may sit in loops and
+	switch statements and a macro may wait more than once.
+*/
+#define SEQ_CAT_(a, b) a##b
+#define SEQ_CAT(a, b) SEQ_CAT_(a, b)
+
+#define SEQ_BEGIN(t) do { if ((t)->resume != NULL) goto *(t)->resume; } while (0)
+
+#define SEQ_END(t) do { (t)->resume = NULL; (t)->state = BP_SEQ_DONE; return BP_SEQ_DONE; } while (0)
+
+#define SEQ_WAIT_(t, st, n) \
+	do { (t)->resume = &&SEQ_CAT(seq_resume_, n); (t)->state = (st); return (st); \
+	     SEQ_CAT(seq_resume_, n):; } while (0)
+
+/* Send t->msg (see bp_seq_frame()), the answer is in t->data and t->spi_status */
+#define SEQ_SPI(t) SEQ_WAIT_(t, BP_SEQ_SPI, __COUNTER__)
+
+#define SEQ_SLEEP_US(t, us) \
+	do { (t)->wake_ns = monotonic_ns() + (unsigned long long) (us) * 1000ULL; \
+	     SEQ_WAIT_(t, BP_SEQ_SLEEP, __COUNTER__); } while (0)
+
+#define SEQ_SLEEP_MS(t, ms) SEQ_SLEEP_US(t, (unsigned long long) (ms) * 1000ULL)
+
+/* Let the other procedures run a turn */
+#define SEQ_YIELD(t) SEQ_SLEEP_US(t, 0)
+
+/* Until cond holds, checked every poll_us; after timeout_ms t->timed_out is set */
+#define SEQ_UNTIL(t, cond, poll_us, timeout_ms) \
+	do { (t)->deadline_ns = monotonic_ns() + (unsigned long long) (timeout_ms) * 1000000ULL; \
+	     (t)->timed_out = 0; \
+	     while (!(cond)) { \
+		if (monotonic_ns() >= (t)->deadline_ns) { (t)->timed_out = 1; break; } \
+		SEQ_SLEEP_US(t, poll_us); \
+	     } } while (0)
+
+/* Run the procedure fn(child) to its end, child->ctx holds its inputs and results */
+#define SEQ_CALL(t, child, f, c) \
+	do { bp_seq_call(t, child, f, c); SEQ_WAIT_(t, BP_SEQ_CALL, __COUNTER__); } while (0)
+
+void bp_seq_init(struct bp_seq *seq);
+int bp_seq_add(struct bp_seq *seq, struct bp_seq_task *t, const char *name, bp_seq_fn fn, void *ctx,
+	int period_ms);
+unsigned short *bp_seq_frame(struct bp_seq_task *t, unsigned short som, unsigned short cw);
+void bp_seq_call(struct bp_seq_task *t, struct bp_seq_task *child, bp_seq_fn fn, void *ctx);
+int bp_seq_run(struct bp_seq *seq, int (*stop)(void));
+void bp_seq_log(const struct bp_seq_task *t, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+void bp_seq_report(const struct bp_seq *seq, FILE *fptr);
+
+/* Library procedures for SEQ_CALL */
+struct bp_seq_nstimer {
+	unsigned long long target;     // wait until the TFPGA nsTimer reaches this
+	int poll_us;
+	int timeout_ms;
+	unsigned long long nstime;     // last value read
+	int status;                    // 0, or -1 on timeout or no answer
+};
+int bp_seq_wait_nstimer(struct bp_seq_task *t);
+
+struct bp_seq_hskp {
+	int settle_us;                 // between CW_TRG_ADCS and the reads
+	unsigned short row[64];        // FEE I slots 0-31, then FEE V, as hskp_read_adcs()
+	int frame;
+	int status;                    // 0, or -1 if a frame got no valid answer
+};
+int bp_seq_hskp_sweep(struct bp_seq_task *t);
+
+#endif
@@ -0,0 +1,406 @@
+/*
+ ============================================================================
+ Name        : bp_tat.c
+ Description : Trigger at time characterisation (menu 'L'). Each attempt
+               reads the nsTimer, asks for a trigger lead_ns later with
+               SPI_SET_TRIG_AT_TIME, waits until the nsTimer is past that
+               time and reads the time of the last trigger
+               (SPI_READ_TRIGGER_NSTIMER_TFPGA) back. It fired if that
+               time moved to within window_ns of the request, missed if
+               it did not move (the request came after the time, or was
+               lost) and went astray if it moved somewhere else. Attempts
+               during which more triggers came than the one time change
+               explains are set aside as busy, so the physics triggers
+               are best disabled ('g') for the run.
+
+               The leads are log-spaced from min_lead_ns to max_lead_ns
+               and taken in turn, so drifts affect them all alike, and the
+               whole sweep is repeated for each SPI clock divider. The
+               safe lead of a divider is margin times the shortest lead
+               from which on no lead fails more often than max_fail. The
+               table (failures, offset percentiles and histogram per
+               divider) goes to table_file, and the safe lead of the
+               divider in use with the offset to report_file, which
+               bp_tat_min_lead_ns() reads for bp_tat_schedule().
+ ============================================================================
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+
+#include "spicomms.h"
+#include "bp_config.h"
+#include "bp_fault.h"
+#include "bp_tat.h"
+
+#define TIMEOUT_NS 100000000ULL   // beyond the lead, for an nsTimer that does not advance
+
+/*
+	bp_tat_load()
+
+	Defaults if config_file does not exist: leads from 1 us to 1 ms at 4
+	per decade, 200 attempts each at dividers 128, 256 and 512, fired
+	within 1 us, safe at no failures with a margin of 2, offsets
+	histogrammed in 4 ns bins, trigger_at_time.txt and trigger_at_time.yml.
+*/
+int bp_tat_load(struct bp_tat *c, const char *config_file) {
+	struct bp_config cfg;
+	const char *p;
+	char *end;
+	long d;
+	int status = 0, l;
+
+	memset(c, 0, sizeof(*c));
+	memset(&cfg, 0, sizeof(cfg));
+	if (access(config_file, R_OK) == 0)
+		status = bp_config_load(&cfg, config_file);
+	c->min_lead_ns = bp_config_double(&cfg, "min_lead_ns", 1000);
+	c->max_lead_ns = bp_config_double(&cfg, "max_lead_ns", 1000000);
+	c->leads_per_decade = bp_config_double(&cfg, "leads_per_decade", 4);
+	c->trials = bp_config_double(&cfg, "trials", 200);
+	c->divider_in_use = bp_config_double(&cfg, "divider_in_use", 128);
+	c->window_ns = bp_config_double(&cfg, "window_ns", 1000);
+	c->max_fail = bp_config_double(&cfg, "max_fail", 0);
+	c->margin = bp_config_double(&cfg, "margin", 2);
+	c->offset_bin_ns = bp_config_double(&cfg, "offset_bin_ns", 4);
+	snprintf(c->table_file, sizeof(c->table_file), "%s",
+		bp_config_string(&cfg, "table_file", "trigger_at_time.txt"));
+	snprintf(c->report_file, sizeof(c->report_file), "%s",
+		bp_config_string(&cfg, "report_file", "trigger_at_time.yml"));
+	for (p = bp_config_string(&cfg, "dividers", "128 256 512"); c->ndividers < BP_TAT_MAX_DIVIDERS; p = end) {
+		d = strtol(p, &end, 10);
+		if (end == p)
+			break;
+		if (d > 0)
+			c->dividers[c->ndividers++] = d;
+	}
+	if (c->ndividers == 0)
+		c->dividers[c->ndividers++] = c->divider_in_use;
+	if (c->min_lead_ns < 8)
+		c->min_lead_ns = 8;
+	if (c->max_lead_ns < c->min_lead_ns)
+		c->max_lead_ns = c->min_lead_ns;
+	if (c->leads_per_decade < 1)
+		c->leads_per_decade = 4;
+	if (c->trials < 1)
+		c->trials = 1;
+	if (c->offset_bin_ns <= 0)
+		c->offset_bin_ns = 4;
+
+	for (l = 0; l < BP_TAT_MAX_LEADS; l++) {
+		c->leads_ns[l] = c->min_lead_ns * pow(10, (double) l / c->leads_per_decade);
+		if (c->leads_ns[l] > c->max_lead_ns * 1.0001)
+			break;
+	}
+	c->nleads = l;
+	return status;
+}
+
+/* One TFPGA frame, v from data[2..5] and the HW trigger count if asked for */
+static int frame(unsigned short cw, unsigned long long *v, unsigned long *hwtriggers) {
+	unsigned short spi_message[11], data[11];
+
+	spi_message[0] = SPI_SOM_TFPGA; //som
+	spi_message[1] = cw;
+	spi_message[2] = *v >> 48;
+	spi_message[3] = *v >> 32;
+	spi_message[4] = *v >> 16;
+	spi_message[5] = *v;
+	spi_message[6] = 0x0005;
+	spi_message[7] = 0x0006;
+	spi_message[8] = 0x0007;
+	spi_message[9] = 0x0008;
+	spi_message[10] = SPI_EOM_TFPGA; //not used
+	if (transfer_checked("trigger at time", spi_message, data) != 0)
+		return -1;
+	*v = ((unsigned long long) data[2] << 48) | ((unsigned long long) data[3] << 32) |
+		((unsigned long long) data[4] << 16) | data[5];
+	if (hwtriggers != NULL)
+		*hwtriggers = (((unsigned long) data[8] << 16) | data[9]) - 1;
+	return 0;
+}
+
+/*
+	attempt()
+
+	One trigger lead_ns after the nsTimer read. Returns -1 when the SPI
+	fails or the nsTimer does not get past the requested time.
+*/
+static int attempt(struct bp_tat *c, struct bp_tat_cell *cell, double lead_ns) {
+	unsigned long long before, now, target, after, t, deadline;
+	unsigned long hw_before, hw_after, extra;
+	long long offset;
+
+	before = 0;
+	if (frame(SPI_READ_TRIGGER_NSTIMER_TFPGA, &before, NULL) != 0)
+		return -1;
+	now = 0;
+	if (frame(SPI_READ_nsTimer_TFPGA, &now, &hw_before) != 0)
+		return -1;
+	target = (now + (unsigned long long) lead_ns + 7) & ~7ULL;   // the 3 LSBs 000
+	t = target;
+	if (frame(SPI_SET_TRIG_AT_TIME, &t, NULL) != 0)
+		return -1;
+	after = 0;
+	if (frame(SPI_READ_nsTimer_TFPGA, &after, NULL) != 0)
+		return -1;
+	cell->sum_turnaround_ns += after - now;
+
+	// sleep most of a long lead, then poll past the window
+	deadline = monotonic_ns() + (unsigned long long) (lead_ns + c->window_ns) + TIMEOUT_NS;
+	while (after < target + (unsigned long long) c->window_ns) {
+		if (target > after + 200000)
+			us_sleep((target - after - 100000) / 1000);
+		if (monotonic_ns() > deadline) {
+			fprintf(stderr, "trigger at time: nsTimer stuck at %llu ns, waiting for %llu ns\n", after, target);
+			return -1;
+		}
+		after = 0;
+		if (frame(SPI_READ_nsTimer_TFPGA, &after, NULL) != 0)
+			return -1;
+	}
+	t = 0;
+	if (frame(SPI_READ_TRIGGER_NSTIMER_TFPGA, &t, NULL) != 0)
+		return -1;
+	after = 0;
+	if (frame(SPI_READ_nsTimer_TFPGA, &after, &hw_after) != 0)
+		return -1;
+
+	cell->attempts++;
+	// the counter may or may not count the scheduled trigger, a time change explains one
+	extra = hw_after - hw_before;
+	if (extra > (t != before ? 1UL : 0UL)) {
+		cell->busy++;
+		return 0;
+	}
+	offset = (long long) (t - target);
+	if (t == before)
+		cell->missed++;
+	else if (llabs(offset) > c->window_ns)
+		cell->stray++;
+	else
+		cell->offsets[cell->fired++] = offset;
+	return 0;
+}
+
+/*
+	bp_tat_run()
+
+	The sweep, at each divider in turn, leaving the SPI at divider_in_use.
+	Returns -1 if it had to stop.
+*/
+int bp_tat_run(struct bp_tat *c, bp_tat_divider_fn set_divider) {
+	int d, l, r, status = 0;
+
+	for (d = 0; d < c->ndividers; d++)
+		for (l = 0; l < c->nleads; l++) {
+			memset(&c->cells[d][l], 0, sizeof(c->cells[d][l]));
+			c->cells[d][l].offsets = malloc(c->trials * sizeof(long));
+			if (c->cells[d][l].offsets == NULL)
+				return -1;
+		}
+
+	for (d = 0; d < c->ndividers && status == 0; d++) {
+		if (set_divider != NULL)
+			set_divider(c->dividers[d]);
+		for (r = 0; r < c->trials && status == 0; r++)
+			for (l = 0; l < c->nleads && status == 0; l++)
+				status = attempt(c, &c->cells[d][(l + r) % c->nleads], c->leads_ns[(l + r) % c->nleads]);
+		printf("divider %d: %d attempts at %d leads%s\n", c->dividers[d], r * c->nleads, c->nleads,
+			status == 0 ? "" : ", stopped");
+	}
+	if (set_divider != NULL)
+		set_divider(c->divider_in_use);
+	bp_tat_analyse(c);
+	return status;
+}
+
+static int compare_long(const void *a, const void *b) {
+	long x = *(const long *) a, y = *(const long *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+static double failures(const struct bp_tat_cell *cell) {
+	unsigned long counted = cell->attempts - cell->busy;
+
+	return counted == 0 ? 0 : (double) (cell->missed + cell->stray) / counted;
+}
+
+/* Offsets sorted, histograms, safe lead and mean offset per divider */
+void bp_tat_analyse(struct bp_tat *c) {
+	struct bp_tat_cell *cell;
+	double sum, sum2;
+	unsigned long n;
+	long b;
+	int d, l, first, i;
+
+	for (d = 0; d < c->ndividers; d++) {
+		memset(c->offset_counts[d], 0, sizeof(c->offset_counts[d]));
+		c->offset_outside[d] = 0;
+		sum = sum2 = 0;
+		n = 0;
+		// from the longest lead down, the first to fail too often ends the safe range
+		first = c->nleads;
+		for (l = c->nleads - 1; l >= 0; l--) {
+			cell = &c->cells[d][l];
+			if (cell->attempts == cell->busy || failures(cell) > c->max_fail)
+				break;
+			first = l;
+		}
+		c->safe_lead_ns[d] = first < c->nleads ? (unsigned long long) ceil(c->margin * c->leads_ns[first]) : 0;
+
+		for (l = 0; l < c->nleads; l++) {
+			cell = &c->cells[d][l];
+			if (cell->offsets == NULL)
+				continue;
+			qsort(cell->offsets, cell->fired, sizeof(long), compare_long);
+			for (i = 0; i < (int) cell->fired; i++) {
+				sum += cell->offsets[i];
+				sum2 += (double) cell->offsets[i] * cell->offsets[i];
+				b = (long) floor(cell->offsets[i] / c->offset_bin_ns) + BP_TAT_OFFSET_BINS / 2;
+				if (b >= 0 && b < BP_TAT_OFFSET_BINS)
+					c->offset_counts[d][b]++;
+				else
+					c->offset_outside[d]++;
+			}
+			n += cell->fired;
+		}
+		c->offset_mean_ns[d] = n > 0 ? sum / n : 0;
+		c->offset_rms_ns[d] = n > 0 ? sqrt(fmax(sum2 / n - c->offset_mean_ns[d] * c->offset_mean_ns[d], 0)) : 0;
+	}
+}
+
+static long percentile(const struct bp_tat_cell *cell, double q) {
+	return cell->fired == 0 ? 0 : cell->offsets[(unsigned long) (q * (cell->fired - 1) + 0.5)];
+}
+
+/* Per divider the safe lead and offset, then a line per lead */
+void bp_tat_print(const struct bp_tat *c, FILE *fptr) {
+	const struct bp_tat_cell *cell;
+	int d, l;
+
+	for (d = 0; d < c->ndividers; d++) {
+		if (c->safe_lead_ns[d] > 0)
+			fprintf(fptr, "divider %d: safe lead %llu ns, offset %.1f ns rms %.1f ns\n", c->dividers[d],
+				c->safe_lead_ns[d], c->offset_mean_ns[d], c->offset_rms_ns[d]);
+		else
+			fprintf(fptr, "divider %d: no safe lead up to %.0f ns\n", c->dividers[d], c->leads_ns[c->nleads - 1]);
+		fprintf(fptr, "  lead_ns  tries  busy  missed  stray   fail %%  turnaround_ns  offset_ns p50 p99 min max\n");
+		for (l = 0; l < c->nleads; l++) {
+			cell = &c->cells[d][l];
+			fprintf(fptr, "%9.0f  %5lu  %4lu  %6lu  %5lu  %7.2f  %13.0f  %4ld %4ld %4ld %4ld\n", c->leads_ns[l],
+				cell->attempts, cell->busy, cell->missed, cell->stray, 100 * failures(cell),
+				cell->attempts ? cell->sum_turnaround_ns / cell->attempts : 0, percentile(cell, 0.5),
+				percentile(cell, 0.99), percentile(cell, 0), percentile(cell, 1));
+		}
+	}
+}
+
+/*
+	bp_tat_write()
+
+	The table with the offset histograms to table_file, and the safe lead
+	of divider_in_use (or the longest of all if it was not swept) to
+	report_file. The report is left alone when there is no safe lead.
+*/
+int bp_tat_write(const struct bp_tat *c) {
+	unsigned long long lead = 0;
+	char date[32];
+	time_t now = time(NULL);
+	FILE *fptr;
+	int d, b, use = -1;
+
+	fptr = fopen(c->table_file, "w");
+	if (fptr == NULL) {
+		perror(c->table_file);
+		return -1;
+	}
+	bp_tat_print(c, fptr);
+	for (d = 0; d < c->ndividers; d++) {
+		fprintf(fptr, "# offset histogram, divider %d, %lu outside: lo_ns count\n", c->dividers[d],
+			c->offset_outside[d]);
+		for (b = 0; b < BP_TAT_OFFSET_BINS; b++)
+			if (c->offset_counts[d][b] > 0)
+				fprintf(fptr, "%.0f %lu\n", (b - BP_TAT_OFFSET_BINS / 2) * c->offset_bin_ns, c->offset_counts[d][b]);
+	}
+	if (fclose(fptr) != 0)
+		return -1;
+
+	for (d = 0; d < c->ndividers; d++) {
+		if (c->dividers[d] == c->divider_in_use)
+			use = d;
+	}
+	for (d = 0; d < c->ndividers && (d == 0 || lead > 0); d++)
+		if (c->safe_lead_ns[d] == 0 || c->safe_lead_ns[d] > lead)
+			lead = c->safe_lead_ns[d];
+	if (use >= 0)
+		lead = c->safe_lead_ns[use];
+	if (lead == 0) {
+		fprintf(stderr, "no safe lead, %s left as it was\n", c->report_file);
+		return -1;
+	}
+	fptr = fopen(c->report_file, "w");
+	if (fptr == NULL) {
+		perror(c->report_file);
+		return -1;
+	}
+	strftime(date, sizeof(date), "%Y-%m-%d %H:%M", localtime(&now));
+	fprintf(fptr, "# Trigger at time (menu 'L' in bp_test_pi), %s, %d attempts at leads %.0f-%.0f ns\n", date,
+		c->trials, c->leads_ns[0], c->leads_ns[c->nleads - 1]);
+	fprintf(fptr, "min_safe_lead_ns: %llu", lead);
+	if (use >= 0)
+		fprintf(fptr, "        # SPI clock divider %d\n", c->divider_in_use);
+	else
+		fprintf(fptr, "        # longest of the dividers swept\n");
+	if (use >= 0) {
+		fprintf(fptr, "offset_ns: %.1f                # fired - requested\n", c->offset_mean_ns[use]);
+		fprintf(fptr, "offset_rms_ns: %.1f\n", c->offset_rms_ns[use]);
+	}
+	for (d = 0; d < c->ndividers; d++)
+		if (d != use)
+			fprintf(fptr, "# divider %d: safe lead %llu ns, offset %.1f ns rms %.1f ns\n", c->dividers[d],
+				c->safe_lead_ns[d], c->offset_mean_ns[d], c->offset_rms_ns[d]);
+	if (fclose(fptr) != 0)
+		return -1;
+	return 0;
+}
+
+void bp_tat_free(struct bp_tat *c) {
+	int d, l;
+
+	for (d = 0; d < BP_TAT_MAX_DIVIDERS; d++)
+		for (l = 0; l < BP_TAT_MAX_LEADS; l++) {
+			free(c->cells[d][l].offsets);
+			c->cells[d][l].offsets = NULL;
+		}
+}
+
+/* min_safe_lead_ns of the report, BP_TAT_DEFAULT_LEAD_NS without one */
+unsigned long long bp_tat_min_lead_ns(const char *report_file) {
+	struct bp_config cfg;
+
+	memset(&cfg, 0, sizeof(cfg));
+	if (access(report_file, R_OK) == 0)
+		bp_config_load(&cfg, report_file);
+	return bp_config_double(&cfg, "min_safe_lead_ns", BP_TAT_DEFAULT_LEAD_NS);
+}
+
+/*
+	bp_tat_schedule()
+
+	A trigger lead_ns from now, but at least min_lead_ns. The time it was
+	asked for goes to target.
+*/
+int bp_tat_schedule(unsigned long long lead_ns, unsigned long long min_lead_ns, unsigned long long *target) {
+	unsigned long long now = 0;
+
+	if (frame(SPI_READ_nsTimer_TFPGA, &now, NULL) != 0)
+		return -1;
+	*target = (now + (lead_ns > min_lead_ns ? lead_ns : min_lead_ns) + 7) & ~7ULL;
+	now = *target;
+	return frame(SPI_SET_TRIG_AT_TIME, &now, NULL);
+}
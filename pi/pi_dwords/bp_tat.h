@@ -0,0 +1,67 @@
+/*
+ ============================================================================
+ Name        : bp_tat.h
+ Description : Trigger at time (SPI_SET_TRIG_AT_TIME) offset and minimum
+               lead characterisation, and scheduling with that lead
+ ============================================================================
+ */
+#ifndef BP_TAT_H
+#define BP_TAT_H
+
+#include <stdio.h>
+
+#define BP_TAT_MAX_LEADS 40
+#define BP_TAT_MAX_DIVIDERS 8
+#define BP_TAT_OFFSET_BINS 64
+#define BP_TAT_DEFAULT_LEAD_NS 100000ULL   // used by bp_tat_schedule() until there is a report
+
+/* Attempts at one lead and SPI clock divider */
+struct bp_tat_cell {
+	unsigned long attempts;
+	unsigned long fired;         // the last trigger time moved to within window_ns of the request
+	unsigned long missed;        // it did not move, the request came too late or was lost
+	unsigned long stray;         // it moved, but not to near the requested time
+	unsigned long busy;          // other triggers came as well, not counted
+	long *offsets;               // fired - requested [ns], fired of them
+	double sum_turnaround_ns;    // nsTimer read to SPI_SET_TRIG_AT_TIME done
+};
+
+struct bp_tat {
+	/* configuration, see bp_tat.yml */
+	double min_lead_ns, max_lead_ns;
+	int leads_per_decade;
+	int trials;                  // attempts per lead and divider
+	int ndividers;
+	int dividers[BP_TAT_MAX_DIVIDERS];
+	int divider_in_use;          // the one bp_test_pi runs with, whose lead goes in the report
+	double window_ns;            // fired this close to the request counts as fired
+	double max_fail;             // failure fraction a safe lead and all longer ones keep
+	double margin;               // safe lead = margin * shortest lead that keeps max_fail
+	double offset_bin_ns;
+	char table_file[208];
+	char report_file[208];
+
+	/* results */
+	int nleads;
+	double leads_ns[BP_TAT_MAX_LEADS];
+	struct bp_tat_cell cells[BP_TAT_MAX_DIVIDERS][BP_TAT_MAX_LEADS];
+	unsigned long offset_counts[BP_TAT_MAX_DIVIDERS][BP_TAT_OFFSET_BINS];
+	unsigned long offset_outside[BP_TAT_MAX_DIVIDERS];
+	unsigned long long safe_lead_ns[BP_TAT_MAX_DIVIDERS];
+	double offset_mean_ns[BP_TAT_MAX_DIVIDERS], offset_rms_ns[BP_TAT_MAX_DIVIDERS];
+};
+
+/* Sets the SPI clock divider, NULL or a no-op on the emulated backplane */
+typedef void (*bp_tat_divider_fn)(int divider);
+
+int bp_tat_load(struct bp_tat *c, const char *config_file);
+int bp_tat_run(struct bp_tat *c, bp_tat_divider_fn set_divider);
+void bp_tat_analyse(struct bp_tat *c);
+void bp_tat_print(const struct bp_tat *c, FILE *fptr);
+int bp_tat_write(const struct bp_tat *c);
+void bp_tat_free(struct bp_tat *c);
+
+unsigned long long bp_tat_min_lead_ns(const char *report_file);
+int bp_tat_schedule(unsigned long long lead_ns, unsigned long long min_lead_ns, unsigned long long *target);
+
+#endif
@@ -19,10 +19,39 @@
 #include <sys/types.h>
 #include <sys/select.h>
 #include <time.h>
+#include <sys/resource.h>
+#ifdef BP_RT
+#include <sched.h>
+#include <sys/mman.h>
+#endif
 // #include <sys/ioctl.h>
+#ifndef BP_EMULATOR_ONLY
 #include <bcm2835.h> // Driver for SPI chip
+#endif
 
 #include "spicomms.h"
+#include "hskp_burst.h"
+#include "hp_occupancy.h"
+#include "automask.h"
+#include "dashboard.h"
+#include "bp_emulator.h"
+#include "bp_fault.h"
+#include "hp_file.h"
+#include "hp_format.h"
+#include "hp_writer.h"
+#include "hp_stage.h"
+#include "bp_seq.h"
+#include "bp_proc.h"
+#include "hp_stream.h"
+#include "hp_rate.h"
+#include "hp_interval.h"
+#include "bp_tat.h"
+#include "hskp_archive.h"
+#include "hskp_deadband.h"
+#include "bp_pubsub.h"
+#include "bp_request.h"
+#include "bp_dma.h"
+#include "hp_edge.h"
 
 /* Functions */
 void us_sleep(int us);
@@ -40,10 +69,33 @@ void display_pwrbd_hskp(void);
 void display_env_hskp(void);
 void display_nstime_trigger_count(unsigned short *data);
 void trig_adcs (void);
+void run_procedures(const char *procs);
+void stream_hit_patterns(void);
+void record_adaptive(void);
+void trigger_intervals(void);
+void trigger_at_time(void);
+void archive_housekeeping(void);
+void changed_housekeeping(void);
+void publish_live(void);
+void compare_frame_engines(void);
+void record_on_edges(void);
+void set_spi_divider(int divider);
 unsigned short spi_tword(unsigned short write_word) ;
 void transfer_message(unsigned short *message, unsigned short *data) ;
+void spi_transfer(const unsigned short *message, unsigned short *data) ;
+unsigned long long monotonic_ns(void);
+void sleep_until_ns(unsigned long long deadline);
+void record_occupancy(unsigned short *hit_pattern, int *poll_stdin);
+void report_occupancy(const char *filename);
+void trigger_mask_written(unsigned short *mask);
 
 /*  Global variables */
+struct hp_occupancy occupancy; // trigger pixel hit counters of the last recording
+struct hp_writer writer;       // '$' recording file
+struct hp_writer_config writer_cfg;
+struct hp_format_spec writer_spec;
+struct automask automask;      // closed-loop trigger pixel masking, run while recording
+int automask_enabled;
 	
 
 int main(void){
@@ -53,7 +105,32 @@ int main(void){
 	unsigned long k;
     char key;
 	unsigned short hit_pattern[32];
-
+	int poll_stdin;
+	char procs[16];
+	unsigned long long lead, target;
+#ifdef BP_RT
+	struct sched_param sp;
+#endif
+
+	// RT build (cmake -DCMAKE_BUILD_TYPE=RT): no page faults and no preemption
+	// by ordinary tasks in the polling loops, BP_RT_PRIORITY=1..99 (default 50)
+#ifdef BP_RT
+	if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0)
+	  perror("mlockall");
+	sp.sched_priority = getenv("BP_RT_PRIORITY") ? atoi(getenv("BP_RT_PRIORITY")) : 50;
+	if (sched_setscheduler(0, SCHED_FIFO, &sp) != 0)
+	  perror("SCHED_FIFO");
+#endif
+
+	// BP_EMULATE=hp_gen.yml answers every frame from the emulated backplane
+#ifdef BP_EMULATOR_ONLY
+	if (bp_emulator_init(getenv("BP_EMULATE") ? getenv("BP_EMULATE") : "hp_gen.yml") != 0)
+	  return 1;
+#else
+	if (getenv("BP_EMULATE") != NULL) {
+	  if (bp_emulator_init(getenv("BP_EMULATE")) != 0)
+	    return 1;
+	} else {
 	if (!bcm2835_init())
 	  return 1;
 	bcm2835_spi_begin();
@@ -66,6 +143,17 @@ int main(void){
 	bcm2835_spi_setClockDivider(BCM2835_SPI_CLOCK_DIVIDER_128); 
 	bcm2835_spi_chipSelect(BCM2835_SPI_CS0);              
 	bcm2835_spi_setChipSelectPolarity(BCM2835_SPI_CS0, LOW);  // the default
+	// BP_DMA=bp_dma.yml sends batches of frames (the live trigger reads) by DMA
+	if (getenv("BP_DMA") != NULL)
+	  bp_dma_init(getenv("BP_DMA"));
+	}
+#endif
+	if (bp_emulator_enabled)
+	  printf("Backplane emulated, no SPI traffic\n");
+	// BP_FAULTS=faults.yml corrupts the answers of whichever backend is in use
+	if (getenv("BP_FAULTS") != NULL &&
+	    bp_fault_init(getenv("BP_FAULTS"), bp_emulator_enabled ? bp_emulator_transfer : spi_transfer) != 0)
+	  return 1;
 
 // load SPI wrap around message as default
 	spi_message[0] = SPI_SOM_HKFPGA; //som
@@ -100,12 +188,19 @@ int main(void){
             printf("r. Reset FEE                          n. Power on/off FEE     \n");
 			printf("t. Send Cal Trigger                   u. Power Board Status   \n");
 			printf("1. Reset DACQ1 Power                  2. Reset DACQ2 Power \n");
+			printf("I. Burst sample FEE I/V (ripple)      D. Live dashboard (q to leave)\n");
+			printf("F. SPI frame errors and retries       Q. Run procedures together (sequencer)\n");
+			printf("S. Stream hit patterns to hp_aggregate   R. Record hit patterns at an adaptive rate\n");
+			printf("T. Inter-trigger interval histogram   L. Trigger at time lead and offset\n");
+			printf("U. Trigger at time after a lead       H. Housekeeping to the long-term archive\n");
+			printf("C. Changed housekeeping (deadband)    P. Publish live data to subscribers\n");
+			printf("E. SPI frame engine, DMA against polling  G. Record hit patterns on GPIO trigger edges\n");
 			printf("                       \n");
 			printf("a. TFPGA wrap around                  k. TFPGA Trigger\n");
 			printf("b. TFPGA set nsTimer                  c. TFPGA Read nsTimer, Counts, Rates\n");
 			printf("f. TFPGA Trigger Time Read            g. TFPGA En/Disable Trigger/TACK\n");
 			printf("j. Set Trigger Mask                   l. Reset Trigger Counter and nsTimer\n");
-			printf("5. Set Trigger Mask for single group   \n");
+			printf("5. Set Trigger Mask for single group  A. Automatic masking on/off\n");
 			printf("q. Read Hit Pattern                   y. Set Array Board COnfig\n");
 			printf("z. Set Tack Type and Mode             d. Set Trigger at Time\n");
 			printf("s. Send a SYNC MEssage                o. Set Hold Off  \n");
@@ -251,7 +346,103 @@ int main(void){
 			trig_adcs();
 			display_currents();
 			break;
+
+		case 'I': // Burst sample FEE currents and voltages
+			{
+			struct hskp_burst burst;
+			int nsamples, settle_us;
+			printf("Enter number of burst samples: ");
+			scanf("%d", &nsamples);
+			printf("Enter ADC settle time after trigger [us] 0-999999: ");
+			scanf("%d", &settle_us);
+			if (settle_us < 0 || settle_us > 999999) {
+				printf("Settle time must be below 1 s\n");
+				break;
+			}
+			if (hskp_burst_acquire(&burst, nsamples, settle_us) != 0) {
+				printf("Burst of %d samples not taken\n", nsamples);
+				break;
+			}
+			hskp_burst_write_raw(&burst, "hskp_burst.bin");
+			hskp_burst_analyze(&burst, "hskp_burst_spectrum.txt");
+			hskp_burst_free(&burst);
+			printf("Raw burst written to hskp_burst.bin, spectra to hskp_burst_spectrum.txt\n");
+			}
+			break;
 		
+		case 'D': // Live dashboard of hit map, rates and housekeeping
+			dashboard_run("dashboard.yml");
+			break;
+
+		case 'F': // SPI frame errors, retries and injected faults
+			bp_fault_report(stdout);
+			bp_dma_report(stdout);
+			break;
+
+		case 'E': // Hit pattern reads by polling and by DMA, frames/s and CPU
+			compare_frame_engines();
+			break;
+
+		case 'G': // A hit pattern read on every trigger edge on a GPIO line
+			record_on_edges();
+			break;
+
+		case 'T': // Poll the last trigger time for the intervals between triggers
+			trigger_intervals();
+			break;
+
+		case 'L': // Trigger at time offsets and failures against the lead, and the safe lead
+			trigger_at_time();
+			break;
+
+		case 'U': // Trigger at time a lead from now, at least the safe lead of trigger_at_time.yml
+			printf("Enter the time until the trigger [ns]: ");
+			scanf("%llu", &lead);
+			if (bp_tat_schedule(lead, bp_tat_min_lead_ns("trigger_at_time.yml"), &target) == 0)
+				printf("Trigger at nsTimer %llu ns (0x%016llx)\n", target, target);
+			else
+				printf("Trigger at time refused: no answer from the TFPGA, nothing scheduled\n");
+			break;
+
+		case 'H': // FEE I/V and ENV into the raw/minute/hour archive of hskp_archive.yml
+			archive_housekeeping();
+			break;
+
+		case 'C': // FEE I/V and ENV values past the deadbands of hskp_deadband.yml, for slow control
+			changed_housekeeping();
+			break;
+
+		case 'P': // Hit patterns, rates, housekeeping and events to any number of subscribers
+			publish_live();
+			break;
+
+		case 'R': // Hit patterns at a rate following the trigger rate
+			record_adaptive();
+			break;
+
+		case 'S': // New hit patterns to the DAQ host aggregator over TCP
+			stream_hit_patterns();
+			break;
+
+		case 'Q': // Several multi-step procedures at once on the sequencer
+			printf("Procedures to run together, any of s (SYNC), n (power FEEs, wait for the currents to settle),\n");
+			printf("r (mask triggers, reset a FEE, dwell, read it back), i (FEE I/V sweep): ");
+			scanf("%15s", procs);
+			run_procedures(procs);
+			break;
+
+		case 'A': // Toggle closed-loop masking of noisy trigger pixels
+			if (automask_enabled) {
+				automask_enabled = 0;
+				automask_close(&automask);
+			} else if (automask_init(&automask, "automask.yml") == 0) {
+				automask_enabled = 1;
+				printf("Automatic masking on, it acts while recording trigger patterns (9, $, *)\n");
+			} else {
+				printf("Automatic masking not enabled\n");
+			}
+			break;
+
 		case '5': // Set Trigger Mask from input, for single group
 			printf("Setting Trigger Mask from input\n");
 			int module;
@@ -357,6 +548,7 @@ int main(void){
 			//display_slavespi_data(data);
 			printf(" %04x %04x %04x %04x\n",data[2],data[3],data[4],data[5]);
 			printf("      %04x %04x %04x %04x\n",data[6],data[7],data[8],data[9]);
+			trigger_mask_written(j);
             break;
 		
 		case 'j': // Set Trigger Mask from file
@@ -447,6 +639,7 @@ int main(void){
 			//display_slavespi_data(data);
 			printf(" %04x %04x %04x\n",data[2],data[3],data[4]);
 			printf(" %04x %04x %04x %04x %04x\n", data[5],data[6],data[7],data[8],data[9]);
+			trigger_mask_written(j);
 		break;
 
 		case '8': // Set Trigger Mask from file
@@ -544,6 +737,7 @@ int main(void){
 			//display_slavespi_data(data);
 			printf(" %04x %04x %04x\n",data[2],data[3],data[4]);
 			printf(" %04x %04x %04x %04x %04x\n", data[5],data[6],data[7],data[8],data[9]);
+			trigger_mask_written(j);
 		break;
 
 		case 'k': // TFPGA software trigger
@@ -659,6 +853,10 @@ int main(void){
       fptr = fopen("hitpattern_dwords.txt", "w");
       fprintf(fptr, "N: %d, freq: %f\n", N, freq);
 
+      hp_occupancy_init(&occupancy);
+      poll_stdin = 1;
+      printf("Type o<Return> while recording to print trigger pixel occupancy\n");
+
       for (int step = 0; step < N; step++) {
       printf("Step: %d\n", step+1);
       fprintf(fptr, "Step: %d\n", step+1);
@@ -683,18 +881,24 @@ int main(void){
 			spi_message[10] = SPI_EOM_TFPGA; //not used
 			transfer_message(spi_message,data);
 			print_slavespi_data(fptr, data);
+			hit_pattern_from_frame(hit_pattern, 0, data);
 
 			spi_message[1] = SPI_READ_HIT_PATTERN1; //cw
 			transfer_message(spi_message,data);
 			print_slavespi_data(fptr, data);
+			hit_pattern_from_frame(hit_pattern, 1, data);
 			
 			spi_message[1] = SPI_READ_HIT_PATTERN2; //cw
 			transfer_message(spi_message,data);
 			print_slavespi_data(fptr, data);
+			hit_pattern_from_frame(hit_pattern, 2, data);
 			
 			spi_message[1] = SPI_READ_HIT_PATTERN3; //cw
 			transfer_message(spi_message,data);
 			print_slavespi_data(fptr, data);
+			hit_pattern_from_frame(hit_pattern, 3, data);
+
+      record_occupancy(hit_pattern, &poll_stdin);
 
       double period_int;
       double period_frac = modf(period, &period_int);
@@ -712,6 +916,7 @@ int main(void){
       }
 
       fclose(fptr);
+      report_occupancy("hitpattern_occupancy.txt");
       printf("Closing hit pattern file\n\n");
 			
 		  break;
@@ -1374,6 +1579,10 @@ int main(void){
       fptr = fopen("hitpattern.txt", "w");
       fprintf(fptr, "N: %d, freq: %f\n", N, freq);
 
+      hp_occupancy_init(&occupancy);
+      poll_stdin = 1;
+      printf("Type o<Return> while recording to print trigger pixel occupancy\n");
+
       for (int step = 0; step < N; step++) {
       printf("Step: %d\n", step+1);
 
@@ -1965,6 +2174,8 @@ int main(void){
 				(hit_pattern[0] & 0x1000) >>12 //
 				);
 
+      record_occupancy(hit_pattern, &poll_stdin);
+
       double period_int;
       double period_frac = modf(period, &period_int);
 
@@ -1981,6 +2192,7 @@ int main(void){
       }
 			
       fclose(fptr);
+      report_occupancy("hitpattern_occupancy.txt");
       printf("Closing hit pattern file\n\n");
 	
 			break;
@@ -2008,10 +2220,21 @@ int main(void){
       printf("%s %d %s %0.3f %s", "Will read", N, "patterns with a period of", period, "s\n");
       printf("\n");
 
-      //FILE *fptr;
-      fptr = fopen("hitpattern.bin", "wb");
-      fwrite(&N, sizeof(N), 1, fptr); // write number of frames to binary file
-      fwrite(&freq, sizeof(freq), 1, fptr); // write sampling freq to binary file
+      // large aligned blocks, rotation and fsync policy from hp_writer.yml;
+      // the header with N and freq is patched with the count actually written
+      hp_writer_config_load(&writer_cfg, "hp_writer.yml");
+      writer_spec.format = HP_FILE_BINARY;
+      writer_spec.nsamples = N;
+      writer_spec.freq = freq;
+      if (hp_writer_open(&writer, &writer_cfg, "hitpattern", ".bin", hp_format_writer_header, &writer_spec) != 0) {
+        printf("Could not open %s/hitpattern.bin\n\n", writer_cfg.dir);
+        break;
+      }
+      fptr = writer.stream;
+
+      hp_occupancy_init(&occupancy);
+      poll_stdin = 1;
+      printf("Type o<Return> while recording to print trigger pixel occupancy\n");
 
       for (int step = 0; step < N; step++) {
       printf("Step: %d\n", step+1);
@@ -2029,6 +2252,7 @@ int main(void){
 			spi_message[10] = SPI_EOM_TFPGA; //not used
 			transfer_message(spi_message,data);
       fwrite(data,sizeof(data),1, fptr); // write data to binary file
+      hit_pattern_from_frame(hit_pattern, 0, data);
 
       // Write the step number to the binary file
       fwrite(&step,sizeof(step),1, fptr); // write data to binary file
@@ -2051,15 +2275,24 @@ int main(void){
 			spi_message[1] = SPI_READ_HIT_PATTERN1; //cw
 			transfer_message(spi_message,data);
       fwrite(data,sizeof(data),1, fptr); // write data to binary file
+      hit_pattern_from_frame(hit_pattern, 1, data);
 			
 			spi_message[1] = SPI_READ_HIT_PATTERN2; //cw
 			transfer_message(spi_message,data);
       fwrite(data,sizeof(data),1, fptr); // write data to binary file
+      hit_pattern_from_frame(hit_pattern, 2, data);
 			
 			spi_message[1] = SPI_READ_HIT_PATTERN3; //cw
 			transfer_message(spi_message,data);
       fwrite(data,sizeof(data),1, fptr); // write data to binary file
+      hit_pattern_from_frame(hit_pattern, 3, data);
+      if (hp_writer_end_record(&writer) != 0) {
+        printf("Write to %s failed, stopping\n", writer.part);
+        break;
+      }
 			
+      record_occupancy(hit_pattern, &poll_stdin);
+
      double period_int;
      // double period_frac = modf(period, &period_int);
      double period_frac = modf(period, &period_int);
@@ -2077,7 +2310,9 @@ int main(void){
 
       }
 			
-      fclose(fptr);
+      hp_writer_close(&writer);
+      hp_writer_report(&writer, stdout);
+      report_occupancy("hitpattern_occupancy.txt");
       printf("Closing hit pattern binary file\n\n");
 	
 			break;
@@ -2218,6 +2453,9 @@ int main(void){
 		
         case 'x': // exit program 
             printf("\n exiting program \n\n");
+            if (bp_fault_enabled)
+              bp_fault_report(stdout);
+            hp_stage_stop(1); // staged recording segments go to the card first
             quit = 1;
             break;
 			
@@ -2451,7 +2689,12 @@ unsigned short	spi_tword(unsigned short write_word)
 
     // read_msb = bcm2835_spi_transfer(write_msb) ;
     // read_lsb = bcm2835_spi_transfer(write_lsb) ;
+#ifdef BP_EMULATOR_ONLY
+    (void) tbuf ;
+    rbuf[0] = rbuf[1] = 0 ; // never called, transfer_message() goes to the emulator
+#else
     bcm2835_spi_transfernb(tbuf, rbuf, 0x00000002) ;
+#endif
     read_msb = rbuf[0] ;
     read_lsb = rbuf[1] ;
     tword = read_msb ;
@@ -2469,10 +2712,25 @@ unsigned short	spi_tword(unsigned short write_word)
 	data (from FPGA slave to PI master).  
 	Format of both send message and receive data are:
 	SOM word, CMD word, 8 words of data, EOM word.
-	Full duplex operation makes this simultaneous transfer of bits,
-	bytes and words a bit tricky.
+	The frame goes through the fault injection layer if BP_FAULTS is set,
+	then to the emulated backplane or to spi_transfer().
 */ 
 void transfer_message(unsigned short *message, unsigned short *pdata) {
+	if (bp_fault_enabled)
+		bp_fault_transfer(message, pdata);
+	else if (bp_emulator_enabled)
+		bp_emulator_transfer(message, pdata);
+	else
+		spi_transfer(message, pdata);
+}
+
+/*
+	spi_transfer()
+
+	The frame on the SPI bus. Full duplex operation makes this
+	simultaneous transfer of bits, bytes and words a bit tricky.
+*/
+void spi_transfer(const unsigned short *message, unsigned short *pdata) {
 	unsigned short dummy_word ;
 	unsigned short som_word ;
 	unsigned short cmd_word ;
@@ -2529,6 +2787,69 @@ void transfer_message(unsigned short *message, unsigned short *pdata) {
 	} // end switch */
 }
 
+unsigned long long monotonic_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// sleep_until_ns - sleep until monotonic_ns() reaches deadline, any length
+// of time (us_sleep() and ms_sleep() only take less than a second).
+void sleep_until_ns(unsigned long long deadline) {
+	struct timespec ts;
+	ts.tv_sec = deadline / 1000000000ULL;
+	ts.tv_nsec = deadline % 1000000000ULL;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+		;
+}
+
+/*
+	record_occupancy()
+
+	Fold a recorded snapshot into the trigger pixel occupancy and print the
+	occupancy maps when 'o' is typed during the recording. Any other input
+	is pushed back and left for the menu once the recording is done.
+*/
+void record_occupancy(unsigned short *hit_pattern, int *poll_stdin) {
+	int c;
+
+	hp_occupancy_add(&occupancy, hit_pattern, monotonic_ns());
+	if (automask_enabled)
+		automask_step(&automask, &occupancy, monotonic_ns());
+	if (*poll_stdin && kbhit()) {
+		c = getchar();
+		if (c == 'o') {
+			hp_occupancy_print(&occupancy, monotonic_ns(), 10);
+			while (c != '\n' && c != EOF)
+				c = getchar();
+		} else {
+			ungetc(c, stdin);
+			*poll_stdin = 0;
+		}
+	}
+}
+
+/*
+	trigger_mask_written()
+
+	Remember a mask written by 'j', '5' or '8'. A hand-set mask replaces
+	whatever the automatic masking had done, so the loop is switched off.
+*/
+void trigger_mask_written(unsigned short *mask) {
+	trigger_mask_set(mask);
+	if (automask_enabled) {
+		automask_enabled = 0;
+		automask_close(&automask);
+	}
+}
+
+void report_occupancy(const char *filename) {
+	unsigned long long now = monotonic_ns();
+	hp_occupancy_print(&occupancy, now, 10);
+	if (hp_occupancy_write(&occupancy, now, filename) == 0)
+		printf("Trigger pixel occupancy written to %s\n", filename);
+}
+
 void display_slavespi_data (unsigned short *data) {
 	unsigned short i;
 	printf(" SOM  CMD DW 1 DW 2 DW 3 DW 4 DW 5 DW 6 DW 7 DW 8  EOM\n");
@@ -2671,18 +2992,738 @@ void trig_adcs (void){
 	spi_message[9] = 0x0088;
 	spi_message[10] = SPI_EOM_HKFPGA; // not used
 	transfer_message(spi_message,data);// trig ADCs
-	delay(100);
+	ms_sleep(100);
+}
+
+/*
+	stream_hit_patterns()
+
+	Serve the hit pattern of every new trigger to hp_aggregate, reading
+	the counters at the given frequency for the given time. The readout
+	never waits for the network, records the host is too slow for are
+	dropped and show up there as gaps.
+*/
+void stream_hit_patterns(void) {
+	static struct hp_stream stream;
+	struct hp_stream_record rec;
+	unsigned short spi_message[11], data[11], counters[11], hit_pattern[32];
+	unsigned long hwtriggers, last_hwtriggers = 0;
+	unsigned long long next, now;
+	struct timespec ts;
+	float freq, dt;
+	int port, n, N, f, ok, first = 1;
+
+	printf("Enter the frequency of the hit pattern readout [Hz]: ");
+	scanf("%f", &freq);
+	printf("Enter the duration of the stream [s]: ");
+	scanf("%f", &dt);
+	printf("Enter the TCP port hp_aggregate connects to (%d): ", HP_STREAM_PORT);
+	scanf("%d", &port);
+	if (freq <= 0 || hp_stream_listen(&stream, port) != 0)
+		return;
+	printf("Waiting up to 60 s for hp_aggregate to connect to port %d\n", port);
+	if (hp_stream_accept(&stream, 60000) != 0) {
+		printf("Nobody connected\n\n");
+		hp_stream_close(&stream);
+		return;
+	}
+	N = (int) (freq * dt);
+	printf("Streaming for %0.1f s, reading the counters at %0.1f Hz\n", dt, freq);
+
+	next = monotonic_ns();
+	for (n = 0; n < N; n++) {
+		spi_message[0] = SPI_SOM_TFPGA; //som
+		spi_message[1] = SPI_READ_nsTimer_TFPGA; //cw
+		spi_message[2] = 0x0111;
+		spi_message[3] = 0x1222;
+		spi_message[4] = 0x2333;
+		spi_message[5] = 0x3444;
+		spi_message[6] = 0x4555;
+		spi_message[7] = 0x5666;
+		spi_message[8] = 0x6777;
+		spi_message[9] = 0x7888;
+		spi_message[10] = SPI_EOM_TFPGA; //not used
+		ok = transfer_checked("stream", spi_message, counters) == 0;
+		hwtriggers = (((unsigned long) counters[8] << 16) | counters[9]) - 1;
+		if (ok && (first || hwtriggers != last_hwtriggers)) {
+			// the pattern and trigger time stay latched until the next trigger, send them once
+			spi_message[1] = SPI_READ_TRIGGER_NSTIMER_TFPGA;
+			ok = transfer_checked("stream", spi_message, data) == 0;
+			rec.nstime = ((unsigned long long) data[2] << 48) | ((unsigned long long) data[3] << 32) |
+				((unsigned long long) data[4] << 16) | data[5];
+			for (f = 0; f < 4 && ok; f++) {
+				spi_message[1] = f == 0 ? SPI_READ_HIT_PATTERN : f == 1 ? SPI_READ_HIT_PATTERN1 :
+					f == 2 ? SPI_READ_HIT_PATTERN2 : SPI_READ_HIT_PATTERN3;
+				ok = transfer_checked("stream", spi_message, data) == 0;
+				hit_pattern_from_frame(hit_pattern, f, data);
+			}
+			if (ok) {
+				clock_gettime(CLOCK_REALTIME, &ts);
+				rec.hwtriggers = hwtriggers;
+				rec.pi_ns = (unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+				memcpy(rec.hit_pattern, hit_pattern, sizeof(rec.hit_pattern));
+				if (hp_stream_send(&stream, &rec) != 0) {
+					printf("hp_aggregate closed the connection\n");
+					break;
+				}
+				last_hwtriggers = hwtriggers;
+				first = 0;
+			}
+		}
+
+		next += (unsigned long long) (1e9 / freq);
+		now = monotonic_ns();
+		if (next > now)
+			sleep_until_ns(next);
+		else
+			next = now; // fell behind, do not burst to catch up
+	}
+	printf("%llu hit patterns streamed, %llu dropped while the host was behind\n\n", stream.sent, stream.dropped);
+	hp_stream_close(&stream);
+}
+
+/*
+	trigger_intervals()
+
+	Poll the nsTimer of the last trigger for the given time and histogram
+	the intervals between triggers (hp_interval.yml). The histogram and
+	its comparison with Poisson are written to export_file every export_s
+	and at the end.
+*/
+void trigger_intervals(void) {
+	static struct hp_interval h;
+	struct hp_interval_fit fit;
+	unsigned short spi_message[11], data[11], counters[11];
+	unsigned long long start, now, next_export, next_counters, next_poll, t = 0;
+	float dt;
+	int tries, ok;
+
+	printf("Enter the duration of the interval measurement [s]: ");
+	scanf("%f", &dt);
+	hp_interval_load(&h, "hp_interval.yml");
+	hp_interval_start(&h);
+	printf("Polling the last trigger time for %0.1f s, histogram in %s every %0.0f s\n", dt, h.export_file,
+		h.export_s);
+
+	spi_message[0] = SPI_SOM_TFPGA; //som
+	spi_message[2] = 0x0000;
+	spi_message[3] = 0x0000;
+	spi_message[4] = 0x0000;
+	spi_message[5] = 0x0000;
+	spi_message[6] = 0x0005;
+	spi_message[7] = 0x0006;
+	spi_message[8] = 0x0007;
+	spi_message[9] = 0x0008;
+	spi_message[10] = SPI_EOM_TFPGA; //not used
+	start = next_poll = next_counters = monotonic_ns();
+	next_export = start + h.export_s * 1e9;
+	while ((now = monotonic_ns()) - start < dt * 1e9) {
+		spi_message[1] = SPI_READ_TRIGGER_NSTIMER_TFPGA;
+		ok = transfer_checked("intervals", spi_message, data) == 0;
+		if (ok)
+			t = ((unsigned long long) data[2] << 48) | ((unsigned long long) data[3] << 32) |
+				((unsigned long long) data[4] << 16) | data[5];
+		// a new trigger, or once a second for the rate: the counters, and the
+		// last trigger time again to be sure no trigger came in between. A failed
+		// read still waits for the next poll, a bus in trouble is not hammered
+		if (ok && (hp_interval_poll(&h, t, now) || now >= next_counters)) {
+			for (tries = 0; tries < 3; tries++) {
+				spi_message[1] = SPI_READ_nsTimer_TFPGA;
+				if (transfer_checked("intervals", spi_message, counters) != 0)
+					continue;
+				spi_message[1] = SPI_READ_TRIGGER_NSTIMER_TFPGA;
+				if (transfer_checked("intervals", spi_message, data) != 0)
+					continue;
+				if ((((unsigned long long) data[2] << 48) | ((unsigned long long) data[3] << 32) |
+					((unsigned long long) data[4] << 16) | data[5]) == t)
+					break;
+				t = ((unsigned long long) data[2] << 48) | ((unsigned long long) data[3] << 32) |
+					((unsigned long long) data[4] << 16) | data[5];
+			}
+			if (tries < 3)
+				hp_interval_update(&h, ((unsigned long long) counters[2] << 48) |
+					((unsigned long long) counters[3] << 32) | ((unsigned long long) counters[4] << 16) |
+					counters[5], (((unsigned long) counters[8] << 16) | counters[9]) - 1, t);
+			next_counters = now + 1000000000ULL;
+		}
+
+		if (now >= next_export) {
+			hp_interval_write(&h, h.export_file);
+			hp_interval_fit(&h, &fit);
+			printf("%6.0f s  %.1f Hz, %llu intervals, %llu missed, chi2/ndf %.1f/%d, %s\n", (now - start) * 1e-9,
+				fit.rate_hz, h.intervals, h.missed, fit.chi2, fit.ndf, fit.findings[0]);
+			next_export += h.export_s * 1e9;
+		}
+		if (h.poll_us > 0) {
+			next_poll += h.poll_us * 1000ULL;
+			now = monotonic_ns();
+			if (next_poll > now)
+				us_sleep((next_poll - now) / 1000);
+			else
+				next_poll = now;
+		}
+	}
+
+	hp_interval_write(&h, h.export_file);
+	hp_interval_fit(&h, &fit);
+	hp_interval_print(&h, &fit, stdout, "");
+	printf("Histogram in %s\n\n", h.export_file);
+}
+
+/*
+	trigger_at_time()
+
+	Schedule triggers at the leads of bp_tat.yml and read their time back,
+	at each SPI clock divider, for the offset and the shortest safe lead
+	('U' keeps to it). Best run with the physics triggers disabled.
+*/
+void trigger_at_time(void) {
+	static struct bp_tat c;
+	int status;
+
+	bp_tat_load(&c, "bp_tat.yml");
+	printf("%d triggers at each of %d leads from %0.0f to %0.0f ns and %d SPI clock dividers\n", c.trials,
+		c.nleads, c.leads_ns[0], c.leads_ns[c.nleads - 1], c.ndividers);
+	status = bp_tat_run(&c, set_spi_divider);
+	bp_tat_print(&c, stdout);
+	if (status == 0 && bp_tat_write(&c) == 0)
+		printf("Table in %s, safe lead in %s\n\n", c.table_file, c.report_file);
+	bp_tat_free(&c);
+}
+
+/*
+	archive_housekeeping()
+
+	Sample the FEE currents and voltages and the ENV frame every period_s
+	of hskp_archive.yml into its archive, for the given time or until q.
+	hskp_query reads it back.
+*/
+void archive_housekeeping(void) {
+	static struct hskp_archive a;
+	struct hskp_archive_config cfg;
+	unsigned short fee[HSKP_NCHAN], env[HSKP_ENV_NCHAN];
+	float v[HSKP_ARCHIVE_NCHAN];
+	unsigned long long start, next, next_status, now;
+	unsigned long failed = 0;
+	struct timespec ts;
+	float dt;
+
+	printf("Enter how long to archive housekeeping [s], 0 until q: ");
+	scanf("%f", &dt);
+	hskp_archive_load(&cfg, "hskp_archive.yml");
+	if (hskp_archive_open(&a, cfg.file, &cfg) != 0)
+		return;
+	printf("FEE I/V and ENV every %g s to %s\n", cfg.period_s, cfg.file);
+
+	start = next = monotonic_ns();
+	next_status = start + 60000000000ULL;
+	while (dt <= 0 || monotonic_ns() - start < dt * 1e9) {
+		if (dt <= 0 && kbhit() && getchar() == 'q')
+			break;
+		if (hskp_trigger_adcs() == 0) {
+			us_sleep(HSKP_SETTLE_US);
+			if (hskp_read_adcs(fee) == 0 && hskp_read_env(env) == 0) {
+				clock_gettime(CLOCK_REALTIME, &ts);
+				hskp_archive_values(fee, env, v);
+				hskp_archive_add(&a, (int64_t) ts.tv_sec * 1000000000LL + ts.tv_nsec, v);
+			} else {
+				failed++;
+			}
+		} else {
+			failed++;
+		}
+		if ((now = monotonic_ns()) >= next_status) {
+			printf("%llu samples, %lu failed, %lld minute and %lld hour rollups\n", a.samples, failed,
+				(long long) a.header.tier[HSKP_ARCHIVE_MINUTE].count, (long long) a.header.tier[HSKP_ARCHIVE_HOUR].count);
+			next_status += 60000000000ULL;
+		}
+		next += cfg.period_s * 1e9;
+		now = monotonic_ns();
+		if (next > now)
+			sleep_until_ns(next);
+		else
+			next = now;
+	}
+	printf("%llu samples archived in %s, %lu failed\n\n", a.samples, cfg.file, failed);
+	hskp_archive_close(&a);
+}
+
+/*
+	changed_housekeeping()
+
+	One sweep of the FEE currents and voltages and the ENV frame, printing
+	only the values hskp_deadband passes on, "HK <channel> <value> <reason>"
+	one per line, then "HK end <passed> of <channels>, <ratio> % suppressed"
+	with the ratio since the first call, or "HK end 0 of <channels>, read
+	failed". The deadband state is kept from call to call, slow control
+	polls this instead of 'i' and 'v'.
+*/
+void changed_housekeeping(void) {
+	static struct hskp_deadband d;
+	static int ready;
+	struct hskp_deadband_config cfg;
+	unsigned short fee[HSKP_NCHAN], env[HSKP_ENV_NCHAN];
+	unsigned char reason[HSKP_DEADBAND_NCHAN];
+	float v[HSKP_DEADBAND_NCHAN];
+	struct timespec ts;
+	int c, n, failed;
+
+	if (!ready) {
+		hskp_deadband_load(&cfg, "hskp_deadband.yml");
+		hskp_deadband_init(&d, &cfg);   // without the log if it cannot be opened
+		ready = 1;
+	}
+	failed = hskp_trigger_adcs() != 0;
+	if (!failed) {
+		us_sleep(HSKP_SETTLE_US);
+		failed = hskp_read_adcs(fee) != 0 || hskp_read_env(env) != 0;
+	}
+	if (failed) {   // a client waits for the end line all the same
+		printf("HK end 0 of %d, read failed\n", HSKP_DEADBAND_NCHAN);
+		return;
+	}
+	clock_gettime(CLOCK_REALTIME, &ts);
+	hskp_archive_values(fee, env, v);
+	n = hskp_deadband_filter(&d, (int64_t) ts.tv_sec * 1000000000LL + ts.tv_nsec, v, reason);
+	for (c = 0; c < HSKP_DEADBAND_NCHAN; c++)
+		if (reason[c] != HSKP_PASS_NONE)
+			printf("HK %s %.3f %s\n", d.name[c], v[c], hskp_deadband_reason(reason[c]));
+	printf("HK end %d of %d, %.1f %% suppressed\n", n, HSKP_DEADBAND_NCHAN, 100 * hskp_deadband_suppression(&d));
+}
+
+/*
+	publish_live()
+
+	Run the bp_live acquisition threads for the given time or until q and
+	publish every new hit pattern, every FEE sweep, the rates every
+	rate_period_ms and the notable events to the subscribers of the port
+	in bp_pubsub.yml, each with its own queue and policy, and answer
+	their requests (bp_request.c) meanwhile.
+*/
+void publish_live(void) {
+	static struct bp_pubsub ps;
+	static struct bp_live live;
+	struct bp_pubsub_config cfg;
+	struct bp_live_trigger st;
+	struct bp_live_hskp hk;
+	unsigned long long start, next, next_status, now;
+	unsigned long long spi_failed = 0, hskp_failed = 0;
+	unsigned long hwtriggers = 0;
+	float dt;
+
+	printf("Enter how long to publish [s], 0 until q: ");
+	scanf("%f", &dt);
+	bp_pubsub_load(&cfg, "bp_pubsub.yml");
+	memset(&live, 0, sizeof(live));
+	bp_request_allow_frames = cfg.allow_frames;
+	if (bp_pubsub_start(&ps, &cfg, bp_request_live, &live) != 0)
+		return;
+	live.trigger_period_ms = cfg.trigger_period_ms;
+	live.hskp_period_ms = cfg.hskp_period_ms;
+	live.hskp_settle_ms = cfg.hskp_settle_ms;
+	live.rate_window_s = cfg.rate_window_s;
+	live.on_trigger = bp_pubsub_live_trigger;
+	live.on_hskp = bp_pubsub_live_hskp;
+	live.arg = &ps;
+	if (bp_live_start(&live) != 0) {
+		printf("Could not start the acquisition threads\n");
+		bp_pubsub_stop(&ps);
+		return;
+	}
+	printf("Publishing on %s:%d: SUB <hp,rate,hskp,event|all|none> <block|drop|conflate> [queue] [interval_ms],\n",
+		cfg.bind, cfg.port);
+	printf("then REQ <id> <ping|trigger|hit_pattern|hskp%s>\n", cfg.allow_frames ? "|frame ..." : "");
+	bp_pubsub_event(&ps, "publishing");
+
+	start = next = monotonic_ns();
+	next_status = start + 10000000000ULL;
+	while (dt <= 0 || monotonic_ns() - start < dt * 1e9) {
+		if (dt <= 0 && kbhit() && getchar() == 'q')
+			break;
+		bp_live_trigger(&live, &st);
+		bp_live_hskp(&live, &hk);
+		bp_pubsub_rate(&ps, &st);
+		if (st.spi_failed > spi_failed)
+			bp_pubsub_event(&ps, "%llu trigger reads failed", st.spi_failed - spi_failed);
+		if (hk.spi_failed > hskp_failed)
+			bp_pubsub_event(&ps, "%llu housekeeping sweeps failed", hk.spi_failed - hskp_failed);
+		if (st.nreads > 0 && st.hwtriggers < hwtriggers)
+			bp_pubsub_event(&ps, "trigger counter reset");
+		spi_failed = st.spi_failed;
+		hskp_failed = hk.spi_failed;
+		hwtriggers = st.hwtriggers;
+		if ((now = monotonic_ns()) >= next_status) {
+			bp_pubsub_report(&ps, stdout);
+			next_status += 10000000000ULL;
+		}
+		next += cfg.rate_period_ms * 1000000ULL;
+		now = monotonic_ns();
+		if (next > now)
+			sleep_until_ns(next);
+		else
+			next = now;
+	}
+	bp_pubsub_event(&ps, "stopped");
+	bp_live_stop(&live);
+	bp_pubsub_report(&ps, stdout);
+	bp_pubsub_stop(&ps);
+	printf("\n");
+}
+
+/* Reads of the nsTimer frame and the four hit pattern frames for seconds,
+   paced at rate (0 back to back), with the CPU the process used meanwhile */
+static void frame_engine_run(const char *name, float seconds, float rate) {
+	static const unsigned short cw[5] = {
+		SPI_READ_nsTimer_TFPGA, SPI_READ_HIT_PATTERN, SPI_READ_HIT_PATTERN1, SPI_READ_HIT_PATTERN2,
+		SPI_READ_HIT_PATTERN3
+	};
+	unsigned short spi_message[5][11], data[5][11];
+	unsigned long long start, next, now, n = 0, failed = 0;
+	struct rusage r0, r1;
+	double wall, cpu;
+	int f, i;
+
+	for (f = 0; f < 5; f++) {
+		spi_message[f][0] = SPI_SOM_TFPGA; //som
+		spi_message[f][1] = cw[f]; //cw
+		for (i = 2; i < 10; i++)
+			spi_message[f][i] = i - 1;
+		spi_message[f][10] = SPI_EOM_TFPGA; //not used
+	}
+	getrusage(RUSAGE_SELF, &r0);
+	start = next = monotonic_ns();
+	do {
+		failed += bp_dma_checked("engine", spi_message, data, 5) != 0;
+		n++;
+		if (rate > 0) {
+			next += 1e9 / rate;
+			now = monotonic_ns();
+			if (next > now)
+				us_sleep((next - now) / 1000);
+			else
+				next = now;
+		}
+	} while (monotonic_ns() - start < seconds * 1e9);
+	wall = (monotonic_ns() - start) * 1e-9;
+	getrusage(RUSAGE_SELF, &r1);
+	cpu = (r1.ru_utime.tv_sec - r0.ru_utime.tv_sec) + (r1.ru_utime.tv_usec - r0.ru_utime.tv_usec) * 1e-6 +
+		(r1.ru_stime.tv_sec - r0.ru_stime.tv_sec) + (r1.ru_stime.tv_usec - r0.ru_stime.tv_usec) * 1e-6;
+	printf("%-8s %10.0f %10.0f %8llu %7.1f %%\n", name, n / wall, 5 * n / wall, failed, 100 * cpu / wall);
+}
+
+/*
+	compare_frame_engines()
+
+	The same hit pattern reads by polling (transfer_checked() per frame)
+	and as DMA batches through bp_dma_checked(), back to back for the
+	highest rate or paced at the acquisition rate for the CPU it costs.
+*/
+void compare_frame_engines(void) {
+	float seconds, rate;
+	int dma = bp_dma_enabled;
+
+	printf("Enter seconds per engine and reads/s (0 back to back): ");
+	scanf("%f %f", &seconds, &rate);
+	printf("%-8s %10s %10s %8s %9s\n", "engine", "reads/s", "frames/s", "failed", "CPU");
+	bp_dma_enabled = 0;
+	frame_engine_run("polling", seconds, rate);
+	bp_dma_enabled = dma;
+	if (dma)
+		frame_engine_run("DMA", seconds, rate);
+	bp_dma_report(stdout);
+}
+
+/*
+	record_on_edges()
+
+	Record the hit pattern on every edge of the trigger or TACK line
+	(hp_edge.yml), read as soon as the edge wakes the program and stamped
+	with the kernel timestamp of the edge, until the duration is up or q
+	is typed. Prints the edge to readout latencies every 10 s and at the
+	end.
+*/
+void record_on_edges(void) {
+	static const unsigned short cw[5] = {
+		SPI_READ_nsTimer_TFPGA, SPI_READ_HIT_PATTERN, SPI_READ_HIT_PATTERN1, SPI_READ_HIT_PATTERN2,
+		SPI_READ_HIT_PATTERN3
+	};
+	static struct hp_edge edge;
+	struct hp_edge_config cfg;
+	struct hp_format_spec spec;
+	unsigned short spi_message[5][11], data[5][11];
+	unsigned long long start, next_status, edge_ns;
+	unsigned long hwtriggers, first_hwtriggers = 0, last_hwtriggers = 0;
+	struct timespec ts;
+	const char *base = "hitpattern_edges", *ext = ".bin";
+	char format_key[8];
+	float dt;
+	int step = 0, f, i, r;
+
+	printf("Enter the format of the recording ($ binary, * dwords, 9 picture): ");
+	scanf("%7s", format_key);
+	printf("Enter the duration of the recording [s], 0 until q: ");
+	scanf("%f", &dt);
+	spec.format = HP_FILE_BINARY;
+	if (format_key[0] == '*') {
+		spec.format = HP_FILE_DWORDS;
+		base = "hitpattern_edges_dwords";
+		ext = ".txt";
+	} else if (format_key[0] == '9') {
+		spec.format = HP_FILE_PICTURE;
+		ext = ".txt";
+	}
+	spec.nsamples = 0;
+	spec.freq = 0;   // at the trigger rate
+
+	if (hp_edge_load(&cfg, "hp_edge.yml") != 0) {
+		printf("Check hp_edge.yml\n\n");
+		return;
+	}
+	if (hp_edge_open(&edge, &cfg) != 0) {
+		printf("Could not request line %d of %s for edge events\n\n", cfg.line, cfg.chip);
+		return;
+	}
+	hp_writer_config_load(&writer_cfg, "hp_writer.yml");
+	if (hp_writer_open(&writer, &writer_cfg, base, ext, hp_format_writer_header, &spec) != 0) {
+		printf("Could not open %s/%s%s\n\n", writer_cfg.dir, base, ext);
+		hp_edge_close(&edge);
+		return;
+	}
+	for (f = 0; f < 5; f++) {
+		spi_message[f][0] = SPI_SOM_TFPGA; //som
+		spi_message[f][1] = cw[f]; //cw
+		for (i = 2; i < 10; i++)
+			spi_message[f][i] = i - 1;
+		spi_message[f][10] = SPI_EOM_TFPGA; //not used
+	}
+	printf("Recording a hit pattern on every edge of line %d of %s%s\n", cfg.line, cfg.chip,
+		dt <= 0 ? ", q to stop" : "");
+
+	start = monotonic_ns();
+	next_status = start + 10000000000ULL;
+	while (dt <= 0 || monotonic_ns() - start < dt * 1e9) {
+		if (dt <= 0 && kbhit() && getchar() == 'q')
+			break;
+		if (monotonic_ns() >= next_status) {
+			hp_edge_report(&edge, stdout);
+			next_status += 10000000000ULL;
+		}
+		r = hp_edge_wait(&edge, 100, &edge_ns);
+		if (r < 0) {
+			printf("Reading edges from %s failed, stopping\n", cfg.chip);
+			break;
+		}
+		if (r == 0)
+			continue;
+		// the nsTimer/counter frame and the four hit pattern frames at once
+		r = bp_dma_checked("edge", spi_message, data, 5) == 0;
+		hp_edge_done(&edge, edge_ns, r);
+		if (!r)
+			continue;
+		hwtriggers = (((unsigned long) data[0][8] << 16) | data[0][9]) - 1;
+		if (step == 0)
+			first_hwtriggers = hwtriggers;
+		last_hwtriggers = hwtriggers;
+		hp_edge_timespec(&edge, edge_ns, &ts);
+		hp_format_record(writer.stream, spec.format, data + 1, step++, &ts);
+		if (hp_writer_end_record(&writer) != 0) {
+			printf("Write to %s failed, stopping\n", writer.part);
+			break;
+		}
+	}
+
+	hp_writer_close(&writer);
+	hp_writer_report(&writer, stdout);
+	hp_edge_report(&edge, stdout);   // before the close, which ends the gpio-sim edges
+	hp_edge_close(&edge);
+	printf("%d hit patterns in %0.1f s, %lu hardware triggers counted by the TFPGA meanwhile\n\n", step,
+		(monotonic_ns() - start) * 1e-9, last_hwtriggers - first_hwtriggers);
+}
+
+/* The emulated backplane has no SPI clock */
+void set_spi_divider(int divider) {
+#ifndef BP_EMULATOR_ONLY
+	if (!bp_emulator_enabled)
+		bcm2835_spi_setClockDivider(divider);
+#endif
+}
+
+/*
+	record_adaptive()
+
+	Record hit patterns for the given time in any of the three formats,
+	through the block writer like '$', at a rate that follows the HW
+	trigger rate within the bounds of hp_rate.yml. The trigger counter is
+	read every poll_ms in between, and every rate change is noted in the
+	recording (hp_format_rate()).
+*/
+void record_adaptive(void) {
+	static struct hp_rate rate;
+	struct hp_format_spec spec;
+	unsigned short spi_message[11], counters[11], frames[4][11];
+	unsigned long long start, now, next_poll, next_snapshot, t0, wake, bytes0;
+	struct timespec ts;
+	const char *base = "hitpattern", *ext = ".bin";
+	char format_key[8];
+	float dt;
+	int step = 0, f, ok;
+
+	printf("Enter the format of the recording ($ binary, * dwords, 9 picture): ");
+	scanf("%7s", format_key);
+	printf("Enter the duration of the hit pattern recording [s]: ");
+	scanf("%f", &dt);
+	spec.format = HP_FILE_BINARY;
+	if (format_key[0] == '*') {
+		spec.format = HP_FILE_DWORDS;
+		base = "hitpattern_dwords";
+		ext = ".txt";
+	} else if (format_key[0] == '9') {
+		spec.format = HP_FILE_PICTURE;
+		ext = ".txt";
+	}
+	spec.nsamples = 0;
+	spec.freq = 0;   // the header rate of a recording at a varying rate
+
+	hp_rate_load(&rate, "hp_rate.yml");
+	hp_rate_start(&rate, 0);
+	hp_writer_config_load(&writer_cfg, "hp_writer.yml");
+	if (hp_writer_open(&writer, &writer_cfg, base, ext, hp_format_writer_header, &spec) != 0) {
+		printf("Could not open %s/%s%s\n\n", writer_cfg.dir, base, ext);
+		return;
+	}
+	printf("Recording for %0.1f s at %0.2f-%0.2f Hz, %0.1f hit patterns per trigger\n", dt, rate.min_hz,
+		rate.max_hz, rate.samples_per_trigger);
+	hp_format_rate(writer.stream, spec.format, rate.hz, rate.trigger_hz);
+
+	spi_message[0] = SPI_SOM_TFPGA; //som
+	spi_message[2] = 0x0111;
+	spi_message[3] = 0x1222;
+	spi_message[4] = 0x2333;
+	spi_message[5] = 0x3444;
+	spi_message[6] = 0x4555;
+	spi_message[7] = 0x5666;
+	spi_message[8] = 0x6777;
+	spi_message[9] = 0x7888;
+	spi_message[10] = SPI_EOM_TFPGA; //not used
+	start = next_poll = next_snapshot = monotonic_ns();
+	bytes0 = writer.bytes;
+	while ((now = monotonic_ns()) - start < dt * 1e9) {
+		if (now >= next_poll) {
+			spi_message[1] = SPI_READ_nsTimer_TFPGA;
+			if (transfer_checked("adaptive", spi_message, counters) == 0)
+				hp_rate_counter(&rate, ((unsigned long long) counters[2] << 48) |
+					((unsigned long long) counters[3] << 32) | ((unsigned long long) counters[4] << 16) |
+					counters[5], (((unsigned long) counters[8] << 16) | counters[9]) - 1);
+			if (hp_rate_update(&rate, now)) {
+				hp_format_rate(writer.stream, spec.format, rate.hz, rate.trigger_hz);
+				printf("%6.1f s  trigger rate %8.1f Hz, sampling at %7.2f Hz\n", (now - start) * 1e-9,
+					rate.trigger_hz, rate.hz);
+				if (next_snapshot > now + 1e9 / rate.hz)
+					next_snapshot = now + 1e9 / rate.hz;   // a burst does not wait out the slow period
+			}
+			next_poll = now + rate.poll_ms * 1000000ULL;
+		}
+
+		if (now >= next_snapshot) {
+			t0 = now;
+			for (f = 0, ok = 1; f < 4 && ok; f++) {
+				spi_message[1] = f == 0 ? SPI_READ_HIT_PATTERN : f == 1 ? SPI_READ_HIT_PATTERN1 :
+					f == 2 ? SPI_READ_HIT_PATTERN2 : SPI_READ_HIT_PATTERN3;
+				ok = transfer_checked("adaptive", spi_message, frames[f]) == 0;
+			}
+			if (ok) {
+				timespec_get(&ts, TIME_UTC);
+				hp_format_record(writer.stream, spec.format, frames, step, &ts);
+				if (hp_writer_end_record(&writer) != 0) {
+					printf("Write to %s failed, stopping\n", writer.part);
+					break;
+				}
+				if (step++ == 0)
+					rate.record_bytes = writer.bytes - bytes0;
+				hp_rate_record_time(&rate, (monotonic_ns() - t0) * 1e-9);
+			}
+			next_snapshot += 1e9 / rate.hz;
+			if (next_snapshot < now)
+				next_snapshot = now;   // fell behind, do not burst to catch up
+		}
+
+		wake = next_poll < next_snapshot ? next_poll : next_snapshot;
+		now = monotonic_ns();
+		if (wake > now)
+			us_sleep((wake - now) / 1000);
+	}
+
+	hp_writer_close(&writer);
+	hp_writer_report(&writer, stdout);
+	printf("%d hit patterns in %0.1f s, %lu rate changes between %0.2f and %0.2f Hz\n\n", step,
+		(monotonic_ns() - start) * 1e-9, rate.changes, rate.lowest_hz, rate.highest_hz);
+}
+
+/*
+	run_procedures()
+
+	Run the procedures named in procs (s, n, r, i) together on the
+	sequencer, with the trigger counters read every second alongside,
+	until they have all finished. Parameters are asked for first.
+*/
+void run_procedures(const char *procs) {
+	static struct bp_seq seq;
+	static struct bp_seq_task tasks[5];
+	static struct bp_proc_sync sync;
+	static struct bp_proc_power power;
+	static struct bp_proc_reset reset;
+	static struct bp_proc_hskp hskp;
+	static struct bp_proc_counters counters;
+
+	bp_seq_init(&seq);
+	if (strchr(procs, 's') != NULL) {
+		memset(&sync, 0, sizeof(sync));
+		sync.sync_ns = 0x10000; // A short time after 0
+		bp_seq_add(&seq, &tasks[0], "sync", bp_proc_sync, &sync, 0);
+	}
+	if (strchr(procs, 'n') != NULL) {
+		memset(&power, 0, sizeof(power));
+		printf("Enter FEEs to Power ON/OFF (32 bits 0=off 1=on) 0-0xFFFFFFFF: ");
+		scanf("%lx", &power.fees);
+		power.settle_a = 0.05;
+		power.settle_sweeps = 3;
+		power.sweep_ms = 100;
+		power.timeout_ms = 10000;
+		power.min_a = 0.1;
+		bp_seq_add(&seq, &tasks[1], "power", bp_proc_power, &power, 0);
+	}
+	if (strchr(procs, 'r') != NULL) {
+		memset(&reset, 0, sizeof(reset));
+		printf("Enter which FEE to reset 0-31: ");
+		scanf("%d", &reset.fee);
+		printf("Enter the dwell after the reset [ms]: ");
+		scanf("%d", &reset.dwell_ms);
+		bp_seq_add(&seq, &tasks[2], "reset", bp_proc_reset, &reset, 0);
+	}
+	if (strchr(procs, 'i') != NULL) {
+		memset(&hskp, 0, sizeof(hskp));
+		hskp.settle_us = HSKP_SETTLE_US;
+		bp_seq_add(&seq, &tasks[3], "hskp", bp_proc_hskp, &hskp, 0);
+	}
+	if (seq.ntasks == 0) {
+		printf("No procedures given\n");
+		return;
+	}
+	memset(&counters, 0, sizeof(counters));
+	bp_seq_add(&seq, &tasks[4], "counters", bp_proc_counters, &counters, 1000);
+
+	bp_seq_run(&seq, NULL);
+	bp_seq_report(&seq, stdout);
 }
 
 void display_voltages (void) {
-    unsigned short i, voltsarray[32];
+	static const unsigned short cw[4] = {CW_RD_FEE0_V, CW_RD_FEE8_V, CW_RD_FEE16_V, CW_RD_FEE24_V};
+    unsigned short i, k, voltsarray[32];
 	unsigned short data[11];
     float volts[32];
 	unsigned short spi_message[11];
 	
-	tdelay(10);
 	spi_message[0] = SPI_SOM_HKFPGA; // som
-	spi_message[1] = CW_RD_FEE0_V; //cw
 	spi_message[2] = 0x0111;
 	spi_message[3] = 0x1222;
 	spi_message[4] = 0x2333;
@@ -2692,108 +3733,37 @@ void display_voltages (void) {
 	spi_message[8] = 0x0000;
 	spi_message[9] = 0x0088;	
 	spi_message[10] = SPI_EOM_HKFPGA; // not used
-	transfer_message(spi_message,data);
-	
-    voltsarray[5]  = data[2];
-	voltsarray[12] = data[3];
-	voltsarray[6]  = data[4];
-	voltsarray[17] = data[5];
-	voltsarray[7]  = data[6];
-	voltsarray[13] = data[7];
-	voltsarray[11] = data[8];
-	voltsarray[18] = data[9];
-		
-	tdelay(10);
-	spi_message[1] = CW_RD_FEE8_V; //cw
-	transfer_message(spi_message,data);
-	
-    voltsarray[4]  = data[2];
-	voltsarray[10] = data[3];
-	voltsarray[1]  = data[4];
-	voltsarray[0]  = data[5];
-	voltsarray[3]  = data[6];
-	voltsarray[2]  = data[7];
-	voltsarray[16] = data[8];
-	voltsarray[22] = data[9];
-	
-	tdelay(10);
-	spi_message[1] = CW_RD_FEE16_V; //cw
-	transfer_message(spi_message,data);
-
-    voltsarray[28] = data[2];
-	voltsarray[24] = data[3];
-	voltsarray[30] = data[4];
-	voltsarray[23] = data[5];
-	voltsarray[31] = data[6];
-	voltsarray[29] = data[7];
-	voltsarray[26] = data[8];
-	voltsarray[25] = data[9];
-	
-	tdelay(10);
-	spi_message[1] = CW_RD_FEE24_V; //cw
-	transfer_message(spi_message,data);
-	
-    voltsarray[20] = data[2];
-	voltsarray[8]  = data[3];
-	voltsarray[27] = data[4];
-	voltsarray[15] = data[5];
-	voltsarray[9]  = data[6];
-	voltsarray[19] = data[7];
-	voltsarray[21] = data[8];
-	voltsarray[14] = data[9];
+	for (i = 0; i < 4; i++) {
+		tdelay(10);
+		spi_message[1] = cw[i]; //cw
+		transfer_message(spi_message,data);
+		for (k = 0; k < 8; k++)
+			voltsarray[fee_hskp_slot[i][k]] = data[k+2];
+	}
 	
     for (i=0; i< 32; i++){
-		volts[i] = voltsarray[i] * 0.006158;
+		volts[i] = voltsarray[i] * HSKP_VOLTS_PER_LSB;
     }
 
 	printf("\nFEE Volrages Should be ~12V\n\n");
 
-	printf("%5.2f  ", volts[5]);
-	printf("%5.2f  ", volts[6]);
-	printf("%5.2f  ", volts[7]);
-	printf("%5.2f  ", volts[8]);
-	printf("%5.2f  ", volts[9]);
-	printf("\n");
-	
-	printf("%5.2f  ", volts[11]);
-	printf("%5.2f  ", volts[12]);
-	printf("%5.2f  ", volts[13]);
-	printf("%5.2f  ", volts[14]);
-	printf("%5.2f  ", volts[15]);
-	printf("\n");
-	
-	printf("%5.2f  ", volts[17]);
-	printf("%5.2f  ", volts[18]);
-	printf("%5.2f  ", volts[19]);
-	printf("%5.2f  ", volts[20]);
-	printf("%5.2f  ", volts[21]);
-	printf("\n");
-	
-	printf("%5.2f  ", volts[23]);
-	printf("%5.2f  ", volts[24]);
-	printf("%5.2f  ", volts[25]);
-	printf("%5.2f  ", volts[26]);
-	printf("%5.2f  ", volts[27]);
-	printf("\n");
-	
-	printf("%5.2f  ", volts[28]);
-	printf("%5.2f  ", volts[29]);
-	printf("%5.2f  ", volts[30]);
-	printf("%5.2f  ", volts[31]);
-	printf("%5.2f  ", volts[22]); // slot j32 and j22 are connected by a jumper
-	printf("\n");
+	// slot j32 and j22 are connected by a jumper, j22 is printed in its place
+	for (i = 0; i < 25; i++) {
+		printf("%5.2f  ", volts[fee_display_order[i]]);
+		if (i % 5 == 4)
+			printf("\n");
+	}
 	
     return;
 }
 
 void display_currents (void) {
-    unsigned short i, spi_message[11], currentarray[32];
+	static const unsigned short cw[4] = {CW_RD_FEE0_I, CW_RD_FEE8_I, CW_RD_FEE16_I, CW_RD_FEE24_I};
+    unsigned short i, k, spi_message[11], currentarray[32];
     float amps[32];
 	unsigned short data[11];
     
-	tdelay(10);
 	spi_message[0] = SPI_SOM_HKFPGA; // som
-	spi_message[1] = CW_RD_FEE0_I; //cw
 	spi_message[2] = 0x0011;
 	spi_message[3] = 0x1222;
 	spi_message[4] = 0x2333;
@@ -2803,96 +3773,26 @@ void display_currents (void) {
 	spi_message[8] = 0x0000;
 	spi_message[9] = 0x0088;	
 	spi_message[10] = SPI_EOM_HKFPGA; // not used
-	transfer_message(spi_message,data);
-
-    currentarray[5]  = data[2];
-	currentarray[12] = data[3];
-	currentarray[6]  = data[4];
-	currentarray[17] = data[5];
-	currentarray[7]  = data[6];
-	currentarray[13] = data[7];
-	currentarray[11] = data[8];
-	currentarray[18] = data[9];
-	
-	tdelay(10);
-	spi_message[1] = CW_RD_FEE8_I; //cw
-	transfer_message(spi_message,data);
-
-    currentarray[4]  = data[2];
-	currentarray[10] = data[3];
-	currentarray[1]  = data[4];
-	currentarray[0]  = data[5];
-	currentarray[3]  = data[6];
-	currentarray[2]  = data[7];
-	currentarray[16] = data[8];
-	currentarray[22] = data[9];
-	
-	tdelay(10);
-	spi_message[1] = CW_RD_FEE16_I; //cw
-	transfer_message(spi_message,data);
-
-    currentarray[28] = data[2];
-	currentarray[24] = data[3];
-	currentarray[30] = data[4];
-	currentarray[23] = data[5];
-	currentarray[31] = data[6];
-	currentarray[29] = data[7];
-	currentarray[26] = data[8];
-	currentarray[25] = data[9];
-	
-	tdelay(10);
-	spi_message[1] = CW_RD_FEE24_I; //cw
-	transfer_message(spi_message,data);
-	
-    currentarray[20] = data[2];
-	currentarray[8]  = data[3];
-	currentarray[27] = data[4];
-	currentarray[15] = data[5];
-	currentarray[9]  = data[6];
-	currentarray[19] = data[7];
-	currentarray[21] = data[8];
-	currentarray[14] = data[9];	
+	for (i = 0; i < 4; i++) {
+		tdelay(10);
+		spi_message[1] = cw[i]; //cw
+		transfer_message(spi_message,data);
+		for (k = 0; k < 8; k++)
+			currentarray[fee_hskp_slot[i][k]] = data[k+2];
+	}
 	
     for (i=0; i< 32; i++){
-		amps[i] = currentarray[i] * 0.00117;
+		amps[i] = currentarray[i] * HSKP_AMPS_PER_LSB;
     }
 
 	printf("\nFEE 12 Volt Current (A)\n\n");
 
-	printf("%5.2f  ", amps[5]);
-	printf("%5.2f  ", amps[6]);
-	printf("%5.2f  ", amps[7]);
-	printf("%5.2f  ", amps[8]);
-	printf("%5.2f  ", amps[9]);
-	printf("\n");
-	
-	printf("%5.2f  ", amps[11]);
-	printf("%5.2f  ", amps[12]);
-	printf("%5.2f  ", amps[13]);
-	printf("%5.2f  ", amps[14]);
-	printf("%5.2f  ", amps[15]);
-	printf("\n");
-	
-	printf("%5.2f  ", amps[17]);
-	printf("%5.2f  ", amps[18]);
-	printf("%5.2f  ", amps[19]);
-	printf("%5.2f  ", amps[20]);
-	printf("%5.2f  ", amps[21]);
-	printf("\n");
-	
-	printf("%5.2f  ", amps[23]);
-	printf("%5.2f  ", amps[24]);
-	printf("%5.2f  ", amps[25]);
-	printf("%5.2f  ", amps[26]);
-	printf("%5.2f  ", amps[27]);
-	printf("\n");
-	
-	printf("%5.2f  ", amps[28]);
-	printf("%5.2f  ", amps[29]);
-	printf("%5.2f  ", amps[30]);
-	printf("%5.2f  ", amps[31]);
-	printf("%5.2f  ", amps[22]); // slot j32 and j22 are connected by jumper
-	printf("\n");
+	// slot j32 and j22 are connected by jumper, j22 is printed in its place
+	for (i = 0; i < 25; i++) {
+		printf("%5.2f  ", amps[fee_display_order[i]]);
+		if (i % 5 == 4)
+			printf("\n");
+	}
 	
     return;
 }
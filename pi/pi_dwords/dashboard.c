@@ -0,0 +1,321 @@
+/*
+ ============================================================================
+ Name        : dashboard.c
+ Description : Full-screen live dashboard (menu 'D').
+               Starts the bp_live acquisition threads and redraws at a fixed
+               frame rate from their latest-state buffers only: the camera
+               trigger pixel occupancy in module layout, TACK and HW trigger
+               rates, and FEE currents/voltages colored against the alarm
+               limits in dashboard.yml. Every cell and line remembers what
+               was last drawn and is only rewritten when it changes, and
+               curses sends just those cells to the terminal. Between frames
+               the thread sleeps in getch().
+ ============================================================================
+ */
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <curses.h>
+
+#include "spicomms.h"
+#include "bp_config.h"
+#include "bp_live.h"
+#include "fpm_config.h"
+#include "hp_camera.h"
+#include "hskp_burst.h"
+#include "trigger_mask.h"
+#include "dashboard.h"
+
+#define MAP_TOP    4
+#define MAP_LEFT   2
+#define HSKP_LEFT  50
+#define NLINES     40
+#define LINE_LEN   96
+
+enum { C_NONE, C_OK, C_WARN, C_ALARM, C_LOW, C_DIM };
+
+/* Occupancy levels of the hit map, level 0 is a pixel that (next to) never fired */
+static const char *level_glyph[] = {" .", "--", "==", "++", "##", "@@", "xx"};
+static const double level_edge[] = {0.001, 0.01, 0.05, 0.20, 0.50};
+#define LEVEL_MASKED 6
+
+struct dashboard {
+	double frame_hz;
+	double hitmap_tau_s;
+	double current_warn_a, current_alarm_a;
+	double voltage_low_alarm_v, voltage_low_warn_v, voltage_high_warn_v, voltage_high_alarm_v;
+	struct bp_live live;
+	struct fpm_config fpm;
+	int have_fpm;
+	struct hp_geometry geo;
+
+	double occ[HP_NPIXELS];
+	struct bp_live_trigger prev;
+	unsigned long long prev_frame_ns;
+	unsigned long long prev_spi_frames;
+	unsigned long long prev_reads;
+	unsigned long long prev_triggers;
+
+	signed char drawn[HP_NPIXELS];   // level on screen, -1 for none yet
+	char line[NLINES][LINE_LEN];
+	int line_attr[NLINES];
+};
+
+static int color_attr(int c) {
+	if (c == C_NONE)
+		return A_NORMAL;
+	if (has_colors())
+		return COLOR_PAIR(c) | (c == C_ALARM ? A_BOLD : 0);
+	return c == C_ALARM ? A_REVERSE : c == C_WARN ? A_BOLD : c == C_DIM ? A_DIM : A_NORMAL;
+}
+
+/* Rewrite screen line n (at row, col) only if its text or color changed */
+static void put_line(struct dashboard *db, int n, int row, int col, int color, const char *fmt, ...)
+	__attribute__((format(printf, 6, 7)));
+
+static void put_line(struct dashboard *db, int n, int row, int col, int color, const char *fmt, ...) {
+	char buff[LINE_LEN];
+	va_list ap;
+	int len;
+
+	va_start(ap, fmt);
+	vsnprintf(buff, sizeof(buff), fmt, ap);
+	va_end(ap);
+	if (strcmp(buff, db->line[n]) == 0 && db->line_attr[n] == color)
+		return;
+	len = strlen(db->line[n]);
+	attrset(color_attr(color));
+	mvaddstr(row, col, buff);
+	attrset(A_NORMAL);
+	// blank what is left of a longer previous text
+	for (; len > (int) strlen(buff); len--)
+		mvaddch(row, col + len - 1, ' ');
+	strcpy(db->line[n], buff);
+	db->line_attr[n] = color;
+}
+
+static int pixel_masked(const struct dashboard *db, int w, int b) {
+	int word;
+
+	if (!trigger_mask_valid || !db->have_fpm)
+		return 0;
+	word = db->fpm.mask_word[w];
+	return word >= 0 && word < TRIGGER_MASK_NWORDS && (trigger_mask[word] >> b) & 1;
+}
+
+/* Fold the trigger reads since the last frame into the hit map average */
+static void update_occupancy(struct dashboard *db, const struct bp_live_trigger *st, double dt) {
+	unsigned long long dtrig = st->ntriggers - db->prev.ntriggers;
+	double alpha;
+	int p;
+
+	if (st->ntriggers < db->prev.ntriggers) {
+		memset(db->occ, 0, sizeof(db->occ));
+		return;
+	}
+	if (dtrig == 0)
+		return;
+	alpha = 1 - exp(-dt / db->hitmap_tau_s);
+	for (p = 0; p < HP_NPIXELS; p++)
+		db->occ[p] += alpha * ((double) (st->hits[p] - db->prev.hits[p]) / dtrig - db->occ[p]);
+}
+
+static void draw_hitmap(struct dashboard *db) {
+	int w, b, x, y, p, level, row, col;
+	static const int level_color[] = {C_DIM, C_LOW, C_OK, C_WARN, C_ALARM, C_ALARM, C_DIM};
+
+	for (w = 0; w < HP_NWORDS; w++) {
+		if (db->geo.x0[w] < 0)
+			continue;
+		for (b = 0; b < 16; b++) {
+			p = 16 * w + b;
+			if (pixel_masked(db, w, b)) {
+				level = LEVEL_MASKED;
+			} else {
+				for (level = 0; level < 5 && db->occ[p] > level_edge[level]; level++)
+					;
+			}
+			if (level == db->drawn[p])
+				continue;
+			x = db->geo.x0[w] + b / 4;
+			y = db->geo.y0[w] + b % 4;
+			// camera row 0 is the bottom, a blank line between module rows
+			row = MAP_TOP + (HP_CAM_SIZE - 1 - y) + (HP_CAM_SIZE - 1 - y) / 4;
+			col = MAP_LEFT + 2 * x + x / 4;
+			attrset(color_attr(level_color[level]));
+			mvaddstr(row, col, level_glyph[level]);
+			attrset(A_NORMAL);
+			db->drawn[p] = level;
+		}
+	}
+}
+
+static int hskp_color(const struct dashboard *db, double amps, double volts) {
+	if (volts < 1)
+		return C_DIM;   // FEE powered off
+	if (amps > db->current_alarm_a || volts < db->voltage_low_alarm_v || volts > db->voltage_high_alarm_v)
+		return C_ALARM;
+	if (amps > db->current_warn_a || volts < db->voltage_low_warn_v || volts > db->voltage_high_warn_v)
+		return C_WARN;
+	return C_OK;
+}
+
+static void draw_hskp(struct dashboard *db) {
+	struct bp_live_hskp hk;
+	double amps, volts;
+	int i, slot, n = 10;
+
+	bp_live_hskp(&db->live, &hk);
+	if (hk.nsweeps == 0) {
+		put_line(db, n, MAP_TOP - 1, HSKP_LEFT, C_DIM, "FEE housekeeping: waiting");
+		return;
+	}
+	put_line(db, n, MAP_TOP - 1, HSKP_LEFT, C_NONE, "slot module  I [A]   V [V]  %3.0fs",
+		(monotonic_ns() - hk.t_ns) * 1e-9);
+	for (i = 0; i < 25; i++) {
+		slot = fee_display_order[i];
+		amps = hk.raw[slot] * HSKP_AMPS_PER_LSB;
+		volts = hk.raw[HSKP_NSLOTS + slot] * HSKP_VOLTS_PER_LSB;
+		if (db->have_fpm && db->fpm.module_id[slot] >= 0)
+			put_line(db, n + 1 + i, MAP_TOP + i, HSKP_LEFT, hskp_color(db, amps, volts),
+				" j%-2d  %4d   %6.3f  %6.3f", slot, db->fpm.module_id[slot], amps, volts);
+		else
+			put_line(db, n + 1 + i, MAP_TOP + i, HSKP_LEFT, hskp_color(db, amps, volts),
+				" j%-2d   ---   %6.3f  %6.3f", slot, amps, volts);
+	}
+}
+
+static void draw_frame(struct dashboard *db) {
+	struct bp_live_trigger st;
+	unsigned long long now = monotonic_ns();
+	double dt = db->prev_frame_ns ? (now - db->prev_frame_ns) * 1e-9 : 0;
+	char buff[32];
+	time_t t = time(NULL);
+
+	bp_live_trigger(&db->live, &st);
+	if (dt > 0)
+		update_occupancy(db, &st, dt);
+
+	strftime(buff, sizeof(buff), "%Y-%m-%d %H:%M:%S", gmtime(&t));
+	put_line(db, 0, 0, 0, C_NONE, "Backplane live  %s UTC   q quit  r reset map", buff);
+	if (st.nreads == 0) {
+		put_line(db, 1, 1, 0, C_DIM, "TFPGA: waiting");
+	} else {
+		put_line(db, 1, 1, 0, C_NONE, "TACK %9.1f Hz (%lu)   HW trigger %9.1f Hz (%lu)   nsTimer %.3f s",
+			st.tack_rate_hz, st.tacks, st.hw_rate_hz, st.hwtriggers, st.nstime * 1e-9);
+	}
+	if (dt > 0)
+		put_line(db, 2, 2, 0, C_DIM, "hit pattern reads %5.1f/s, new triggers %5.1f/s, SPI frames %5.0f/s,"
+			" %llu failed", (st.nreads - db->prev_reads) / dt, (st.ntriggers - db->prev_triggers) / dt,
+			(st.spi_frames - db->prev_spi_frames) / dt, st.spi_failed);
+	put_line(db, 3, MAP_TOP - 1, MAP_LEFT, C_NONE, "Trigger pixel occupancy, %.0f s average", db->hitmap_tau_s);
+	put_line(db, 4, MAP_TOP + 25, MAP_LEFT, C_DIM,
+		"' .' <0.1%%  -- <1%%  == <5%%  ++ <20%%  ## <50%%  @@ >50%%  xx masked");
+
+	draw_hitmap(db);
+	draw_hskp(db);
+
+	db->prev = st;
+	db->prev_frame_ns = now;
+	db->prev_reads = st.nreads;
+	db->prev_triggers = st.ntriggers;
+	db->prev_spi_frames = st.spi_frames;
+	move(MAP_TOP + 26, 0);
+	refresh();
+}
+
+static void load_config(struct dashboard *db, const char *config_file) {
+	struct bp_config cfg;
+
+	memset(&cfg, 0, sizeof(cfg));
+	if (access(config_file, R_OK) == 0)
+		bp_config_load(&cfg, config_file);
+	db->frame_hz = bp_config_double(&cfg, "frame_hz", 4);
+	db->hitmap_tau_s = bp_config_double(&cfg, "hitmap_tau_s", 5);
+	db->live.trigger_period_ms = bp_config_double(&cfg, "trigger_period_ms", 20);
+	db->live.hskp_period_ms = bp_config_double(&cfg, "hskp_period_ms", 1000);
+	db->live.hskp_settle_ms = bp_config_double(&cfg, "hskp_settle_ms", HSKP_SETTLE_US / 1000);
+	db->live.rate_window_s = bp_config_double(&cfg, "rate_window_s", 1);
+	db->current_warn_a = bp_config_double(&cfg, "current_warn_a", 2.5);
+	db->current_alarm_a = bp_config_double(&cfg, "current_alarm_a", 3.0);
+	db->voltage_low_alarm_v = bp_config_double(&cfg, "voltage_low_alarm_v", 11.0);
+	db->voltage_low_warn_v = bp_config_double(&cfg, "voltage_low_warn_v", 11.5);
+	db->voltage_high_warn_v = bp_config_double(&cfg, "voltage_high_warn_v", 12.5);
+	db->voltage_high_alarm_v = bp_config_double(&cfg, "voltage_high_alarm_v", 13.0);
+	if (db->frame_hz <= 0 || db->frame_hz > 50)
+		db->frame_hz = 4;
+	if (db->hitmap_tau_s <= 0)
+		db->hitmap_tau_s = 5;
+
+	db->have_fpm = fpm_config_load(&db->fpm, bp_config_string(&cfg, "fpm_config", "FPM_config.csv")) == 0;
+	if (db->have_fpm)
+		hp_geometry_from_fpm(&db->geo, &db->fpm);
+	else
+		hp_geometry_default(&db->geo);
+}
+
+/*
+	dashboard_run()
+
+	Blocks until 'q' (or 'x') is pressed. The menu must not touch the bus
+	meanwhile, the acquisition threads own it for the whole session.
+*/
+int dashboard_run(const char *config_file) {
+	static struct dashboard db;
+	unsigned long long now, next, period;
+	int ch, wait_ms;
+
+	memset(&db, 0, sizeof(db));
+	load_config(&db, config_file);
+	memset(db.drawn, -1, sizeof(db.drawn));
+	if (bp_live_start(&db.live) != 0) {
+		printf("Could not start the acquisition threads\n");
+		return -1;
+	}
+
+	initscr();
+	cbreak();
+	noecho();
+	curs_set(0);
+	keypad(stdscr, TRUE);
+	if (has_colors()) {
+		start_color();
+		use_default_colors();
+		init_pair(C_OK, COLOR_GREEN, -1);
+		init_pair(C_WARN, COLOR_YELLOW, -1);
+		init_pair(C_ALARM, COLOR_RED, -1);
+		init_pair(C_LOW, COLOR_CYAN, -1);
+		init_pair(C_DIM, COLOR_BLUE, -1);
+	}
+
+	period = (unsigned long long) (1e9 / db.frame_hz);
+	next = monotonic_ns();
+	for (;;) {
+		now = monotonic_ns();
+		if (now >= next) {
+			draw_frame(&db);
+			next += period;
+			if (next < now)
+				next = now + period;
+		}
+		wait_ms = (next - monotonic_ns()) / 1000000;
+		timeout(wait_ms > 0 ? wait_ms : 0);
+		ch = getch();
+		if (ch == 'q' || ch == 'x' || ch == 'Q')
+			break;
+		if (ch == 'r') {
+			memset(db.occ, 0, sizeof(db.occ));
+		} else if (ch == KEY_RESIZE || ch == 12) {   // ^L
+			clear();
+			memset(db.drawn, -1, sizeof(db.drawn));
+			memset(db.line, 0, sizeof(db.line));
+		}
+	}
+
+	endwin();
+	bp_live_stop(&db.live);
+	return 0;
+}
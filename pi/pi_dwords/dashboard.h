@@ -0,0 +1,12 @@
+/*
+ ============================================================================
+ Name        : dashboard.h
+ Description : Full-screen live dashboard of hit map, rates and housekeeping
+ ============================================================================
+ */
+#ifndef DASHBOARD_H
+#define DASHBOARD_H
+
+int dashboard_run(const char *config_file);
+
+#endif
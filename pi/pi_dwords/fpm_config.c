@@ -0,0 +1,87 @@
+/*
+ ============================================================================
+ Name        : fpm_config.c
+ Description : Reader for data_taking/FPM_config.csv. Columns are located by
+               their header name so the file can gain columns freely.
+ ============================================================================
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fpm_config.h"
+
+enum {COL_SECTOR, COL_POSITION, COL_SLOT, COL_MASK, COL_MODULE, NCOLS};
+static const char *fpm_columns[NCOLS] = {
+	"fpm_sector", "fpm_position", "slow_control_slot", "trigger_mask_position", "module_id"
+};
+
+int fpm_config_load(struct fpm_config *fpm, const char *filename) {
+	char line[256], *tok, *save;
+	int col[NCOLS], val[NCOLS];
+	int i, c, n, slot;
+	FILE *fptr;
+
+	fptr = fopen(filename, "r");
+	if (fptr == NULL) {
+		perror(filename);
+		return -1;
+	}
+	memset(fpm, 0, sizeof(*fpm));
+	for (i = 0; i < FPM_NSLOTS; i++)
+		fpm->module_id[i] = fpm->mask_word[i] = fpm->fpm_position[i] = fpm->fpm_sector[i] = -1;
+
+	for (c = 0; c < NCOLS; c++)
+		col[c] = -1;
+	if (fgets(line, sizeof(line), fptr) == NULL) {
+		fclose(fptr);
+		return -1;
+	}
+	line[strcspn(line, "\r\n")] = '\0';
+	for (n = 0, tok = strtok_r(line, ",", &save); tok; tok = strtok_r(NULL, ",", &save), n++)
+		for (c = 0; c < NCOLS; c++)
+			if (strcmp(tok, fpm_columns[c]) == 0)
+				col[c] = n;
+	for (c = 0; c < NCOLS; c++) {
+		if (col[c] < 0) {
+			fprintf(stderr, "%s: missing column %s\n", filename, fpm_columns[c]);
+			fclose(fptr);
+			return -1;
+		}
+	}
+
+	while (fgets(line, sizeof(line), fptr) != NULL) {
+		for (c = 0; c < NCOLS; c++)
+			val[c] = -1;
+		for (n = 0, tok = strtok_r(line, ",\r\n", &save); tok; tok = strtok_r(NULL, ",\r\n", &save), n++)
+			for (c = 0; c < NCOLS; c++)
+				if (col[c] == n)
+					val[c] = atoi(tok);
+		slot = val[COL_SLOT];
+		if (slot < 0 || slot >= FPM_NSLOTS || val[COL_MODULE] < 0)
+			continue;
+		fpm->module_id[slot] = val[COL_MODULE];
+		fpm->mask_word[slot] = val[COL_MASK] - 1;
+		fpm->fpm_position[slot] = val[COL_POSITION];
+		fpm->fpm_sector[slot] = val[COL_SECTOR];
+		fpm->nmodules++;
+	}
+	fclose(fptr);
+	return fpm->nmodules > 0 ? 0 : -1;
+}
+
+int fpm_config_slot_of_module(const struct fpm_config *fpm, int module_id) {
+	int slot;
+	for (slot = 0; slot < FPM_NSLOTS; slot++)
+		if (fpm->module_id[slot] == module_id)
+			return slot;
+	return -1;
+}
+
+int fpm_config_slot_of_mask_word(const struct fpm_config *fpm, int mask_word) {
+	int slot;
+	for (slot = 0; slot < FPM_NSLOTS; slot++)
+		if (fpm->mask_word[slot] == mask_word)
+			return slot;
+	return -1;
+}
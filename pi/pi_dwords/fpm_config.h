@@ -0,0 +1,27 @@
+/*
+ ============================================================================
+ Name        : fpm_config.h
+ Description : Backplane slot to module / trigger mask mapping from
+               data_taking/FPM_config.csv
+ ============================================================================
+ */
+#ifndef FPM_CONFIG_H
+#define FPM_CONFIG_H
+
+#define FPM_NSLOTS 32
+
+/* Indexed by slow control slot, which is also the hit_pattern[] word.
+   Unpopulated slots have module_id, mask_word and fpm_position set to -1. */
+struct fpm_config {
+	int nmodules;
+	int module_id[FPM_NSLOTS];
+	int mask_word[FPM_NSLOTS];      // trigger_mask_position - 1, index of j[] in case 'j'
+	int fpm_position[FPM_NSLOTS];   // 0-24, left to right and bottom to top
+	int fpm_sector[FPM_NSLOTS];
+};
+
+int fpm_config_load(struct fpm_config *fpm, const char *filename);
+int fpm_config_slot_of_module(const struct fpm_config *fpm, int module_id);
+int fpm_config_slot_of_mask_word(const struct fpm_config *fpm, int mask_word);
+
+#endif
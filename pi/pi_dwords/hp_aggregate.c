@@ -0,0 +1,418 @@
+/*
+ ============================================================================
+ Name        : hp_aggregate.c
+ Description : DAQ host aggregator for several backplanes. Connects to
+               the hit pattern stream (menu 'S') of each Pi, reads them
+               concurrently (one thread per Pi into a bounded queue) and
+               merges them into one camera-wide run file ordered by
+
+                 -k host     the Pi's CLOCK_REALTIME corrected by its
+                             offset from the host clock (default)
+                 -k nstimer  the TFPGA nsTimer, for backplanes SYNCed to
+                             a common TACK/SYNC distribution
+
+               The offset is the smallest (host arrival - Pi time) seen so
+               far, the network delay floor plus the clock difference, so
+               the sources line up to within their delay jitter.
+
+               The merge is a k-way heap merge over the queue heads. A
+               record is written once every source has a record queued
+               (nothing earlier can still come), or after it has waited
+               -w ms (default 200) for a source that has gone quiet. A
+               record that arrives behind what has already been written is
+               still written, flagged late. Full queues stop that reader,
+               TCP pushes back to the Pi, and the Pi drops; drops show up
+               as sequence gaps.
+
+               hp_aggregate [-k host|nstimer] [-w reorder_ms] [-q queue]
+                            [-o run.hpr] host:port ...
+
+               Run file: char[4] "HPR1", int nsources, int key (0 host,
+               1 nstimer), char[56] name per source, then per record
+               unsigned short source, unsigned short flags (1 late),
+               unsigned long long key_ns, followed by the source's
+               hp_stream_record (seq, hwtriggers, nstime, pi_ns,
+               hit_pattern[32]); host byte order.
+
+               A status line per source goes to stderr every second, and
+               a summary with records, drops, triggers not read out, late
+               records, delay (arrival - corrected Pi time) and buffer wait
+               at the end. Ctrl-C stops the readers and drains the queues.
+ ============================================================================
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "hp_stream.h"
+
+#define MAX_SOURCES 32
+
+struct item {
+	struct hp_stream_record r;
+	unsigned long long key;
+	unsigned long long recv_ns;
+};
+
+struct source {
+	char addr[128];
+	char name[56];
+	int fd;
+	pthread_t thread;
+	struct item *queue;
+	int head, count;
+	int eof;
+	int in_heap;
+
+	long long offset_ns;           // min(arrival - pi_ns)
+	int have_offset;
+	uint32_t next_seq;
+	uint32_t last_hwtriggers;
+	int have_last;
+	unsigned long long last_key;   // keys within a source only go forward
+
+	unsigned long long received, lost, missed, late, written, backwards;
+	unsigned long long delay_ns, max_delay_ns, max_wait_ns;
+	unsigned long long window_received;
+};
+
+static struct source sources[MAX_SOURCES];
+static int nsources;
+static int key_type = HPR_KEY_HOST;
+static int queue_size = 4096;
+static unsigned long long reorder_ns = 200000000ULL;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t arrived = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t taken = PTHREAD_COND_INITIALIZER;
+static volatile sig_atomic_t stopping;
+
+// heap of source indices with a queued record, by head key
+static int heap[MAX_SOURCES];
+static int nheap;
+
+static unsigned long long realtime_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static unsigned long long head_key(int s) {
+	return sources[s].queue[sources[s].head].key;
+}
+
+static void heap_swap(int a, int b) {
+	int t = heap[a];
+	heap[a] = heap[b];
+	heap[b] = t;
+}
+
+static void heap_push(int s) {
+	int i = nheap++;
+
+	heap[i] = s;
+	sources[s].in_heap = 1;
+	while (i > 0 && head_key(heap[(i - 1) / 2]) > head_key(heap[i])) {
+		heap_swap(i, (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
+}
+
+static int heap_pop(void) {
+	int s = heap[0], i = 0, c;
+
+	heap[0] = heap[--nheap];
+	for (;;) {
+		c = 2 * i + 1;
+		if (c >= nheap)
+			break;
+		if (c + 1 < nheap && head_key(heap[c + 1]) < head_key(heap[c]))
+			c++;
+		if (head_key(heap[i]) <= head_key(heap[c]))
+			break;
+		heap_swap(i, c);
+		i = c;
+	}
+	sources[s].in_heap = 0;
+	return s;
+}
+
+static int read_all(int fd, void *buf, size_t len) {
+	size_t done = 0;
+	ssize_t n;
+
+	while (done < len) {
+		n = read(fd, (char *) buf + done, len - done);
+		if (n < 0 && errno == EINTR && !stopping)
+			continue;
+		if (n <= 0)
+			return -1;
+		done += n;
+	}
+	return 0;
+}
+
+/* Connect to host:port, retrying for a while: the Pis may start later */
+static int connect_source(struct source *src) {
+	struct addrinfo hints, *res, *ai;
+	char host[128], *port;
+	int fd = -1, tries;
+
+	memcpy(host, src->addr, sizeof(host));
+	port = strrchr(host, ':');
+	if (port == NULL) {
+		fprintf(stderr, "%s: expected host:port\n", src->addr);
+		return -1;
+	}
+	*port++ = '\0';
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(host, port, &hints, &res) != 0) {
+		fprintf(stderr, "%s: unknown host\n", src->addr);
+		return -1;
+	}
+	for (tries = 0; tries < 300 && fd < 0 && !stopping; tries++) {
+		for (ai = res; ai != NULL; ai = ai->ai_next) {
+			fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+			if (fd >= 0 && connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+				break;
+			if (fd >= 0)
+				close(fd);
+			fd = -1;
+		}
+		if (fd < 0)
+			usleep(100000);
+	}
+	freeaddrinfo(res);
+	if (fd < 0)
+		fprintf(stderr, "%s: could not connect\n", src->addr);
+	return fd;
+}
+
+static void *reader_main(void *arg) {
+	struct source *src = arg;
+	struct hp_stream_hello hello;
+	struct item it;
+	long long d;
+	uint32_t dropped;
+
+	if (read_all(src->fd, &hello, sizeof(hello)) != 0 || memcmp(hello.magic, HP_STREAM_MAGIC, 4) != 0) {
+		fprintf(stderr, "%s: not a hit pattern stream\n", src->addr);
+	} else {
+		pthread_mutex_lock(&lock);
+		memcpy(src->name, hello.name, sizeof(src->name));
+		src->name[sizeof(src->name) - 1] = '\0';
+		pthread_cond_broadcast(&arrived);
+		pthread_mutex_unlock(&lock);
+		while (read_all(src->fd, &it.r, sizeof(it.r)) == 0) {
+			it.recv_ns = realtime_ns();
+			pthread_mutex_lock(&lock);
+			d = (long long) (it.recv_ns - it.r.pi_ns);
+			if (!src->have_offset || d < src->offset_ns)
+				src->offset_ns = d;
+			src->have_offset = 1;
+			it.key = key_type == HPR_KEY_NSTIMER ? it.r.nstime : it.r.pi_ns + src->offset_ns;
+			if (src->received > 0 && it.key < src->last_key) {
+				// nsTimer reset by a SYNC, or the offset estimate improved: keep the source ordered
+				src->backwards++;
+				it.key = src->last_key;
+			}
+			src->last_key = it.key;
+			dropped = src->received > 0 ? it.r.seq - src->next_seq : 0;
+			src->lost += dropped;
+			src->next_seq = it.r.seq + 1;
+			// triggers between two records that the Pi did not drop were never read out
+			if (src->have_last && it.r.hwtriggers > src->last_hwtriggers + 1 + dropped)
+				src->missed += it.r.hwtriggers - src->last_hwtriggers - 1 - dropped;
+			src->last_hwtriggers = it.r.hwtriggers;
+			src->have_last = 1;
+			src->received++;
+			src->window_received++;
+			d = (long long) (it.recv_ns - (it.r.pi_ns + src->offset_ns));
+			src->delay_ns += d;
+			if ((unsigned long long) d > src->max_delay_ns)
+				src->max_delay_ns = d;
+
+			while (src->count == queue_size && !stopping)
+				pthread_cond_wait(&taken, &lock);   // back pressure, TCP slows the Pi down
+			if (src->count == queue_size) {
+				pthread_mutex_unlock(&lock);
+				break;
+			}
+			src->queue[(src->head + src->count) % queue_size] = it;
+			src->count++;
+			pthread_cond_signal(&arrived);
+			pthread_mutex_unlock(&lock);
+		}
+	}
+	pthread_mutex_lock(&lock);
+	src->eof = 1;
+	pthread_cond_signal(&arrived);
+	pthread_mutex_unlock(&lock);
+	return NULL;
+}
+
+static void on_signal(int sig) {
+	int i;
+
+	stopping = 1;
+	for (i = 0; i < nsources; i++)
+		if (sources[i].fd >= 0)
+			shutdown(sources[i].fd, SHUT_RDWR);
+}
+
+static void status(FILE *fptr, double dt) {
+	int i;
+
+	for (i = 0; i < nsources; i++) {
+		struct source *s = &sources[i];
+		fprintf(fptr, "%-22s %8.1f rec/s, queued %5d, lost %llu, missed %llu, late %llu, delay %.2f ms\n",
+			s->name[0] ? s->name : s->addr, s->window_received / dt, s->count, s->lost, s->missed, s->late,
+			s->received ? s->delay_ns * 1e-6 / s->received : 0.0);
+		s->window_received = 0;
+	}
+}
+
+int main(int argc, char **argv) {
+	const char *out_name = "run.hpr";
+	struct hpr_header header;
+	struct hpr_record rec;
+	struct timespec ts;
+	unsigned long long now, last_status, last_key = 0, written = 0, late = 0, t0;
+	FILE *fptr;
+	int opt, i, s, all_queued, live, have_last = 0;
+
+	while ((opt = getopt(argc, argv, "k:w:q:o:")) != -1) {
+		switch (opt) {
+		case 'k': key_type = strcmp(optarg, "nstimer") == 0 ? HPR_KEY_NSTIMER : HPR_KEY_HOST; break;
+		case 'w': reorder_ns = atof(optarg) * 1e6; break;
+		case 'q': queue_size = atoi(optarg); break;
+		case 'o': out_name = optarg; break;
+		default: optind = argc + 1;
+		}
+	}
+	nsources = argc - optind;
+	if (nsources < 1 || nsources > MAX_SOURCES || queue_size < 1) {
+		fprintf(stderr, "usage: %s [-k host|nstimer] [-w reorder_ms] [-q queue] [-o run.hpr] host:port ...\n",
+			argv[0]);
+		return 1;
+	}
+
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+	for (i = 0; i < nsources; i++) {
+		snprintf(sources[i].addr, sizeof(sources[i].addr), "%s", argv[optind + i]);
+		sources[i].queue = malloc(queue_size * sizeof(struct item));
+		sources[i].fd = connect_source(&sources[i]);
+		if (sources[i].queue == NULL || sources[i].fd < 0)
+			return 1;
+	}
+	fptr = fopen(out_name, "wb");
+	if (fptr == NULL) {
+		perror(out_name);
+		return 1;
+	}
+	for (i = 0; i < nsources; i++)
+		pthread_create(&sources[i].thread, NULL, reader_main, &sources[i]);
+
+	t0 = last_status = realtime_ns();
+	pthread_mutex_lock(&lock);
+	// names come with the hello, wait for them before the file header
+	for (i = 0; i < nsources; i++)
+		while (sources[i].name[0] == '\0' && !sources[i].eof)
+			pthread_cond_wait(&arrived, &lock);
+	memcpy(header.magic, HPR_MAGIC, 4);
+	header.nsources = nsources;
+	header.key = key_type;
+	fwrite(&header, sizeof(header), 1, fptr);
+	for (i = 0; i < nsources; i++)
+		fwrite(sources[i].name, sizeof(sources[i].name), 1, fptr);
+
+	for (;;) {
+		live = 0;
+		all_queued = 1;
+		for (i = 0; i < nsources; i++) {
+			if (sources[i].count > 0 && !sources[i].in_heap)
+				heap_push(i);
+			if (!sources[i].eof || sources[i].count > 0)
+				live++;
+			if (sources[i].count == 0 && !sources[i].eof)
+				all_queued = 0;
+		}
+		if (live == 0)
+			break;
+		now = realtime_ns();
+		if (now - last_status >= 1000000000ULL) {
+			status(stderr, (now - last_status) * 1e-9);
+			last_status = now;
+		}
+		// the head is safe to write when no source can still send something earlier,
+		// or when it has waited the reorder window for a quiet source
+		if (nheap > 0 && (all_queued || now >= sources[heap[0]].queue[sources[heap[0]].head].recv_ns + reorder_ns)) {
+			s = heap_pop();
+			struct source *src = &sources[s];
+			struct item *it = &src->queue[src->head];
+			rec.source = s;
+			rec.flags = 0;
+			rec.key_ns = it->key;
+			rec.r = it->r;
+			if (have_last && it->key < last_key) {
+				rec.flags |= HPR_LATE;
+				src->late++;
+				late++;
+			} else {
+				last_key = it->key;
+				have_last = 1;
+			}
+			if (now - it->recv_ns > src->max_wait_ns)
+				src->max_wait_ns = now - it->recv_ns;
+			src->head = (src->head + 1) % queue_size;
+			src->count--;
+			src->written++;
+			written++;
+			if (src->count > 0)
+				heap_push(s);
+			pthread_cond_broadcast(&taken);
+			pthread_mutex_unlock(&lock);
+			fwrite(&rec, sizeof(rec), 1, fptr);
+			pthread_mutex_lock(&lock);
+			continue;
+		}
+		// nothing to write yet: wait for a record or for the head's window to run out
+		ts.tv_sec = 0;
+		ts.tv_nsec = 0;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += 10000000L;
+		if (ts.tv_nsec >= 1000000000L) {
+			ts.tv_nsec -= 1000000000L;
+			ts.tv_sec++;
+		}
+		pthread_cond_timedwait(&arrived, &lock, &ts);
+	}
+	pthread_mutex_unlock(&lock);
+	for (i = 0; i < nsources; i++)
+		pthread_join(sources[i].thread, NULL);
+	fclose(fptr);
+
+	now = realtime_ns();
+	printf("%llu records from %d sources in %.1f s to %s ordered by %s, %llu late\n", written, nsources,
+		(now - t0) * 1e-9, out_name, key_type == HPR_KEY_NSTIMER ? "nsTimer" : "corrected Pi time", late);
+	printf("%-22s %9s %7s %8s %6s %10s %10s %10s %12s\n", "source", "records", "lost", "missed", "late",
+		"delay ms", "max ms", "wait ms", "offset ms");
+	for (i = 0; i < nsources; i++) {
+		struct source *s = &sources[i];
+		printf("%-22s %9llu %7llu %8llu %6llu %10.3f %10.3f %10.3f %12.3f\n", s->name[0] ? s->name : s->addr,
+			s->received, s->lost, s->missed, s->late, s->received ? s->delay_ns * 1e-6 / s->received : 0.0,
+			s->max_delay_ns * 1e-6, s->max_wait_ns * 1e-6, s->offset_ns * 1e-6);
+		if (s->backwards)
+			printf("%-22s %llu records keyed before their predecessor (nsTimer reset, or the offset estimate tightened), kept in order\n", "", s->backwards);
+	}
+	return 0;
+}
@@ -0,0 +1,70 @@
+/*
+ ============================================================================
+ Name        : hp_camera.c
+ Description : Trigger pixel bitmaps in camera geometry.
+               Places the 16 trigger pixels of each hit pattern word on the
+               20x20 focal plane using the module positions of
+               FPM_config.csv.
+ ============================================================================
+ */
+#include <string.h>
+
+#include "hp_camera.h"
+
+/* Slots of the 25 modules, top row first, as display_currents() prints them */
+static const unsigned short default_slot_order[25] = {
+	 5,  6,  7,  8,  9,
+	11, 12, 13, 14, 15,
+	17, 18, 19, 20, 21,
+	23, 24, 25, 26, 27,
+	28, 29, 30, 31, 22
+};
+
+/* Layout used when no FPM config is at hand */
+void hp_geometry_default(struct hp_geometry *geo) {
+	int i, w;
+
+	for (w = 0; w < HP_NWORDS; w++)
+		geo->x0[w] = geo->y0[w] = -1;
+	for (i = 0; i < 25; i++) {
+		w = default_slot_order[i];
+		geo->x0[w] = 4 * (i % 5);
+		geo->y0[w] = 4 * (4 - i / 5);
+	}
+}
+
+void hp_geometry_from_fpm(struct hp_geometry *geo, const struct fpm_config *fpm) {
+	int w, pos;
+
+	for (w = 0; w < HP_NWORDS; w++) {
+		pos = w < FPM_NSLOTS ? fpm->fpm_position[w] : -1;
+		if (pos < 0 || pos >= 25) {
+			geo->x0[w] = geo->y0[w] = -1;
+			continue;
+		}
+		geo->x0[w] = 4 * (pos % 5);
+		geo->y0[w] = 4 * (pos / 5);
+	}
+}
+
+/*
+	hp_cam_from_pattern()
+
+	Row r of a module is bits r, r+4, r+8 and r+12 of its word, gathered
+	into a nibble and shifted to the module's column.
+*/
+void hp_cam_from_pattern(struct hp_cam *cam, const struct hp_geometry *geo, const unsigned short *hit_pattern) {
+	unsigned int w, word, r, nib;
+
+	memset(cam, 0, sizeof(*cam));
+	for (w = 0; w < HP_NWORDS; w++) {
+		word = hit_pattern[w];
+		if (word == 0 || geo->x0[w] < 0)
+			continue;
+		for (r = 0; r < 4; r++) {
+			nib = ((word >> r) & 1) | ((word >> (r + 3)) & 2) |
+			      ((word >> (r + 6)) & 4) | ((word >> (r + 9)) & 8);
+			cam->row[HP_CAM_PAD + geo->y0[w] + r] |= nib << geo->x0[w];
+		}
+	}
+}
@@ -0,0 +1,66 @@
+/*
+ ============================================================================
+ Name        : hp_camera.h
+ Description : Trigger pixel bitmaps in camera geometry
+ ============================================================================
+ */
+#ifndef HP_CAMERA_H
+#define HP_CAMERA_H
+
+#include <string.h>
+
+#include "fpm_config.h"
+#include "hp_occupancy.h"
+
+#define HP_CAM_SIZE  20   // 5x5 modules of 4x4 trigger pixels
+#define HP_CAM_VROWS 4    // camera rows per vector
+#define HP_CAM_NVEC  5    // vectors covering the 20 rows
+#define HP_CAM_PAD   4    // zero rows either side, so row +-1 loads need no edge test
+#define HP_CAM_COLS  ((1u << HP_CAM_SIZE) - 1)
+
+/* Four camera rows, bit x of element y is the trigger pixel in column x
+   of row y. Built on GCC vector extensions, one NEON register on the Pi
+   and one SSE register on the host. */
+typedef unsigned int hp_rows __attribute__((vector_size(4 * HP_CAM_VROWS)));
+
+/* Row 0 is the bottom of the camera, column 0 the left as seen in
+   fpm_position order. */
+struct hp_cam {
+	unsigned int row[HP_CAM_PAD + HP_CAM_NVEC * HP_CAM_VROWS + HP_CAM_PAD] __attribute__((aligned(16)));
+};
+
+/* Lower left camera pixel of each hit pattern word, -1 if the slot is not
+   on the focal plane. Bit b of a word is column b/4, row b%4 within the
+   module, the order of the display_order table in sctcamsoft. */
+struct hp_geometry {
+	int x0[HP_NWORDS];
+	int y0[HP_NWORDS];
+};
+
+void hp_geometry_default(struct hp_geometry *geo);
+void hp_geometry_from_fpm(struct hp_geometry *geo, const struct fpm_config *fpm);
+void hp_cam_from_pattern(struct hp_cam *cam, const struct hp_geometry *geo, const unsigned short *hit_pattern);
+
+/* Rows 4v+dy .. 4v+dy+3, dy -1, 0 or +1 */
+static inline hp_rows hp_cam_rows(const struct hp_cam *cam, int v, int dy) {
+	hp_rows r;
+	memcpy(&r, &cam->row[HP_CAM_PAD + HP_CAM_VROWS * v + dy], sizeof(r));
+	return r;
+}
+
+static inline int hp_rows_any(hp_rows r) {
+	unsigned int any = 0;
+	int i;
+	for (i = 0; i < HP_CAM_VROWS; i++)
+		any |= r[i];
+	return any != 0;
+}
+
+static inline int hp_rows_popcount(hp_rows r) {
+	int i, n = 0;
+	for (i = 0; i < HP_CAM_VROWS; i++)
+		n += __builtin_popcount(r[i]);
+	return n;
+}
+
+#endif
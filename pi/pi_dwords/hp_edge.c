@@ -0,0 +1,328 @@
+/*
+ ============================================================================
+ Name        : hp_edge.c
+ Description : Trigger edges on a GPIO line for the edge-triggered hit
+               pattern readout (menu 'G'). With the camera trigger or TACK
+               wired to a Pi GPIO, the line is requested through the
+               gpiochip character device (v2 uAPI) for edge events, so the
+               kernel timestamps every edge in its interrupt handler and
+               the reader sleeps in poll() until one comes, instead of
+               polling the TFPGA counters over SPI. Edges the kernel buffer
+               had no room for show as gaps in the line sequence number;
+               several edges read at once get one readout, of the newest.
+
+               Two latencies are histogrammed per edge, 10 bins per decade
+               from 100 ns: edge to the event read here (interrupt and
+               scheduler) and edge to the hit pattern read (the SPI frames
+               on top), with percentiles from the bins.
+
+               For tests without a camera the line can be a gpio-sim line:
+               sim_pull names its pull attribute in sysfs and a thread
+               toggles it at sim_hz, which makes the edges.
+ ============================================================================
+ */
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <math.h>
+#include <sys/ioctl.h>
+#include <linux/gpio.h>
+
+#include "bp_config.h"
+#include "hp_edge.h"
+
+static unsigned long long clock_ns(clockid_t clock) {
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+	return (unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static double bin_edge(int bin) {
+	return HP_EDGE_MIN_NS * pow(10, bin / 10.0);
+}
+
+static void hist_add(struct hp_edge_hist *h, long long ns) {
+	int bin;
+
+	if (ns < 0)
+		ns = 0;   // a realtime clock stepped back
+	h->n++;
+	h->sum_ns += ns;
+	if (ns > h->max_ns)
+		h->max_ns = ns;
+	if (ns < HP_EDGE_MIN_NS) {
+		h->underflow++;
+		return;
+	}
+	bin = (int) (10 * log10((double) ns / HP_EDGE_MIN_NS));
+	if (bin >= HP_EDGE_NBINS)
+		h->overflow++;
+	else
+		h->counts[bin]++;
+}
+
+/* Latency below which a fraction q of the entries are, interpolated
+   geometrically within the bin */
+static double hist_quantile(const struct hp_edge_hist *h, double q) {
+	double target = q * h->n, seen = h->underflow;
+	int bin;
+
+	if (h->n == 0)
+		return 0;
+	if (seen >= target)
+		return HP_EDGE_MIN_NS;
+	for (bin = 0; bin < HP_EDGE_NBINS; bin++) {
+		if (seen + h->counts[bin] >= target)
+			return bin_edge(bin) * pow(10, (target - seen) / h->counts[bin] / 10.0);
+		seen += h->counts[bin];
+	}
+	return h->max_ns;
+}
+
+static const char *format_ns(char *buf, double ns) {
+	if (ns < 1e3)
+		sprintf(buf, "%.0f ns", ns);
+	else if (ns < 1e6)
+		sprintf(buf, "%.3g us", ns * 1e-3);
+	else if (ns < 1e9)
+		sprintf(buf, "%.3g ms", ns * 1e-6);
+	else
+		sprintf(buf, "%.3g s", ns * 1e-9);
+	return buf;
+}
+
+/*
+	hp_edge_load()
+
+	Defaults if config_file does not exist: rising edges on line 17 of
+	/dev/gpiochip0 (GPIO17, header pin 11 on a Pi), bias and debounce as
+	they are, CLOCK_REALTIME timestamps, no simulated edges. Returns -1
+	for a file that cannot be read or an edge, bias or clock that is not
+	one of the names in hp_edge.yml.
+*/
+int hp_edge_load(struct hp_edge_config *cfg, const char *config_file) {
+	struct bp_config c;
+	const char *edge, *clock;
+	int status = 0;
+
+	memset(cfg, 0, sizeof(*cfg));
+	memset(&c, 0, sizeof(c));
+	if (access(config_file, R_OK) == 0)
+		status = bp_config_load(&c, config_file);
+	snprintf(cfg->chip, sizeof(cfg->chip), "%s", bp_config_string(&c, "chip", "/dev/gpiochip0"));
+	cfg->line = bp_config_double(&c, "line", 17);
+	edge = bp_config_string(&c, "edge", "rising");
+	cfg->edge = strcmp(edge, "both") == 0 ? 3 : strcmp(edge, "falling") == 0 ? 2 : strcmp(edge, "rising") == 0 ? 1 : 0;
+	if (cfg->edge == 0) {
+		fprintf(stderr, "%s: edge must be rising, falling or both, not %s\n", config_file, edge);
+		status = -1;
+	}
+	snprintf(cfg->bias, sizeof(cfg->bias), "%s", bp_config_string(&c, "bias", ""));
+	if (cfg->bias[0] && strcmp(cfg->bias, "pull-up") != 0 && strcmp(cfg->bias, "pull-down") != 0 &&
+	    strcmp(cfg->bias, "disabled") != 0) {
+		fprintf(stderr, "%s: bias must be pull-up, pull-down, disabled or empty, not %s\n", config_file, cfg->bias);
+		status = -1;
+	}
+	cfg->debounce_us = bp_config_double(&c, "debounce_us", 0);
+	clock = bp_config_string(&c, "clock", "realtime");
+	cfg->realtime = strcmp(clock, "realtime") == 0;
+	if (!cfg->realtime && strcmp(clock, "monotonic") != 0) {
+		fprintf(stderr, "%s: clock must be realtime or monotonic, not %s\n", config_file, clock);
+		status = -1;
+	}
+	snprintf(cfg->sim_pull, sizeof(cfg->sim_pull), "%s", bp_config_string(&c, "sim_pull", ""));
+	cfg->sim_hz = bp_config_double(&c, "sim_hz", 100);
+	return status;
+}
+
+/* gpio-sim: a rising edge of the pull every 1/sim_hz, falling halfway */
+static void *sim_main(void *arg) {
+	struct hp_edge *e = arg;
+	unsigned long long next = clock_ns(CLOCK_MONOTONIC), half = 5e8 / e->cfg.sim_hz;
+	struct timespec ts;
+	int up = 0;
+
+	while (e->sim_running) {
+		up = !up;
+		if (pwrite(e->sim_fd, up ? "pull-up" : "pull-down", up ? 7 : 9, 0) < 0) {
+			perror(e->cfg.sim_pull);
+			break;
+		}
+		e->sim_edges += up;
+		next += half;
+		ts.tv_sec = next / 1000000000ULL;
+		ts.tv_nsec = next % 1000000000ULL;
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+	}
+	return NULL;
+}
+
+int hp_edge_open(struct hp_edge *e, const struct hp_edge_config *cfg) {
+	struct gpio_v2_line_request req;
+	int chip_fd;
+
+	memset(e, 0, sizeof(*e));
+	e->cfg = *cfg;
+	e->fd = e->sim_fd = -1;
+	chip_fd = open(cfg->chip, O_RDONLY | O_CLOEXEC);
+	if (chip_fd < 0) {
+		perror(cfg->chip);
+		return -1;
+	}
+	memset(&req, 0, sizeof(req));
+	req.offsets[0] = cfg->line;
+	req.num_lines = 1;
+	snprintf(req.consumer, sizeof(req.consumer), "bp_test_pi trigger");
+	req.config.flags = GPIO_V2_LINE_FLAG_INPUT;
+	if (cfg->edge & 1)
+		req.config.flags |= GPIO_V2_LINE_FLAG_EDGE_RISING;
+	if (cfg->edge & 2)
+		req.config.flags |= GPIO_V2_LINE_FLAG_EDGE_FALLING;
+	if (cfg->realtime)
+		req.config.flags |= GPIO_V2_LINE_FLAG_EVENT_CLOCK_REALTIME;
+	if (strcmp(cfg->bias, "pull-up") == 0)
+		req.config.flags |= GPIO_V2_LINE_FLAG_BIAS_PULL_UP;
+	else if (strcmp(cfg->bias, "pull-down") == 0)
+		req.config.flags |= GPIO_V2_LINE_FLAG_BIAS_PULL_DOWN;
+	else if (strcmp(cfg->bias, "disabled") == 0)
+		req.config.flags |= GPIO_V2_LINE_FLAG_BIAS_DISABLED;
+	if (cfg->debounce_us > 0) {
+		req.config.num_attrs = 1;
+		req.config.attrs[0].attr.id = GPIO_V2_LINE_ATTR_ID_DEBOUNCE;
+		req.config.attrs[0].attr.debounce_period_us = cfg->debounce_us;
+		req.config.attrs[0].mask = 1;
+	}
+	req.event_buffer_size = HP_EDGE_NEVENTS;
+	if (ioctl(chip_fd, GPIO_V2_GET_LINE_IOCTL, &req) < 0) {
+		fprintf(stderr, "%s line %d: %s\n", cfg->chip, cfg->line, strerror(errno));
+		close(chip_fd);
+		return -1;
+	}
+	close(chip_fd);
+	e->fd = req.fd;
+	e->clock = cfg->realtime ? CLOCK_REALTIME : CLOCK_MONOTONIC;
+
+	if (cfg->sim_pull[0] != '\0' && cfg->sim_hz > 0) {
+		e->sim_fd = open(cfg->sim_pull, O_WRONLY | O_CLOEXEC);
+		if (e->sim_fd < 0) {
+			perror(cfg->sim_pull);
+			hp_edge_close(e);
+			return -1;
+		}
+		e->sim_running = 1;
+		if (pthread_create(&e->sim_thread, NULL, sim_main, e) != 0) {
+			e->sim_running = 0;
+			hp_edge_close(e);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+void hp_edge_close(struct hp_edge *e) {
+	if (e->sim_running) {
+		e->sim_running = 0;
+		pthread_join(e->sim_thread, NULL);
+	}
+	if (e->sim_fd >= 0)
+		close(e->sim_fd);
+	if (e->fd >= 0)
+		close(e->fd);
+	e->fd = e->sim_fd = -1;
+}
+
+/*
+	hp_edge_wait()
+
+	Sleeps up to timeout_ms for edges, then takes all that are buffered.
+	Returns 1 with edge_ns the kernel timestamp of the newest, 0 if none
+	came, -1 if the line cannot be read.
+*/
+int hp_edge_wait(struct hp_edge *e, int timeout_ms, unsigned long long *edge_ns) {
+	struct gpio_v2_line_event ev[HP_EDGE_NEVENTS];
+	struct pollfd p;
+	unsigned long long now;
+	ssize_t n;
+	int i, count;
+
+	p.fd = e->fd;
+	p.events = POLLIN;
+	n = poll(&p, 1, timeout_ms);
+	if (n <= 0)
+		return n < 0 && errno != EINTR ? -1 : 0;
+	n = read(e->fd, ev, sizeof(ev));
+	now = clock_ns(e->clock);
+	if (n < (ssize_t) sizeof(ev[0]))
+		return n < 0 && errno != EINTR && errno != EAGAIN ? -1 : 0;
+	count = n / sizeof(ev[0]);
+	for (i = 0; i < count; i++) {
+		e->lost += ev[i].line_seqno - e->last_seqno - 1;   // line_seqno counts from 1
+		e->last_seqno = ev[i].line_seqno;
+		e->edges++;
+		hist_add(&e->wake, (long long) (now - ev[i].timestamp_ns));
+	}
+	e->coalesced += count - 1;
+	*edge_ns = ev[count - 1].timestamp_ns;
+	return 1;
+}
+
+/* The readout for the edge at edge_ns is done (ok) or failed */
+void hp_edge_done(struct hp_edge *e, unsigned long long edge_ns, int ok) {
+	if (!ok) {
+		e->failed++;
+		return;
+	}
+	e->readouts++;
+	hist_add(&e->readout, (long long) (clock_ns(e->clock) - edge_ns));
+}
+
+/* UTC of an edge, for the record */
+void hp_edge_timespec(const struct hp_edge *e, unsigned long long edge_ns, struct timespec *ts) {
+	if (e->clock != CLOCK_REALTIME)
+		edge_ns += clock_ns(CLOCK_REALTIME) - clock_ns(e->clock);
+	ts->tv_sec = edge_ns / 1000000000ULL;
+	ts->tv_nsec = edge_ns % 1000000000ULL;
+}
+
+static void print_hist(FILE *fptr, const char *name, const struct hp_edge_hist *h) {
+	char a[16], b[16], c[16], d[16], f[16], g[16];
+
+	if (h->n == 0) {
+		fprintf(fptr, "%-16s none\n", name);
+		return;
+	}
+	fprintf(fptr, "%-16s mean %s, 50 %% %s, 90 %% %s, 99 %% %s, 99.9 %% %s, max %s\n", name,
+		format_ns(a, h->sum_ns / h->n), format_ns(b, hist_quantile(h, 0.5)), format_ns(c, hist_quantile(h, 0.9)),
+		format_ns(d, hist_quantile(h, 0.99)), format_ns(f, hist_quantile(h, 0.999)), format_ns(g, h->max_ns));
+}
+
+void hp_edge_report(const struct hp_edge *e, FILE *fptr) {
+	static const char *edge_name[4] = { "", "rising", "falling", "rising and falling" };
+	char a[16], b[16];
+	int bin, lo, hi;
+
+	fprintf(fptr, "%s line %d, %s edges, %s timestamps: %llu edges, %llu lost in the kernel buffer,"
+		" %llu read together with a newer one, %llu readouts, %llu failed", e->cfg.chip, e->cfg.line,
+		edge_name[e->cfg.edge], e->clock == CLOCK_REALTIME ? "CLOCK_REALTIME" : "CLOCK_MONOTONIC", e->edges,
+		e->lost, e->coalesced, e->readouts, e->failed);
+	if (e->sim_fd >= 0)
+		fprintf(fptr, ", %llu made by gpio-sim", e->sim_edges);
+	fprintf(fptr, "\n");
+	print_hist(fptr, "edge to wake:", &e->wake);
+	print_hist(fptr, "edge to readout:", &e->readout);
+
+	for (lo = 0; lo < HP_EDGE_NBINS && e->wake.counts[lo] == 0 && e->readout.counts[lo] == 0; lo++)
+		;
+	for (hi = HP_EDGE_NBINS - 1; hi >= lo && e->wake.counts[hi] == 0 && e->readout.counts[hi] == 0; hi--)
+		;
+	if (lo > hi)
+		return;
+	fprintf(fptr, "%21s %10s %10s\n", "latency", "wake", "readout");
+	for (bin = lo; bin <= hi; bin++)
+		fprintf(fptr, "%9s - %9s %10llu %10llu\n", format_ns(a, bin_edge(bin)), format_ns(b, bin_edge(bin + 1)),
+			e->wake.counts[bin], e->readout.counts[bin]);
+}
@@ -0,0 +1,62 @@
+/*
+ ============================================================================
+ Name        : hp_edge.h
+ Description : Trigger edges on a GPIO line (gpiochip v2 uAPI) with kernel
+               timestamps, and edge-to-readout latency histograms
+ ============================================================================
+ */
+#ifndef HP_EDGE_H
+#define HP_EDGE_H
+
+#include <stdio.h>
+#include <time.h>
+#include <pthread.h>
+
+#define HP_EDGE_MIN_NS 100        // lower edge of the first latency bin
+#define HP_EDGE_NBINS  70         // 10 per decade, up to 1 s
+#define HP_EDGE_NEVENTS 64        // kernel event buffer, and read at once
+
+struct hp_edge_config {
+	char chip[64];               // /dev/gpiochipN
+	int line;                    // offset on the chip, the BCM GPIO number on a Pi
+	int edge;                    // 1 rising, 2 falling, 3 both
+	char bias[16];               // "pull-up", "pull-down", "disabled" or "" as is
+	int debounce_us;
+	int realtime;                // kernel timestamps CLOCK_REALTIME, else CLOCK_MONOTONIC
+	char sim_pull[208];          // gpio-sim: the line's pull attribute, toggled to make edges
+	double sim_hz;               // edges made per second
+};
+
+struct hp_edge_hist {
+	unsigned long long counts[HP_EDGE_NBINS];
+	unsigned long long n, underflow, overflow;
+	double sum_ns, max_ns;
+};
+
+struct hp_edge {
+	struct hp_edge_config cfg;
+	int fd;                      // the line request
+	clockid_t clock;             // of the timestamps
+	unsigned long long edges;    // seen, the kernel's count of this line
+	unsigned long long lost;     // the kernel buffer overflowed, seqno gaps
+	unsigned long long coalesced;   // a newer edge came before their readout
+	unsigned long long readouts, failed;
+	unsigned int last_seqno;
+	struct hp_edge_hist wake;    // edge to the event read here
+	struct hp_edge_hist readout; // edge to the hit pattern read
+
+	int sim_fd;
+	volatile int sim_running;
+	pthread_t sim_thread;
+	unsigned long long sim_edges;
+};
+
+int hp_edge_load(struct hp_edge_config *cfg, const char *config_file);
+int hp_edge_open(struct hp_edge *e, const struct hp_edge_config *cfg);
+void hp_edge_close(struct hp_edge *e);
+int hp_edge_wait(struct hp_edge *e, int timeout_ms, unsigned long long *edge_ns);
+void hp_edge_done(struct hp_edge *e, unsigned long long edge_ns, int ok);
+void hp_edge_timespec(const struct hp_edge *e, unsigned long long edge_ns, struct timespec *ts);
+void hp_edge_report(const struct hp_edge *e, FILE *fptr);
+
+#endif
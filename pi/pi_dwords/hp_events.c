@@ -0,0 +1,295 @@
+/*
+ ============================================================================
+ Name        : hp_events.c
+ Description : Event builder for the hit patterns and the TARGET DAQ
+               events. Joins a run file of hp_aggregate (menu 'S') with
+               the event list of the DAQ on the TFPGA nsTimer: the hit
+               pattern records carry the nsTimer of their trigger, the
+               DAQ events the time of the TACK that read them out, both
+               from the same TFPGA. Both inputs are read once, in time
+               order, with one record of look-ahead on each side, so the
+               join is linear in time and constant in memory.
+
+               hp_events [-s source] [-t tolerance_ns] [-d delay_ns]
+                         [-o matched.csv] run.hpr events.csv
+
+               events.csv has a header line naming its columns, of which
+               `event` and `tack_ns` are needed and `tack_count` is used
+               when present; other columns and '#' lines are ignored.
+               A record and an event match when the record's nsTimer plus
+               -d lies within -t ns (default 200) of the TACK time, and
+               no neighbour on either side lies closer. With tack_count,
+               (hwtriggers - tack_count) mod 2^16 (the TARGET counter
+               width) must stay what it was at the first match; a change
+               is reported once as a counter slip and the new difference
+               kept.
+
+               matched.csv: event,tack_ns,hit_ns,dt_ns,hwtriggers,seq,
+               counter (ok, slip or -), hit_pattern (the 32 words as hex).
+               The summary gives matched and unmatched counts on both
+               sides and the time differences. Events without a record
+               are triggers the Pi did not read out (see missed in
+               hp_aggregate), records without an event are triggers the
+               DAQ did not keep.
+ ============================================================================
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+
+#include "hp_stream.h"
+
+#define MAX_LINE 4096
+
+struct event {
+	long long event;
+	long long tack_ns;
+	long tack_count;
+	int have_count;
+};
+
+static FILE *hits, *events;
+static int source;
+static long long last_hit_ns = -1, last_event_ns = -1;
+static int col_event = -1, col_tack_ns = -1, col_tack_count = -1;
+static long line_number;
+static unsigned long long hits_read, hits_backwards, events_read, events_backwards, events_bad;
+
+/* Next record of the source, skipping any that go back in time */
+static int read_hit(struct hpr_record *r) {
+	while (fread(r, sizeof(*r), 1, hits) == 1) {
+		if (r->source != source)
+			continue;
+		if ((long long) r->r.nstime < last_hit_ns) {
+			hits_backwards++;
+			continue;
+		}
+		last_hit_ns = r->r.nstime;
+		hits_read++;
+		return 1;
+	}
+	return 0;
+}
+
+/* Split line at the commas in place, returns the number of fields */
+static int split(char *line, char **field, int max) {
+	int n = 0;
+	char *p = line;
+
+	while (n < max) {
+		while (*p == ' ' || *p == '\t')
+			p++;
+		field[n++] = p;
+		p += strcspn(p, ",\r\n");
+		if (*p != ',') {
+			*p = '\0';
+			break;
+		}
+		*p++ = '\0';
+	}
+	return n;
+}
+
+static int read_header(void) {
+	char line[MAX_LINE], *field[256];
+	int i, n;
+
+	while (fgets(line, sizeof(line), events) != NULL) {
+		line_number++;
+		if (line[0] == '#' || line[0] == '\n')
+			continue;
+		n = split(line, field, 256);
+		for (i = 0; i < n; i++) {
+			if (strcmp(field[i], "event") == 0)
+				col_event = i;
+			else if (strcmp(field[i], "tack_ns") == 0)
+				col_tack_ns = i;
+			else if (strcmp(field[i], "tack_count") == 0)
+				col_tack_count = i;
+		}
+		return col_event >= 0 && col_tack_ns >= 0 ? 0 : -1;
+	}
+	return -1;
+}
+
+/* Next event, skipping lines that do not parse or go back in time */
+static int read_event(struct event *e) {
+	char line[MAX_LINE], *field[256], *end;
+	int n;
+
+	while (fgets(line, sizeof(line), events) != NULL) {
+		line_number++;
+		if (line[0] == '#' || line[0] == '\n')
+			continue;
+		n = split(line, field, 256);
+		if (n <= col_event || n <= col_tack_ns) {
+			events_bad++;
+			continue;
+		}
+		e->event = strtoll(field[col_event], &end, 10);
+		e->tack_ns = strtoll(field[col_tack_ns], &end, 10);
+		if (end == field[col_tack_ns]) {
+			events_bad++;
+			continue;
+		}
+		e->have_count = col_tack_count >= 0 && n > col_tack_count && field[col_tack_count][0] != '\0';
+		e->tack_count = e->have_count ? strtol(field[col_tack_count], NULL, 10) : 0;
+		if (e->tack_ns < last_event_ns) {
+			events_backwards++;
+			continue;
+		}
+		last_event_ns = e->tack_ns;
+		events_read++;
+		return 1;
+	}
+	return 0;
+}
+
+static long long abs_ll(long long v) {
+	return v < 0 ? -v : v;
+}
+
+int main(int argc, char **argv) {
+	const char *out_name = "matched.csv";
+	struct hpr_header header;
+	char name[56];
+	struct hpr_record h[2];
+	struct event e[2];
+	long long tolerance_ns = 200, delay_ns = 0, ht, dt, max_dt = 0;
+	unsigned long long matched = 0, lone_hits = 0, lone_events = 0, slips = 0, checked = 0;
+	unsigned long difference = 0;
+	double sum_dt = 0, sum_dt2 = 0;
+	int opt, nh, ne, w, have_difference = 0;
+	const char *counter;
+	FILE *fptr;
+
+	while ((opt = getopt(argc, argv, "s:t:d:o:")) != -1) {
+		switch (opt) {
+		case 's': source = atoi(optarg); break;
+		case 't': tolerance_ns = atoll(optarg); break;
+		case 'd': delay_ns = atoll(optarg); break;
+		case 'o': out_name = optarg; break;
+		default: optind = argc + 1;
+		}
+	}
+	if (argc - optind != 2) {
+		fprintf(stderr, "usage: %s [-s source] [-t tolerance_ns] [-d delay_ns] [-o matched.csv] run.hpr events.csv\n",
+			argv[0]);
+		return 1;
+	}
+
+	hits = fopen(argv[optind], "rb");
+	if (hits == NULL) {
+		perror(argv[optind]);
+		return 1;
+	}
+	if (fread(&header, sizeof(header), 1, hits) != 1 || memcmp(header.magic, HPR_MAGIC, 4) != 0) {
+		fprintf(stderr, "%s: not an hp_aggregate run file\n", argv[optind]);
+		return 1;
+	}
+	if (source < 0 || source >= header.nsources) {
+		fprintf(stderr, "%s has %d sources, no source %d\n", argv[optind], header.nsources, source);
+		return 1;
+	}
+	for (w = 0; w < header.nsources; w++) {
+		if (fread(name, sizeof(name), 1, hits) != 1)
+			return 1;
+		if (w == source)
+			fprintf(stderr, "hit patterns of %.*s (source %d of %d)\n", (int) sizeof(name), name, source,
+				header.nsources);
+	}
+	events = fopen(argv[optind + 1], "r");
+	if (events == NULL) {
+		perror(argv[optind + 1]);
+		return 1;
+	}
+	if (read_header() != 0) {
+		fprintf(stderr, "%s: no header line with event and tack_ns columns\n", argv[optind + 1]);
+		return 1;
+	}
+	fptr = fopen(out_name, "w");
+	if (fptr == NULL) {
+		perror(out_name);
+		return 1;
+	}
+	fprintf(fptr, "event,tack_ns,hit_ns,dt_ns,hwtriggers,seq,counter,hit_pattern\n");
+
+	nh = read_hit(&h[0]);
+	nh += nh == 1 && read_hit(&h[1]);
+	ne = read_event(&e[0]);
+	ne += ne == 1 && read_event(&e[1]);
+	while (nh > 0 && ne > 0) {
+		ht = (long long) h[0].r.nstime + delay_ns;
+		dt = e[0].tack_ns - ht;
+		// whichever is earlier and out of reach has no partner, and neither
+		// has one when the other side's next entry is closer
+		if (dt > tolerance_ns || (nh == 2 && abs_ll(e[0].tack_ns - ((long long) h[1].r.nstime + delay_ns)) < abs_ll(dt))) {
+			lone_hits++;
+			h[0] = h[1];
+			nh = nh == 2 ? 1 + read_hit(&h[1]) : 0;
+			continue;
+		}
+		if (dt < -tolerance_ns || (ne == 2 && abs_ll(e[1].tack_ns - ht) < abs_ll(dt))) {
+			lone_events++;
+			e[0] = e[1];
+			ne = ne == 2 ? 1 + read_event(&e[1]) : 0;
+			continue;
+		}
+
+		counter = "-";
+		if (e[0].have_count) {
+			checked++;
+			counter = "ok";
+			if (!have_difference) {
+				difference = (h[0].r.hwtriggers - e[0].tack_count) & 0xffff;
+				have_difference = 1;
+			} else if (((h[0].r.hwtriggers - e[0].tack_count) & 0xffff) != difference) {
+				difference = (h[0].r.hwtriggers - e[0].tack_count) & 0xffff;
+				counter = "slip";
+				slips++;
+			}
+		}
+		fprintf(fptr, "%lld,%lld,%llu,%lld,%u,%u,%s,", e[0].event, e[0].tack_ns,
+			(unsigned long long) h[0].r.nstime, dt, h[0].r.hwtriggers, h[0].r.seq, counter);
+		for (w = 0; w < HP_NWORDS; w++)
+			fprintf(fptr, "%04x", h[0].r.hit_pattern[w]);
+		fprintf(fptr, "\n");
+		matched++;
+		sum_dt += dt;
+		sum_dt2 += (double) dt * dt;
+		if (abs_ll(dt) > max_dt)
+			max_dt = abs_ll(dt);
+
+		h[0] = h[1];
+		nh = nh == 2 ? 1 + read_hit(&h[1]) : 0;
+		e[0] = e[1];
+		ne = ne == 2 ? 1 + read_event(&e[1]) : 0;
+	}
+	// what is left on one side has nothing left to match on the other
+	lone_hits += nh;
+	while (read_hit(&h[0]))
+		lone_hits++;
+	lone_events += ne;
+	while (read_event(&e[0]))
+		lone_events++;
+	fclose(fptr);
+
+	printf("%llu events, %llu hit pattern records, %llu matched within %lld ns to %s\n", events_read, hits_read,
+		matched, tolerance_ns, out_name);
+	printf("events with a hit pattern  %6.2f %%\n", events_read ? 100.0 * matched / events_read : 0);
+	printf("events without             %llu (triggers the Pi did not read out)\n", lone_events);
+	printf("records without an event   %llu (triggers the DAQ did not keep)\n", lone_hits);
+	if (matched > 0)
+		printf("dt = tack - hit - delay    mean %.1f ns, rms %.1f ns, max |dt| %lld ns\n", sum_dt / matched,
+			sqrt(sum_dt2 / matched), max_dt);
+	if (checked > 0)
+		printf("counter check              %llu matches checked, %llu slips\n", checked, slips);
+	else
+		printf("counter check              no tack_count column, not checked\n");
+	if (hits_backwards + events_backwards + events_bad > 0)
+		printf("skipped                    %llu records and %llu events going back in time, %llu bad lines\n",
+			hits_backwards, events_backwards, events_bad);
+	return 0;
+}
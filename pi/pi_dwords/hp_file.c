@@ -0,0 +1,248 @@
+/*
+ ============================================================================
+ Name        : hp_file.c
+ Description : Reader for the hit pattern recordings of bp_test_pi.
+               Loads any of the three recorder outputs into 32-word hit
+               patterns laid out as hit_pattern_from_frame() builds them:
+                 '$' binary: int N, float freq, then per step frame 0
+                     (11 words), int step, char[100] "%D %T" UTC time, long
+                     ns, frames 1-3. long is 4 bytes on the Pi and 8 on a
+                     64-bit host, the record size tells which.
+                 '*' text: per step "Step:", "Current time:" and the four
+                     frames as printed by print_slavespi_data().
+                 '9' text: per step "Step:", "Current time:" and the camera
+                     picture. Only words 0-24 are drawn, the bit order of
+                     the picture is hp_picture_order[] of hp_format.c.
+               Adaptive recordings (menu 'R', freq 0 in the header) note
+               each rate change, see hp_format_rate().
+ ============================================================================
+ */
+#define _GNU_SOURCE // timegm
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "hp_format.h"
+#include "hp_file.h"
+
+const char *hp_file_format_name(int format) {
+	switch (format) {
+	case HP_FILE_BINARY:  return "binary";
+	case HP_FILE_DWORDS:  return "dwords";
+	case HP_FILE_PICTURE: return "picture";
+	}
+	return "unknown";
+}
+
+/* "mm/dd/yy HH:MM:SS" as written with strftime("%D %T") plus ns, to UTC ns */
+static unsigned long long parse_time(const char *s, long ns) {
+	struct tm tm;
+	time_t t;
+
+	memset(&tm, 0, sizeof(tm));
+	if (sscanf(s, "%d/%d/%d %d:%d:%d", &tm.tm_mon, &tm.tm_mday, &tm.tm_year,
+		&tm.tm_hour, &tm.tm_min, &tm.tm_sec) != 6)
+		return 0;
+	tm.tm_mon -= 1;
+	tm.tm_year += 100;
+	t = timegm(&tm);
+	if (t < 0)
+		return 0;
+	return (unsigned long long) t * 1000000000ULL + ns;
+}
+
+static int reserve(struct hp_file *f, int *capacity, int n) {
+	void *p, *t, *s, *r;
+
+	if (n <= *capacity)
+		return 0;
+	n = n > 2 * *capacity ? n : 2 * *capacity;
+	p = realloc(f->pattern, (size_t) n * sizeof(*f->pattern));
+	if (p != NULL)
+		f->pattern = p;
+	t = realloc(f->t_ns, (size_t) n * sizeof(*f->t_ns));
+	if (t != NULL)
+		f->t_ns = t;
+	s = realloc(f->step, (size_t) n * sizeof(*f->step));
+	if (s != NULL)
+		f->step = s;
+	r = realloc(f->rate, (size_t) n * sizeof(*f->rate));
+	if (r != NULL)
+		f->rate = r;
+	if (p == NULL || t == NULL || s == NULL || r == NULL)
+		return -1;
+	*capacity = n;
+	return 0;
+}
+
+static int load_binary(struct hp_file *f, FILE *fptr, long size) {
+	unsigned char rec[200], *p;
+	unsigned short data[11];
+	int header[2], lsize, capacity = 0, frame, n;
+	long long ns;
+	char buff[101];
+	float rate;
+
+	if (fread(header, sizeof(int), 2, fptr) != 2)
+		return -1;
+	memcpy(&f->freq, &header[1], sizeof(f->freq));
+	rate = f->freq;
+
+	// sizeof(long) of the recording host, from the record size or the time string
+	if (header[0] > 0 && size - 8 == (long) header[0] * 196)
+		lsize = 4;
+	else if (header[0] > 0 && size - 8 == (long) header[0] * 200)
+		lsize = 8;
+	else if (size >= 8 + 196 + 126 && fseek(fptr, 8 + 196 + 26, SEEK_SET) == 0 &&
+		fread(buff, 1, 6, fptr) == 6 && buff[2] == '/' && buff[5] == '/')
+		lsize = 4;
+	else
+		lsize = 8;
+	fseek(fptr, 8, SEEK_SET);
+
+	for (n = 0; fread(rec, 192 + lsize, 1, fptr) == 1; n++) {
+		if (reserve(f, &capacity, n + 1) != 0)
+			return -1;
+		memcpy(data, rec, sizeof(data));
+		hit_pattern_from_frame(f->pattern[n], 0, data);
+		memcpy(&f->step[n], rec + 22, sizeof(int));
+		memcpy(buff, rec + 26, 100);
+		buff[100] = '\0';
+		ns = 0;
+		if (lsize == 4) {
+			int ns32;
+			memcpy(&ns32, rec + 126, 4);
+			ns = ns32;
+		} else {
+			memcpy(&ns, rec + 126, 8);
+		}
+		f->t_ns[n] = parse_time(buff, ns);
+		if (strlen(buff) < 99)
+			sscanf(buff + strlen(buff) + 1, "rate %f", &rate);
+		f->rate[n] = rate;
+		p = rec + 126 + lsize;
+		for (frame = 1; frame < 4; frame++, p += sizeof(data)) {
+			memcpy(data, p, sizeof(data));
+			hit_pattern_from_frame(f->pattern[n], frame, data);
+		}
+	}
+	f->nsamples = n;
+	return 0;
+}
+
+static int load_text(struct hp_file *f, FILE *fptr) {
+	char line[512], tbuf[64], *c;
+	unsigned short data[11];
+	int capacity = 0, n = -1, step, nframe = 0, nbit = 0, v[11], i;
+	long ns;
+	float rate = 0;
+
+	while (fgets(line, sizeof(line), fptr) != NULL) {
+		if (sscanf(line, "N: %*d, freq: %f", &f->freq) == 1) {
+			rate = f->freq;
+			continue;
+		}
+		if (sscanf(line, "Rate: %f", &rate) == 1)
+			continue;
+		if (sscanf(line, "Step: %d", &step) == 1) {
+			n++;
+			if (reserve(f, &capacity, n + 1) != 0)
+				return -1;
+			memset(f->pattern[n], 0, sizeof(f->pattern[n]));
+			f->step[n] = step - 1;
+			f->t_ns[n] = 0;
+			f->rate[n] = rate;
+			nframe = nbit = 0;
+			continue;
+		}
+		if (n < 0)
+			continue;
+		if (strncmp(line, "Current time:", 13) == 0) {
+			if (sscanf(line, "Current time: %8s %8[0-9:].%ld", tbuf, tbuf + 9, &ns) == 3) {
+				tbuf[8] = ' ';
+				f->t_ns[n] = parse_time(tbuf, ns);
+			}
+			continue;
+		}
+		if (strstr(line, "SOM") != NULL)
+			continue;
+		if (sscanf(line, "%x %x %x %x %x %x %x %x %x %x %x", &v[0], &v[1], &v[2], &v[3], &v[4],
+			&v[5], &v[6], &v[7], &v[8], &v[9], &v[10]) == 11) {
+			f->format = HP_FILE_DWORDS;
+			for (i = 0; i < 11; i++)
+				data[i] = v[i];
+			if (nframe < 4)
+				hit_pattern_from_frame(f->pattern[n], nframe++, data);
+			continue;
+		}
+		for (c = line; *c != '\0' && nbit < HP_PICTURE_NBITS; c++) {
+			if (*c != '0' && *c != '1')
+				continue;
+			f->format = HP_FILE_PICTURE;
+			if (*c == '1')
+				f->pattern[n][hp_picture_order[nbit] / 16] |= 1 << (hp_picture_order[nbit] % 16);
+			nbit++;
+		}
+	}
+	f->nsamples = n + 1;
+	if (f->format == 0)
+		f->format = HP_FILE_DWORDS; // header but no frames
+	return 0;
+}
+
+/*
+	hp_file_load()
+
+	Load a whole recording. A step cut short at the end of the file is kept
+	with the frames or bits read so far. Returns -1 if the file cannot be
+	read or is not a hit pattern recording.
+*/
+int hp_file_load(struct hp_file *f, const char *filename) {
+	char head[4];
+	FILE *fptr;
+	long size;
+	int ret;
+
+	memset(f, 0, sizeof(*f));
+	snprintf(f->name, sizeof(f->name), "%s", filename);
+	fptr = fopen(filename, "rb");
+	if (fptr == NULL) {
+		perror(filename);
+		return -1;
+	}
+	fseek(fptr, 0, SEEK_END);
+	size = ftell(fptr);
+	rewind(fptr);
+	if (fread(head, 1, 3, fptr) == 3 && memcmp(head, "N: ", 3) == 0) {
+		rewind(fptr);
+		ret = load_text(f, fptr);
+	} else {
+		rewind(fptr);
+		f->format = HP_FILE_BINARY;
+		ret = load_binary(f, fptr, size);
+	}
+	fclose(fptr);
+	if (ret != 0 || f->format == 0) {
+		fprintf(stderr, "%s: not a hit pattern recording\n", filename);
+		hp_file_free(f);
+		return -1;
+	}
+	return 0;
+}
+
+void hp_file_free_patterns(struct hp_file *f) {
+	free(f->pattern);
+	f->pattern = NULL;
+}
+
+void hp_file_free(struct hp_file *f) {
+	hp_file_free_patterns(f);
+	free(f->t_ns);
+	free(f->step);
+	free(f->rate);
+	f->t_ns = NULL;
+	f->step = NULL;
+	f->rate = NULL;
+	f->nsamples = 0;
+}
@@ -0,0 +1,32 @@
+/*
+ ============================================================================
+ Name        : hp_file.h
+ Description : Reader for the hit pattern recordings of bp_test_pi
+ ============================================================================
+ */
+#ifndef HP_FILE_H
+#define HP_FILE_H
+
+#include "hp_occupancy.h"
+
+#define HP_FILE_BINARY  1   // '$', hitpattern.bin
+#define HP_FILE_DWORDS  2   // '*', hitpattern_dwords.txt
+#define HP_FILE_PICTURE 3   // '9', hitpattern.txt (hit pattern words 0-24 only)
+
+struct hp_file {
+	char name[256];
+	int format;
+	int nsamples;
+	float freq;
+	unsigned short (*pattern)[HP_NWORDS];  // pattern[n] as built by hit_pattern_from_frame()
+	unsigned long long *t_ns;              // UTC time of the step, 0 if not recorded
+	int *step;
+	float *rate;                           // sampling rate in effect, freq unless a rate change was noted
+};
+
+int hp_file_load(struct hp_file *f, const char *filename);
+void hp_file_free_patterns(struct hp_file *f);
+void hp_file_free(struct hp_file *f);
+const char *hp_file_format_name(int format);
+
+#endif
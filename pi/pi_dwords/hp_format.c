@@ -0,0 +1,167 @@
+/*
+ ============================================================================
+ Name        : hp_format.c
+ Description : Writers for the three hit pattern recording formats, byte for
+               byte what the '$', '*' and '9' recorders of bp_test_pi write
+               and hp_file_load() reads back. A record is the four
+               SPI_READ_HIT_PATTERN{,1,2,3} answers of one step, step
+               counting from 0, and the UTC time it was taken.
+ ============================================================================
+ */
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "spicomms.h"
+#include "hp_file.h"
+#include "hp_format.h"
+
+const unsigned short hp_picture_order[HP_PICTURE_NBITS] = {
+	387, 391, 395, 399, 371, 375, 379, 383, 355, 359, 363, 367, 339, 343, 347, 351,
+	323, 327, 331, 335, 386, 390, 394, 398, 370, 374, 378, 382, 354, 358, 362, 366,
+	338, 342, 346, 350, 322, 326, 330, 334, 385, 389, 393, 397, 369, 373, 377, 381,
+	353, 357, 361, 365, 337, 341, 345, 349, 321, 325, 329, 333, 384, 388, 392, 396,
+	368, 372, 376, 380, 352, 356, 360, 364, 336, 340, 344, 348, 320, 324, 328, 332,
+	307, 311, 315, 319, 291, 295, 299, 303, 275, 279, 283, 287, 259, 263, 267, 271,
+	243, 247, 251, 255, 306, 310, 314, 318, 290, 294, 298, 302, 274, 278, 282, 286,
+	258, 262, 266, 270, 242, 246, 250, 254, 305, 309, 313, 317, 289, 293, 297, 301,
+	273, 277, 281, 285, 257, 261, 265, 269, 241, 245, 249, 253, 304, 308, 312, 316,
+	288, 292, 296, 300, 272, 276, 280, 284, 256, 260, 264, 268, 240, 244, 248, 252,
+	227, 231, 235, 239, 211, 215, 219, 223, 195, 199, 203, 207, 179, 183, 187, 191,
+	163, 167, 171, 175, 226, 230, 234, 238, 210, 214, 218, 222, 194, 198, 202, 206,
+	178, 182, 186, 190, 162, 166, 170, 174, 225, 229, 233, 237, 209, 213, 217, 221,
+	193, 197, 201, 205, 177, 181, 185, 189, 161, 165, 169, 173, 224, 228, 232, 236,
+	208, 212, 216, 220, 192, 196, 200, 204, 176, 180, 184, 188, 160, 164, 168, 172,
+	147, 151, 155, 159, 131, 135, 139, 143, 115, 119, 123, 127,  99, 103, 107, 111,
+	 83,  87,  91,  95, 146, 150, 154, 158, 130, 134, 138, 142, 114, 118, 122, 126,
+	 98, 102, 106, 110,  82,  86,  90,  94, 145, 149, 153, 157, 129, 133, 137, 141,
+	113, 117, 121, 125,  97, 101, 105, 109,  81,  85,  89,  93, 144, 148, 152, 156,
+	128, 132, 136, 140, 112, 116, 120, 124,  96, 100, 104, 108,  80,  84,  88,  92,
+	 67,  71,  75,  79,  51,  55,  59,  63,  35,  39,  43,  47,  19,  23,  27,  31,
+	  3,   7,  11,  15,  66,  70,  74,  78,  50,  54,  58,  62,  34,  38,  42,  46,
+	 18,  22,  26,  30,   2,   6,  10,  14,  65,  69,  73,  77,  49,  53,  57,  61,
+	 33,  37,  41,  45,  17,  21,  25,  29,   1,   5,   9,  13,  64,  68,  72,  76,
+	 48,  52,  56,  60,  32,  36,  40,  44,  16,  20,  24,  28,   0,   4,   8,  12,
+};
+
+
+static char rate_note[48];   // for the time field of the next '$' record
+
+static const unsigned short hit_pattern_cw[4] = {
+	SPI_READ_HIT_PATTERN, SPI_READ_HIT_PATTERN1, SPI_READ_HIT_PATTERN2, SPI_READ_HIT_PATTERN3
+};
+
+/* hp_writer_header_fn: the header of a file holding nrecords records,
+   spec->nsamples while that is not known. The binary header keeps its
+   length, so hp_writer patches the final count into it. */
+int hp_format_writer_header(char *buf, int size, long nrecords, void *spec) {
+	const struct hp_format_spec *s = spec;
+	int n = nrecords < 0 ? s->nsamples : (int) nrecords;
+
+	if (s->format == HP_FILE_BINARY) {
+		memcpy(buf, &n, sizeof(n));
+		memcpy(buf + sizeof(n), &s->freq, sizeof(s->freq));
+		return sizeof(n) + sizeof(s->freq);
+	}
+	return snprintf(buf, size, "N: %d, freq: %f\n", n, s->freq);
+}
+
+/* File header, the record count and sampling frequency of the recording */
+void hp_format_header(FILE *fptr, int format, int nsamples, float freq) {
+	struct hp_format_spec spec = { format, nsamples, freq };
+	char buf[64];
+
+	fwrite(buf, hp_format_writer_header(buf, sizeof(buf), nsamples, &spec), 1, fptr);
+}
+
+/* Frame f as transfer_message() returns it for SPI_READ_HIT_PATTERN{,1,2,3} */
+void hp_format_frame(unsigned short *data, const unsigned short *hit_pattern, int f) {
+	int i;
+
+	data[0] = SPI_SOM_TFPGA;
+	data[1] = hit_pattern_cw[f];
+	for (i = 0; i < 8; i++)
+		data[i+2] = hit_pattern[HP_NWORDS - 1 - 8*f - i];
+	data[10] = SPI_EOM_TFPGA;
+}
+
+static void format_dwords(FILE *fptr, const unsigned short *data) {
+	int i;
+
+	fprintf(fptr, " SOM  CMD DW 1 DW 2 DW 3 DW 4 DW 5 DW 6 DW 7 DW 8  EOM\n");
+	for (i = 0; i < 10; i++)
+		fprintf(fptr, "%04x ", data[i]);
+	fprintf(fptr, "%04x\n", data[10]);
+}
+
+/* The camera picture of '9': five rows of modules, four lines of 20 digits */
+static void format_picture(FILE *fptr, unsigned short frames[4][11]) {
+	unsigned short hit_pattern[HP_NWORDS];
+	char line[26];
+	int f, i, nbit, pos, b;
+
+	for (f = 0; f < 4; f++)
+		for (i = 0; i < 8; i++)
+			hit_pattern[31 - 8*f - i] = frames[f][i+2];
+	for (nbit = 0; nbit < HP_PICTURE_NBITS; nbit += 20) {
+		if (nbit % 80 == 0)
+			fputc('\n', fptr);
+		for (i = 0, pos = 0; i < 20; i++) {
+			if (i % 4 == 0)
+				line[pos++] = ' ';
+			b = hp_picture_order[nbit + i];
+			line[pos++] = '0' + ((hit_pattern[b / 16] >> (b % 16)) & 1);
+		}
+		line[pos++] = '\n';
+		fwrite(line, 1, pos, fptr);
+	}
+}
+
+void hp_format_record(FILE *fptr, int format, unsigned short frames[4][11], int step, const struct timespec *ts) {
+	char buff[100];
+	long ns = ts->tv_nsec;
+	int f;
+
+	memset(buff, 0, sizeof(buff));
+	strftime(buff, sizeof(buff), "%D %T", gmtime(&ts->tv_sec));
+	switch (format) {
+	case HP_FILE_BINARY:
+		if (rate_note[0] != '\0') {
+			memcpy(buff + strlen(buff) + 1, rate_note, strlen(rate_note) + 1);
+			rate_note[0] = '\0';
+		}
+		fwrite(frames[0], sizeof(frames[0]), 1, fptr);
+		fwrite(&step, sizeof(step), 1, fptr);
+		fwrite(buff, sizeof(buff), 1, fptr);
+		fwrite(&ns, sizeof(ns), 1, fptr);
+		for (f = 1; f < 4; f++)
+			fwrite(frames[f], sizeof(frames[f]), 1, fptr);
+		break;
+	case HP_FILE_DWORDS:
+		fprintf(fptr, "Step: %d\n", step + 1);
+		fprintf(fptr, "Current time: %s.%09ld UTC\n", buff, ns);
+		for (f = 0; f < 4; f++)
+			format_dwords(fptr, frames[f]);
+		break;
+	case HP_FILE_PICTURE:
+		fprintf(fptr, "Step: %d\n", step + 1);
+		fprintf(fptr, "Current time: %s.%09ld UTC\n", buff, ns);
+		format_picture(fptr, frames);
+		break;
+	}
+}
+
+/*
+	hp_format_rate()
+
+	Note a change of the sampling rate of an adaptive recording (menu 'R')
+	before the next record. The text formats get a "Rate:" line. A binary
+	record has no room for a line, so "rate <Hz> trigger <Hz>" follows the
+	NUL that ends the next record's time string, where readers stop.
+*/
+void hp_format_rate(FILE *fptr, int format, double hz, double trigger_hz) {
+	if (format == HP_FILE_BINARY)
+		snprintf(rate_note, sizeof(rate_note), "rate %.3f trigger %.3f", hz, trigger_hz);
+	else
+		fprintf(fptr, "Rate: %.3f Hz, trigger rate %.3f Hz\n", hz, trigger_hz);
+}
@@ -0,0 +1,33 @@
+/*
+ ============================================================================
+ Name        : hp_format.h
+ Description : Writers for the three hit pattern recording formats
+ ============================================================================
+ */
+#ifndef HP_FORMAT_H
+#define HP_FORMAT_H
+
+#include <stdio.h>
+#include <time.h>
+
+#include "hp_occupancy.h"
+
+#define HP_PICTURE_NBITS 400
+
+/* 16*word+bit of each 0/1 digit of a '9' picture, in file order */
+extern const unsigned short hp_picture_order[HP_PICTURE_NBITS];
+
+/* What the file header of a recording holds */
+struct hp_format_spec {
+	int format;      // HP_FILE_*
+	int nsamples;
+	float freq;
+};
+
+void hp_format_header(FILE *fptr, int format, int nsamples, float freq);
+int hp_format_writer_header(char *buf, int size, long nrecords, void *spec);
+void hp_format_frame(unsigned short *data, const unsigned short *hit_pattern, int f);
+void hp_format_record(FILE *fptr, int format, unsigned short frames[4][11], int step, const struct timespec *ts);
+void hp_format_rate(FILE *fptr, int format, double hz, double trigger_hz);
+
+#endif
@@ -0,0 +1,129 @@
+/*
+ ============================================================================
+ Name        : hp_gen.c
+ Description : Writes synthetic hit pattern recordings in the format of case
+               '$' (hitpattern.bin), for benchmarking the offline tools and
+               the automatic masking away from the telescope.
+
+               hp_gen [-c hp_gen.yml] [-F FPM_config.csv] [-s seed]
+                      [-n nsamples] [-o hitpattern.bin]
+
+               Without -o only the generation rate and a summary of the
+               run are printed.
+ ============================================================================
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "hp_generator.h"
+#include "hp_file.h"
+#include "hp_format.h"
+
+#define BATCH 4096
+
+static double now_s(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void write_record(FILE *fptr, const struct hp_gen_sample *s, int step, time_t t0) {
+	unsigned short frames[4][11];
+	struct timespec ts;
+	int f;
+
+	for (f = 0; f < 4; f++)
+		hp_format_frame(frames[f], s->hit_pattern, f);
+	ts.tv_sec = t0 + s->nstime / 1000000000ULL;
+	ts.tv_nsec = s->nstime % 1000000000ULL;
+	hp_format_record(fptr, HP_FILE_BINARY, frames, step, &ts);
+}
+
+int main(int argc, char **argv) {
+	const char *config_file = "hp_gen.yml", *fpm_file = "FPM_config.csv", *out_file = NULL;
+	const char *seed_arg = NULL;
+	struct hp_gen_config cfg;
+	struct fpm_config fpm;
+	struct hp_geometry geo;
+	static struct hp_gen gen;
+	static struct hp_gen_sample batch[BATCH];
+	unsigned long long type_count[3] = {0, 0, 0}, pixel_hits = 0;
+	long nsamples = 1000000, done, i;
+	int opt, have_fpm, n, w;
+	double t_gen = 0, t_start, t;
+	time_t t0 = time(NULL);
+	FILE *fptr = NULL;
+
+	while ((opt = getopt(argc, argv, "c:F:s:n:o:")) != -1) {
+		switch (opt) {
+		case 'c': config_file = optarg; break;
+		case 'F': fpm_file = optarg; break;
+		case 's': seed_arg = optarg; break;
+		case 'n': nsamples = atol(optarg); break;
+		case 'o': out_file = optarg; break;
+		default:
+			fprintf(stderr, "usage: %s [-c hp_gen.yml] [-F FPM_config.csv] [-s seed] [-n nsamples] [-o hitpattern.bin]\n",
+				argv[0]);
+			return 1;
+		}
+	}
+
+	have_fpm = access(fpm_file, R_OK) == 0 && fpm_config_load(&fpm, fpm_file) == 0;
+	if (hp_gen_config_load(&cfg, have_fpm ? &fpm : NULL, config_file) != 0)
+		return 1;
+	if (seed_arg != NULL)
+		cfg.seed = strtoull(seed_arg, NULL, 0);
+	if (have_fpm)
+		hp_geometry_from_fpm(&geo, &fpm);
+	else
+		hp_geometry_default(&geo);
+	hp_gen_init(&gen, &cfg, &geo);
+
+	if (out_file != NULL) {
+		if (nsamples > 0x7fffffff) {
+			fprintf(stderr, "%s: a recording holds at most %d samples\n", argv[0], 0x7fffffff);
+			return 1;
+		}
+		fptr = fopen(out_file, "wb");
+		if (fptr == NULL) {
+			perror(out_file);
+			return 1;
+		}
+		hp_format_header(fptr, HP_FILE_BINARY, nsamples, gen.rate_hz);
+	}
+
+	t_start = now_s();
+	for (done = 0; done < nsamples; done += n) {
+		n = nsamples - done < BATCH ? nsamples - done : BATCH;
+		t = now_s();
+		for (i = 0; i < n; i++)
+			hp_gen_next(&gen, &batch[i]);
+		t_gen += now_s() - t;
+		for (i = 0; i < n; i++) {
+			type_count[batch[i].type]++;
+			for (w = 0; w < HP_NWORDS; w++)
+				pixel_hits += __builtin_popcount(batch[i].hit_pattern[w]);
+			if (fptr != NULL)
+				write_record(fptr, &batch[i], done + i, t0);
+		}
+	}
+	if (fptr != NULL && fclose(fptr) != 0) {
+		perror(out_file);
+		return 1;
+	}
+
+	printf("seed %llu: %ld samples, %.2f M samples/s generated (%.2f s total)\n",
+		cfg.seed, nsamples, nsamples / t_gen * 1e-6, now_s() - t_start);
+	if (nsamples > 0) {
+		printf("background %.1f%%, Cherenkov %.1f%%, hot pixel %.1f%%, %.2f pixels per pattern\n",
+			100.0 * type_count[HP_GEN_NSB] / nsamples, 100.0 * type_count[HP_GEN_CHERENKOV] / nsamples,
+			100.0 * type_count[HP_GEN_HOT] / nsamples, (double) pixel_hits / nsamples);
+		printf("nsTimer %.3f s, HW triggers %lu (%.1f Hz), TACKs %lu (%.1f Hz)\n", gen.nstime * 1e-9,
+			gen.hwtriggers, gen.hwtriggers / (gen.nstime * 1e-9), gen.tacks, gen.tacks / (gen.nstime * 1e-9));
+	}
+	if (out_file != NULL)
+		printf("written to %s\n", out_file);
+	return 0;
+}
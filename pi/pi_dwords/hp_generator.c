@@ -0,0 +1,357 @@
+/*
+ ============================================================================
+ Name        : hp_generator.c
+ Description : Synthetic camera workload for the backplane emulator and the
+               offline tools. Triggers arrive as a Poisson process made of
+               accidental background triggers, Cherenkov images and
+               triggers caused by hot pixels. The latched hit pattern holds
+               every pixel that fired in the coincidence window: Poisson
+               night sky background per pixel (with per-module scale), hot
+               pixels, and for an image an elliptical cluster of pixel hits
+               at a random position and angle. Pixels masked by the trigger
+               mask neither show up nor trigger. The nsTimer advances by the
+               trigger intervals and the TACK counter follows the trigger
+               counter, less triggers inside the TACK dead time.
+
+               Background hits are drawn by skipping along the stream of
+               focal plane pixels with geometric gaps at the highest pixel
+               probability and thinning to each pixel's own probability,
+               so the cost is per hit rather than per pixel. Everything
+               comes from one xoshiro256** stream seeded from the config,
+               so a seed reproduces a run exactly.
+ ============================================================================
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "bp_config.h"
+#include "hp_generator.h"
+
+static inline unsigned long long rotl(unsigned long long x, int k) {
+	return (x << k) | (x >> (64 - k));
+}
+
+static inline unsigned long long next_u64(struct hp_gen *gen) {
+	unsigned long long *s = gen->s;
+	unsigned long long result = rotl(s[1] * 5, 7) * 9;
+	unsigned long long t = s[1] << 17;
+
+	s[2] ^= s[0];
+	s[3] ^= s[1];
+	s[1] ^= s[2];
+	s[0] ^= s[3];
+	s[2] ^= t;
+	s[3] = rotl(s[3], 45);
+	return result;
+}
+
+/* [0, 1) */
+static inline double uniform(struct hp_gen *gen) {
+	return (next_u64(gen) >> 11) * 0x1.0p-53;
+}
+
+/* (0, 1], safe for log() */
+static inline double uniform_pos(struct hp_gen *gen) {
+	return ((next_u64(gen) >> 11) + 1) * 0x1.0p-53;
+}
+
+static void gauss2(struct hp_gen *gen, double *a, double *b) {
+	double r = sqrt(-2 * log(uniform_pos(gen)));
+	double phi = 2 * M_PI * uniform(gen);
+
+	*a = r * cos(phi);
+	*b = r * sin(phi);
+}
+
+static unsigned long poisson(struct hp_gen *gen, double mean) {
+	double limit, p, a, b;
+	unsigned long k;
+
+	if (mean <= 0)
+		return 0;
+	if (mean > 30) {
+		gauss2(gen, &a, &b);
+		a = floor(mean + sqrt(mean) * a + 0.5);
+		return a > 0 ? (unsigned long) a : 0;
+	}
+	limit = exp(-mean);
+	p = uniform(gen);
+	for (k = 0; p > limit; k++)
+		p *= uniform(gen);
+	return k;
+}
+
+/* Focal plane pixels passed before the next background candidate */
+static inline long long nsb_gap(struct hp_gen *gen) {
+	if (gen->nsb_pmax >= 1)
+		return 0;
+	return (long long) (log(uniform_pos(gen)) / gen->nsb_log1m);
+}
+
+static void seed(struct hp_gen *gen, unsigned long long x) {
+	unsigned long long z;
+	int i;
+
+	// splitmix64, so nearby seeds give unrelated streams
+	for (i = 0; i < 4; i++) {
+		z = (x += 0x9e3779b97f4a7c15ULL);
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+		gen->s[i] = z ^ (z >> 31);
+	}
+}
+
+/*
+	hp_gen_config_load()
+
+	Keys as in hp_gen.yml. hot_pixels is a list of pixel:rate_hz pairs,
+	nsb_scale_<module_id> scales the background of one module (needs the
+	FPM config to find its hit pattern word).
+*/
+int hp_gen_config_load(struct hp_gen_config *cfg, const struct fpm_config *fpm, const char *filename) {
+	struct bp_config c;
+	char *p, *end;
+	long pixel;
+	double rate;
+	int i, w, slot;
+
+	memset(cfg, 0, sizeof(*cfg));
+	if (bp_config_load(&c, filename) != 0)
+		return -1;
+	cfg->seed = strtoull(bp_config_string(&c, "seed", "1"), NULL, 0);
+	cfg->trigger_rate_hz = bp_config_double(&c, "trigger_rate_hz", 200);
+	cfg->window_ns = bp_config_double(&c, "window_ns", 8);
+	cfg->nsb_pixel_rate_hz = bp_config_double(&c, "nsb_pixel_rate_hz", 1e6);
+	cfg->cherenkov_rate_hz = bp_config_double(&c, "cherenkov_rate_hz", 20);
+	cfg->cherenkov_size = bp_config_double(&c, "cherenkov_size", 12);
+	cfg->cherenkov_length = bp_config_double(&c, "cherenkov_length", 2.5);
+	cfg->cherenkov_width = bp_config_double(&c, "cherenkov_width", 0.8);
+	cfg->tack_deadtime_ns = bp_config_double(&c, "tack_deadtime_ns", 0);
+	for (w = 0; w < HP_NWORDS; w++)
+		cfg->nsb_scale[w] = 1;
+
+	for (i = 0; i < c.nkeys; i++) {
+		if (strncmp(c.key[i], "nsb_scale_", 10) != 0)
+			continue;
+		slot = fpm != NULL ? fpm_config_slot_of_module(fpm, atoi(c.key[i] + 10)) : -1;
+		if (slot < 0 || slot >= HP_NWORDS) {
+			fprintf(stderr, "%s: %s, module is not in the FPM config\n", filename, c.key[i]);
+			continue;
+		}
+		cfg->nsb_scale[slot] = atof(c.value[i]);
+	}
+
+	for (p = (char *) bp_config_string(&c, "hot_pixels", ""); *p != '\0'; p = end) {
+		pixel = strtol(p, &end, 10);
+		if (end == p) {
+			end = p + 1;
+			continue;
+		}
+		if (*end != ':') {
+			fprintf(stderr, "%s: hot_pixels takes pixel:rate_hz pairs\n", filename);
+			break;
+		}
+		p = end + 1;
+		rate = strtod(p, &end);
+		if (pixel < 0 || pixel >= HP_NPIXELS || end == p) {
+			fprintf(stderr, "%s: bad hot pixel entry\n", filename);
+			continue;
+		}
+		if (cfg->nhot == HP_GEN_MAX_HOT) {
+			fprintf(stderr, "%s: more than %d hot pixels\n", filename, HP_GEN_MAX_HOT);
+			break;
+		}
+		cfg->hot_pixel[cfg->nhot] = pixel;
+		cfg->hot_rate_hz[cfg->nhot++] = rate;
+	}
+	return 0;
+}
+
+void hp_gen_init(struct hp_gen *gen, const struct hp_gen_config *cfg, const struct hp_geometry *geo) {
+	unsigned short keep[HP_NWORDS];
+	double p[HP_NPIXELS];
+	int w, b, x, y, i, pix;
+
+	memset(gen, 0, sizeof(*gen));
+	gen->cfg = *cfg;
+	seed(gen, cfg->seed);
+
+	for (y = 0; y < HP_CAM_SIZE; y++)
+		for (x = 0; x < HP_CAM_SIZE; x++)
+			gen->cam[y][x] = -1;
+	for (w = 0; w < HP_NWORDS; w++) {
+		if (geo->x0[w] < 0)
+			continue;
+		for (b = 0; b < 16; b++) {
+			pix = 16 * w + b;
+			gen->cam[geo->y0[w] + b % 4][geo->x0[w] + b / 4] = pix;
+			gen->pixel[gen->npixels++] = pix;
+			p[pix] = 1 - exp(-cfg->nsb_pixel_rate_hz * cfg->nsb_scale[w] * cfg->window_ns * 1e-9);
+			if (p[pix] > gen->nsb_pmax)
+				gen->nsb_pmax = p[pix];
+		}
+	}
+	for (i = 0; i < gen->npixels; i++) {
+		pix = gen->pixel[i];
+		gen->nsb_accept[pix] = gen->nsb_pmax > 0 ? p[pix] / gen->nsb_pmax : 0;
+	}
+	if (gen->nsb_pmax > 0 && gen->nsb_pmax < 1)
+		gen->nsb_log1m = log1p(-gen->nsb_pmax);
+	gen->nsb_skip = gen->nsb_pmax > 0 ? nsb_gap(gen) : 0;
+
+	for (i = 0; i < cfg->nhot; i++)
+		gen->hot_p[i] = 1 - exp(-cfg->hot_rate_hz[i] * cfg->window_ns * 1e-9);
+	for (w = 0; w < HP_NWORDS; w++)
+		keep[w] = geo->x0[w] >= 0 ? 0xffff : 0;   // nothing fires off the focal plane
+	hp_gen_set_keep(gen, keep);
+}
+
+/*
+	hp_gen_set_keep()
+
+	Apply a trigger mask, keep[] as from hp_mask_keep(). Masked hot pixels
+	stop causing triggers, so the trigger rate follows the mask.
+*/
+void hp_gen_set_keep(struct hp_gen *gen, const unsigned short *keep) {
+	int i, pix;
+
+	memcpy(gen->keep, keep, sizeof(gen->keep));
+	gen->hot_rate_hz = 0;
+	for (i = 0; i < gen->cfg.nhot; i++) {
+		pix = gen->cfg.hot_pixel[i];
+		if ((keep[pix >> 4] >> (pix & 15)) & 1)
+			gen->hot_rate_hz += gen->cfg.hot_rate_hz[i];
+	}
+	gen->rate_hz = gen->cfg.trigger_rate_hz + gen->cfg.cherenkov_rate_hz + gen->hot_rate_hz;
+	// non-paralyzable dead time: TACK rate r/(1 + r*tau)
+	gen->tack_fraction = 1 / (1 + gen->rate_hz * gen->cfg.tack_deadtime_ns * 1e-9);
+}
+
+static void add_nsb(struct hp_gen *gen, unsigned short *hit_pattern) {
+	long long i = gen->nsb_skip;
+	int pix;
+
+	if (gen->nsb_pmax <= 0)
+		return;
+	while (i < gen->npixels) {
+		pix = gen->pixel[i];
+		if (gen->nsb_accept[pix] >= 1 || uniform(gen) < gen->nsb_accept[pix])
+			hit_pattern[pix >> 4] |= 1 << (pix & 15);
+		i += 1 + nsb_gap(gen);
+	}
+	gen->nsb_skip = i - gen->npixels;
+}
+
+static void add_cherenkov(struct hp_gen *gen, unsigned short *hit_pattern) {
+	double cx, cy, c, s, a, b, x, y;
+	unsigned long n, k;
+	int tries, pix;
+
+	// image centre on the focal plane
+	for (tries = 0; tries < 16; tries++) {
+		cx = HP_CAM_SIZE * uniform(gen);
+		cy = HP_CAM_SIZE * uniform(gen);
+		if (gen->cam[(int) cy][(int) cx] >= 0)
+			break;
+	}
+	a = 2 * M_PI * uniform(gen);
+	c = cos(a);
+	s = sin(a);
+	n = poisson(gen, gen->cfg.cherenkov_size);
+	for (k = 0; k < (n ? n : 1); k++) {
+		gauss2(gen, &a, &b);
+		a *= gen->cfg.cherenkov_length;
+		b *= gen->cfg.cherenkov_width;
+		x = cx + a * c - b * s;
+		y = cy + a * s + b * c;
+		if (x < 0 || y < 0 || x >= HP_CAM_SIZE || y >= HP_CAM_SIZE)
+			continue;
+		pix = gen->cam[(int) y][(int) x];
+		if (pix >= 0)
+			hit_pattern[pix >> 4] |= 1 << (pix & 15);
+	}
+}
+
+/* One latched hit pattern, returns the kind of trigger that latched it */
+int hp_gen_pattern(struct hp_gen *gen, unsigned short *hit_pattern) {
+	double u;
+	int i, pix, type = HP_GEN_NSB;
+
+	memset(hit_pattern, 0, HP_NWORDS * sizeof(*hit_pattern));
+	add_nsb(gen, hit_pattern);
+	for (i = 0; i < gen->cfg.nhot; i++) {
+		if (gen->hot_p[i] > 0 && uniform(gen) < gen->hot_p[i]) {
+			pix = gen->cfg.hot_pixel[i];
+			hit_pattern[pix >> 4] |= 1 << (pix & 15);
+		}
+	}
+
+	u = uniform(gen) * gen->rate_hz;
+	if (u >= gen->cfg.trigger_rate_hz) {
+		u -= gen->cfg.trigger_rate_hz;
+		if (u < gen->cfg.cherenkov_rate_hz) {
+			type = HP_GEN_CHERENKOV;
+			add_cherenkov(gen, hit_pattern);
+		} else {
+			u -= gen->cfg.cherenkov_rate_hz;
+			for (i = 0; i < gen->cfg.nhot; i++) {
+				pix = gen->cfg.hot_pixel[i];
+				if (!((gen->keep[pix >> 4] >> (pix & 15)) & 1))
+					continue;
+				if (u < gen->cfg.hot_rate_hz[i] || i == gen->cfg.nhot - 1) {
+					type = HP_GEN_HOT;
+					hit_pattern[pix >> 4] |= 1 << (pix & 15);
+					break;
+				}
+				u -= gen->cfg.hot_rate_hz[i];
+			}
+		}
+	}
+
+	for (i = 0; i < HP_NWORDS; i++)
+		hit_pattern[i] &= gen->keep[i];
+	return type;
+}
+
+/* The next trigger, its time, counters and hit pattern */
+void hp_gen_next(struct hp_gen *gen, struct hp_gen_sample *sample) {
+	if (gen->rate_hz > 0)
+		gen->nstime += (unsigned long long) (-log(uniform_pos(gen)) / gen->rate_hz * 1e9 + 0.5);
+	gen->hwtriggers++;
+	if (!gen->have_tack || gen->nstime - gen->last_tack_ns >= gen->cfg.tack_deadtime_ns) {
+		gen->tacks++;
+		gen->last_tack_ns = gen->nstime;
+		gen->have_tack = 1;
+	}
+	sample->type = hp_gen_pattern(gen, sample->hit_pattern);
+	sample->nstime = gen->nstime;
+	sample->hwtriggers = gen->hwtriggers;
+	sample->tacks = gen->tacks;
+}
+
+/*
+	hp_gen_advance()
+
+	Move the nsTimer on by dt_ns without making the patterns in between,
+	for a polled TFPGA that only shows counters and the last pattern. The
+	trigger count is one Poisson draw, the TACKs follow at the mean dead
+	time fraction. Returns the number of triggers.
+*/
+unsigned long hp_gen_advance(struct hp_gen *gen, unsigned long long dt_ns) {
+	unsigned long n = poisson(gen, gen->rate_hz * dt_ns * 1e-9);
+	unsigned long k;
+
+	gen->nstime += dt_ns;
+	gen->hwtriggers += n;
+	gen->tack_carry += n * gen->tack_fraction;
+	k = (unsigned long) gen->tack_carry;
+	gen->tacks += k;
+	gen->tack_carry -= k;
+	if (n > 0) {
+		gen->last_tack_ns = gen->nstime;
+		gen->have_tack = 1;
+	}
+	return n;
+}
@@ -0,0 +1,74 @@
+/*
+ ============================================================================
+ Name        : hp_generator.h
+ Description : Synthetic camera workload, hit patterns and TFPGA counters
+ ============================================================================
+ */
+#ifndef HP_GENERATOR_H
+#define HP_GENERATOR_H
+
+#include "fpm_config.h"
+#include "hp_camera.h"
+#include "hp_occupancy.h"
+
+#define HP_GEN_MAX_HOT 64
+
+#define HP_GEN_NSB       0   // accidental trigger on night sky background
+#define HP_GEN_HOT       1   // trigger caused by a hot pixel
+#define HP_GEN_CHERENKOV 2   // shower image
+
+struct hp_gen_config {
+	unsigned long long seed;
+	double trigger_rate_hz;          // accidental triggers on the background
+	double window_ns;                // the hit pattern shows pixels fired within this
+	double nsb_pixel_rate_hz;        // background rate of each trigger pixel
+	double nsb_scale[HP_NWORDS];     // per hit pattern word, nsb_scale_<module_id>
+	int nhot;
+	int hot_pixel[HP_GEN_MAX_HOT];   // 16*word + bit
+	double hot_rate_hz[HP_GEN_MAX_HOT];
+	double cherenkov_rate_hz;
+	double cherenkov_size;           // mean pixel hits per image
+	double cherenkov_length;         // rms along / across the image axis, in pixels
+	double cherenkov_width;
+	double tack_deadtime_ns;         // triggers closer than this to the last TACK get none
+};
+
+struct hp_gen_sample {
+	unsigned long long nstime;       // TFPGA nsTimer at the trigger
+	unsigned long hwtriggers;        // counters after the trigger, as 'c' shows them
+	unsigned long tacks;
+	int type;
+	unsigned short hit_pattern[HP_NWORDS];
+};
+
+struct hp_gen {
+	struct hp_gen_config cfg;
+	unsigned long long s[4];                // xoshiro256** state
+	short cam[HP_CAM_SIZE][HP_CAM_SIZE];    // [y][x] to pixel, -1 off the focal plane
+	int npixels;
+	short pixel[HP_NPIXELS];                // focal plane pixels
+	float nsb_accept[HP_NPIXELS];           // pixel probability / nsb_pmax
+	double nsb_pmax;
+	double nsb_log1m;                       // log(1 - nsb_pmax)
+	long long nsb_skip;                     // focal plane pixels to pass before the next candidate
+	double hot_p[HP_GEN_MAX_HOT];           // hot pixel in the window of any trigger
+	unsigned short keep[HP_NWORDS];         // pixels the trigger mask leaves enabled
+	double rate_hz;                         // total trigger rate with the current mask
+	double hot_rate_hz;                     // of which from enabled hot pixels
+	double tack_fraction;                   // TACKs per trigger, for hp_gen_advance()
+	double tack_carry;
+	unsigned long long nstime;
+	unsigned long long last_tack_ns;
+	unsigned long hwtriggers;
+	unsigned long tacks;
+	int have_tack;
+};
+
+int hp_gen_config_load(struct hp_gen_config *cfg, const struct fpm_config *fpm, const char *filename);
+void hp_gen_init(struct hp_gen *gen, const struct hp_gen_config *cfg, const struct hp_geometry *geo);
+void hp_gen_set_keep(struct hp_gen *gen, const unsigned short *keep);
+void hp_gen_next(struct hp_gen *gen, struct hp_gen_sample *sample);
+int hp_gen_pattern(struct hp_gen *gen, unsigned short *hit_pattern);
+unsigned long hp_gen_advance(struct hp_gen *gen, unsigned long long dt_ns);
+
+#endif
@@ -0,0 +1,495 @@
+/*
+ ============================================================================
+ Name        : hp_index.c
+ Description : Pixel to sample inverted index over hit pattern recordings.
+               Building writes, for every one of the 512 trigger pixels, a
+               compressed bitmap of the sample numbers where it was hit,
+               next to the sample times. Queries combine those bitmaps
+               with AND/OR/NOT and a time window, reading only the pixels
+               named in the query from the mmap'ed index, so answering
+               does not mean rescanning the run.
+
+               hp_index -b [-o out.hpx] recording ...
+               hp_index [-c FPM_config.csv] [-f from] [-u until] [-l] [-n max]
+                        'query' index.hpx ...
+
+               query: atoms p<pixel> (16*word+bit), <word>:<bit>, w<word>
+                      (any pixel of that hit pattern word) and m<module_id>,
+                      combined with & | ! and parentheses, e.g.
+                      "p352 & p356", "m111 & !(p177 | 2:3)".
+               from/until: "YYYY-mm-dd HH:MM:SS[.s]" UTC or "+seconds" from
+                      the first sample.
+ ============================================================================
+ */
+#define _GNU_SOURCE // timegm
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "fpm_config.h"
+#include "hp_file.h"
+#include "hp_roaring.h"
+
+#define HPX_MAGIC "HPX1"
+
+struct hpx_header {
+	char magic[4];
+	unsigned int npixels;
+	unsigned long long nsamples;
+	unsigned long long t_offset;                      // nsamples UTC times in ns
+	unsigned long long pixel_offset[HP_NPIXELS + 1];  // serialized bitmap of pixel p
+	char source[256];
+};
+
+struct hpx {
+	const struct hpx_header *head;
+	const unsigned long long *t_ns;
+	size_t size;
+	void *map;
+};
+
+struct query {
+	const char *s;
+	const struct hpx *ix;
+	const struct fpm_config *fpm;
+	unsigned int lo, hi;          // time window as sample numbers
+	int windowed;                 // the window is narrower than the recording
+	struct roaring universe;      // lo..hi, built on first use
+	int have_universe;
+	const char *error;
+};
+
+static int build_index(const char *recording, const char *out_file) {
+	struct hpx_header head;
+	struct hp_file f;
+	struct roaring *rb;
+	char name[512];
+	unsigned int w, word, bit;
+	int n, p;
+	FILE *fptr;
+
+	if (hp_file_load(&f, recording) != 0)
+		return -1;
+	rb = calloc(HP_NPIXELS, sizeof(*rb));
+	if (rb == NULL) {
+		hp_file_free(&f);
+		return -1;
+	}
+	for (n = 0; n < f.nsamples; n++) {
+		for (w = 0; w < HP_NWORDS; w++) {
+			for (word = f.pattern[n][w]; word; word &= word - 1) {
+				bit = __builtin_ctz(word);
+				rb_append(&rb[16 * w + bit], n);
+			}
+		}
+	}
+
+	if (out_file == NULL) {
+		snprintf(name, sizeof(name), "%s.hpx", recording);
+		out_file = name;
+	}
+	fptr = fopen(out_file, "wb");
+	if (fptr == NULL) {
+		perror(out_file);
+		return -1;
+	}
+	memset(&head, 0, sizeof(head));
+	memcpy(head.magic, HPX_MAGIC, 4);
+	head.npixels = HP_NPIXELS;
+	head.nsamples = f.nsamples;
+	snprintf(head.source, sizeof(head.source), "%s", recording);
+	fwrite(&head, sizeof(head), 1, fptr);
+	head.t_offset = sizeof(head);
+	fwrite(f.t_ns, sizeof(*f.t_ns), f.nsamples, fptr);
+	head.pixel_offset[0] = head.t_offset + f.nsamples * sizeof(*f.t_ns);
+	for (p = 0; p < HP_NPIXELS; p++) {
+		head.pixel_offset[p + 1] = head.pixel_offset[p] + rb_write(&rb[p], fptr);
+		rb_free(&rb[p]);
+	}
+	rewind(fptr);
+	fwrite(&head, sizeof(head), 1, fptr);
+	if (fclose(fptr) != 0) {
+		perror(out_file);
+		return -1;
+	}
+	printf("%s: %d samples indexed, %.1f kB of bitmaps, written to %s\n", recording, f.nsamples,
+		(head.pixel_offset[HP_NPIXELS] - head.pixel_offset[0]) / 1024.0, out_file);
+	free(rb);
+	hp_file_free(&f);
+	return 0;
+}
+
+static int open_index(struct hpx *ix, const char *filename) {
+	struct stat st;
+	int fd;
+
+	memset(ix, 0, sizeof(*ix));
+	fd = open(filename, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) != 0) {
+		perror(filename);
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+	ix->size = st.st_size;
+	ix->map = ix->size >= sizeof(struct hpx_header) ?
+		mmap(NULL, ix->size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+	close(fd);
+	if (ix->map == MAP_FAILED) {
+		fprintf(stderr, "%s: not a hit pattern index\n", filename);
+		return -1;
+	}
+	ix->head = ix->map;
+	if (memcmp(ix->head->magic, HPX_MAGIC, 4) != 0 || ix->head->npixels != HP_NPIXELS ||
+		ix->head->pixel_offset[HP_NPIXELS] > ix->size) {
+		fprintf(stderr, "%s: not a hit pattern index\n", filename);
+		munmap(ix->map, ix->size);
+		return -1;
+	}
+	ix->t_ns = (const unsigned long long *) ((const char *) ix->map + ix->head->t_offset);
+	return 0;
+}
+
+static void close_index(struct hpx *ix) {
+	munmap(ix->map, ix->size);
+}
+
+/* First sample at or after t (before, for the end of a window) */
+static unsigned long long sample_at(const struct hpx *ix, unsigned long long t) {
+	unsigned long long lo = 0, hi = ix->head->nsamples, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (ix->t_ns[mid] < t)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* UTC "YYYY-mm-dd HH:MM:SS[.s]" or "+seconds" from the first sample, to ns */
+static int parse_time(const char *s, unsigned long long first_ns, unsigned long long *t) {
+	struct tm tm;
+	double frac = 0;
+	int nf;
+
+	if (s[0] == '+') {
+		*t = first_ns + (unsigned long long) (atof(s + 1) * 1e9);
+		return 0;
+	}
+	memset(&tm, 0, sizeof(tm));
+	nf = sscanf(s, "%d-%d-%d%*[ T]%d:%d:%d%lf", &tm.tm_year, &tm.tm_mon, &tm.tm_mday,
+		&tm.tm_hour, &tm.tm_min, &tm.tm_sec, &frac);
+	if (nf < 6)
+		return -1;
+	tm.tm_year -= 1900;
+	tm.tm_mon -= 1;
+	*t = (unsigned long long) timegm(&tm) * 1000000000ULL + (unsigned long long) (frac * 1e9);
+	return 0;
+}
+
+static void pixel_bitmap(struct query *q, int pixel, struct roaring *out) {
+	const unsigned long long *off = q->ix->head->pixel_offset;
+
+	if (rb_map(out, (const char *) q->ix->map + off[pixel], off[pixel + 1] - off[pixel]) != 0)
+		q->error = "corrupt index";
+}
+
+/* OR of the 16 pixels of hit pattern word w */
+static void word_bitmap(struct query *q, int w, struct roaring *out) {
+	struct roaring acc, pix, tmp;
+	int b;
+
+	rb_init(&acc);
+	for (b = 0; b < 16; b++) {
+		pixel_bitmap(q, 16 * w + b, &pix);
+		rb_or(&tmp, &acc, &pix);
+		rb_free(&acc);
+		rb_free(&pix);
+		acc = tmp;
+	}
+	*out = acc;
+}
+
+static const struct roaring *universe(struct query *q) {
+	if (!q->have_universe) {
+		rb_range(&q->universe, q->lo, q->hi);
+		q->have_universe = 1;
+	}
+	return &q->universe;
+}
+
+static void skip_space(struct query *q) {
+	while (isspace((unsigned char) *q->s))
+		q->s++;
+}
+
+static void parse_expr(struct query *q, struct roaring *out);
+
+static void parse_atom(struct query *q, struct roaring *out) {
+	char *end;
+	long a, b;
+	int slot;
+
+	rb_init(out);
+	skip_space(q);
+	if (*q->s == '(') {
+		q->s++;
+		parse_expr(q, out);
+		skip_space(q);
+		if (*q->s != ')')
+			q->error = "missing )";
+		else
+			q->s++;
+		return;
+	}
+	if (*q->s == 'p' || *q->s == 'w' || *q->s == 'm') {
+		a = strtol(q->s + 1, &end, 10);
+		if (end == q->s + 1) {
+			q->error = "expected a number";
+			return;
+		}
+		switch (*q->s) {
+		case 'p':
+			if (a < 0 || a >= HP_NPIXELS)
+				q->error = "pixel out of range";
+			else
+				pixel_bitmap(q, a, out);
+			break;
+		case 'w':
+			if (a < 0 || a >= HP_NWORDS)
+				q->error = "word out of range";
+			else
+				word_bitmap(q, a, out);
+			break;
+		case 'm':
+			slot = q->fpm ? fpm_config_slot_of_module(q->fpm, a) : -1;
+			if (slot < 0)
+				q->error = "module not in the FPM config";
+			else
+				word_bitmap(q, slot, out);
+			break;
+		}
+		q->s = end;
+		return;
+	}
+	a = strtol(q->s, &end, 10);
+	if (end != q->s && *end == ':') {
+		q->s = end + 1;
+		b = strtol(q->s, &end, 10);
+		if (end == q->s || a < 0 || a >= HP_NWORDS || b < 0 || b > 15)
+			q->error = "expected word:bit";
+		else
+			pixel_bitmap(q, 16 * a + b, out);
+		q->s = end;
+		return;
+	}
+	q->error = "expected p<pixel>, <word>:<bit>, w<word>, m<module> or (";
+}
+
+static int parse_factor(struct query *q, struct roaring *out) {
+	int negated = 0;
+
+	skip_space(q);
+	while (*q->s == '!') {
+		negated = !negated;
+		q->s++;
+		skip_space(q);
+	}
+	parse_atom(q, out);
+	return negated;
+}
+
+/*
+	parse_term()
+
+	Factors joined by &. Every result is kept inside the universe (the
+	time window), and a negated factor is applied as AND NOT so that the
+	complement is never built unless the term starts with it. The
+	universe itself is only built for a term starting with a negation or
+	when a time window cuts the recording; otherwise the pixel bitmaps
+	already hold only samples of the recording.
+*/
+static void parse_term(struct query *q, struct roaring *out) {
+	struct roaring f, tmp;
+	int negated;
+
+	negated = parse_factor(q, &f);
+	if (negated) {
+		rb_andnot(out, universe(q), &f);
+	} else if (q->windowed) {
+		rb_and(out, universe(q), &f);
+	} else {
+		*out = f;
+		rb_init(&f);
+	}
+	rb_free(&f);
+	for (;;) {
+		skip_space(q);
+		if (*q->s != '&' || q->error)
+			return;
+		q->s++;
+		negated = parse_factor(q, &f);
+		if (negated)
+			rb_andnot(&tmp, out, &f);
+		else
+			rb_and(&tmp, out, &f);
+		rb_free(&f);
+		rb_free(out);
+		*out = tmp;
+	}
+}
+
+static void parse_expr(struct query *q, struct roaring *out) {
+	struct roaring t, tmp;
+
+	parse_term(q, out);
+	for (;;) {
+		skip_space(q);
+		if (*q->s != '|' || q->error)
+			return;
+		q->s++;
+		parse_term(q, &t);
+		rb_or(&tmp, out, &t);
+		rb_free(&t);
+		rb_free(out);
+		*out = tmp;
+	}
+}
+
+struct listing {
+	const struct hpx *ix;
+	int left;
+};
+
+static int print_sample(unsigned int v, void *arg) {
+	struct listing *l = arg;
+	unsigned long long t = l->ix->t_ns[v];
+	time_t sec = t / 1000000000ULL;
+	char buff[32];
+
+	if (l->left-- == 0)
+		return 1;
+	strftime(buff, sizeof(buff), "%Y-%m-%d %H:%M:%S", gmtime(&sec));
+	printf("  %8u  %s.%09llu UTC\n", v, buff, t % 1000000000ULL);
+	return 0;
+}
+
+static int run_query(const char *expr, const char *index_file, const struct fpm_config *fpm,
+	const char *from, const char *until, int max_list) {
+	struct hpx ix;
+	struct query q;
+	struct roaring result;
+	struct listing listing;
+	unsigned long long lo, hi, t, first;
+	struct timespec t0, t1;
+
+	if (open_index(&ix, index_file) != 0)
+		return -1;
+	lo = 0;
+	hi = ix.head->nsamples;
+	first = hi ? ix.t_ns[0] : 0;
+	if ((from != NULL || until != NULL) && first == 0) {
+		fprintf(stderr, "%s: recording has no sample times\n", index_file);
+		close_index(&ix);
+		return -1;
+	}
+	if (from != NULL) {
+		if (parse_time(from, first, &t) != 0) {
+			fprintf(stderr, "cannot read time '%s'\n", from);
+			close_index(&ix);
+			return -1;
+		}
+		lo = sample_at(&ix, t);
+	}
+	if (until != NULL) {
+		if (parse_time(until, first, &t) != 0) {
+			fprintf(stderr, "cannot read time '%s'\n", until);
+			close_index(&ix);
+			return -1;
+		}
+		hi = sample_at(&ix, t + 1);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	memset(&q, 0, sizeof(q));
+	q.s = expr;
+	q.ix = &ix;
+	q.fpm = fpm;
+	q.lo = lo;
+	q.hi = hi > lo ? hi : lo;
+	q.windowed = lo > 0 || hi < ix.head->nsamples;
+	rb_init(&q.universe);
+	parse_expr(&q, &result);
+	skip_space(&q);
+	if (q.error == NULL && *q.s != '\0')
+		q.error = "unexpected text";
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	if (q.error != NULL) {
+		fprintf(stderr, "query error at '%s': %s\n", q.s, q.error);
+		rb_free(&result);
+		rb_free(&q.universe);
+		close_index(&ix);
+		return -1;
+	}
+
+	printf("%s: %llu of %llu samples (%llu-%llu) match, %.3f ms\n", ix.head->source,
+		rb_cardinality(&result), hi > lo ? hi - lo : 0, lo, hi,
+		(t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) * 1e-6);
+	listing.ix = &ix;
+	listing.left = max_list;
+	rb_foreach(&result, print_sample, &listing);
+	rb_free(&result);
+	rb_free(&q.universe);
+	close_index(&ix);
+	return 0;
+}
+
+int main(int argc, char **argv) {
+	const char *fpm_file = "FPM_config.csv", *out_file = NULL, *from = NULL, *until = NULL, *expr;
+	struct fpm_config fpm;
+	int build = 0, max_list = 20, opt, i, ret = 0, have_fpm;
+
+	while ((opt = getopt(argc, argv, "bo:c:f:u:ln:")) != -1) {
+		switch (opt) {
+		case 'b': build = 1; break;
+		case 'o': out_file = optarg; break;
+		case 'c': fpm_file = optarg; break;
+		case 'f': from = optarg; break;
+		case 'u': until = optarg; break;
+		case 'l': max_list = -1; break;
+		case 'n': max_list = atoi(optarg); break;
+		default:
+			fprintf(stderr, "usage: %s -b [-o out.hpx] recording ...\n"
+				"       %s [-c FPM_config.csv] [-f from] [-u until] [-l] [-n max] 'query' index.hpx ...\n",
+				argv[0], argv[0]);
+			return 1;
+		}
+	}
+	if (build) {
+		if (optind == argc || (out_file != NULL && argc - optind > 1)) {
+			fprintf(stderr, "%s: give recordings to index, -o only with a single one\n", argv[0]);
+			return 1;
+		}
+		for (i = optind; i < argc; i++)
+			ret |= build_index(argv[i], out_file) != 0;
+		return ret;
+	}
+
+	if (argc - optind < 2) {
+		fprintf(stderr, "%s: give a query and one or more index files\n", argv[0]);
+		return 1;
+	}
+	expr = argv[optind];
+	have_fpm = access(fpm_file, R_OK) == 0 && fpm_config_load(&fpm, fpm_file) == 0;
+	for (i = optind + 1; i < argc; i++)
+		ret |= run_query(expr, argv[i], have_fpm ? &fpm : NULL, from, until, max_list) != 0;
+	return ret;
+}
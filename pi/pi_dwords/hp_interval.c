@@ -0,0 +1,309 @@
+/*
+ ============================================================================
+ Name        : hp_interval.c
+ Description : Inter-trigger interval histograms (menu 'T'). The TFPGA
+               keeps the nsTimer of the last trigger
+               (SPI_READ_TRIGGER_NSTIMER_TFPGA), so polling it shows each
+               new trigger as long as triggers are further apart than the
+               polls. A poll that finds a new time reads the counters:
+               when exactly one trigger came since the last time seen,
+               the difference of the two times is an exact interval and
+               goes into a log-binned histogram; when several came, the
+               ones in between were missed and only counted.
+
+               For a Poisson process the intervals are exponential at the
+               rate the counters give. Every interval longer than the time
+               between two polls is seen, so the histogram is compared
+               with that exponential from twice the poll gap that 99.9 %
+               of the polls keep (the gaps are histogrammed too, the
+               scheduler stretches some) up:
+               an excess of short intervals points at afterpulsing, one
+               at a fixed interval, or long intervals cut short, at a
+               flasher or other periodic pickup, a deficit at the short
+               end at holdoff (the bins after it then follow from the
+               normalisation). Below the poll time
+               the histogram is blind, there the number of polls that
+               found several triggers is compared with Poisson instead.
+ ============================================================================
+ */
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+
+#include "bp_config.h"
+#include "hp_interval.h"
+
+/*
+	hp_interval_load()
+
+	Defaults if config_file does not exist: polls as fast as the SPI
+	allows, 10 bins per decade from 1 us to 100 s, 4 sigma reported,
+	trigger_intervals.txt every 10 s.
+*/
+int hp_interval_load(struct hp_interval *h, const char *config_file) {
+	struct bp_config cfg;
+	int status = 0;
+
+	memset(h, 0, sizeof(*h));
+	memset(&cfg, 0, sizeof(cfg));
+	if (access(config_file, R_OK) == 0)
+		status = bp_config_load(&cfg, config_file);
+	h->poll_us = bp_config_double(&cfg, "poll_us", 0);
+	h->min_ns = bp_config_double(&cfg, "min_ns", 1000);
+	h->decades = bp_config_double(&cfg, "decades", 8);
+	h->bins_per_decade = bp_config_double(&cfg, "bins_per_decade", 10);
+	h->pull_limit = bp_config_double(&cfg, "pull_limit", 4);
+	h->export_s = bp_config_double(&cfg, "export_s", 10);
+	snprintf(h->export_file, sizeof(h->export_file), "%s",
+		bp_config_string(&cfg, "export_file", "trigger_intervals.txt"));
+	if (h->min_ns < 1)
+		h->min_ns = 1;
+	if (h->bins_per_decade < 1)
+		h->bins_per_decade = 10;
+	if (h->decades < 1 || h->decades * h->bins_per_decade > HP_INTERVAL_MAX_BINS)
+		h->decades = HP_INTERVAL_MAX_BINS / h->bins_per_decade;
+	h->nbins = h->decades * h->bins_per_decade;
+	return status;
+}
+
+void hp_interval_start(struct hp_interval *h) {
+	memset(h->counts, 0, sizeof(h->counts));
+	h->underflow = h->overflow = 0;
+	memset(h->gap_counts, 0, sizeof(h->gap_counts));
+	h->polls = h->elapsed_ns = h->triggers = h->intervals = h->missed = h->multi_polls = 0;
+	h->last_poll_ns = h->max_gap_ns = 0;
+	h->have_last = h->have_trigger = 0;
+}
+
+/* Lower edge of bin, nbins gives the upper edge of the last */
+double hp_interval_edge(const struct hp_interval *h, int bin) {
+	return h->min_ns * pow(10, (double) bin / h->bins_per_decade);
+}
+
+static double gap_edge(int bin) {
+	return 10 * pow(10, bin / 10.0);
+}
+
+/* A read of the last trigger time at CLOCK_MONOTONIC now_ns. Returns 1
+   when it moved, the counters are then needed. */
+int hp_interval_poll(struct hp_interval *h, unsigned long long last_trigger_ns, unsigned long long now_ns) {
+	unsigned long long gap;
+	int bin;
+
+	if (h->last_poll_ns > 0 && now_ns > h->last_poll_ns) {
+		gap = now_ns - h->last_poll_ns;
+		bin = gap < 10 ? 0 : (int) floor(log10(gap / 10.0) * 10);
+		h->gap_counts[bin < HP_INTERVAL_GAP_BINS ? bin : HP_INTERVAL_GAP_BINS - 1]++;
+		if (gap > h->max_gap_ns)
+			h->max_gap_ns = gap;
+	}
+	h->last_poll_ns = now_ns;
+	h->polls++;
+	return !h->have_last || last_trigger_ns != h->last_trigger_ns;
+}
+
+/*
+	hp_interval_update()
+
+	Counters (SPI_READ_nsTimer_TFPGA) and a last trigger time read after
+	them that had not moved since before them, so both belong together.
+*/
+void hp_interval_update(struct hp_interval *h, unsigned long long nstime, unsigned long hwtriggers,
+	unsigned long long last_trigger_ns) {
+	unsigned long k;
+	double dt;
+	int bin;
+
+	// first reading, or a SYNC or 'l' reset the counters: no interval spans it
+	if (!h->have_last || hwtriggers < h->last_hwtriggers || nstime < h->last_nstime) {
+		h->have_trigger = hwtriggers > 0;
+		goto keep;
+	}
+	h->elapsed_ns += nstime - h->last_nstime;
+	k = hwtriggers - h->last_hwtriggers;
+	h->triggers += k;
+	if (k > 1) {
+		h->missed += k - 1;
+		h->multi_polls++;
+	} else if (k == 1 && h->have_trigger && last_trigger_ns > h->last_trigger_ns) {
+		dt = last_trigger_ns - h->last_trigger_ns;
+		h->intervals++;
+		if (dt < h->min_ns) {
+			h->underflow++;
+		} else {
+			bin = (int) floor(log10(dt / h->min_ns) * h->bins_per_decade);
+			if (bin >= h->nbins)
+				h->overflow++;
+			else
+				h->counts[bin]++;
+		}
+	}
+	if (k > 0)
+		h->have_trigger = 1;
+keep:
+	h->last_nstime = nstime;
+	h->last_hwtriggers = hwtriggers;
+	h->last_trigger_ns = last_trigger_ns;
+	h->have_last = 1;
+}
+
+static const char *format_ns(char *buf, double ns) {
+	if (ns < 1e3)
+		sprintf(buf, "%.0f ns", ns);
+	else if (ns < 1e6)
+		sprintf(buf, "%.3g us", ns * 1e-3);
+	else if (ns < 1e9)
+		sprintf(buf, "%.3g ms", ns * 1e-6);
+	else
+		sprintf(buf, "%.3g s", ns * 1e-9);
+	return buf;
+}
+
+static void finding(struct hp_interval_fit *fit, const char *what, double lo, double hi, const char *hint) {
+	char a[16], b[16];
+
+	if (fit->nfindings < HP_INTERVAL_MAX_FINDINGS)
+		snprintf(fit->findings[fit->nfindings++], sizeof(fit->findings[0]), "%s %s-%s: %s", what,
+			format_ns(a, lo), format_ns(b, hi), hint);
+}
+
+/*
+	hp_interval_fit()
+
+	Expected counts for a Poisson process at the counter rate, normalised
+	to the intervals seen above the cutoff, pulls (counts - expected) /
+	sqrt(expected), and what the runs of bins beyond pull_limit suggest.
+*/
+void hp_interval_fit(const struct hp_interval *h, struct hp_interval_fit *fit) {
+	double lambda, norm, lo, hi, x, pull;
+	char a[16];
+	unsigned long long nfit = 0, ngaps = 0, sum = 0;
+	int b, start, sign;
+
+	memset(fit, 0, sizeof(*fit));
+	if (h->elapsed_ns == 0 || h->polls == 0)
+		return;
+	fit->rate_hz = h->triggers / (h->elapsed_ns * 1e-9);
+	fit->poll_ns = (double) h->elapsed_ns / h->polls;
+	lambda = fit->rate_hz * 1e-9;
+	// the gaps decide which intervals are always seen and how often a poll
+	// finds several triggers: 1 - P(0) - P(1) of a gap at the rate
+	for (b = 0; b < HP_INTERVAL_GAP_BINS; b++)
+		ngaps += h->gap_counts[b];
+	for (b = 0; b < HP_INTERVAL_GAP_BINS; b++) {
+		sum += h->gap_counts[b];
+		x = lambda * sqrt(gap_edge(b) * gap_edge(b + 1));
+		fit->multi_expected += h->gap_counts[b] * (1 - exp(-x) * (1 + x));
+		if (fit->gap_ns == 0 && sum >= 0.999 * ngaps)
+			fit->gap_ns = gap_edge(b + 1);
+	}
+	fit->cutoff_ns = 2 * fit->gap_ns;
+	for (b = 0; b < h->nbins && hp_interval_edge(h, b) < fit->cutoff_ns; b++)
+		;
+	fit->first_bin = b;
+	for (b = fit->first_bin; b < h->nbins; b++)
+		nfit += h->counts[b];
+	nfit += h->overflow;
+
+	norm = exp(-lambda * hp_interval_edge(h, fit->first_bin));
+	for (b = fit->first_bin; b < h->nbins; b++) {
+		lo = hp_interval_edge(h, b);
+		hi = hp_interval_edge(h, b + 1);
+		fit->expected[b] = norm > 0 ? nfit * (exp(-lambda * lo) - exp(-lambda * hi)) / norm : 0;
+		fit->pull[b] = (h->counts[b] - fit->expected[b]) / sqrt(fit->expected[b] > 1 ? fit->expected[b] : 1);
+		if (fit->expected[b] >= 5) {
+			fit->chi2 += fit->pull[b] * fit->pull[b];
+			fit->ndf++;
+		}
+	}
+	if (fit->ndf > 0)
+		fit->ndf--;   // the normalisation
+
+	if (nfit < 100) {
+		snprintf(fit->findings[fit->nfindings++], sizeof(fit->findings[0]),
+			"too few intervals above %s to compare with Poisson", format_ns(a, fit->cutoff_ns));
+		return;
+	}
+	// runs of bins on the same side of the limit
+	for (b = fit->first_bin; b < h->nbins; ) {
+		sign = fit->pull[b] > h->pull_limit ? 1 : fit->pull[b] < -h->pull_limit ? -1 : 0;
+		if (sign == 0) {
+			b++;
+			continue;
+		}
+		for (start = b; b < h->nbins && (sign > 0 ? fit->pull[b] > h->pull_limit : fit->pull[b] < -h->pull_limit); b++)
+			;
+		lo = hp_interval_edge(h, start);
+		hi = hp_interval_edge(h, b);
+		if (sign > 0 && hi <= 1e6)
+			finding(fit, "excess", lo, hi, "clustered triggers, afterpulsing?");
+		else if (sign > 0)
+			finding(fit, "excess", lo, hi, "periodic triggers, flasher or other pickup?");
+		else if (start == fit->first_bin)
+			finding(fit, "deficit", lo, hi, "holdoff or dead time?");
+		else if (lo >= 1e6)
+			finding(fit, "deficit", lo, hi, "long intervals cut short, periodic triggers (flasher?)");
+		else
+			finding(fit, "deficit", lo, hi, "fewer intervals than Poisson");
+	}
+	// below the cutoff only the number of polls that found several triggers tells
+	pull = (h->multi_polls - fit->multi_expected) / sqrt(fit->multi_expected > 1 ? fit->multi_expected : 1);
+	if ((pull > h->pull_limit || pull < -h->pull_limit) && fit->nfindings < HP_INTERVAL_MAX_FINDINGS)
+		snprintf(fit->findings[fit->nfindings++], sizeof(fit->findings[0]),
+			"%llu polls found several triggers, %.0f expected: %s below %s", h->multi_polls,
+			fit->multi_expected, pull > 0 ? "clustered triggers (afterpulsing?)" : "holdoff or dead time?",
+			format_ns(a, fit->gap_ns));
+	if (fit->nfindings == 0)
+		snprintf(fit->findings[fit->nfindings++], sizeof(fit->findings[0]), "consistent with Poisson");
+}
+
+/* The summary, each line started with prefix */
+void hp_interval_print(const struct hp_interval *h, const struct hp_interval_fit *fit, FILE *fptr,
+	const char *prefix) {
+	char a[16], b[16], c[16], d[16];
+	int i;
+
+	fprintf(fptr, "%s%llu triggers at %.1f Hz, %llu intervals measured\n", prefix, h->triggers, fit->rate_hz,
+		h->intervals);
+	fprintf(fptr, "%s%llu polls every %s, 99.9 %% within %s, longest gap %s\n", prefix, h->polls,
+		format_ns(a, fit->poll_ns), format_ns(b, fit->gap_ns), format_ns(c, h->max_gap_ns));
+	fprintf(fptr, "%smissed between polls: %llu triggers (%.2f %%) in %llu polls that found several, %.1f expected for Poisson\n",
+		prefix, h->missed, h->triggers ? 100.0 * h->missed / h->triggers : 0, h->multi_polls, fit->multi_expected);
+	fprintf(fptr, "%sPoisson above %s: chi2/ndf %.1f/%d, below %s %llu, above %s %llu\n", prefix,
+		format_ns(a, fit->cutoff_ns),
+		fit->chi2, fit->ndf, format_ns(b, h->min_ns), h->underflow, format_ns(d, hp_interval_edge(h, h->nbins)),
+		h->overflow);
+	for (i = 0; i < fit->nfindings; i++)
+		fprintf(fptr, "%s  %s\n", prefix, fit->findings[i]);
+}
+
+/*
+	hp_interval_write()
+
+	The summary as comments, then per bin: lower and upper edge [ns],
+	intervals, Poisson expectation and pull (0 below the cutoff). Written
+	to a temporary file and renamed, so a reader never sees half of it.
+*/
+int hp_interval_write(const struct hp_interval *h, const char *filename) {
+	struct hp_interval_fit fit;
+	char tmp[240];
+	FILE *fptr;
+	int b;
+
+	hp_interval_fit(h, &fit);
+	snprintf(tmp, sizeof(tmp), "%s.tmp", filename);
+	fptr = fopen(tmp, "w");
+	if (fptr == NULL) {
+		perror(tmp);
+		return -1;
+	}
+	hp_interval_print(h, &fit, fptr, "# ");
+	fprintf(fptr, "# lo_ns hi_ns intervals expected pull\n");
+	for (b = 0; b < h->nbins; b++)
+		fprintf(fptr, "%.0f %.0f %llu %.2f %.2f\n", hp_interval_edge(h, b), hp_interval_edge(h, b + 1), h->counts[b],
+			fit.expected[b], fit.pull[b]);
+	if (fclose(fptr) != 0)
+		return -1;
+	return rename(tmp, filename);
+}
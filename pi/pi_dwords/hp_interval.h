@@ -0,0 +1,73 @@
+/*
+ ============================================================================
+ Name        : hp_interval.h
+ Description : Inter-trigger interval histograms from the last trigger time
+ ============================================================================
+ */
+#ifndef HP_INTERVAL_H
+#define HP_INTERVAL_H
+
+#include <stdio.h>
+
+#define HP_INTERVAL_MAX_BINS 160
+#define HP_INTERVAL_MAX_FINDINGS 8
+#define HP_INTERVAL_GAP_BINS 100     // poll gaps, 10 bins per decade from 10 ns
+
+struct hp_interval {
+	/* configuration, see hp_interval.yml */
+	int poll_us;                 // between polls, 0 as fast as the SPI allows
+	double min_ns;               // lower edge of the first bin
+	int decades;
+	int bins_per_decade;
+	double pull_limit;           // sigma off the Poisson expectation that is reported
+	double export_s;
+	char export_file[208];
+
+	/* histogram, bin b covers min_ns * 10^(b / bins_per_decade) upwards */
+	int nbins;
+	unsigned long long counts[HP_INTERVAL_MAX_BINS];
+	unsigned long long underflow, overflow;
+
+	/* polls */
+	unsigned long long polls;        // reads of the last trigger time
+	unsigned long long gap_counts[HP_INTERVAL_GAP_BINS];
+	unsigned long long last_poll_ns, max_gap_ns;
+	unsigned long long elapsed_ns;   // nsTimer time covered by the counter readings
+	unsigned long long triggers;     // counter increase over the run
+	unsigned long long intervals;    // measured: exactly one new trigger since the last one seen
+	unsigned long long missed;       // triggers whose time no poll saw
+	unsigned long long multi_polls;  // polls that found more than one new trigger
+	unsigned long long last_nstime;
+	unsigned long long last_trigger_ns;
+	unsigned long last_hwtriggers;
+	int have_last, have_trigger;
+};
+
+/* Comparison with a Poisson process of the measured rate */
+struct hp_interval_fit {
+	double rate_hz;
+	double poll_ns;              // mean time between polls
+	double gap_ns;               // 99.9 % of the polls came within this of the one before
+	double cutoff_ns;            // fitted from twice that up, where every interval is seen
+	int first_bin;
+	double expected[HP_INTERVAL_MAX_BINS];
+	double pull[HP_INTERVAL_MAX_BINS];
+	double chi2;
+	int ndf;
+	double multi_expected;       // polls with more than one new trigger for Poisson
+	int nfindings;
+	char findings[HP_INTERVAL_MAX_FINDINGS][128];
+};
+
+int hp_interval_load(struct hp_interval *h, const char *config_file);
+void hp_interval_start(struct hp_interval *h);
+int hp_interval_poll(struct hp_interval *h, unsigned long long last_trigger_ns, unsigned long long now_ns);
+void hp_interval_update(struct hp_interval *h, unsigned long long nstime, unsigned long hwtriggers,
+	unsigned long long last_trigger_ns);
+double hp_interval_edge(const struct hp_interval *h, int bin);
+void hp_interval_fit(const struct hp_interval *h, struct hp_interval_fit *fit);
+void hp_interval_print(const struct hp_interval *h, const struct hp_interval_fit *fit, FILE *fptr,
+	const char *prefix);
+int hp_interval_write(const struct hp_interval *h, const char *filename);
+
+#endif
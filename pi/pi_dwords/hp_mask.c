@@ -0,0 +1,90 @@
+/*
+ ============================================================================
+ Name        : hp_mask.c
+ Description : Trigger mask files and their hit pattern equivalent.
+               A mask is 32 words in trigger mask position order, a set bit
+               masks the trigger pixel. It is read either from the hex file
+               of case 'j' (as written by psct_toolkit write_trigger_mask)
+               or from a masked_trigger_pixels*.yml file, where every
+               populated position not listed is fully enabled and the
+               unused positions are masked.
+ ============================================================================
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bp_config.h"
+#include "hp_mask.h"
+
+static int read_yml(unsigned short *mask, const struct fpm_config *fpm, const char *filename) {
+	struct bp_config cfg;
+	char *p, *end;
+	int i, slot, word;
+	long bit;
+
+	if (bp_config_load(&cfg, filename) != 0)
+		return -1;
+	for (i = 0; i < HP_MASK_NWORDS; i++)
+		mask[i] = 0xffff;
+	for (slot = 0; slot < FPM_NSLOTS; slot++)
+		if (fpm->mask_word[slot] >= 0 && fpm->mask_word[slot] < HP_MASK_NWORDS)
+			mask[fpm->mask_word[slot]] = 0;
+	for (i = 0; i < cfg.nkeys; i++) {
+		slot = fpm_config_slot_of_module(fpm, atoi(cfg.key[i]));
+		if (slot < 0 || fpm->mask_word[slot] < 0) {
+			fprintf(stderr, "%s: module %s is not in the FPM config\n", filename, cfg.key[i]);
+			continue;
+		}
+		word = fpm->mask_word[slot];
+		for (p = cfg.value[i]; *p != '\0'; p = end) {
+			bit = strtol(p, &end, 10);
+			if (end == p) {
+				end = p + 1;
+				continue;
+			}
+			if (bit >= 0 && bit < 16)
+				mask[word] |= 1 << bit;
+		}
+	}
+	return 0;
+}
+
+int hp_mask_read(unsigned short *mask, const struct fpm_config *fpm, const char *filename) {
+	const char *ext = strrchr(filename, '.');
+	FILE *fptr;
+	int i;
+
+	if (ext != NULL && (strcmp(ext, ".yml") == 0 || strcmp(ext, ".yaml") == 0))
+		return read_yml(mask, fpm, filename);
+	fptr = fopen(filename, "r");
+	if (fptr == NULL) {
+		perror(filename);
+		return -1;
+	}
+	for (i = 0; i < HP_MASK_NWORDS; i++) {
+		if (fscanf(fptr, "%hx", &mask[i]) != 1) {
+			fprintf(stderr, "%s: expected %d hex words, found %d\n", filename, HP_MASK_NWORDS, i);
+			fclose(fptr);
+			return -1;
+		}
+	}
+	fclose(fptr);
+	return 0;
+}
+
+/*
+	hp_mask_keep()
+
+	Hit pattern word w is slot w, so the pixels a mask leaves enabled are
+	keep[w] = ~mask[mask_word of slot w]. Slots off the focal plane keep
+	nothing.
+*/
+void hp_mask_keep(unsigned short *keep, const unsigned short *mask, const struct fpm_config *fpm) {
+	int w, word;
+
+	for (w = 0; w < HP_NWORDS; w++) {
+		word = w < FPM_NSLOTS ? fpm->mask_word[w] : -1;
+		keep[w] = word >= 0 && word < HP_MASK_NWORDS ? (unsigned short) ~mask[word] : 0;
+	}
+}
@@ -0,0 +1,18 @@
+/*
+ ============================================================================
+ Name        : hp_mask.h
+ Description : Trigger mask files and their hit pattern equivalent
+ ============================================================================
+ */
+#ifndef HP_MASK_H
+#define HP_MASK_H
+
+#include "fpm_config.h"
+#include "hp_occupancy.h"
+
+#define HP_MASK_NWORDS 32
+
+int hp_mask_read(unsigned short *mask, const struct fpm_config *fpm, const char *filename);
+void hp_mask_keep(unsigned short *keep, const unsigned short *mask, const struct fpm_config *fpm);
+
+#endif
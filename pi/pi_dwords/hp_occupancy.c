@@ -0,0 +1,164 @@
+/*
+ ============================================================================
+ Name        : hp_occupancy.c
+ Description : Per trigger pixel hit counters accumulated over a recording.
+               Every 512-bit hit pattern snapshot is folded into whole-run
+               counters and into a ring of one-second slices, so occupancy
+               over the last 10 s, the last 60 s or the whole run can be
+               queried at any time without keeping the sample stream.
+ ============================================================================
+ */
+#define _GNU_SOURCE // qsort_r
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hp_occupancy.h"
+
+/*
+	hit_pattern_from_frame()
+
+	Place the 8 data words of SPI_READ_HIT_PATTERN{,1,2,3} (frame 0-3) in
+	the 32-word hit pattern, highest word first as in case 'q'.
+*/
+void hit_pattern_from_frame(unsigned short *hit_pattern, int frame, const unsigned short *data) {
+	int i;
+	for (i = 0; i < 8; i++)
+		hit_pattern[HP_NWORDS - 1 - 8*frame - i] = data[i+2];
+}
+
+void hp_occupancy_init(struct hp_occupancy *occ) {
+	int s;
+
+	memset(occ, 0, sizeof(*occ));
+	for (s = 0; s < HP_OCC_NSLICES; s++)
+		occ->slice_second[s] = -1;
+}
+
+/*
+	hp_occupancy_add()
+
+	The 32 sixteen-bit words are taken 64 bits at a time (little-endian, as
+	on the Pi and x86 hosts), so pixel 16*w+b of the hit pattern is bit
+	16*(w%4)+b of lane w/4. Empty lanes cost one compare, and the set bits
+	of the rest are scattered into the counters with popcount/ctz rather
+	than testing all 512 bits.
+*/
+void hp_occupancy_add(struct hp_occupancy *occ, const unsigned short *hit_pattern, unsigned long long t_ns) {
+	unsigned long long lanes[HP_NWORDS / 4], bits;
+	unsigned int *slice;
+	long long second;
+	int s, l, p;
+
+	second = t_ns / 1000000000ULL;
+	s = second % HP_OCC_NSLICES;
+	if (occ->slice_second[s] != second) {
+		memset(occ->slice_counts[s], 0, sizeof(occ->slice_counts[s]));
+		occ->slice_samples[s] = 0;
+		occ->slice_second[s] = second;
+	}
+	slice = occ->slice_counts[s];
+	occ->slice_samples[s]++;
+	occ->run_samples++;
+
+	memcpy(lanes, hit_pattern, sizeof(lanes));
+	for (l = 0; l < HP_NWORDS / 4; l++) {
+		bits = lanes[l];
+		if (bits == 0)
+			continue;
+		occ->run_hits += __builtin_popcountll(bits);
+		while (bits) {
+			p = 64 * l + __builtin_ctzll(bits);
+			occ->run_counts[p]++;
+			slice[p]++;
+			bits &= bits - 1;
+		}
+	}
+}
+
+/*
+	hp_occupancy_window()
+
+	Sum the hit counts of the last window_s seconds (counting the current
+	second) into counts[HP_NPIXELS] and return the number of snapshots they
+	cover. window_s <= 0 or beyond the slice ring gives the whole run.
+*/
+unsigned long long hp_occupancy_window(const struct hp_occupancy *occ, int window_s,
+	unsigned long long now_ns, unsigned long long *counts) {
+	unsigned long long nsamples = 0;
+	long long now_s, oldest;
+	int s, p;
+
+	if (window_s <= 0 || window_s > HP_OCC_NSLICES) {
+		for (p = 0; p < HP_NPIXELS; p++)
+			counts[p] = occ->run_counts[p];
+		return occ->run_samples;
+	}
+	memset(counts, 0, HP_NPIXELS * sizeof(*counts));
+	now_s = now_ns / 1000000000ULL;
+	oldest = now_s - window_s + 1;
+	for (s = 0; s < HP_OCC_NSLICES; s++) {
+		if (occ->slice_second[s] < oldest || occ->slice_second[s] > now_s)
+			continue;
+		nsamples += occ->slice_samples[s];
+		for (p = 0; p < HP_NPIXELS; p++)
+			counts[p] += occ->slice_counts[s][p];
+	}
+	return nsamples;
+}
+
+static int hottest_first(const void *a, const void *b, void *counts) {
+	unsigned long long ca = ((unsigned long long *) counts)[*(const int *) a];
+	unsigned long long cb = ((unsigned long long *) counts)[*(const int *) b];
+	return (ca < cb) - (ca > cb);
+}
+
+/* Print the nhottest pixels of each window as fraction of snapshots hit. */
+void hp_occupancy_print(const struct hp_occupancy *occ, unsigned long long now_ns, int nhottest) {
+	static const int windows[3] = {10, 60, 0};
+	unsigned long long counts[HP_NPIXELS], nsamples;
+	int order[HP_NPIXELS];
+	int w, p;
+
+	for (w = 0; w < 3; w++) {
+		nsamples = hp_occupancy_window(occ, windows[w], now_ns, counts);
+		if (windows[w] > 0)
+			printf("Occupancy last %2d s (%llu snapshots):", windows[w], nsamples);
+		else
+			printf("Occupancy whole run (%llu snapshots):", nsamples);
+		if (nsamples == 0) {
+			printf("\n");
+			continue;
+		}
+		for (p = 0; p < HP_NPIXELS; p++)
+			order[p] = p;
+		qsort_r(order, HP_NPIXELS, sizeof(int), hottest_first, counts);
+		for (p = 0; p < nhottest && counts[order[p]] > 0; p++)
+			printf(" %d:%d=%.3f", order[p] / 16, order[p] % 16, (double) counts[order[p]] / nsamples);
+		printf("\n");
+	}
+}
+
+/*
+	Write the 512-entry counter arrays, one line per pixel:
+	pixel word bit run_count last60_count last10_count
+	preceded by a header giving the snapshot count of each column.
+*/
+int hp_occupancy_write(const struct hp_occupancy *occ, unsigned long long now_ns, const char *filename) {
+	unsigned long long c60[HP_NPIXELS], c10[HP_NPIXELS], n60, n10;
+	FILE *fptr;
+	int p;
+
+	n60 = hp_occupancy_window(occ, 60, now_ns, c60);
+	n10 = hp_occupancy_window(occ, 10, now_ns, c10);
+	fptr = fopen(filename, "w");
+	if (fptr == NULL) {
+		perror(filename);
+		return -1;
+	}
+	fprintf(fptr, "# snapshots run: %llu, last60: %llu, last10: %llu\n", occ->run_samples, n60, n10);
+	fprintf(fptr, "# pixel word bit run last60 last10\n");
+	for (p = 0; p < HP_NPIXELS; p++)
+		fprintf(fptr, "%d %d %d %llu %llu %llu\n", p, p / 16, p % 16, occ->run_counts[p], c60[p], c10[p]);
+	return fclose(fptr);
+}
@@ -0,0 +1,31 @@
+/*
+ ============================================================================
+ Name        : hp_occupancy.h
+ Description : Per trigger pixel hit counters accumulated over a recording
+ ============================================================================
+ */
+#ifndef HP_OCCUPANCY_H
+#define HP_OCCUPANCY_H
+
+#define HP_NWORDS      32
+#define HP_NPIXELS     (16 * HP_NWORDS)   // pixel = 16 * hit_pattern word + bit
+#define HP_OCC_NSLICES 60                 // one-second slices kept for windows
+
+struct hp_occupancy {
+	unsigned long long run_counts[HP_NPIXELS];
+	unsigned long long run_samples;
+	unsigned long long run_hits;
+	unsigned int slice_counts[HP_OCC_NSLICES][HP_NPIXELS];
+	unsigned int slice_samples[HP_OCC_NSLICES];
+	long long slice_second[HP_OCC_NSLICES];
+};
+
+void hit_pattern_from_frame(unsigned short *hit_pattern, int frame, const unsigned short *data);
+void hp_occupancy_init(struct hp_occupancy *occ);
+void hp_occupancy_add(struct hp_occupancy *occ, const unsigned short *hit_pattern, unsigned long long t_ns);
+unsigned long long hp_occupancy_window(const struct hp_occupancy *occ, int window_s,
+	unsigned long long now_ns, unsigned long long *counts);
+void hp_occupancy_print(const struct hp_occupancy *occ, unsigned long long now_ns, int nhottest);
+int hp_occupancy_write(const struct hp_occupancy *occ, unsigned long long now_ns, const char *filename);
+
+#endif
@@ -0,0 +1,126 @@
+/*
+ ============================================================================
+ Name        : hp_rate.c
+ Description : Sampling policy for hit pattern recordings (menu 'R').
+               The HW trigger counter is read every poll_ms between
+               snapshots and its rate averaged over window_s; the snapshot
+               rate aims for samples_per_trigger times that, within
+               min_hz and max_hz. It is further capped by what the output
+               takes: max_mb_s over the record size, and 80 % of the rate
+               the averaged time to read and write a snapshot allows,
+               which falls when block writes start to block. The rate goes up as
+               soon as the target has moved by more than the hysteresis, so
+               a burst is sampled from its start, and down at most every
+               min_change_s so a lull between bursts does not throttle it.
+ ============================================================================
+ */
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+
+#include "bp_config.h"
+#include "hp_rate.h"
+
+/*
+	hp_rate_load()
+
+	Defaults if config_file does not exist: 1-100 Hz at two snapshots per
+	trigger, rate averaged over 2 s, counter read every 20 ms, no
+	bandwidth budget, 20 % hysteresis, down at most once a second.
+*/
+int hp_rate_load(struct hp_rate *r, const char *config_file) {
+	struct bp_config cfg;
+	int status = 0;
+
+	memset(r, 0, sizeof(*r));
+	memset(&cfg, 0, sizeof(cfg));
+	if (access(config_file, R_OK) == 0)
+		status = bp_config_load(&cfg, config_file);
+	r->min_hz = bp_config_double(&cfg, "min_hz", 1);
+	r->max_hz = bp_config_double(&cfg, "max_hz", 100);
+	r->samples_per_trigger = bp_config_double(&cfg, "samples_per_trigger", 2);
+	r->window_s = bp_config_double(&cfg, "window_s", 2);
+	r->poll_ms = bp_config_double(&cfg, "poll_ms", 20);
+	r->max_mb_s = bp_config_double(&cfg, "max_mb_s", 0);
+	r->hysteresis = bp_config_double(&cfg, "hysteresis", 0.2);
+	r->min_change_s = bp_config_double(&cfg, "min_change_s", 1);
+	if (r->min_hz <= 0)
+		r->min_hz = 0.1;
+	if (r->max_hz < r->min_hz)
+		r->max_hz = r->min_hz;
+	if (r->poll_ms < 1)
+		r->poll_ms = 1;
+	if (r->window_s <= 0)
+		r->window_s = 2;
+	return status;
+}
+
+/* Start at min_hz until the first trigger rate is known */
+void hp_rate_start(struct hp_rate *r, int record_bytes) {
+	r->record_bytes = record_bytes;
+	r->hz = r->lowest_hz = r->highest_hz = r->min_hz;
+	r->cap_hz = r->max_hz;
+	r->trigger_hz = 0;
+	r->record_s = 0;
+	r->have_last = 0;
+	r->last_change_ns = 0;
+	r->changes = 0;
+}
+
+/* A reading of the TFPGA counters (SPI_READ_nsTimer_TFPGA) */
+void hp_rate_counter(struct hp_rate *r, unsigned long long nstime, unsigned long hwtriggers) {
+	double dt, alpha;
+
+	// a SYNC or 'l' resets the counters, start over from the next reading
+	if (r->have_last && nstime > r->last_nstime && hwtriggers >= r->last_hwtriggers) {
+		dt = (nstime - r->last_nstime) * 1e-9;
+		alpha = 1 - exp(-dt / r->window_s);
+		r->trigger_hz += alpha * ((hwtriggers - r->last_hwtriggers) / dt - r->trigger_hz);
+	}
+	r->last_nstime = nstime;
+	r->last_hwtriggers = hwtriggers;
+	r->have_last = 1;
+}
+
+/* Time one snapshot took to read and hand to the writer */
+void hp_rate_record_time(struct hp_rate *r, double seconds) {
+	r->record_s = r->record_s == 0 ? seconds : r->record_s + 0.1 * (seconds - r->record_s);
+}
+
+/*
+	hp_rate_update()
+
+	Move r->hz towards the target. Returns 1 when it changed.
+*/
+int hp_rate_update(struct hp_rate *r, unsigned long long now_ns) {
+	double target;
+
+	r->cap_hz = r->max_hz;
+	if (r->max_mb_s > 0 && r->record_bytes > 0 && r->max_mb_s * 1e6 / r->record_bytes < r->cap_hz)
+		r->cap_hz = r->max_mb_s * 1e6 / r->record_bytes;
+	if (r->record_s > 0 && 0.8 / r->record_s < r->cap_hz)
+		r->cap_hz = 0.8 / r->record_s;
+	if (r->cap_hz < r->min_hz)
+		r->cap_hz = r->min_hz;
+
+	target = r->samples_per_trigger * r->trigger_hz;
+	if (target < r->min_hz)
+		target = r->min_hz;
+	if (target > r->cap_hz)
+		target = r->cap_hz;
+	if (target == r->hz || (fabs(target - r->hz) <= r->hysteresis * r->hz && r->hz <= r->cap_hz))
+		return 0;
+	// down only every min_change_s, unless the output cannot keep up
+	if (target < r->hz && r->hz <= r->cap_hz && now_ns - r->last_change_ns < r->min_change_s * 1e9)
+		return 0;
+
+	r->hz = target;
+	r->last_change_ns = now_ns;
+	r->changes++;
+	if (r->hz < r->lowest_hz)
+		r->lowest_hz = r->hz;
+	if (r->hz > r->highest_hz)
+		r->highest_hz = r->hz;
+	return 1;
+}
@@ -0,0 +1,40 @@
+/*
+ ============================================================================
+ Name        : hp_rate.h
+ Description : Hit pattern sampling rate that follows the trigger rate
+ ============================================================================
+ */
+#ifndef HP_RATE_H
+#define HP_RATE_H
+
+struct hp_rate {
+	/* configuration, see hp_rate.yml */
+	double min_hz, max_hz;        // bounds of the snapshot rate
+	double samples_per_trigger;   // snapshot rate aimed for, as a multiple of the trigger rate
+	double window_s;              // trigger rate averaging time
+	int poll_ms;                  // HW trigger counter read interval between snapshots
+	double max_mb_s;              // storage/stream budget, 0 unlimited
+	double hysteresis;            // relative change of the target needed to change the rate
+	double min_change_s;          // the rate goes down at most this often, up at once
+
+	/* state */
+	double hz;                    // current snapshot rate
+	double trigger_hz;            // averaged HW trigger rate
+	double record_s;              // averaged time a snapshot takes to read and write
+	double cap_hz;                // what max_hz, max_mb_s and record_s allow
+	int record_bytes;
+	unsigned long long last_nstime;
+	unsigned long last_hwtriggers;
+	int have_last;
+	unsigned long long last_change_ns;
+	unsigned long changes;
+	double lowest_hz, highest_hz;
+};
+
+int hp_rate_load(struct hp_rate *r, const char *config_file);
+void hp_rate_start(struct hp_rate *r, int record_bytes);
+void hp_rate_counter(struct hp_rate *r, unsigned long long nstime, unsigned long hwtriggers);
+void hp_rate_record_time(struct hp_rate *r, double seconds);
+int hp_rate_update(struct hp_rate *r, unsigned long long now_ns);
+
+#endif
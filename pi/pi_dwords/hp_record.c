@@ -0,0 +1,185 @@
+/*
+ ============================================================================
+ Name        : hp_record.c
+ Description : Measures recording on the actual card: synthetic hit
+               patterns from hp_gen.yml are formatted and written through
+               hp_writer exactly as the '$' recorder does, and the
+               sustained MB/s, the block write and fdatasync latencies and
+               the worst time one record held up the acquisition loop are
+               reported.
+
+               hp_record [-w hp_writer.yml] [-c hp_gen.yml] [-f format]
+                         [-n nsamples] [-r rate_hz] [-s]
+
+               format is binary (default), dwords or picture. -r paces the
+               records as a recording at that frequency would, without it
+               they are written as fast as possible. -s writes the same
+               records with plain stdio (fopen, fwrite, fclose) into the
+               configured dir for comparison. With stage_dir set the
+               segments go through the RAM staging area and the time the
+               flusher needs after the last record is reported too.
+ ============================================================================
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "spicomms.h"
+#include "hp_camera.h"
+#include "hp_generator.h"
+#include "hp_file.h"
+#include "hp_format.h"
+#include "hp_writer.h"
+#include "hp_stage.h"
+
+#define NBUCKETS 32   // record latency histogram, bucket k holds [2^k, 2^(k+1)) us
+
+unsigned long long monotonic_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int format_of(const char *name) {
+	if (strcmp(name, "binary") == 0)
+		return HP_FILE_BINARY;
+	if (strcmp(name, "dwords") == 0)
+		return HP_FILE_DWORDS;
+	if (strcmp(name, "picture") == 0)
+		return HP_FILE_PICTURE;
+	return -1;
+}
+
+/* Upper edge of the bucket below which a fraction q of the records fall */
+static double percentile_us(const unsigned long long *hist, unsigned long long n, double q) {
+	unsigned long long sum = 0;
+	int k;
+
+	for (k = 0; k < NBUCKETS; k++) {
+		sum += hist[k];
+		if (sum >= q * n)
+			break;
+	}
+	return (double) (2ULL << k);
+}
+
+int main(int argc, char **argv) {
+	const char *writer_file = "hp_writer.yml", *gen_file = "hp_gen.yml";
+	struct hp_writer_config wcfg;
+	struct hp_gen_config gcfg;
+	struct hp_geometry geo;
+	static struct hp_gen gen;
+	static struct hp_writer w;
+	struct hp_gen_sample s;
+	struct hp_format_spec spec = { HP_FILE_BINARY, 100000, 0 };
+	unsigned short frames[4][11];
+	unsigned long long hist[NBUCKETS], t0, t, dt, worst = 0, bytes;
+	struct timespec ts, next;
+	double rate_hz = 0, elapsed;
+	char filename[512];
+	int opt, n, f, k, use_stdio = 0;
+	FILE *fptr;
+
+	while ((opt = getopt(argc, argv, "w:c:f:n:r:s")) != -1) {
+		switch (opt) {
+		case 'w': writer_file = optarg; break;
+		case 'c': gen_file = optarg; break;
+		case 'f': spec.format = format_of(optarg); break;
+		case 'n': spec.nsamples = atoi(optarg); break;
+		case 'r': rate_hz = atof(optarg); break;
+		case 's': use_stdio = 1; break;
+		default:
+			spec.format = -1;
+		}
+	}
+	if (spec.format < 0 || spec.nsamples < 1) {
+		fprintf(stderr, "usage: %s [-w hp_writer.yml] [-c hp_gen.yml] [-f binary|dwords|picture] [-n nsamples]"
+			" [-r rate_hz] [-s]\n", argv[0]);
+		return 1;
+	}
+
+	hp_writer_config_load(&wcfg, writer_file);
+	if (hp_gen_config_load(&gcfg, NULL, gen_file) != 0)
+		return 1;
+	hp_geometry_default(&geo);
+	hp_gen_init(&gen, &gcfg, &geo);
+	spec.freq = rate_hz > 0 ? rate_hz : gen.rate_hz;
+
+	if (use_stdio) {
+		snprintf(filename, sizeof(filename), "%s/hp_record_stdio%s", wcfg.dir,
+			spec.format == HP_FILE_BINARY ? ".bin" : ".txt");
+		fptr = fopen(filename, "wb");
+		if (fptr == NULL) {
+			perror(filename);
+			return 1;
+		}
+		hp_format_header(fptr, spec.format, spec.nsamples, spec.freq);
+	} else {
+		if (hp_writer_open(&w, &wcfg, "hp_record", spec.format == HP_FILE_BINARY ? ".bin" : ".txt",
+		    hp_format_writer_header, &spec) != 0)
+			return 1;
+		fptr = w.stream;
+	}
+
+	memset(hist, 0, sizeof(hist));
+	t0 = monotonic_ns();
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	for (n = 0; n < spec.nsamples; n++) {
+		hp_gen_next(&gen, &s);
+		for (f = 0; f < 4; f++)
+			hp_format_frame(frames[f], s.hit_pattern, f);
+		timespec_get(&ts, TIME_UTC);
+
+		t = monotonic_ns();
+		hp_format_record(fptr, spec.format, frames, n, &ts);
+		if (use_stdio ? ferror(fptr) : hp_writer_end_record(&w) != 0) {
+			fprintf(stderr, "write failed at record %d\n", n);
+			break;
+		}
+		dt = monotonic_ns() - t;
+		if (dt > worst)
+			worst = dt;
+		for (k = 0; k < NBUCKETS - 1 && (2ULL << k) * 1000 <= dt; k++)
+			;
+		hist[k]++;
+
+		if (rate_hz > 0) {
+			next.tv_nsec += (long) (1e9 / rate_hz);
+			while (next.tv_nsec >= 1000000000L) {
+				next.tv_nsec -= 1000000000L;
+				next.tv_sec++;
+			}
+			clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+		}
+	}
+	t = monotonic_ns();
+	if (use_stdio) {
+		bytes = ftell(fptr);
+		fclose(fptr);
+	} else {
+		hp_writer_close(&w);
+		bytes = w.bytes;
+	}
+	dt = monotonic_ns() - t;
+	elapsed = (monotonic_ns() - t0) * 1e-9;
+
+	printf("%d %s records, %.1f MB in %.2f s: %.2f MB/s sustained (close included)\n", n,
+		hp_file_format_name(spec.format), bytes * 1e-6, elapsed, bytes * 1e-6 / elapsed);
+	printf("time a record held the loop: p50 < %.0f us, p99 < %.0f us, p99.9 < %.0f us, worst %.2f ms;"
+		" final close %.2f ms\n", percentile_us(hist, n, 0.5), percentile_us(hist, n, 0.99),
+		percentile_us(hist, n, 0.999), worst * 1e-6, dt * 1e-6);
+	if (use_stdio) {
+		printf("written with stdio to %s\n", filename);
+		return 0;
+	}
+	hp_writer_report(&w, stdout);
+	if (hp_stage_running) {
+		t = monotonic_ns();
+		hp_stage_stop(1);
+		printf("staged segments flushed %.2f s after the last record:\n", (monotonic_ns() - t) * 1e-9);
+		hp_stage_report(stdout);
+	}
+	return 0;
+}
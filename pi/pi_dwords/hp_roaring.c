@@ -0,0 +1,401 @@
+/*
+ ============================================================================
+ Name        : hp_roaring.c
+ Description : Roaring-style compressed bitmaps of sample numbers.
+               The 32-bit value space is cut into 65536-value containers,
+               each stored as a sorted array of the low 16 bits while it
+               holds at most 4096 values and as a plain 8 kB bitmap above
+               that. Set operations work container by container, so their
+               cost follows the containers touched, not the run length.
+
+               Serialized form (host byte order, 8-byte aligned):
+                 unsigned int n, unsigned int 0,
+                 n x {unsigned short key, unsigned short type, int card},
+                 then each container's data padded to 8 bytes.
+ ============================================================================
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hp_roaring.h"
+
+#define RB_WORDS 1024
+
+#define OP_AND    0
+#define OP_OR     1
+#define OP_ANDNOT 2
+
+static void *xmalloc(size_t size) {
+	void *p = malloc(size);
+	if (p == NULL) {
+		fprintf(stderr, "hp_roaring: out of memory\n");
+		exit(1);
+	}
+	return p;
+}
+
+void rb_init(struct roaring *r) {
+	memset(r, 0, sizeof(*r));
+}
+
+void rb_free(struct roaring *r) {
+	int i;
+	for (i = 0; i < r->n; i++)
+		if (r->c[i].owned)
+			free(r->c[i].data);
+	free(r->c);
+	rb_init(r);
+}
+
+static struct rb_container *push_container(struct roaring *r, unsigned short key) {
+	struct rb_container *c;
+
+	if (r->n == r->cap) {
+		r->cap = r->cap ? 2 * r->cap : 4;
+		c = realloc(r->c, r->cap * sizeof(*c));
+		if (c == NULL) {
+			fprintf(stderr, "hp_roaring: out of memory\n");
+			exit(1);
+		}
+		r->c = c;
+	}
+	c = &r->c[r->n++];
+	memset(c, 0, sizeof(*c));
+	c->key = key;
+	return c;
+}
+
+static void array_to_bitmap(struct rb_container *c) {
+	unsigned long long *bits = xmalloc(RB_WORDS * sizeof(*bits));
+	const unsigned short *a = c->data;
+	int i;
+
+	memset(bits, 0, RB_WORDS * sizeof(*bits));
+	for (i = 0; i < c->card; i++)
+		bits[a[i] >> 6] |= 1ULL << (a[i] & 63);
+	if (c->owned)
+		free(c->data);
+	c->data = bits;
+	c->type = RB_BITMAP;
+	c->owned = 1;
+}
+
+static void bitmap_to_array(struct rb_container *c) {
+	const unsigned long long *bits = c->data;
+	unsigned short *a = xmalloc((c->card ? c->card : 1) * sizeof(*a));
+	unsigned long long w;
+	int i, n = 0;
+
+	for (i = 0; i < RB_WORDS; i++)
+		for (w = bits[i]; w; w &= w - 1)
+			a[n++] = 64 * i + __builtin_ctzll(w);
+	if (c->owned)
+		free(c->data);
+	c->data = a;
+	c->type = RB_ARRAY;
+	c->owned = 1;
+}
+
+/*
+	rb_append()
+
+	Add v, which must be larger than every value already in r, as the
+	index builder does when it walks a recording in sample order. Arrays
+	grow by doubling and turn into a bitmap past RB_ARRAY_MAX.
+*/
+int rb_append(struct roaring *r, unsigned int v) {
+	struct rb_container *c = r->n ? &r->c[r->n - 1] : NULL;
+	unsigned short key = v >> 16, low = v & 0xffff;
+	void *p;
+
+	if (c == NULL || c->key != key) {
+		c = push_container(r, key);
+		c->type = RB_ARRAY;
+		c->data = xmalloc(4 * sizeof(unsigned short));
+		c->owned = 1;
+	}
+	if (c->type == RB_ARRAY && c->card == RB_ARRAY_MAX)
+		array_to_bitmap(c);
+	if (c->type == RB_BITMAP) {
+		((unsigned long long *) c->data)[low >> 6] |= 1ULL << (low & 63);
+		c->card++;
+		return 0;
+	}
+	if (c->card >= 4 && (c->card & (c->card - 1)) == 0) {
+		p = realloc(c->data, 2 * c->card * sizeof(unsigned short));
+		if (p == NULL)
+			return -1;
+		c->data = p;
+	}
+	((unsigned short *) c->data)[c->card++] = low;
+	return 0;
+}
+
+unsigned long long rb_cardinality(const struct roaring *r) {
+	unsigned long long n = 0;
+	int i;
+	for (i = 0; i < r->n; i++)
+		n += r->c[i].card;
+	return n;
+}
+
+/* All values in [lo, hi) */
+void rb_range(struct roaring *out, unsigned int lo, unsigned int hi) {
+	struct rb_container *c;
+	unsigned int key, start, end, v;
+	unsigned long long *bits;
+
+	rb_init(out);
+	if (hi <= lo)
+		return;
+	for (key = lo >> 16; key <= (hi - 1) >> 16; key++) {
+		start = key == lo >> 16 ? lo & 0xffff : 0;
+		end = key == (hi - 1) >> 16 ? ((hi - 1) & 0xffff) + 1 : 65536;
+		c = push_container(out, key);
+		c->card = end - start;
+		c->owned = 1;
+		if (c->card <= RB_ARRAY_MAX) {
+			c->type = RB_ARRAY;
+			c->data = xmalloc(c->card * sizeof(unsigned short));
+			for (v = start; v < end; v++)
+				((unsigned short *) c->data)[v - start] = v;
+		} else {
+			c->type = RB_BITMAP;
+			bits = c->data = xmalloc(RB_WORDS * sizeof(*bits));
+			memset(bits, 0, RB_WORDS * sizeof(*bits));
+			for (v = start; v < end && (v & 63); v++)
+				bits[v >> 6] |= 1ULL << (v & 63);
+			for (; v + 64 <= end; v += 64)
+				bits[v >> 6] = ~0ULL;
+			for (; v < end; v++)
+				bits[v >> 6] |= 1ULL << (v & 63);
+		}
+	}
+}
+
+static void copy_container(struct roaring *out, const struct rb_container *src) {
+	struct rb_container *c = push_container(out, src->key);
+	size_t size = src->type == RB_BITMAP ? RB_WORDS * sizeof(unsigned long long) : src->card * sizeof(unsigned short);
+
+	*c = *src;
+	c->data = xmalloc(size ? size : 1);
+	memcpy(c->data, src->data, size);
+	c->owned = 1;
+}
+
+static int bitmap_contains(const struct rb_container *c, unsigned short v) {
+	const unsigned long long *bits = c->data;
+	return (bits[v >> 6] >> (v & 63)) & 1;
+}
+
+/* Both sorted arrays: merge */
+static void array_op(struct rb_container *out, const struct rb_container *a, const struct rb_container *b, int op) {
+	const unsigned short *x = a->data, *y = b->data;
+	unsigned short *z = xmalloc((a->card + b->card + 1) * sizeof(*z));
+	int i = 0, j = 0, n = 0;
+
+	while (i < a->card && j < b->card) {
+		if (x[i] < y[j]) {
+			if (op != OP_AND)
+				z[n++] = x[i];
+			i++;
+		} else if (x[i] > y[j]) {
+			if (op == OP_OR)
+				z[n++] = y[j];
+			j++;
+		} else {
+			if (op != OP_ANDNOT)
+				z[n++] = x[i];
+			i++;
+			j++;
+		}
+	}
+	if (op != OP_AND)
+		while (i < a->card)
+			z[n++] = x[i++];
+	if (op == OP_OR)
+		while (j < b->card)
+			z[n++] = y[j++];
+	out->type = RB_ARRAY;
+	out->data = z;
+	out->card = n;
+	out->owned = 1;
+	if (n > RB_ARRAY_MAX)
+		array_to_bitmap(out);
+}
+
+/* Array a against bitmap b for AND and ANDNOT: filter the array */
+static void array_bitmap_op(struct rb_container *out, const struct rb_container *a, const struct rb_container *b, int op) {
+	const unsigned short *x = a->data;
+	unsigned short *z = xmalloc((a->card + 1) * sizeof(*z));
+	int i, n = 0;
+
+	for (i = 0; i < a->card; i++)
+		if (bitmap_contains(b, x[i]) == (op == OP_AND))
+			z[n++] = x[i];
+	out->type = RB_ARRAY;
+	out->data = z;
+	out->card = n;
+	out->owned = 1;
+}
+
+static void bitmap_op(struct rb_container *out, const struct rb_container *a, const struct rb_container *b, int op) {
+	unsigned long long ta[RB_WORDS], tb[RB_WORDS], *z = xmalloc(RB_WORDS * sizeof(*z));
+	const unsigned long long *x = a->data, *y = b->data;
+	int i, n = 0;
+
+	if (a->type == RB_ARRAY) {
+		memset(ta, 0, sizeof(ta));
+		for (i = 0; i < a->card; i++)
+			ta[((unsigned short *) a->data)[i] >> 6] |= 1ULL << (((unsigned short *) a->data)[i] & 63);
+		x = ta;
+	}
+	if (b->type == RB_ARRAY) {
+		memset(tb, 0, sizeof(tb));
+		for (i = 0; i < b->card; i++)
+			tb[((unsigned short *) b->data)[i] >> 6] |= 1ULL << (((unsigned short *) b->data)[i] & 63);
+		y = tb;
+	}
+	for (i = 0; i < RB_WORDS; i++) {
+		z[i] = op == OP_AND ? x[i] & y[i] : op == OP_OR ? x[i] | y[i] : x[i] & ~y[i];
+		n += __builtin_popcountll(z[i]);
+	}
+	out->type = RB_BITMAP;
+	out->data = z;
+	out->card = n;
+	out->owned = 1;
+	if (n <= RB_ARRAY_MAX)
+		bitmap_to_array(out);
+}
+
+static void rb_op(struct roaring *out, const struct roaring *a, const struct roaring *b, int op) {
+	const struct rb_container *ca, *cb;
+	struct rb_container *c;
+	int i = 0, j = 0;
+
+	rb_init(out);
+	while (i < a->n || j < b->n) {
+		ca = i < a->n ? &a->c[i] : NULL;
+		cb = j < b->n ? &b->c[j] : NULL;
+		if (cb == NULL || (ca != NULL && ca->key < cb->key)) {
+			if (op != OP_AND)
+				copy_container(out, ca);
+			i++;
+		} else if (ca == NULL || cb->key < ca->key) {
+			if (op == OP_OR)
+				copy_container(out, cb);
+			j++;
+		} else {
+			c = push_container(out, ca->key);
+			if (ca->type == RB_ARRAY && cb->type == RB_ARRAY)
+				array_op(c, ca, cb, op);
+			else if (ca->type == RB_ARRAY && op != OP_OR)
+				array_bitmap_op(c, ca, cb, op);
+			else
+				bitmap_op(c, ca, cb, op);
+			if (c->card == 0) {
+				free(c->data);
+				out->n--;
+			}
+			i++;
+			j++;
+		}
+	}
+}
+
+void rb_and(struct roaring *out, const struct roaring *a, const struct roaring *b) {
+	rb_op(out, a, b, OP_AND);
+}
+
+void rb_or(struct roaring *out, const struct roaring *a, const struct roaring *b) {
+	rb_op(out, a, b, OP_OR);
+}
+
+void rb_andnot(struct roaring *out, const struct roaring *a, const struct roaring *b) {
+	rb_op(out, a, b, OP_ANDNOT);
+}
+
+/* Call fn for every value in increasing order until it returns non-zero */
+int rb_foreach(const struct roaring *r, int (*fn)(unsigned int v, void *arg), void *arg) {
+	const struct rb_container *c;
+	unsigned long long w;
+	unsigned int base;
+	int i, k, ret;
+
+	for (i = 0; i < r->n; i++) {
+		c = &r->c[i];
+		base = (unsigned int) c->key << 16;
+		if (c->type == RB_ARRAY) {
+			for (k = 0; k < c->card; k++)
+				if ((ret = fn(base | ((unsigned short *) c->data)[k], arg)) != 0)
+					return ret;
+		} else {
+			for (k = 0; k < RB_WORDS; k++)
+				for (w = ((unsigned long long *) c->data)[k]; w; w &= w - 1)
+					if ((ret = fn(base | (64 * k + __builtin_ctzll(w)), arg)) != 0)
+						return ret;
+		}
+	}
+	return 0;
+}
+
+static size_t padded(size_t n) {
+	return (n + 7) & ~(size_t) 7;
+}
+
+size_t rb_write(const struct roaring *r, FILE *fptr) {
+	static const char zeros[8];
+	unsigned int head[2] = {r->n, 0};
+	size_t size, total;
+	int i;
+
+	total = fwrite(head, sizeof(head), 1, fptr) * sizeof(head);
+	for (i = 0; i < r->n; i++) {
+		fwrite(&r->c[i].key, sizeof(unsigned short), 1, fptr);
+		fwrite(&r->c[i].type, sizeof(unsigned short), 1, fptr);
+		fwrite(&r->c[i].card, sizeof(int), 1, fptr);
+		total += 8;
+	}
+	for (i = 0; i < r->n; i++) {
+		size = r->c[i].type == RB_BITMAP ? RB_WORDS * sizeof(unsigned long long)
+			: r->c[i].card * sizeof(unsigned short);
+		fwrite(r->c[i].data, 1, size, fptr);
+		fwrite(zeros, 1, padded(size) - size, fptr);
+		total += padded(size);
+	}
+	return total;
+}
+
+/* Point r at a serialized bitmap in buf (e.g. mmap'ed), nothing is copied */
+int rb_map(struct roaring *r, const void *buf, size_t len) {
+	const unsigned char *p = buf;
+	unsigned int n;
+	size_t off, size;
+	int i;
+
+	rb_init(r);
+	if (len < 8)
+		return -1;
+	memcpy(&n, p, sizeof(n));
+	off = 8 + 8 * (size_t) n;
+	if (off > len)
+		return -1;
+	r->c = xmalloc((n ? n : 1) * sizeof(*r->c));
+	r->n = r->cap = n;
+	for (i = 0; i < (int) n; i++) {
+		memcpy(&r->c[i].key, p + 8 + 8 * i, sizeof(unsigned short));
+		memcpy(&r->c[i].type, p + 10 + 8 * i, sizeof(unsigned short));
+		memcpy(&r->c[i].card, p + 12 + 8 * i, sizeof(int));
+		size = r->c[i].type == RB_BITMAP ? RB_WORDS * sizeof(unsigned long long)
+			: r->c[i].card * sizeof(unsigned short);
+		if (off + size > len) {
+			rb_free(r);
+			return -1;
+		}
+		r->c[i].data = (void *) (p + off);
+		r->c[i].owned = 0;
+		off += padded(size);
+	}
+	return 0;
+}
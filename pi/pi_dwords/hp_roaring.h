@@ -0,0 +1,46 @@
+/*
+ ============================================================================
+ Name        : hp_roaring.h
+ Description : Roaring-style compressed bitmaps of sample numbers
+ ============================================================================
+ */
+#ifndef HP_ROARING_H
+#define HP_ROARING_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+#define RB_ARRAY_MAX 4096   // above this many values a container becomes a bitmap
+#define RB_ARRAY     1      // sorted unsigned short values
+#define RB_BITMAP    2      // 1024 unsigned long long, 65536 bits
+
+/* Values sharing their upper 16 bits (key) */
+struct rb_container {
+	unsigned short key;
+	unsigned short type;
+	int card;
+	void *data;
+	int owned;      // data was allocated here rather than mapped from a file
+};
+
+/* Containers in increasing key order */
+struct roaring {
+	int n;
+	int cap;
+	struct rb_container *c;
+};
+
+void rb_init(struct roaring *r);
+void rb_free(struct roaring *r);
+int rb_append(struct roaring *r, unsigned int v);
+unsigned long long rb_cardinality(const struct roaring *r);
+void rb_range(struct roaring *out, unsigned int lo, unsigned int hi);
+void rb_and(struct roaring *out, const struct roaring *a, const struct roaring *b);
+void rb_or(struct roaring *out, const struct roaring *a, const struct roaring *b);
+void rb_andnot(struct roaring *out, const struct roaring *a, const struct roaring *b);
+int rb_foreach(const struct roaring *r, int (*fn)(unsigned int v, void *arg), void *arg);
+
+size_t rb_write(const struct roaring *r, FILE *fptr);
+int rb_map(struct roaring *r, const void *buf, size_t len);
+
+#endif
@@ -0,0 +1,186 @@
+/*
+ ============================================================================
+ Name        : hp_rules.c
+ Description : Camera trigger coincidence rules evaluated on hit patterns.
+               A rules file has one rule per line in bp_config form,
+                 name: term [& term ...]
+               with the terms of hp_rules.h, e.g. "nn3: nn 3 & mult 4".
+               Neighbour rules count the hit neighbours of every camera
+               pixel at once with bit-sliced adders over row vectors, so a
+               sample costs a few dozen vector operations per rule.
+ ============================================================================
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bp_config.h"
+#include "hp_rules.h"
+
+static int parse_term(struct hp_term *term, char *s) {
+	char kind[16];
+	int n, nb = 4, nf;
+
+	nf = sscanf(s, "%15s %d %d", kind, &n, &nb);
+	if (nf < 2 || n < 1)
+		return -1;
+	term->n = n;
+	term->neighbours = nb;
+	if (strcmp(kind, "mult") == 0 && nf == 2)
+		term->kind = HP_TERM_MULT;
+	else if (strcmp(kind, "nn") == 0 && (nb == 4 || nb == 8) && n <= nb + 1)
+		term->kind = HP_TERM_NN;
+	else if (strcmp(kind, "module") == 0 && nf == 2 && n <= 16)
+		term->kind = HP_TERM_MODULE;
+	else
+		return -1;
+	return 0;
+}
+
+int hp_rules_load(struct hp_rules *rules, const char *filename) {
+	struct bp_config cfg;
+	struct hp_rule *rule;
+	char value[208], *term, *save;
+	int i;
+
+	memset(rules, 0, sizeof(*rules));
+	if (bp_config_load(&cfg, filename) != 0)
+		return -1;
+	for (i = 0; i < cfg.nkeys && i < HP_RULES_MAX; i++) {
+		rule = &rules->rule[rules->nrules];
+		snprintf(rule->name, sizeof(rule->name), "%s", cfg.key[i]);
+		snprintf(value, sizeof(value), "%s", cfg.value[i]);
+		for (term = strtok_r(value, "&", &save); term != NULL; term = strtok_r(NULL, "&", &save)) {
+			if (rule->nterms == HP_RULE_MAXTERMS || parse_term(&rule->term[rule->nterms], term) != 0) {
+				fprintf(stderr, "%s: rule %s: cannot use term '%s'\n", filename, rule->name, term);
+				return -1;
+			}
+			rule->nterms++;
+		}
+		if (rule->nterms == 0) {
+			fprintf(stderr, "%s: rule %s has no terms\n", filename, rule->name);
+			return -1;
+		}
+		rules->nrules++;
+	}
+	if (rules->nrules == 0) {
+		fprintf(stderr, "%s: no rules\n", filename);
+		return -1;
+	}
+	return 0;
+}
+
+/* Add a one-bit plane into the 4-bit bit-sliced counters s[0..3] */
+static inline void add_plane(hp_rows *s, hp_rows p) {
+	hp_rows carry;
+	int k;
+
+	for (k = 0; k < 4; k++) {
+		carry = s[k] & p;
+		s[k] ^= p;
+		p = carry;
+	}
+}
+
+/* Pixels whose bit-sliced count s[0..3] is at least t */
+static inline hp_rows count_ge(const hp_rows *s, int t) {
+	hp_rows gt = s[0] ^ s[0], eq = ~gt;
+	int k;
+
+	for (k = 3; k >= 0; k--) {
+		if ((t >> k) & 1) {
+			eq &= s[k];
+		} else {
+			gt |= eq & s[k];
+			eq &= ~s[k];
+		}
+	}
+	return gt | eq;
+}
+
+/* Hit neighbour counts of every pixel, per vector of rows */
+struct nn_count {
+	int valid;
+	hp_rows self[HP_CAM_NVEC];
+	hp_rows s[HP_CAM_NVEC][4];
+};
+
+static void count_neighbours(struct nn_count *nc, const struct hp_cam *cam, int neighbours) {
+	hp_rows c, up, down;
+	int v;
+
+	for (v = 0; v < HP_CAM_NVEC; v++) {
+		c = hp_cam_rows(cam, v, 0);
+		up = hp_cam_rows(cam, v, 1);
+		down = hp_cam_rows(cam, v, -1);
+		nc->self[v] = c;
+		memset(nc->s[v], 0, sizeof(nc->s[v]));
+		add_plane(nc->s[v], (c << 1) & HP_CAM_COLS);
+		add_plane(nc->s[v], c >> 1);
+		add_plane(nc->s[v], up);
+		add_plane(nc->s[v], down);
+		if (neighbours == 8) {
+			add_plane(nc->s[v], (up << 1) & HP_CAM_COLS);
+			add_plane(nc->s[v], up >> 1);
+			add_plane(nc->s[v], (down << 1) & HP_CAM_COLS);
+			add_plane(nc->s[v], down >> 1);
+		}
+	}
+	nc->valid = 1;
+}
+
+/*
+	hp_rules_eval()
+
+	Return bit r set for every rule r that the hit pattern satisfies.
+	Camera multiplicity, the busiest module and the neighbour counts are
+	computed once per sample and shared by all rules.
+*/
+unsigned long long hp_rules_eval(const struct hp_rules *rules, const struct hp_geometry *geo,
+	const unsigned short *hit_pattern) {
+	struct hp_cam cam;
+	struct nn_count nc[2];
+	const struct hp_term *term;
+	unsigned long long fired = 0;
+	int mult = 0, module_max = 0, r, t, v, n, ok;
+
+	hp_cam_from_pattern(&cam, geo, hit_pattern);
+	for (v = 0; v < HP_CAM_NVEC; v++)
+		mult += hp_rows_popcount(hp_cam_rows(&cam, v, 0));
+	for (v = 0; v < HP_NWORDS; v++) {
+		n = __builtin_popcount(hit_pattern[v]);
+		if (geo->x0[v] >= 0 && n > module_max)
+			module_max = n;
+	}
+	nc[0].valid = nc[1].valid = 0;
+
+	for (r = 0; r < rules->nrules; r++) {
+		ok = 1;
+		for (t = 0; t < rules->rule[r].nterms && ok; t++) {
+			term = &rules->rule[r].term[t];
+			switch (term->kind) {
+			case HP_TERM_MULT:
+				ok = mult >= term->n;
+				break;
+			case HP_TERM_MODULE:
+				ok = module_max >= term->n;
+				break;
+			case HP_TERM_NN:
+				if (mult < term->n) {
+					ok = 0;
+					break;
+				}
+				n = term->neighbours == 8;
+				if (!nc[n].valid)
+					count_neighbours(&nc[n], &cam, term->neighbours);
+				ok = 0;
+				for (v = 0; v < HP_CAM_NVEC && !ok; v++)
+					ok = hp_rows_any(nc[n].self[v] & count_ge(nc[n].s[v], term->n - 1));
+				break;
+			}
+		}
+		if (ok)
+			fired |= 1ULL << r;
+	}
+	return fired;
+}
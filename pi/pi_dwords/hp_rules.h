@@ -0,0 +1,41 @@
+/*
+ ============================================================================
+ Name        : hp_rules.h
+ Description : Camera trigger coincidence rules evaluated on hit patterns
+ ============================================================================
+ */
+#ifndef HP_RULES_H
+#define HP_RULES_H
+
+#include "hp_camera.h"
+
+#define HP_RULES_MAX     64   // one bit each in the hp_rules_eval() result
+#define HP_RULE_MAXTERMS 4
+
+#define HP_TERM_MULT   1   // mult N: at least N trigger pixels hit on the camera
+#define HP_TERM_NN     2   // nn K [4|8]: a hit pixel with K-1 hit 4- or 8-neighbours
+#define HP_TERM_MODULE 3   // module N: at least N trigger pixels hit in one module
+
+struct hp_term {
+	int kind;
+	int n;
+	int neighbours;
+};
+
+/* A rule fires when all of its terms do */
+struct hp_rule {
+	char name[48];
+	int nterms;
+	struct hp_term term[HP_RULE_MAXTERMS];
+};
+
+struct hp_rules {
+	int nrules;
+	struct hp_rule rule[HP_RULES_MAX];
+};
+
+int hp_rules_load(struct hp_rules *rules, const char *filename);
+unsigned long long hp_rules_eval(const struct hp_rules *rules, const struct hp_geometry *geo,
+	const unsigned short *hit_pattern);
+
+#endif
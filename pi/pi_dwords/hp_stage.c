@@ -0,0 +1,470 @@
+/*
+ ============================================================================
+ Name        : hp_stage.c
+ Description : Staging of kHz recordings in RAM. With stage_dir set in
+               hp_writer.yml (a tmpfs such as /dev/shm/bp_stage) hp_writer
+               writes its segments there instead of to the card, up to
+               stage_mb. Each completed segment is queued to a flusher
+               thread running at idle CPU and I/O priority, which copies
+               it to the recording dir (fdatasync, then rename from .part)
+               at no more than flush_mb_s, or hands it to flush_command
+               (e.g. an rsync to the DAQ host), and then frees it. A
+               segment whose flush fails goes back in the queue behind
+               the others and is tried again after a backoff, at most
+               STAGE_TRIES times.
+
+               When a new segment would not fit in the budget it is
+               written straight to the recording dir instead (spilled):
+               the recording slows to the card speed but nothing is lost,
+               and the next segment is staged again once the flusher has
+               made room. Completed segments left in stage_dir by an
+               earlier run are queued at start.
+
+               Occupancy, segments waiting, flush lag (age of the oldest
+               segment waiting) and flush throughput are kept for
+               hp_stage_report().
+ ============================================================================
+ */
+#define _GNU_SOURCE // SCHED_IDLE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "spicomms.h"
+#include "hp_writer.h"
+#include "hp_stage.h"
+
+#define NSEGMENTS 256             // queue length
+#define CHUNK (1024 * 1024)       // copy unit, also the flush rate granularity
+#define IOPRIO_IDLE (3 << 13)     // IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT
+#define STAGE_TRIES 5             // flushes of a segment before it is left in stage_dir
+#define BACKOFF_NS 1000000000ULL  // before the first retry, doubled for each further one
+
+struct segment {
+	char staged[512];
+	char dest[512];
+	unsigned long long bytes;
+	unsigned long long closed_ns;
+	unsigned long long retry_ns;   // not flushed before this, after a failure
+	int tries;
+};
+
+int hp_stage_running = 0;
+
+static struct {
+	char dir[208];
+	char dest_dir[208];
+	unsigned long long budget;
+	double flush_mb_s;
+	char command[256];
+} cfg;
+
+static pthread_t flusher;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queued = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t flushed = PTHREAD_COND_INITIALIZER;
+static struct segment queue[NSEGMENTS];
+static int head, count, busy, stopping;
+
+// all under lock
+static unsigned long long occupied;       // queued segments and reservations
+static unsigned long long max_occupied;
+static unsigned long long nstaged, nspilled, nflushed, nretried, nfailed;
+static unsigned long long flushed_bytes, flush_ns, max_lag_ns;
+
+static void sleep_ns(unsigned long long ns) {
+	struct timespec ts;
+
+	ts.tv_sec = ns / 1000000000ULL;
+	ts.tv_nsec = ns % 1000000000ULL;
+	nanosleep(&ts, NULL);
+}
+
+static void sync_dir(const char *path) {
+	char buf[512];
+	int fd;
+
+	snprintf(buf, sizeof(buf), "%s", path);
+	fd = open(dirname(buf), O_RDONLY | O_DIRECTORY);
+	if (fd >= 0) {
+		fsync(fd);
+		close(fd);
+	}
+}
+
+/* Copy to <dest>.part at no more than flush_mb_s, sync, rename into place */
+static int copy_segment(const struct segment *s) {
+	char part[520];
+	static char buf[CHUNK];
+	unsigned long long t0 = monotonic_ns(), done = 0, due;
+	ssize_t n, m;
+	int in, out, status = 0;
+
+	in = open(s->staged, O_RDONLY);
+	if (in < 0) {
+		perror(s->staged);
+		return -1;
+	}
+	snprintf(part, sizeof(part), "%s.part", s->dest);
+	out = open(part, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (out < 0) {
+		perror(part);
+		close(in);
+		return -1;
+	}
+	while ((n = read(in, buf, sizeof(buf))) > 0) {
+		for (m = 0; m < n; ) {
+			ssize_t k = write(out, buf + m, n - m);
+			if (k < 0 && errno == EINTR)
+				continue;
+			if (k <= 0) {
+				status = -1;
+				break;
+			}
+			m += k;
+		}
+		if (status != 0)
+			break;
+		done += n;
+		if (cfg.flush_mb_s > 0) {
+			due = t0 + (unsigned long long) (done / (cfg.flush_mb_s * 1e6) * 1e9);
+			if (due > monotonic_ns())
+				sleep_ns(due - monotonic_ns());
+		}
+	}
+	if (n < 0 || fdatasync(out) != 0)
+		status = -1;
+	if (close(out) != 0)
+		status = -1;
+	close(in);
+	if (status == 0 && rename(part, s->dest) != 0)
+		status = -1;
+	if (status != 0) {
+		perror(s->dest);
+		unlink(part);
+		return -1;
+	}
+	sync_dir(s->dest);
+	return 0;
+}
+
+/* Appends staged to command[*n], in single quotes for the shell */
+static int put_quoted(char *command, size_t size, size_t *n, const char *staged) {
+	const char *q;
+
+	if (*n + 2 >= size)
+		return -1;
+	command[(*n)++] = '\'';
+	for (q = staged; *q != '\0'; q++) {
+		if (*n + 5 >= size)
+			return -1;
+		if (*q == '\'') {   // ' becomes '\''
+			memcpy(command + *n, "'\\''", 4);
+			*n += 4;
+		} else {
+			command[(*n)++] = *q;
+		}
+	}
+	command[(*n)++] = '\'';
+	return 0;
+}
+
+/* flush_command with each {} or %s replaced by the staged file, or the
+   file appended if it has neither. Any other % is copied as it is, the
+   command is never used as a format. Returns -1 if it does not fit. */
+static int expand_command(char *command, size_t size, const char *staged) {
+	const char *p = cfg.command;
+	size_t n = 0;
+	int placed = 0;
+
+	while (*p != '\0') {
+		if ((p[0] == '{' && p[1] == '}') || (p[0] == '%' && p[1] == 's')) {
+			if (put_quoted(command, size, &n, staged) != 0)
+				return -1;
+			p += 2;
+			placed = 1;
+		} else {
+			if (n + 1 >= size)
+				return -1;
+			command[n++] = *p++;
+		}
+	}
+	if (!placed) {
+		if (n + 1 >= size)
+			return -1;
+		command[n++] = ' ';
+		if (put_quoted(command, size, &n, staged) != 0)
+			return -1;
+	}
+	command[n] = '\0';
+	return 0;
+}
+
+static int flush_segment(const struct segment *s) {
+	char command[1024];
+
+	if (cfg.command[0] == '\0')
+		return copy_segment(s);
+	// e.g. "rsync -t {} daq:/data/"
+	if (expand_command(command, sizeof(command), s->staged) != 0) {
+		fprintf(stderr, "flush_command too long for %s\n", s->staged);
+		return -1;
+	}
+	return system(command) == 0 ? 0 : -1;
+}
+
+/* Under lock, count > 0. Moves the first segment that is due to the head
+   of the queue and returns 1, or returns 0 with the earliest retry time. */
+static int next_due(unsigned long long *wake_ns) {
+	unsigned long long now = monotonic_ns();
+	struct segment tmp;
+	int i, k;
+
+	*wake_ns = ~0ULL;
+	for (i = 0; i < count; i++) {
+		k = (head + i) % NSEGMENTS;
+		if (queue[k].retry_ns <= now) {
+			if (i > 0) {
+				tmp = queue[head];
+				queue[head] = queue[k];
+				queue[k] = tmp;
+			}
+			return 1;
+		}
+		if (queue[k].retry_ns < *wake_ns)
+			*wake_ns = queue[k].retry_ns;
+	}
+	return 0;
+}
+
+/* Under lock, wait on queued until monotonic time wake_ns at the latest */
+static void wait_until(unsigned long long wake_ns) {
+	unsigned long long now = monotonic_ns(), dt = wake_ns > now ? wake_ns - now : 0;
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	dt += ts.tv_nsec;
+	ts.tv_sec += dt / 1000000000ULL;
+	ts.tv_nsec = dt % 1000000000ULL;
+	pthread_cond_timedwait(&queued, &lock, &ts);
+}
+
+static void *flusher_main(void *unused) {
+	struct sched_param param = { 0 };
+	struct segment s;
+	unsigned long long t0, lag, wake_ns;
+	int ok;
+
+	// only CPU and card time the recorder leaves over
+	pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+	syscall(SYS_ioprio_set, 1, 0, IOPRIO_IDLE);
+
+	pthread_mutex_lock(&lock);
+	for (;;) {
+		while (count == 0 && !stopping)
+			pthread_cond_wait(&queued, &lock);
+		if (count == 0)
+			break;
+		if (!next_due(&wake_ns)) {
+			wait_until(wake_ns);
+			continue;
+		}
+		s = queue[head];
+		busy = 1;
+		pthread_mutex_unlock(&lock);
+
+		t0 = monotonic_ns();
+		ok = flush_segment(&s) == 0;
+		if (ok)
+			unlink(s.staged);
+
+		pthread_mutex_lock(&lock);
+		head = (head + 1) % NSEGMENTS;
+		count--;
+		busy = 0;
+		if (ok) {
+			occupied -= s.bytes;
+			nflushed++;
+			flushed_bytes += s.bytes;
+			flush_ns += monotonic_ns() - t0;
+			lag = monotonic_ns() - s.closed_ns;
+			if (lag > max_lag_ns)
+				max_lag_ns = lag;
+		} else if (++s.tries < STAGE_TRIES && !stopping) {
+			// behind the others, after 1, 2, 4 ... s
+			s.retry_ns = monotonic_ns() + (BACKOFF_NS << (s.tries - 1));
+			queue[(head + count) % NSEGMENTS] = s;
+			count++;
+			nretried++;
+		} else {
+			// left in stage_dir, keeps its share of the budget and is queued again at the next start
+			fprintf(stderr, "%s: not flushed after %d tries, left in place\n", s.staged, s.tries);
+			nfailed++;
+		}
+		pthread_cond_broadcast(&flushed);
+	}
+	pthread_mutex_unlock(&lock);
+	return NULL;
+}
+
+static void enqueue(const char *staged, const char *dest, unsigned long long bytes) {
+	struct segment *s;
+
+	while (count == NSEGMENTS)
+		pthread_cond_wait(&flushed, &lock);
+	s = &queue[(head + count) % NSEGMENTS];
+	snprintf(s->staged, sizeof(s->staged), "%s", staged);
+	snprintf(s->dest, sizeof(s->dest), "%s", dest);
+	s->bytes = bytes;
+	s->closed_ns = monotonic_ns();
+	s->retry_ns = 0;
+	s->tries = 0;
+	count++;
+	pthread_cond_signal(&queued);
+}
+
+/* Complete segments an earlier run left behind, .part files are torn */
+static void queue_leftovers(void) {
+	char staged[512], dest[512];
+	struct dirent *e;
+	struct stat st;
+	DIR *d;
+	size_t len;
+
+	d = opendir(cfg.dir);
+	if (d == NULL)
+		return;
+	while ((e = readdir(d)) != NULL) {
+		len = strlen(e->d_name);
+		if (e->d_name[0] == '.' || (len > 5 && strcmp(e->d_name + len - 5, ".part") == 0))
+			continue;
+		snprintf(staged, sizeof(staged), "%s/%s", cfg.dir, e->d_name);
+		snprintf(dest, sizeof(dest), "%s/%s", cfg.dest_dir, e->d_name);
+		if (stat(staged, &st) != 0 || !S_ISREG(st.st_mode))
+			continue;
+		printf("Flushing %s left from an earlier run\n", staged);
+		pthread_mutex_lock(&lock);
+		occupied += st.st_size;
+		enqueue(staged, dest, st.st_size);
+		pthread_mutex_unlock(&lock);
+	}
+	closedir(d);
+}
+
+/*
+	hp_stage_start()
+
+	Start the flusher for cfg->stage_dir, if it is not running already.
+	Segments are flushed to cfg->dir, or through cfg->flush_command.
+*/
+int hp_stage_start(const struct hp_writer_config *wcfg) {
+	if (hp_stage_running)
+		return 0;
+	snprintf(cfg.dir, sizeof(cfg.dir), "%s", wcfg->stage_dir);
+	snprintf(cfg.dest_dir, sizeof(cfg.dest_dir), "%s", wcfg->dir);
+	snprintf(cfg.command, sizeof(cfg.command), "%s", wcfg->flush_command);
+	cfg.budget = wcfg->stage_mb * 1e6;
+	cfg.flush_mb_s = wcfg->flush_mb_s;
+	if (mkdir(cfg.dir, 0755) != 0 && errno != EEXIST) {
+		perror(cfg.dir);
+		return -1;
+	}
+	head = count = busy = stopping = 0;
+	if (pthread_create(&flusher, NULL, flusher_main, NULL) != 0)
+		return -1;
+	hp_stage_running = 1;
+	queue_leftovers();
+	return 0;
+}
+
+/*
+	hp_stage_reserve()
+
+	Room for a segment of up to bytes: returns the staging dir to write
+	it to, or NULL when the budget is used up and the segment has to go
+	to the recording dir directly.
+*/
+const char *hp_stage_reserve(unsigned long long bytes) {
+	const char *dir = NULL;
+
+	pthread_mutex_lock(&lock);
+	if (hp_stage_running && occupied + bytes <= cfg.budget) {
+		occupied += bytes;
+		if (occupied > max_occupied)
+			max_occupied = occupied;
+		nstaged++;
+		dir = cfg.dir;
+	}
+	pthread_mutex_unlock(&lock);
+	return dir;
+}
+
+/* A staged segment is complete: swap its reservation for its size, queue it */
+void hp_stage_submit(const char *staged, const char *dest, unsigned long long bytes, unsigned long long reserved) {
+	pthread_mutex_lock(&lock);
+	occupied += bytes;
+	occupied -= reserved;
+	if (occupied > max_occupied)
+		max_occupied = occupied;
+	enqueue(staged, dest, bytes);
+	pthread_mutex_unlock(&lock);
+}
+
+void hp_stage_spilled(void) {
+	pthread_mutex_lock(&lock);
+	if (nspilled++ == 0)
+		printf("Staging area %s full, writing segments to %s directly until the flusher catches up\n",
+			cfg.dir, cfg.dest_dir);
+	pthread_mutex_unlock(&lock);
+}
+
+void hp_stage_report(FILE *fptr) {
+	unsigned long long lag;
+
+	if (cfg.dir[0] == '\0')
+		return;
+	pthread_mutex_lock(&lock);
+	lag = count > 0 ? monotonic_ns() - queue[head].closed_ns : 0;
+	fprintf(fptr, "staging %s: %.1f of %.1f MB used (%.0f%%, peak %.0f%%), %d segments waiting, flush lag %.1f s"
+		" (worst %.1f s)\n", cfg.dir, occupied * 1e-6, cfg.budget * 1e-6, 100.0 * occupied / cfg.budget,
+		100.0 * max_occupied / cfg.budget, count, lag * 1e-9, max_lag_ns * 1e-9);
+	fprintf(fptr, "flushed %llu segments, %.1f MB to %s at %.2f MB/s; %llu staged, %llu spilled, %llu retried,"
+		" %llu failed\n", nflushed, flushed_bytes * 1e-6, cfg.command[0] ? "flush_command" : cfg.dest_dir,
+		flush_ns ? flushed_bytes * 1e-6 / (flush_ns * 1e-9) : 0.0, nstaged, nspilled, nretried, nfailed);
+	pthread_mutex_unlock(&lock);
+}
+
+/*
+	hp_stage_stop()
+
+	With drain, wait for every queued segment to be flushed, printing the
+	progress. Otherwise only the segment being copied is finished, the
+	rest stays in stage_dir and is queued again by the next start.
+*/
+void hp_stage_stop(int drain) {
+	if (!hp_stage_running)
+		return;
+	pthread_mutex_lock(&lock);
+	if (drain && count > 0)
+		printf("Flushing %d staged segments (%.1f MB) from %s\n", count, occupied * 1e-6, cfg.dir);
+	while (drain && count > 0)
+		pthread_cond_wait(&flushed, &lock);
+	stopping = 1;
+	if (!drain)
+		count = busy;
+	pthread_cond_signal(&queued);
+	pthread_mutex_unlock(&lock);
+	pthread_join(flusher, NULL);
+	hp_stage_running = 0;
+	occupied = 0;   // what is left is counted again when it is queued at the next start
+}
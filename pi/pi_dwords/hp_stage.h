@@ -0,0 +1,24 @@
+/*
+ ============================================================================
+ Name        : hp_stage.h
+ Description : RAM staging area for recordings, drained to persistent
+               storage or the DAQ host by a low-priority flusher thread
+ ============================================================================
+ */
+#ifndef HP_STAGE_H
+#define HP_STAGE_H
+
+#include <stdio.h>
+
+struct hp_writer_config;
+
+extern int hp_stage_running;
+
+int hp_stage_start(const struct hp_writer_config *cfg);
+const char *hp_stage_reserve(unsigned long long bytes);
+void hp_stage_submit(const char *staged, const char *dest, unsigned long long bytes, unsigned long long reserved);
+void hp_stage_spilled(void);
+void hp_stage_report(FILE *fptr);
+void hp_stage_stop(int drain);
+
+#endif
@@ -0,0 +1,140 @@
+/*
+ ============================================================================
+ Name        : hp_stream.c
+ Description : Pi side of the hit pattern stream (menu 'S'). The Pi
+               listens, hp_aggregate on the DAQ host connects and gets a
+               hello and then one hp_stream_record per new trigger.
+               Sending never blocks the readout: records go into a buffer
+               that is written with MSG_DONTWAIT, and when the host falls
+               so far behind that the buffer is full, new records are
+               dropped. Their sequence numbers are still used up, so the
+               host sees every drop as a gap.
+ ============================================================================
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include "hp_stream.h"
+
+int hp_stream_listen(struct hp_stream *s, int port) {
+	struct sockaddr_in addr;
+	int one = 1;
+
+	memset(s, 0, sizeof(*s));
+	s->fd = -1;
+	s->port = port;
+	s->listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (s->listen_fd < 0) {
+		perror("socket");
+		return -1;
+	}
+	setsockopt(s->listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons(port);
+	if (bind(s->listen_fd, (struct sockaddr *) &addr, sizeof(addr)) != 0 || listen(s->listen_fd, 1) != 0) {
+		perror("hit pattern stream port");
+		close(s->listen_fd);
+		s->listen_fd = -1;
+		return -1;
+	}
+	s->buf = malloc(HP_STREAM_BUFSIZE);
+	return s->buf == NULL ? -1 : 0;
+}
+
+/* Wait for hp_aggregate to connect and send the hello */
+int hp_stream_accept(struct hp_stream *s, int timeout_ms) {
+	struct pollfd p = { s->listen_fd, POLLIN, 0 };
+	struct hp_stream_hello hello;
+	char host[40];
+	int one = 1;
+
+	if (poll(&p, 1, timeout_ms) != 1)
+		return -1;
+	s->fd = accept(s->listen_fd, NULL, NULL);
+	if (s->fd < 0)
+		return -1;
+	setsockopt(s->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	memset(&hello, 0, sizeof(hello));
+	memcpy(hello.magic, HP_STREAM_MAGIC, 4);
+	hello.buffer_records = HP_STREAM_BUFSIZE / sizeof(struct hp_stream_record);
+	gethostname(host, sizeof(host));
+	host[sizeof(host) - 1] = '\0';
+	snprintf(hello.name, sizeof(hello.name), "%s:%d", host, s->port);
+	memcpy(s->buf, &hello, sizeof(hello));
+	s->len = sizeof(hello);
+	return 0;
+}
+
+/* Write what the socket takes without waiting */
+static int flush(struct hp_stream *s, int flags) {
+	ssize_t n;
+
+	while (s->len > 0) {
+		n = send(s->fd, s->buf, s->len, flags | MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return 0;
+		if (n <= 0)
+			return -1;
+		memmove(s->buf, s->buf + n, s->len - n);
+		s->len -= n;
+	}
+	return 0;
+}
+
+/* Queue r with the next sequence number, or drop it if the buffer is full.
+   Returns -1 once the host has gone away. */
+int hp_stream_send(struct hp_stream *s, const struct hp_stream_record *r) {
+	struct hp_stream_record *q;
+
+	if (s->fd < 0)
+		return -1;
+	if (s->len + sizeof(*r) <= HP_STREAM_BUFSIZE) {
+		q = (struct hp_stream_record *) (s->buf + s->len);
+		memcpy(q, r, sizeof(*r));
+		q->seq = s->seq;
+		s->len += sizeof(*r);
+		s->sent++;
+		s->bytes += sizeof(*r);
+	} else {
+		s->dropped++;
+	}
+	s->seq++;
+	if (flush(s, MSG_DONTWAIT) != 0) {
+		close(s->fd);
+		s->fd = -1;
+		return -1;
+	}
+	return 0;
+}
+
+/* Send what is left, waiting at most a few seconds for the host */
+void hp_stream_close(struct hp_stream *s) {
+	struct pollfd p;
+	int tries;
+
+	for (tries = 0; s->fd >= 0 && s->len > 0 && tries < 50; tries++) {
+		p.fd = s->fd;
+		p.events = POLLOUT;
+		if (poll(&p, 1, 100) == 1 && flush(s, MSG_DONTWAIT) != 0)
+			break;
+	}
+	if (s->fd >= 0)
+		close(s->fd);
+	if (s->listen_fd >= 0)
+		close(s->listen_fd);
+	s->fd = s->listen_fd = -1;
+	free(s->buf);
+	s->buf = NULL;
+}
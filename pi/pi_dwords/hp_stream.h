@@ -0,0 +1,70 @@
+/*
+ ============================================================================
+ Name        : hp_stream.h
+ Description : Hit pattern stream from a Pi to the DAQ host aggregator
+ ============================================================================
+ */
+#ifndef HP_STREAM_H
+#define HP_STREAM_H
+
+#include <stdint.h>
+
+#include "hp_occupancy.h"
+
+#define HP_STREAM_MAGIC   "HPS1"
+#define HP_STREAM_PORT    5600
+#define HP_STREAM_BUFSIZE (256 * 1024)   // records queued while the host is slow, then dropped
+
+/* Sent once when hp_aggregate connects. Host byte order (the Pis and the
+   DAQ host are all little endian). */
+struct hp_stream_hello {
+	char magic[4];
+	uint32_t buffer_records;     // how many records the Pi queues before dropping
+	char name[56];               // hostname:port of the Pi
+};
+
+/* One per new hardware trigger */
+struct hp_stream_record {
+	uint32_t seq;                // consecutive per stream, a gap is a record the Pi dropped
+	uint32_t hwtriggers;         // TFPGA counter, a gap is a trigger not read out
+	uint64_t nstime;             // TFPGA nsTimer of the trigger (SPI_READ_TRIGGER_NSTIMER_TFPGA)
+	uint64_t pi_ns;              // CLOCK_REALTIME of the Pi when it was read
+	uint16_t hit_pattern[HP_NWORDS];
+};
+
+struct hp_stream {
+	int listen_fd;
+	int fd;
+	int port;
+	unsigned char *buf;
+	size_t len;
+	uint32_t seq;
+	unsigned long long sent, dropped, bytes;
+};
+
+/* Run file written by hp_aggregate: the header, char name[56] per source,
+   then an hpr_record per record in key order */
+#define HPR_MAGIC       "HPR1"
+#define HPR_KEY_HOST    0     // Pi CLOCK_REALTIME corrected to the host clock
+#define HPR_KEY_NSTIMER 1
+#define HPR_LATE        1     // flags: arrived after later records were written
+
+struct hpr_header {
+	char magic[4];
+	int nsources;
+	int key;
+};
+
+struct hpr_record {
+	unsigned short source;
+	unsigned short flags;
+	unsigned long long key_ns;
+	struct hp_stream_record r;
+};
+
+int hp_stream_listen(struct hp_stream *s, int port);
+int hp_stream_accept(struct hp_stream *s, int timeout_ms);
+int hp_stream_send(struct hp_stream *s, const struct hp_stream_record *r);
+void hp_stream_close(struct hp_stream *s);
+
+#endif
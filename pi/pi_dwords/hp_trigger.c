@@ -0,0 +1,230 @@
+/*
+ ============================================================================
+ Name        : hp_trigger.c
+ Description : Offline camera trigger emulator over recorded hit patterns.
+               Replays every sample of the given recordings ('9', '*' or '$'
+               files of bp_test_pi) through the coincidence rules of a rules
+               file and reports which samples each rule would have
+               triggered. Files are loaded and evaluated in chunks on a
+               work-stealing pool, so a night of recordings and many rule
+               variants can be scanned in one pass.
+
+               hp_trigger [-j threads] [-c FPM_config.csv] [-r hp_rules.yml]
+                          [-o triggers.txt] [-a] [-n chunk] file ...
+ ============================================================================
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "fpm_config.h"
+#include "hp_file.h"
+#include "hp_rules.h"
+#include "ws_pool.h"
+
+struct run;
+
+struct job {
+	struct run *run;
+	const char *filename;
+	struct hp_file file;
+	unsigned long long *fired;  // rules fired by each sample
+	int chunks_left;
+	int ok;
+};
+
+struct run {
+	struct hp_rules rules;
+	struct hp_geometry geo;
+	long chunk;
+};
+
+static void eval_task(struct ws_pool *pool, int worker, void *arg, long begin, long end) {
+	struct job *job = arg;
+	long i;
+
+	for (i = begin; i < end; i++)
+		job->fired[i] = hp_rules_eval(&job->run->rules, &job->run->geo, job->file.pattern[i]);
+	if (__atomic_sub_fetch(&job->chunks_left, 1, __ATOMIC_ACQ_REL) == 0)
+		hp_file_free_patterns(&job->file);
+}
+
+/* Load a file and queue its chunks on this worker, for others to steal */
+static void load_task(struct ws_pool *pool, int worker, void *arg, long begin, long end) {
+	struct job *job = arg;
+	long chunk = job->run->chunk, n, b;
+
+	if (hp_file_load(&job->file, job->filename) != 0)
+		return;
+	n = job->file.nsamples;
+	job->fired = calloc(n > 0 ? n : 1, sizeof(*job->fired));
+	if (job->fired == NULL) {
+		fprintf(stderr, "%s: out of memory\n", job->filename);
+		hp_file_free(&job->file);
+		return;
+	}
+	job->ok = 1;
+	job->chunks_left = (n + chunk - 1) / chunk;
+	if (job->chunks_left == 0) {
+		hp_file_free_patterns(&job->file);
+		return;
+	}
+	for (b = (job->chunks_left - 1) * chunk; b >= 0; b -= chunk)
+		ws_pool_push(pool, worker, eval_task, job, b, b + chunk < n ? b + chunk : n);
+}
+
+static void print_summary(const struct run *run, const struct job *jobs, int njobs) {
+	unsigned long long total = 0, count[HP_RULES_MAX], all[HP_RULES_MAX];
+	const struct job *job;
+	int j, r;
+	long i;
+
+	memset(all, 0, sizeof(all));
+	printf("%-32s %-8s %9s", "file", "format", "samples");
+	for (r = 0; r < run->rules.nrules; r++)
+		printf(" %16s", run->rules.rule[r].name);
+	printf("\n");
+	for (j = 0; j < njobs; j++) {
+		job = &jobs[j];
+		if (!job->ok) {
+			printf("%-32s not read\n", job->filename);
+			continue;
+		}
+		memset(count, 0, sizeof(count));
+		for (i = 0; i < job->file.nsamples; i++)
+			for (r = 0; r < run->rules.nrules; r++)
+				count[r] += (job->fired[i] >> r) & 1;
+		printf("%-32s %-8s %9d", job->filename, hp_file_format_name(job->file.format), job->file.nsamples);
+		for (r = 0; r < run->rules.nrules; r++) {
+			printf(" %8llu (%4.1f%%)", count[r], job->file.nsamples ? 100.0 * count[r] / job->file.nsamples : 0);
+			all[r] += count[r];
+		}
+		printf("\n");
+		total += job->file.nsamples;
+	}
+	printf("%-32s %-8s %9llu", "total", "", total);
+	for (r = 0; r < run->rules.nrules; r++)
+		printf(" %8llu (%4.1f%%)", all[r], total ? 100.0 * all[r] / total : 0);
+	printf("\n");
+}
+
+/* One line per sample: file step utc_ns and a 0/1 column per rule */
+static int write_triggers(const struct run *run, const struct job *jobs, int njobs,
+	const char *filename, int all_samples) {
+	const struct job *job;
+	FILE *fptr;
+	int j, r;
+	long i;
+
+	fptr = fopen(filename, "w");
+	if (fptr == NULL) {
+		perror(filename);
+		return -1;
+	}
+	fprintf(fptr, "# file step utc_ns");
+	for (r = 0; r < run->rules.nrules; r++)
+		fprintf(fptr, " %s", run->rules.rule[r].name);
+	fprintf(fptr, "\n");
+	for (j = 0; j < njobs; j++) {
+		job = &jobs[j];
+		for (i = 0; job->ok && i < job->file.nsamples; i++) {
+			if (!all_samples && job->fired[i] == 0)
+				continue;
+			fprintf(fptr, "%s %d %llu", job->filename, job->file.step[i], job->file.t_ns[i]);
+			for (r = 0; r < run->rules.nrules; r++)
+				fprintf(fptr, " %d", (int) ((job->fired[i] >> r) & 1));
+			fprintf(fptr, "\n");
+		}
+	}
+	return fclose(fptr);
+}
+
+int main(int argc, char **argv) {
+	const char *fpm_file = "FPM_config.csv", *rules_file = "hp_rules.yml", *out_file = NULL;
+	struct fpm_config fpm;
+	struct run run;
+	struct job *jobs;
+	struct ws_pool *pool;
+	struct timespec t0, t1;
+	int nthreads, all_samples = 0, njobs, j, opt, r, t;
+	unsigned long long nsamples = 0;
+	double elapsed;
+
+	nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	run.chunk = 4096;
+	while ((opt = getopt(argc, argv, "j:c:r:o:an:")) != -1) {
+		switch (opt) {
+		case 'j': nthreads = atoi(optarg); break;
+		case 'c': fpm_file = optarg; break;
+		case 'r': rules_file = optarg; break;
+		case 'o': out_file = optarg; break;
+		case 'a': all_samples = 1; break;
+		case 'n': run.chunk = atol(optarg); break;
+		default:
+			fprintf(stderr, "usage: %s [-j threads] [-c FPM_config.csv] [-r hp_rules.yml] "
+				"[-o triggers.txt] [-a] [-n chunk] file ...\n", argv[0]);
+			return 1;
+		}
+	}
+	if (optind == argc) {
+		fprintf(stderr, "%s: no hit pattern files given\n", argv[0]);
+		return 1;
+	}
+	if (run.chunk < 1)
+		run.chunk = 4096;
+	if (fpm_config_load(&fpm, fpm_file) != 0 || hp_rules_load(&run.rules, rules_file) != 0)
+		return 1;
+	hp_geometry_from_fpm(&run.geo, &fpm);
+
+	printf("Rules from %s:\n", rules_file);
+	for (r = 0; r < run.rules.nrules; r++) {
+		printf("  %-16s", run.rules.rule[r].name);
+		for (t = 0; t < run.rules.rule[r].nterms; t++) {
+			const struct hp_term *term = &run.rules.rule[r].term[t];
+			printf("%s", t ? " & " : "");
+			if (term->kind == HP_TERM_MULT)
+				printf("camera multiplicity >= %d", term->n);
+			else if (term->kind == HP_TERM_MODULE)
+				printf("module multiplicity >= %d", term->n);
+			else
+				printf("%d pixels in a %d-neighbourhood", term->n, term->neighbours);
+		}
+		printf("\n");
+	}
+
+	njobs = argc - optind;
+	jobs = calloc(njobs, sizeof(*jobs));
+	pool = ws_pool_create(nthreads);
+	if (jobs == NULL || pool == NULL) {
+		fprintf(stderr, "%s: out of memory\n", argv[0]);
+		return 1;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (j = 0; j < njobs; j++) {
+		jobs[j].run = &run;
+		jobs[j].filename = argv[optind + j];
+		ws_pool_push(pool, -1, load_task, &jobs[j], 0, 0);
+	}
+	ws_pool_wait(pool);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	print_summary(&run, jobs, njobs);
+	for (j = 0; j < njobs; j++)
+		nsamples += jobs[j].file.nsamples;
+	elapsed = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) * 1e-9;
+	fprintf(stderr, "%llu samples x %d rules in %.3f s on %d threads (%.0f samples/s, %ld steals)\n",
+		nsamples, run.rules.nrules, elapsed, nthreads, elapsed > 0 ? nsamples / elapsed : 0,
+		ws_pool_steals(pool));
+	if (out_file != NULL && write_triggers(&run, jobs, njobs, out_file, all_samples) == 0)
+		printf("Triggered samples written to %s\n", out_file);
+
+	ws_pool_destroy(pool);
+	for (j = 0; j < njobs; j++) {
+		hp_file_free(&jobs[j].file);
+		free(jobs[j].fired);
+	}
+	free(jobs);
+	return 0;
+}
@@ -0,0 +1,352 @@
+/*
+ ============================================================================
+ Name        : hp_whatif.c
+ Description : Trigger mask what-if rate predictor over recorded hit patterns.
+               For every candidate mask, counts the recorded samples that
+               would still trigger (at least -n enabled pixels hit) and ranks
+               the candidates by the fraction of the baseline triggering
+               samples they retain. All candidates are evaluated in a single
+               pass: patterns are taken a cache block at a time and every
+               block is ANDed with all candidate masks before moving on, with
+               the 512-bit patterns held in 128-bit (NEON/SSE) or, when built
+               with AVX2, 256-bit vectors.
+
+               hp_whatif [-j threads] [-c FPM_config.csv] [-b base_mask]
+                         [-m mask]... [-M mask_list] [-g] [-n min_pixels]
+                         [-t trigger_rate_hz] [-k top] [-o ranking.txt] file ...
+ ============================================================================
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "fpm_config.h"
+#include "hp_file.h"
+#include "hp_mask.h"
+#include "ws_pool.h"
+
+#if defined(__AVX2__)
+#define WI_VEC_BYTES 32
+#else
+#define WI_VEC_BYTES 16
+#endif
+#define WI_LANES (WI_VEC_BYTES / 8)
+#define WI_NVEC  (2 * HP_NWORDS / WI_VEC_BYTES)  // vectors per hit pattern
+#define WI_BLOCK 256                             // samples per cache block, 16 kB
+
+typedef unsigned long long wi_vec __attribute__((vector_size(WI_VEC_BYTES)));
+
+struct candidate {
+	char name[64];
+	unsigned short mask[HP_MASK_NWORDS];
+	int npixels;                 // masked pixels on the focal plane
+	unsigned long long retained;
+};
+
+struct whatif {
+	int ncand;
+	int maxcand;
+	struct candidate *cand;
+	wi_vec (*keep)[WI_NVEC];     // enabled pixels of each candidate, hit pattern order
+	int min_pixels;
+	unsigned long long *retained; // [worker][candidate]
+};
+
+struct job {
+	struct whatif *wi;
+	const char *filename;
+	struct hp_file file;
+	int chunks_left;
+	int ok;
+};
+
+static int vec_any(wi_vec x) {
+	unsigned long long any = 0;
+	int l;
+	for (l = 0; l < WI_LANES; l++)
+		any |= x[l];
+	return any != 0;
+}
+
+/*
+	count_block()
+
+	Candidates outer, samples inner: the block of patterns stays in L1 while
+	every mask is applied to it, and each mask is loaded once per block.
+*/
+static void count_block(const struct whatif *wi, const wi_vec (*block)[WI_NVEC], int nb, unsigned long long *retained) {
+	const wi_vec *keep;
+	wi_vec x;
+	int c, i, v, l, n, cnt;
+
+	for (c = 0; c < wi->ncand; c++) {
+		keep = wi->keep[c];
+		n = 0;
+		if (wi->min_pixels <= 1) {
+			for (i = 0; i < nb; i++) {
+				x = block[i][0] & keep[0];
+				for (v = 1; v < WI_NVEC; v++)
+					x |= block[i][v] & keep[v];
+				n += vec_any(x);
+			}
+		} else {
+			for (i = 0; i < nb; i++) {
+				cnt = 0;
+				for (v = 0; v < WI_NVEC; v++) {
+					x = block[i][v] & keep[v];
+					for (l = 0; l < WI_LANES; l++)
+						cnt += __builtin_popcountll(x[l]);
+				}
+				n += cnt >= wi->min_pixels;
+			}
+		}
+		retained[c] += n;
+	}
+}
+
+static void chunk_task(struct ws_pool *pool, int worker, void *arg, long begin, long end) {
+	static __thread wi_vec block[WI_BLOCK][WI_NVEC];
+	struct job *job = arg;
+	struct whatif *wi = job->wi;
+	long b;
+	int nb;
+
+	for (b = begin; b < end; b += nb) {
+		nb = end - b < WI_BLOCK ? end - b : WI_BLOCK;
+		memcpy(block, job->file.pattern[b], nb * sizeof(block[0]));
+		count_block(wi, (const wi_vec (*)[WI_NVEC]) block, nb, &wi->retained[(size_t) worker * wi->ncand]);
+	}
+	if (__atomic_sub_fetch(&job->chunks_left, 1, __ATOMIC_ACQ_REL) == 0)
+		hp_file_free_patterns(&job->file);
+}
+
+static void load_task(struct ws_pool *pool, int worker, void *arg, long begin, long end) {
+	struct job *job = arg;
+	long chunk = 16 * WI_BLOCK, n, b;
+
+	if (hp_file_load(&job->file, job->filename) != 0)
+		return;
+	job->ok = 1;
+	n = job->file.nsamples;
+	job->chunks_left = (n + chunk - 1) / chunk;
+	if (job->chunks_left == 0) {
+		hp_file_free_patterns(&job->file);
+		return;
+	}
+	for (b = (job->chunks_left - 1) * chunk; b >= 0; b -= chunk)
+		ws_pool_push(pool, worker, chunk_task, job, b, b + chunk < n ? b + chunk : n);
+}
+
+static struct candidate *add_candidate(struct whatif *wi, const char *name) {
+	struct candidate *c;
+
+	if (wi->ncand == wi->maxcand) {
+		wi->maxcand = wi->maxcand ? 2 * wi->maxcand : 64;
+		c = realloc(wi->cand, wi->maxcand * sizeof(*c));
+		if (c == NULL) {
+			fprintf(stderr, "hp_whatif: out of memory\n");
+			exit(1);
+		}
+		wi->cand = c;
+	}
+	c = &wi->cand[wi->ncand++];
+	memset(c, 0, sizeof(*c));
+	snprintf(c->name, sizeof(c->name), "%s", name);
+	return c;
+}
+
+static int add_mask_file(struct whatif *wi, const struct fpm_config *fpm, const char *filename) {
+	const char *base = strrchr(filename, '/');
+	struct candidate *c = add_candidate(wi, base ? base + 1 : filename);
+
+	if (hp_mask_read(c->mask, fpm, filename) != 0) {
+		wi->ncand--;
+		return -1;
+	}
+	return 0;
+}
+
+/* Every pixel still enabled in the baseline, masked on its own */
+static void add_single_pixels(struct whatif *wi, const struct fpm_config *fpm) {
+	unsigned short base[HP_MASK_NWORDS];
+	struct candidate *c;
+	char name[64];
+	int slot, word, bit;
+
+	memcpy(base, wi->cand[0].mask, sizeof(base));
+	for (slot = 0; slot < FPM_NSLOTS; slot++) {
+		word = fpm->mask_word[slot];
+		if (word < 0 || word >= HP_MASK_NWORDS)
+			continue;
+		for (bit = 0; bit < 16; bit++) {
+			if (base[word] & (1 << bit))
+				continue;
+			snprintf(name, sizeof(name), "+module %d pixel %d", fpm->module_id[slot], bit);
+			c = add_candidate(wi, name);
+			memcpy(c->mask, base, sizeof(base));
+			c->mask[word] |= 1 << bit;
+		}
+	}
+}
+
+static int fewest_retained(const void *a, const void *b) {
+	const struct candidate *ca = a, *cb = b;
+	if (ca->retained != cb->retained)
+		return ca->retained < cb->retained ? -1 : 1;
+	return ca->npixels - cb->npixels;
+}
+
+static void print_ranking(FILE *fptr, const struct whatif *wi, const struct candidate *base,
+	unsigned long long nsamples, double rate_hz, int top) {
+	const struct candidate *c;
+	int i;
+
+	fprintf(fptr, "Baseline %s: %llu of %llu samples trigger with >= %d pixel(s) enabled (%.2f%%), %d pixels masked\n",
+		base->name, base->retained, nsamples, wi->min_pixels,
+		nsamples ? 100.0 * base->retained / nsamples : 0, base->npixels);
+	fprintf(fptr, "%4s  %-32s %6s %10s %9s", "rank", "candidate", "masked", "retained", "of base");
+	if (rate_hz > 0)
+		fprintf(fptr, " %10s", "rate Hz");
+	fprintf(fptr, "\n");
+	for (i = 0; i < wi->ncand && (top <= 0 || i < top); i++) {
+		c = &wi->cand[i];
+		fprintf(fptr, "%4d  %-32s %6d %10llu %8.2f%%", i + 1, c->name, c->npixels, c->retained,
+			base->retained ? 100.0 * c->retained / base->retained : 0);
+		if (rate_hz > 0)
+			fprintf(fptr, " %10.1f", base->retained ? rate_hz * c->retained / base->retained : 0);
+		fprintf(fptr, "\n");
+	}
+}
+
+int main(int argc, char **argv) {
+	const char *fpm_file = "FPM_config.csv", *base_file = NULL, *list_file = NULL, *out_file = NULL;
+	const char *mask_files[256];
+	struct fpm_config fpm;
+	struct whatif wi;
+	struct candidate base;
+	struct job *jobs;
+	struct ws_pool *pool;
+	unsigned short keep[HP_NWORDS];
+	unsigned long long nsamples = 0;
+	int nthreads, nmask_files = 0, single = 0, top = 20, njobs, opt, i, j, w;
+	double rate_hz = 0;
+	char line[256];
+	FILE *fptr;
+
+	memset(&wi, 0, sizeof(wi));
+	wi.min_pixels = 1;
+	nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	while ((opt = getopt(argc, argv, "j:c:b:m:M:gn:t:k:o:")) != -1) {
+		switch (opt) {
+		case 'j': nthreads = atoi(optarg); break;
+		case 'c': fpm_file = optarg; break;
+		case 'b': base_file = optarg; break;
+		case 'm':
+			if (nmask_files < 256)
+				mask_files[nmask_files++] = optarg;
+			break;
+		case 'M': list_file = optarg; break;
+		case 'g': single = 1; break;
+		case 'n': wi.min_pixels = atoi(optarg); break;
+		case 't': rate_hz = atof(optarg); break;
+		case 'k': top = atoi(optarg); break;
+		case 'o': out_file = optarg; break;
+		default:
+			fprintf(stderr, "usage: %s [-j threads] [-c FPM_config.csv] [-b base_mask] [-m mask]... "
+				"[-M mask_list] [-g] [-n min_pixels] [-t trigger_rate_hz] [-k top] [-o ranking.txt] file ...\n",
+				argv[0]);
+			return 1;
+		}
+	}
+	if (optind == argc) {
+		fprintf(stderr, "%s: no hit pattern files given\n", argv[0]);
+		return 1;
+	}
+	if (nthreads < 1)
+		nthreads = 1;
+	if (fpm_config_load(&fpm, fpm_file) != 0)
+		return 1;
+
+	// candidate 0 is the baseline, all populated positions enabled unless -b
+	if (base_file != NULL) {
+		if (add_mask_file(&wi, &fpm, base_file) != 0)
+			return 1;
+	} else {
+		add_candidate(&wi, "no mask");
+		for (i = 0; i < HP_MASK_NWORDS; i++)
+			wi.cand[0].mask[i] = fpm_config_slot_of_mask_word(&fpm, i) >= 0 ? 0 : 0xffff;
+	}
+	for (i = 0; i < nmask_files; i++)
+		add_mask_file(&wi, &fpm, mask_files[i]);
+	if (list_file != NULL) {
+		fptr = fopen(list_file, "r");
+		if (fptr == NULL) {
+			perror(list_file);
+			return 1;
+		}
+		while (fscanf(fptr, "%255s", line) == 1)
+			if (line[0] != '#')
+				add_mask_file(&wi, &fpm, line);
+		fclose(fptr);
+	}
+	if (single)
+		add_single_pixels(&wi, &fpm);
+
+	wi.keep = aligned_alloc(WI_VEC_BYTES, wi.ncand * sizeof(*wi.keep));
+	wi.retained = calloc((size_t) nthreads * wi.ncand, sizeof(*wi.retained));
+	if (wi.keep == NULL || wi.retained == NULL) {
+		fprintf(stderr, "%s: out of memory\n", argv[0]);
+		return 1;
+	}
+	for (i = 0; i < wi.ncand; i++) {
+		hp_mask_keep(keep, wi.cand[i].mask, &fpm);
+		memcpy(wi.keep[i], keep, sizeof(keep));
+		for (w = 0; w < HP_NWORDS; w++)
+			if (fpm.mask_word[w] >= 0)
+				wi.cand[i].npixels += 16 - __builtin_popcount(keep[w]);
+	}
+	printf("%d candidate masks, %d-bit vectors\n", wi.ncand, 8 * WI_VEC_BYTES);
+
+	njobs = argc - optind;
+	jobs = calloc(njobs, sizeof(*jobs));
+	pool = ws_pool_create(nthreads);
+	if (jobs == NULL || pool == NULL) {
+		fprintf(stderr, "%s: out of memory\n", argv[0]);
+		return 1;
+	}
+	for (j = 0; j < njobs; j++) {
+		jobs[j].wi = &wi;
+		jobs[j].filename = argv[optind + j];
+		ws_pool_push(pool, -1, load_task, &jobs[j], 0, 0);
+	}
+	ws_pool_destroy(pool);
+
+	for (j = 0; j < njobs; j++) {
+		if (jobs[j].ok)
+			nsamples += jobs[j].file.nsamples;
+		hp_file_free(&jobs[j].file);
+	}
+	for (i = 0; i < wi.ncand; i++)
+		for (w = 0; w < nthreads; w++)
+			wi.cand[i].retained += wi.retained[(size_t) w * wi.ncand + i];
+	base = wi.cand[0];
+	qsort(wi.cand, wi.ncand, sizeof(*wi.cand), fewest_retained);
+
+	print_ranking(stdout, &wi, &base, nsamples, rate_hz, top);
+	if (out_file != NULL) {
+		fptr = fopen(out_file, "w");
+		if (fptr == NULL) {
+			perror(out_file);
+		} else {
+			print_ranking(fptr, &wi, &base, nsamples, rate_hz, 0);
+			fclose(fptr);
+			printf("Full ranking written to %s\n", out_file);
+		}
+	}
+	free(wi.keep);
+	free(wi.retained);
+	free(wi.cand);
+	free(jobs);
+	return 0;
+}
@@ -0,0 +1,343 @@
+/*
+ ============================================================================
+ Name        : hp_writer.c
+ Description : Recording writer for the SD card. Records are written to a
+               stdio stream as before, but the stream only fills an aligned
+               block buffer (block_kb, 512 KB by default), and whole blocks
+               go to the card with pwrite(), optionally through O_DIRECT so
+               the page cache never builds up a large dirty backlog to
+               flush at once. Files are written as <final>.part and renamed
+               only when complete (tail written, header patched with the
+               record count, fdatasync), so a power cut leaves a partial
+               .part file beside whole files and never a torn file under a
+               final name. Files rotate by size or age at record
+               boundaries, and fdatasync runs every fsync_blocks blocks.
+               Write and sync latencies are kept for hp_writer_report().
+ ============================================================================
+ */
+#define _GNU_SOURCE // fopencookie, O_DIRECT
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "spicomms.h"
+#include "bp_config.h"
+#include "hp_writer.h"
+#include "hp_stage.h"
+
+/*
+	hp_writer_config_load()
+
+	Defaults if filename does not exist: the current directory, 512 KB
+	blocks, no rotation, no fsync before close, no O_DIRECT, no staging.
+	Staged recordings are always segmented, by default into eighths of
+	the staging budget.
+*/
+int hp_writer_config_load(struct hp_writer_config *cfg, const char *filename) {
+	struct bp_config c;
+	int status = 0;
+
+	memset(&c, 0, sizeof(c));
+	if (access(filename, R_OK) == 0)
+		status = bp_config_load(&c, filename);
+	snprintf(cfg->dir, sizeof(cfg->dir), "%s", bp_config_string(&c, "dir", "."));
+	cfg->block_kb = bp_config_double(&c, "block_kb", 512);
+	cfg->rotate_mb = bp_config_double(&c, "rotate_mb", 0);
+	cfg->rotate_s = bp_config_double(&c, "rotate_s", 0);
+	cfg->fsync_blocks = bp_config_double(&c, "fsync_blocks", 0);
+	cfg->direct = bp_config_double(&c, "direct", 0);
+	snprintf(cfg->stage_dir, sizeof(cfg->stage_dir), "%s", bp_config_string(&c, "stage_dir", ""));
+	cfg->stage_mb = bp_config_double(&c, "stage_mb", 256);
+	cfg->flush_mb_s = bp_config_double(&c, "flush_mb_s", 0);
+	snprintf(cfg->flush_command, sizeof(cfg->flush_command), "%s", bp_config_string(&c, "flush_command", ""));
+	if (cfg->stage_dir[0] && (cfg->rotate_mb <= 0 || cfg->rotate_mb > cfg->stage_mb / 2))
+		cfg->rotate_mb = cfg->stage_mb / 8;
+	if (cfg->block_kb < 4)
+		cfg->block_kb = 4;
+	cfg->block_kb &= ~3;
+	return status;
+}
+
+static void sync_file(struct hp_writer *w) {
+	unsigned long long t0 = monotonic_ns(), dt;
+
+	if (fdatasync(w->fd) != 0)
+		w->error = errno;
+	dt = monotonic_ns() - t0;
+	w->nsync++;
+	w->sync_ns += dt;
+	if (dt > w->max_sync_ns)
+		w->max_sync_ns = dt;
+	w->blocks_unsynced = 0;
+}
+
+/* pwrite() all of len, dropping O_DIRECT if the file system refuses it */
+static int write_at(struct hp_writer *w, const char *buf, size_t len, off_t offset) {
+	unsigned long long t0 = monotonic_ns(), dt;
+	ssize_t n;
+	size_t done = 0;
+
+	while (done < len) {
+		n = pwrite(w->fd, buf + done, len - done, offset + done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && errno == EINVAL && w->direct) {
+			fcntl(w->fd, F_SETFL, fcntl(w->fd, F_GETFL) & ~O_DIRECT);
+			w->direct = w->cfg.direct = 0;
+			fprintf(stderr, "%s: O_DIRECT not supported here, writing through the page cache\n", w->part);
+			continue;
+		}
+		if (n <= 0) {
+			w->error = n < 0 ? errno : EIO;
+			return -1;
+		}
+		done += n;
+	}
+	dt = monotonic_ns() - t0;
+	w->write_ns += dt;
+	if (dt > w->max_write_ns)
+		w->max_write_ns = dt;
+	return 0;
+}
+
+static void flush_block(struct hp_writer *w) {
+	if (write_at(w, w->block, w->block_size, w->offset) != 0)
+		return;
+	if (w->offset == 0)
+		memcpy(w->head, w->block, HP_WRITER_ALIGN);
+	w->offset += w->block_size;
+	w->fill = 0;
+	w->blocks++;
+	if (w->cfg.fsync_blocks > 0 && ++w->blocks_unsynced >= w->cfg.fsync_blocks)
+		sync_file(w);
+}
+
+static int open_file(struct hp_writer *w) {
+	char stamp[32];
+	char file[256];
+	const char *dir = w->cfg.dir;
+	time_t t = time(NULL);
+	int flags = O_WRONLY | O_CREAT | O_TRUNC;
+
+	if (w->cfg.rotate_mb > 0 || w->cfg.rotate_s > 0) {
+		strftime(stamp, sizeof(stamp), "%Y%m%d_%H%M%S", gmtime(&t));
+		snprintf(file, sizeof(file), "%s_%s_%03d%s", w->name, stamp, w->seq, w->ext);
+	} else {
+		snprintf(file, sizeof(file), "%s%s", w->name, w->ext);
+	}
+	w->seq++;
+	w->reserved = 0;
+	w->direct = w->cfg.direct;
+	if (hp_stage_running) {
+		// a segment may overshoot rotate_mb by the last record
+		w->reserved = w->cfg.rotate_mb * 1e6 + w->block_size;
+		dir = hp_stage_reserve(w->reserved);
+		if (dir != NULL) {
+			w->direct = 0;   // RAM, and tmpfs refuses O_DIRECT
+		} else {
+			hp_stage_spilled();
+			w->reserved = 0;
+			dir = w->cfg.dir;
+		}
+	}
+	snprintf(w->final, sizeof(w->final), "%s/%s", dir, file);
+	snprintf(w->dest, sizeof(w->dest), "%s/%s", w->cfg.dir, file);
+	snprintf(w->part, sizeof(w->part), "%s.part", w->final);
+
+	w->fd = open(w->part, flags | (w->direct ? O_DIRECT : 0), 0644);
+	if (w->fd < 0 && w->direct && errno == EINVAL) {
+		w->direct = w->cfg.direct = 0;
+		fprintf(stderr, "%s: O_DIRECT not supported here, writing through the page cache\n", w->part);
+		w->fd = open(w->part, flags, 0644);
+	}
+	if (w->fd < 0) {
+		w->error = errno;
+		perror(w->part);
+		return -1;
+	}
+	w->fill = 0;
+	w->offset = 0;
+	w->file_bytes = 0;
+	w->nrecords = 0;
+	w->blocks_unsynced = 0;
+	w->file_start_ns = monotonic_ns();
+	w->nfiles++;
+	if (w->header != NULL) {
+		w->header_len = w->header(w->block, HP_WRITER_ALIGN, -1, w->ctx);
+		w->fill = w->file_bytes = w->header_len;
+		w->bytes += w->header_len;
+	}
+	return 0;
+}
+
+static ssize_t cookie_write(void *cookie, const char *buf, size_t len) {
+	struct hp_writer *w = cookie;
+	size_t n, done = 0;
+
+	if (w->error)   // a full card stays full, do not retry the block for every record
+		return -1;
+	if (w->fd < 0 && open_file(w) != 0)   // rotated, the next file starts with this record
+		return -1;
+	while (done < len) {
+		n = w->block_size - w->fill;
+		if (n > len - done)
+			n = len - done;
+		memcpy(w->block + w->fill, buf + done, n);
+		w->fill += n;
+		done += n;
+		if (w->fill == w->block_size) {
+			flush_block(w);
+			if (w->error)   // the block is still full, ENOSPC or EFBIG
+				return -1;
+		}
+	}
+	w->file_bytes += len;
+	w->bytes += len;
+	return (ssize_t) len;
+}
+
+/* Tail block, header with the record count, fdatasync, rename into place */
+static int close_file(struct hp_writer *w) {
+	unsigned long long t0 = monotonic_ns(), dt;
+	char header[HP_WRITER_ALIGN], *dir;
+	char dirbuf[512];
+	size_t len = 0;
+	int n = -1, dfd;
+
+	if (w->header != NULL)
+		n = w->header(header, sizeof(header), w->nrecords, w->ctx);
+	if (n == w->header_len && w->offset == 0)
+		memcpy(w->block, header, n);   // still in the buffer
+	if (w->fill > 0) {
+		// O_DIRECT writes whole sectors, the padding is cut off again below
+		len = w->direct ? (w->fill + HP_WRITER_ALIGN - 1) & ~(size_t) (HP_WRITER_ALIGN - 1) : w->fill;
+		memset(w->block + w->fill, 0, len - w->fill);
+		write_at(w, w->block, len, w->offset);
+		if (w->offset == 0)
+			memcpy(w->head, w->block, HP_WRITER_ALIGN);
+		w->blocks++;
+	}
+	if (n == w->header_len && n > 0 && w->offset > 0) {
+		if (w->direct) {
+			memcpy(w->head, header, n);
+			write_at(w, w->head, HP_WRITER_ALIGN, 0);
+		} else {
+			write_at(w, header, n, 0);
+		}
+	}
+	if (len > w->fill && ftruncate(w->fd, w->offset + w->fill) != 0)
+		w->error = errno;
+	sync_file(w);
+	if (close(w->fd) != 0)
+		w->error = errno;
+	w->fd = -1;
+	if (w->error) {
+		// torn, left as .part; the recorder stops and hp_stage_stop() frees its budget
+		return -1;
+	}
+	if (rename(w->part, w->final) != 0) {
+		w->error = errno;
+		perror(w->final);
+	}
+	// the rename itself is only durable once the directory is synced
+	snprintf(dirbuf, sizeof(dirbuf), "%s", w->final);
+	dir = dirname(dirbuf);
+	dfd = open(dir, O_RDONLY | O_DIRECTORY);
+	if (dfd >= 0) {
+		fsync(dfd);
+		close(dfd);
+	}
+	if (w->reserved > 0)
+		hp_stage_submit(w->final, w->dest, w->offset + w->fill, w->reserved);
+	dt = monotonic_ns() - t0;
+	if (dt > w->max_close_ns)
+		w->max_close_ns = dt;
+	return w->error ? -1 : 0;
+}
+
+/*
+	hp_writer_open()
+
+	Start writing <dir>/<name><ext>, or <dir>/<name>_<UTC time>_<seq><ext>
+	when rotation is configured. Write records to w->stream and call
+	hp_writer_end_record() after each.
+*/
+int hp_writer_open(struct hp_writer *w, const struct hp_writer_config *cfg, const char *name, const char *ext,
+	hp_writer_header_fn header, void *ctx) {
+	cookie_io_functions_t io = { NULL, cookie_write, NULL, NULL };
+
+	memset(w, 0, sizeof(*w));
+	w->cfg = *cfg;
+	snprintf(w->name, sizeof(w->name), "%s", name);
+	snprintf(w->ext, sizeof(w->ext), "%s", ext);
+	w->header = header;
+	w->ctx = ctx;
+	w->fd = -1;
+	w->block_size = (size_t) cfg->block_kb * 1024;
+	if (cfg->stage_dir[0] && hp_stage_start(cfg) != 0)
+		fprintf(stderr, "%s: staging not available, recording to %s directly\n", cfg->stage_dir, cfg->dir);
+	if (posix_memalign((void **) &w->block, HP_WRITER_ALIGN, w->block_size + HP_WRITER_ALIGN) != 0 ||
+	    posix_memalign((void **) &w->head, HP_WRITER_ALIGN, HP_WRITER_ALIGN) != 0) {
+		free(w->block);
+		return -1;
+	}
+	if (open_file(w) != 0) {
+		free(w->block);
+		free(w->head);
+		return -1;
+	}
+	w->stream = fopencookie(w, "w", io);
+	if (w->stream == NULL) {
+		close_file(w);
+		free(w->block);
+		free(w->head);
+		return -1;
+	}
+	return 0;
+}
+
+/* Record boundary: the file is closed here when it is due for rotation,
+   the next one is opened by the first write after it. Returns -1 once a
+   write has failed, the recording has to stop. */
+int hp_writer_end_record(struct hp_writer *w) {
+	if (fflush(w->stream) != 0 && !w->error)
+		w->error = EIO;
+	w->nrecords++;
+	w->records++;
+	if (w->fd >= 0 && ((w->cfg.rotate_mb > 0 && w->file_bytes >= w->cfg.rotate_mb * 1e6) ||
+	    (w->cfg.rotate_s > 0 && monotonic_ns() - w->file_start_ns >= w->cfg.rotate_s * 1e9))) {
+		if (close_file(w) != 0)
+			return -1;
+	}
+	return w->error ? -1 : 0;
+}
+
+int hp_writer_close(struct hp_writer *w) {
+	int status;
+
+	fflush(w->stream);
+	status = w->fd >= 0 ? close_file(w) : (w->error ? -1 : 0);
+	fclose(w->stream);
+	free(w->block);
+	free(w->head);
+	w->block = w->head = NULL;
+	if (w->error)
+		fprintf(stderr, "%s: %s, left incomplete\n", w->part, strerror(w->error));
+	return status;
+}
+
+void hp_writer_report(const struct hp_writer *w, FILE *fptr) {
+	fprintf(fptr, "%llu records, %.1f MB in %llu files of %s/%s*%s, %llu blocks of %zu KB%s\n", w->records,
+		w->bytes * 1e-6, w->nfiles, w->cfg.dir, w->name, w->ext, w->blocks, w->block_size / 1024,
+		w->cfg.direct ? " (O_DIRECT)" : "");
+	fprintf(fptr, "block writes: mean %.2f ms, worst %.2f ms; fdatasync: %llu, mean %.2f ms, worst %.2f ms;"
+		" file close worst %.2f ms\n", w->blocks ? w->write_ns * 1e-6 / w->blocks : 0.0, w->max_write_ns * 1e-6,
+		w->nsync, w->nsync ? w->sync_ns * 1e-6 / w->nsync : 0.0, w->max_sync_ns * 1e-6, w->max_close_ns * 1e-6);
+	if (w->cfg.stage_dir[0])
+		hp_stage_report(fptr);
+}
@@ -0,0 +1,77 @@
+/*
+ ============================================================================
+ Name        : hp_writer.h
+ Description : Large-block recording writer with rotation and fsync policy
+ ============================================================================
+ */
+#ifndef HP_WRITER_H
+#define HP_WRITER_H
+
+#include <stdio.h>
+#include <sys/types.h>
+
+#define HP_WRITER_ALIGN 4096   // O_DIRECT buffer, offset and length alignment
+
+struct hp_writer_config {
+	char dir[208];
+	int block_kb;          // write unit, a multiple of 4 KB
+	double rotate_mb;      // start a new file after this much, 0 never
+	double rotate_s;       // or after this long, 0 never
+	int fsync_blocks;      // fdatasync every this many blocks, 0 only when a file is closed
+	int direct;            // O_DIRECT, bypasses the page cache
+
+	// staging in RAM, see hp_stage.c
+	char stage_dir[208];   // e.g. /dev/shm/bp_stage, empty to write to dir directly
+	double stage_mb;       // budget, segments beyond it are written to dir directly
+	double flush_mb_s;     // flusher bandwidth to dir, 0 unlimited
+	char flush_command[256];   // run on each staged segment ({} or %s) instead of copying it to dir
+};
+
+/* Writes the file header for a file holding nrecords records (-1 while
+   the file is being opened, the count is not known yet) into buf and
+   returns its length. When a file is closed the header is regenerated
+   with the final count and patched in if its length did not change. */
+typedef int (*hp_writer_header_fn)(char *buf, int size, long nrecords, void *ctx);
+
+struct hp_writer {
+	struct hp_writer_config cfg;
+	char name[64];
+	char ext[16];
+	hp_writer_header_fn header;
+	void *ctx;
+	FILE *stream;              // records are written here, then hp_writer_end_record()
+
+	int fd;
+	char part[512];            // name while being written
+	char final[496];           // renamed to this when closed
+	char dest[496];            // in dir, where a staged file is flushed to
+	unsigned long long reserved;   // staging budget held by the open file, 0 not staged
+	int direct;                // O_DIRECT for the open file
+	char *block;
+	size_t block_size;
+	size_t fill;
+	char *head;                // copy of the first HP_WRITER_ALIGN bytes on disk
+	int header_len;
+	off_t offset;              // bytes on disk, whole blocks
+	unsigned long long file_bytes;
+	long nrecords;
+	unsigned long long file_start_ns;
+	int blocks_unsynced;
+	int seq;
+	int error;
+
+	/* statistics over all files */
+	unsigned long long bytes, records, blocks, nfiles;
+	unsigned long long write_ns, max_write_ns;
+	unsigned long long nsync, sync_ns, max_sync_ns;
+	unsigned long long max_close_ns;   // tail, header patch, fsync and rename
+};
+
+int hp_writer_config_load(struct hp_writer_config *cfg, const char *filename);
+int hp_writer_open(struct hp_writer *w, const struct hp_writer_config *cfg, const char *name, const char *ext,
+	hp_writer_header_fn header, void *ctx);
+int hp_writer_end_record(struct hp_writer *w);
+int hp_writer_close(struct hp_writer *w);
+void hp_writer_report(const struct hp_writer *w, FILE *fptr);
+
+#endif
@@ -0,0 +1,94 @@
+/*
+ ============================================================================
+ Name        : hp_writer_test.c
+ Description : hp_writer on a full card. The file size limit (as ulimit -f)
+               stands in for ENOSPC: the block writes start failing with
+               EFBIG, hp_writer_end_record() has to report it instead of
+               retrying the full block for ever, and the torn file has to
+               stay a .part file. Run by ctest, or as hp_writer_test [dir].
+ ============================================================================
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#include "spicomms.h"
+#include "hp_writer.h"
+
+#define LIMIT_KB 400
+#define RECORD_BYTES 1000
+#define MAX_RECORDS 100000   // 100 MB, far past the limit
+
+unsigned long long monotonic_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int main(int argc, char *argv[]) {
+	struct hp_writer_config cfg;
+	struct hp_writer w;
+	struct rlimit limit = { LIMIT_KB * 1024, LIMIT_KB * 1024 };
+	char tmpl[] = "/tmp/hp_writer_test_XXXXXX";
+	char path[512], record[RECORD_BYTES];
+	const char *dir = argc > 1 ? argv[1] : mkdtemp(tmpl);
+	int n, failed = 0;
+
+	if (dir == NULL) {
+		perror("mkdtemp");
+		return 1;
+	}
+	hp_writer_config_load(&cfg, "/nonexistent");   // the defaults
+	snprintf(cfg.dir, sizeof(cfg.dir), "%s", dir);
+	cfg.block_kb = 64;
+
+	signal(SIGXFSZ, SIG_IGN);   // EFBIG from write() instead of the signal
+	alarm(20);                  // a writer that spins is killed, and the test fails
+	if (setrlimit(RLIMIT_FSIZE, &limit) != 0) {
+		perror("setrlimit");
+		return 1;
+	}
+
+	if (hp_writer_open(&w, &cfg, "full", ".bin", NULL, NULL) != 0) {
+		fprintf(stderr, "FAIL: hp_writer_open\n");
+		return 1;
+	}
+	memset(record, 0x5a, sizeof(record));
+	for (n = 0; n < MAX_RECORDS; n++) {
+		fwrite(record, 1, sizeof(record), w.stream);
+		if (hp_writer_end_record(&w) != 0) {
+			failed = 1;
+			break;
+		}
+	}
+	if (!failed) {
+		fprintf(stderr, "FAIL: %d records (%d KB) written past a %d KB limit\n", n, n * RECORD_BYTES / 1024,
+			LIMIT_KB);
+		return 1;
+	}
+	printf("write failed at record %d, %d KB\n", n, n * RECORD_BYTES / 1024);
+	if (hp_writer_close(&w) == 0) {
+		fprintf(stderr, "FAIL: hp_writer_close() after a failed write returned 0\n");
+		return 1;
+	}
+
+	snprintf(path, sizeof(path), "%s/full.bin", dir);
+	if (access(path, F_OK) == 0) {
+		fprintf(stderr, "FAIL: torn file renamed to %s\n", path);
+		return 1;
+	}
+	snprintf(path, sizeof(path), "%s/full.bin.part", dir);
+	if (access(path, F_OK) != 0) {
+		fprintf(stderr, "FAIL: %s missing\n", path);
+		return 1;
+	}
+	unlink(path);
+	if (argc <= 1)
+		rmdir(dir);
+	printf("PASS\n");
+	return 0;
+}
@@ -0,0 +1,378 @@
+/*
+ ============================================================================
+ Name        : hskp_archive.c
+ Description : Long-term housekeeping archive, in the manner of a round
+               robin database. One file, preallocated when it is created,
+               holds three rings: the raw samples (FEE currents and
+               voltages of the 32 slots and the ENV frame, in A and V) for
+               raw_hours, 1-minute min/max/mean/count rollups for
+               minute_days and 1-hour rollups for hour_days, so the file
+               never grows. The rollups are updated with every sample: the
+               one being filled is written in place at the head of its
+               ring and closed when a sample falls into the next interval,
+               so a restart carries on with it. The ring after a closed
+               rollup is cleared at once, readers never mistake the old
+               record there for the current one.
+
+               Records in a ring are in time order, a range query picks
+               the finest tier that reaches back far enough
+               (hskp_archive_tier_for()) and binary searches it for the
+               start, so it reads only the records it returns.
+ ============================================================================
+ */
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <math.h>
+
+#include "bp_config.h"
+#include "hskp_archive.h"
+
+const char *const hskp_env_name[HSKP_ENV_NCHAN] = {
+	"DACQ1_I", "DACQ2_I", "FEE33_I", "FEE33_V", "ENV1", "ENV2", "ENV3", "ENV4"
+};
+
+const double hskp_env_scale[HSKP_ENV_NCHAN] = {
+	0.00126, 0.00126, 0.00117, 0.006167, 0.001, 0.001, 0.001, 0.001
+};
+
+/*
+	hskp_archive_load()
+
+	Defaults if config_file does not exist: a sample a second, raw for 6
+	hours, minutes for 28 days and hours for 10 years (about 120 MB) in
+	hskp_archive.hka.
+*/
+int hskp_archive_load(struct hskp_archive_config *cfg, const char *config_file) {
+	struct bp_config c;
+	int status = 0;
+
+	memset(cfg, 0, sizeof(*cfg));
+	memset(&c, 0, sizeof(c));
+	if (access(config_file, R_OK) == 0)
+		status = bp_config_load(&c, config_file);
+	cfg->period_s = bp_config_double(&c, "period_s", 1);
+	cfg->raw_hours = bp_config_double(&c, "raw_hours", 6);
+	cfg->minute_days = bp_config_double(&c, "minute_days", 28);
+	cfg->hour_days = bp_config_double(&c, "hour_days", 3650);
+	snprintf(cfg->file, sizeof(cfg->file), "%s", bp_config_string(&c, "file", "hskp_archive.hka"));
+	if (cfg->period_s < 0.01)
+		cfg->period_s = 0.01;
+	return status;
+}
+
+static int64_t slot_offset(const struct hskp_archive *a, int tier, int64_t slot) {
+	const struct hskp_archive_tier *t = &a->header.tier[tier];
+
+	return t->offset + slot * t->record_size;
+}
+
+static int write_header(struct hskp_archive *a) {
+	return pwrite(a->fd, &a->header, sizeof(a->header), 0) == sizeof(a->header) ? 0 : -1;
+}
+
+/* Layout of a new file for cfg */
+static void layout(struct hskp_archive_header *h, const struct hskp_archive_config *cfg) {
+	int64_t offset = HSKP_ARCHIVE_HEADER;
+	int c, t;
+
+	memset(h, 0, sizeof(*h));
+	memcpy(h->magic, HSKP_ARCHIVE_MAGIC, 4);
+	h->nchan = HSKP_ARCHIVE_NCHAN;
+	h->period_ns = cfg->period_s * 1e9;
+	h->tier[HSKP_ARCHIVE_RAW].capacity = ceil(cfg->raw_hours * 3600 / cfg->period_s);
+	h->tier[HSKP_ARCHIVE_RAW].record_size = sizeof(struct hskp_archive_sample);
+	h->tier[HSKP_ARCHIVE_MINUTE].interval_ns = 60000000000LL;
+	h->tier[HSKP_ARCHIVE_MINUTE].capacity = ceil(cfg->minute_days * 1440) + 1;   // +1 for the one being filled
+	h->tier[HSKP_ARCHIVE_HOUR].interval_ns = 3600000000000LL;
+	h->tier[HSKP_ARCHIVE_HOUR].capacity = ceil(cfg->hour_days * 24) + 1;
+	for (t = 0; t < HSKP_ARCHIVE_NTIERS; t++) {
+		if (t != HSKP_ARCHIVE_RAW)
+			h->tier[t].record_size = sizeof(struct hskp_archive_record);
+		if (h->tier[t].capacity < 2)
+			h->tier[t].capacity = 2;
+		h->tier[t].offset = offset;
+		offset += h->tier[t].capacity * h->tier[t].record_size;
+	}
+	for (c = 0; c < HSKP_ARCHIVE_NCHAN; c++)
+		hskp_archive_name(c, h->names[c], sizeof(h->names[c]));
+}
+
+static int64_t file_size(const struct hskp_archive_header *h) {
+	const struct hskp_archive_tier *t = &h->tier[HSKP_ARCHIVE_NTIERS - 1];
+
+	return t->offset + t->capacity * t->record_size;
+}
+
+/*
+	hskp_archive_open()
+
+	With cfg, for adding samples: creates and preallocates the file if it
+	does not exist or is empty, or carries on with the rollups being
+	filled in an existing archive, which must have the tiers cfg asks
+	for. Any other file is left alone. Without, read only for queries.
+*/
+int hskp_archive_open(struct hskp_archive *a, const char *filename, const struct hskp_archive_config *cfg) {
+	struct hskp_archive_header want;
+	struct stat st;
+	int t, c;
+
+	memset(a, 0, sizeof(*a));
+	a->writable = cfg != NULL;
+	a->fd = open(filename, a->writable ? O_RDWR | O_CREAT : O_RDONLY, 0644);
+	if (a->fd < 0) {
+		perror(filename);
+		return -1;
+	}
+	if (fstat(a->fd, &st) != 0) {
+		perror(filename);
+		close(a->fd);
+		return -1;
+	}
+	if (a->writable && st.st_size == 0) {
+		// new file, every slot zero (empty) from the start
+		layout(&a->header, cfg);
+		if (posix_fallocate(a->fd, 0, file_size(&a->header)) != 0) {
+			fprintf(stderr, "%s: cannot allocate %lld bytes\n", filename, (long long) file_size(&a->header));
+			close(a->fd);
+			return -1;
+		}
+		if (write_header(a) != 0) {
+			perror(filename);
+			close(a->fd);
+			return -1;
+		}
+		return 0;
+	}
+	if (pread(a->fd, &a->header, sizeof(a->header), 0) != sizeof(a->header) ||
+	    memcmp(a->header.magic, HSKP_ARCHIVE_MAGIC, 4) != 0) {
+		fprintf(stderr, a->writable ? "%s is not a housekeeping archive, move it away to start a new one\n" :
+			"%s: not a housekeeping archive\n", filename);
+		close(a->fd);
+		return -1;
+	}
+	if (a->header.nchan != HSKP_ARCHIVE_NCHAN) {
+		fprintf(stderr, "%s: %d channels, expected %d\n", filename, a->header.nchan, HSKP_ARCHIVE_NCHAN);
+		close(a->fd);
+		return -1;
+	}
+	if (!a->writable)
+		return 0;
+
+	layout(&want, cfg);
+	for (t = 0; t < HSKP_ARCHIVE_NTIERS; t++)
+		if (want.tier[t].capacity != a->header.tier[t].capacity) {
+			fprintf(stderr, "%s was made for other tier lengths, move it away to start a new one\n", filename);
+			close(a->fd);
+			return -1;
+		}
+	for (t = 0; t < HSKP_ARCHIVE_NTIERS; t++) {
+		if (t == HSKP_ARCHIVE_RAW)
+			continue;
+		if (pread(a->fd, &a->open[t], sizeof(a->open[t]), slot_offset(a, t, a->header.tier[t].head)) !=
+		    sizeof(a->open[t]))
+			memset(&a->open[t], 0, sizeof(a->open[t]));
+		for (c = 0; c < HSKP_ARCHIVE_NCHAN; c++)
+			a->sum[t][c] = (double) a->open[t].mean[c] * a->open[t].count;
+	}
+	return 0;
+}
+
+void hskp_archive_close(struct hskp_archive *a) {
+	if (a->fd < 0)
+		return;
+	if (a->writable)
+		fdatasync(a->fd);
+	close(a->fd);
+	a->fd = -1;
+}
+
+/* Close the rollup being filled and clear the slot after it for the next */
+static int close_rollup(struct hskp_archive *a, int t) {
+	struct hskp_archive_tier *tier = &a->header.tier[t];
+
+	tier->head = (tier->head + 1) % tier->capacity;
+	if (tier->count < tier->capacity - 1)
+		tier->count++;
+	memset(&a->open[t], 0, sizeof(a->open[t]));
+	memset(a->sum[t], 0, sizeof(a->sum[t]));
+	if (pwrite(a->fd, &a->open[t], sizeof(a->open[t]), slot_offset(a, t, tier->head)) != sizeof(a->open[t]))
+		return -1;
+	return 0;
+}
+
+/*
+	hskp_archive_add()
+
+	One sample (HSKP_ARCHIVE_NCHAN values) at CLOCK_REALTIME t_ns. A sample
+	from before the rollup being filled (the clock was set back) goes into
+	it rather than back in time.
+*/
+int hskp_archive_add(struct hskp_archive *a, int64_t t_ns, const float *v) {
+	struct hskp_archive_tier *raw = &a->header.tier[HSKP_ARCHIVE_RAW];
+	struct hskp_archive_sample s;
+	struct hskp_archive_record *r;
+	int64_t start;
+	int t, c, closed = 0, status = 0;
+
+	s.t_ns = t_ns;
+	memcpy(s.v, v, sizeof(s.v));
+	if (pwrite(a->fd, &s, sizeof(s), slot_offset(a, HSKP_ARCHIVE_RAW, raw->head)) != sizeof(s))
+		status = -1;
+	raw->head = (raw->head + 1) % raw->capacity;
+	if (raw->count < raw->capacity)
+		raw->count++;
+
+	for (t = HSKP_ARCHIVE_MINUTE; t < HSKP_ARCHIVE_NTIERS; t++) {
+		r = &a->open[t];
+		start = t_ns - t_ns % a->header.tier[t].interval_ns;
+		if (r->count > 0 && start > r->t_ns) {
+			if (close_rollup(a, t) != 0)
+				status = -1;
+			closed = 1;
+		}
+		if (r->count == 0) {
+			r->t_ns = start;
+			for (c = 0; c < HSKP_ARCHIVE_NCHAN; c++)
+				r->min[c] = r->max[c] = v[c];
+		}
+		r->count++;
+		for (c = 0; c < HSKP_ARCHIVE_NCHAN; c++) {
+			if (v[c] < r->min[c])
+				r->min[c] = v[c];
+			if (v[c] > r->max[c])
+				r->max[c] = v[c];
+			a->sum[t][c] += v[c];
+			r->mean[c] = a->sum[t][c] / r->count;
+		}
+		if (pwrite(a->fd, r, sizeof(*r), slot_offset(a, t, a->header.tier[t].head)) != sizeof(*r))
+			status = -1;
+	}
+	if (write_header(a) != 0)
+		status = -1;
+	// a minute's worth at most is lost in a power cut
+	if (closed)
+		fdatasync(a->fd);
+	a->samples++;
+	return status;
+}
+
+/* I00..I31, V00..V31, then the ENV names */
+void hskp_archive_name(int c, char *name, int size) {
+	if (c < HSKP_NSLOTS)
+		snprintf(name, size, "I%02d", c);
+	else if (c < HSKP_NCHAN)
+		snprintf(name, size, "V%02d", c - HSKP_NSLOTS);
+	else
+		snprintf(name, size, "%s", hskp_env_name[c - HSKP_NCHAN]);
+}
+
+/* FEE ADC counts (hskp_read_adcs() order) and the ENV frame in A and V */
+void hskp_archive_values(const unsigned short *fee_raw, const unsigned short *env_raw, float *v) {
+	int c;
+
+	for (c = 0; c < HSKP_NSLOTS; c++) {
+		v[c] = fee_raw[c] * HSKP_AMPS_PER_LSB;
+		v[HSKP_NSLOTS + c] = fee_raw[HSKP_NSLOTS + c] * HSKP_VOLTS_PER_LSB;
+	}
+	for (c = 0; c < HSKP_ENV_NCHAN; c++)
+		v[HSKP_NCHAN + c] = env_raw[c] * hskp_env_scale[c];
+}
+
+/* Records in the ring, with the rollup being filled if it has samples */
+static int64_t records(const struct hskp_archive *a, int tier) {
+	const struct hskp_archive_tier *t = &a->header.tier[tier];
+	struct hskp_archive_record r;
+
+	if (tier == HSKP_ARCHIVE_RAW)
+		return t->count;
+	if (pread(a->fd, &r, sizeof(r), slot_offset(a, tier, t->head)) == sizeof(r) && r.count > 0)
+		return t->count + 1;
+	return t->count;
+}
+
+/* The i-th record from the oldest, a raw sample as a record of one */
+static int read_record(const struct hskp_archive *a, int tier, int64_t i, struct hskp_archive_record *out) {
+	const struct hskp_archive_tier *t = &a->header.tier[tier];
+	struct hskp_archive_sample s;
+	int64_t slot = ((t->head - t->count + i) % t->capacity + t->capacity) % t->capacity;
+
+	if (tier != HSKP_ARCHIVE_RAW)
+		return pread(a->fd, out, sizeof(*out), slot_offset(a, tier, slot)) == sizeof(*out) ? 0 : -1;
+	if (pread(a->fd, &s, sizeof(s), slot_offset(a, tier, slot)) != sizeof(s))
+		return -1;
+	out->t_ns = s.t_ns;
+	out->count = 1;
+	memcpy(out->min, s.v, sizeof(s.v));
+	memcpy(out->max, s.v, sizeof(s.v));
+	memcpy(out->mean, s.v, sizeof(s.v));
+	return 0;
+}
+
+/* Time of the oldest record of the tier, -1 if it has none */
+int64_t hskp_archive_oldest(const struct hskp_archive *a, int tier) {
+	struct hskp_archive_record r;
+
+	if (records(a, tier) == 0 || read_record(a, tier, 0, &r) != 0)
+		return -1;
+	return r.t_ns;
+}
+
+/* Finest tier that reaches back to t0_ns, else the one that reaches furthest */
+int hskp_archive_tier_for(const struct hskp_archive *a, int64_t t0_ns) {
+	int64_t oldest;
+	int t;
+
+	for (t = 0; t < HSKP_ARCHIVE_NTIERS; t++) {
+		oldest = hskp_archive_oldest(a, t);
+		if (oldest >= 0 && oldest <= t0_ns)
+			return t;
+	}
+	for (t = HSKP_ARCHIVE_NTIERS - 1; t > 0 && records(a, t) == 0; t--)
+		;
+	return t;
+}
+
+/*
+	hskp_archive_query()
+
+	Up to max records of the tier that overlap [t0_ns, t1_ns], oldest
+	first. Returns how many, -1 on a read error.
+*/
+long hskp_archive_query(const struct hskp_archive *a, int tier, int64_t t0_ns, int64_t t1_ns,
+	struct hskp_archive_record *out, long max) {
+	int64_t interval = a->header.tier[tier].interval_ns, lo = 0, hi = records(a, tier), mid, n = hi;
+	struct hskp_archive_record r;
+	long k = 0;
+
+	// first record that ends after t0
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (read_record(a, tier, mid, &r) != 0)
+			return -1;
+		if (interval > 0 ? r.t_ns + interval <= t0_ns : r.t_ns < t0_ns)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	for (; lo < n && k < max; lo++) {
+		if (read_record(a, tier, lo, &out[k]) != 0)
+			return -1;
+		if (out[k].t_ns > t1_ns)
+			break;
+		k++;
+	}
+	return k;
+}
+
+/* Channel index of a name (I00..I31, V00..V31, DACQ1_I, .., ENV4), -1 if none */
+int hskp_archive_channel(const struct hskp_archive *a, const char *name) {
+	int c;
+
+	for (c = 0; c < a->header.nchan; c++)
+		if (strcmp(a->header.names[c], name) == 0)
+			return c;
+	return -1;
+}
@@ -0,0 +1,92 @@
+/*
+ ============================================================================
+ Name        : hskp_archive.h
+ Description : Long-term housekeeping archive, raw samples and minute and
+               hour min/max/mean rollups in one fixed-size file
+ ============================================================================
+ */
+#ifndef HSKP_ARCHIVE_H
+#define HSKP_ARCHIVE_H
+
+#include <stdint.h>
+
+#include "hskp_burst.h"
+
+#define HSKP_ARCHIVE_MAGIC "HKA1"
+#define HSKP_ARCHIVE_NCHAN (HSKP_NCHAN + HSKP_ENV_NCHAN)   // FEE I 0-31, FEE V 0-31, then the ENV frame
+#define HSKP_ARCHIVE_NTIERS 3
+#define HSKP_ARCHIVE_RAW 0
+#define HSKP_ARCHIVE_MINUTE 1
+#define HSKP_ARCHIVE_HOUR 2
+#define HSKP_ARCHIVE_HEADER 4096
+
+/* CW_RD_ENV words as display_env_hskp() prints them, and their scale */
+extern const char *const hskp_env_name[HSKP_ENV_NCHAN];
+extern const double hskp_env_scale[HSKP_ENV_NCHAN];
+
+/* One ring of records, oldest at (head - count) mod capacity */
+struct hskp_archive_tier {
+	int64_t interval_ns;         // rollup length, 0 for the raw samples
+	int64_t capacity;            // records
+	int64_t head;                // slot of the record being filled
+	int64_t count;               // closed records before it
+	int64_t offset;              // of slot 0 in the file
+	int32_t record_size;
+	int32_t pad;
+};
+
+/* File header, the first HSKP_ARCHIVE_HEADER bytes, host byte order */
+struct hskp_archive_header {
+	char magic[4];
+	int32_t nchan;
+	int64_t period_ns;           // sampling period it was created for
+	struct hskp_archive_tier tier[HSKP_ARCHIVE_NTIERS];
+	char names[HSKP_ARCHIVE_NCHAN][16];
+};
+
+/* Raw tier record, values in A, V and ENV units */
+struct hskp_archive_sample {
+	int64_t t_ns;                // CLOCK_REALTIME
+	float v[HSKP_ARCHIVE_NCHAN];
+};
+
+/* Rollup record, and what queries return for every tier */
+struct hskp_archive_record {
+	int64_t t_ns;                // start of the interval, the sample time for raw samples
+	uint32_t count;              // samples in it, 0 for an empty slot
+	uint32_t pad;
+	float min[HSKP_ARCHIVE_NCHAN];
+	float max[HSKP_ARCHIVE_NCHAN];
+	float mean[HSKP_ARCHIVE_NCHAN];
+};
+
+struct hskp_archive_config {
+	double period_s;             // between samples
+	double raw_hours;            // how long each tier reaches back
+	double minute_days;
+	double hour_days;
+	char file[208];
+};
+
+struct hskp_archive {
+	int fd;
+	int writable;
+	struct hskp_archive_header header;
+	struct hskp_archive_record open[HSKP_ARCHIVE_NTIERS];   // rollups being filled
+	double sum[HSKP_ARCHIVE_NTIERS][HSKP_ARCHIVE_NCHAN];
+	unsigned long long samples;
+};
+
+int hskp_archive_load(struct hskp_archive_config *cfg, const char *config_file);
+int hskp_archive_open(struct hskp_archive *a, const char *filename, const struct hskp_archive_config *cfg);
+void hskp_archive_close(struct hskp_archive *a);
+int hskp_archive_add(struct hskp_archive *a, int64_t t_ns, const float *v);
+void hskp_archive_name(int c, char *name, int size);
+void hskp_archive_values(const unsigned short *fee_raw, const unsigned short *env_raw, float *v);
+int hskp_archive_tier_for(const struct hskp_archive *a, int64_t t0_ns);
+int64_t hskp_archive_oldest(const struct hskp_archive *a, int tier);
+long hskp_archive_query(const struct hskp_archive *a, int tier, int64_t t0_ns, int64_t t1_ns,
+	struct hskp_archive_record *out, long max);
+int hskp_archive_channel(const struct hskp_archive *a, const char *name);
+
+#endif
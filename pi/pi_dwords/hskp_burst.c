@@ -0,0 +1,308 @@
+/*
+ ============================================================================
+ Name        : hskp_burst.c
+ Description : Burst sampling of the HKFPGA FEE current/voltage ADCs.
+               Triggers the ADCs and reads the CW_RD_FEE*_I/_V frames back to
+               back for N samples, keeps the raw counts in memory and reduces
+               them to per-slot mean, RMS, min/max and an amplitude spectrum.
+ ============================================================================
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "spicomms.h"
+#include "bp_fault.h"
+#include "hskp_burst.h"
+
+const unsigned short fee_hskp_slot[4][8] = {
+	{ 5, 12,  6, 17,  7, 13, 11, 18},  // CW_RD_FEE0
+	{ 4, 10,  1,  0,  3,  2, 16, 22},  // CW_RD_FEE8
+	{28, 24, 30, 23, 31, 29, 26, 25},  // CW_RD_FEE16
+	{20,  8, 27, 15,  9, 19, 21, 14}   // CW_RD_FEE24
+};
+
+const unsigned short fee_display_order[25] = {
+	 5,  6,  7,  8,  9,
+	11, 12, 13, 14, 15,
+	17, 18, 19, 20, 21,
+	23, 24, 25, 26, 27,
+	28, 29, 30, 31, 22
+};
+
+static const unsigned short fee_i_cw[4] = {CW_RD_FEE0_I, CW_RD_FEE8_I, CW_RD_FEE16_I, CW_RD_FEE24_I};
+static const unsigned short fee_v_cw[4] = {CW_RD_FEE0_V, CW_RD_FEE8_V, CW_RD_FEE16_V, CW_RD_FEE24_V};
+
+static void hkfpga_message(unsigned short *spi_message, unsigned short cw) {
+	spi_message[0] = SPI_SOM_HKFPGA; // som
+	spi_message[1] = cw; // cw
+	spi_message[2] = 0x0111;
+	spi_message[3] = 0x1222;
+	spi_message[4] = 0x2333;
+	spi_message[5] = 0x3444;
+	spi_message[6] = 0x4555;
+	spi_message[7] = 0x5666;
+	spi_message[8] = 0x0000;
+	spi_message[9] = 0x0088;
+	spi_message[10] = SPI_EOM_HKFPGA; // not used
+}
+
+/* One CW_TRG_ADCS frame, starts a conversion of all FEE current/voltage ADCs */
+int hskp_trigger_adcs(void) {
+	unsigned short spi_message[11], data[11];
+
+	hkfpga_message(spi_message, CW_TRG_ADCS);
+	return transfer_checked("hskp", spi_message, data);
+}
+
+/* The four current and four voltage read frames, back to back, into
+   row[c] in channel order (FEE I slots 0-31, then FEE V slots 0-31).
+   Returns -1 if a frame got no valid answer, row is then incomplete. */
+int hskp_read_adcs(unsigned short *row) {
+	unsigned short spi_message[11], data[11];
+	int f, k;
+
+	hkfpga_message(spi_message, CW_RD_FEE0_I);
+	for (f = 0; f < 4; f++) {
+		spi_message[1] = fee_i_cw[f];
+		if (transfer_checked("hskp", spi_message, data) != 0)
+			return -1;
+		for (k = 0; k < 8; k++)
+			row[fee_hskp_slot[f][k]] = data[k+2];
+	}
+	for (f = 0; f < 4; f++) {
+		spi_message[1] = fee_v_cw[f];
+		if (transfer_checked("hskp", spi_message, data) != 0)
+			return -1;
+		for (k = 0; k < 8; k++)
+			row[HSKP_NSLOTS + fee_hskp_slot[f][k]] = data[k+2];
+	}
+	return 0;
+}
+
+/* The CW_RD_ENV frame, DACQ and FEE 3.3 V supplies and ENV1-4, raw into
+   row[0..7] in the order display_env_hskp() prints them. Returns -1 if
+   the frame got no valid answer. */
+int hskp_read_env(unsigned short *row) {
+	unsigned short spi_message[11], data[11];
+	int k;
+
+	hkfpga_message(spi_message, CW_RD_ENV);
+	if (transfer_checked("hskp", spi_message, data) != 0)
+		return -1;
+	for (k = 0; k < HSKP_ENV_NCHAN; k++)
+		row[k] = data[k+2];
+	return 0;
+}
+
+/*
+	hskp_burst_acquire()
+
+	Take nsamples housekeeping sweeps as fast as the bus allows. Each sweep
+	is one CW_TRG_ADCS frame, an optional settle time for the ADC conversion
+	(trig_adcs() waits 100 ms, which is far longer than needed), then the
+	four current and four voltage read frames with no delay in between.
+	The burst is abandoned if a frame gets no valid answer. settle_us is
+	at most 999999, as us_sleep() takes.
+*/
+int hskp_burst_acquire(struct hskp_burst *burst, int nsamples, int settle_us) {
+	int n;
+
+	memset(burst, 0, sizeof(*burst));
+	if (nsamples < 1 || settle_us < 0 || settle_us > 999999)
+		return -1;
+	burst->t_ns = malloc(nsamples * sizeof(*burst->t_ns));
+	burst->raw = malloc((size_t) nsamples * HSKP_NCHAN * sizeof(*burst->raw));
+	if (burst->t_ns == NULL || burst->raw == NULL) {
+		hskp_burst_free(burst);
+		return -1;
+	}
+	burst->nsamples = nsamples;
+	burst->settle_us = settle_us;
+
+	for (n = 0; n < nsamples; n++) {
+		burst->t_ns[n] = monotonic_ns();
+		if (hskp_trigger_adcs() != 0)
+			break;
+		if (settle_us > 0)
+			us_sleep(settle_us);
+		if (hskp_read_adcs(&burst->raw[(size_t) n * HSKP_NCHAN]) != 0)
+			break;
+	}
+	if (n < nsamples) {
+		printf("No valid answer from the HKFPGA at sample %d, burst abandoned\n", n);
+		hskp_burst_free(burst);
+		return -1;
+	}
+	return 0;
+}
+
+void hskp_burst_free(struct hskp_burst *burst) {
+	free(burst->t_ns);
+	free(burst->raw);
+	burst->t_ns = NULL;
+	burst->raw = NULL;
+	burst->nsamples = 0;
+}
+
+/*
+	Raw burst file layout (host byte order):
+	  char[4] "HKB1", int nsamples, int nchan, int settle_us,
+	  unsigned long long t_ns[nsamples],
+	  unsigned short raw[nsamples][nchan]  (FEE I slots 0-31, FEE V slots 0-31)
+*/
+int hskp_burst_write_raw(const struct hskp_burst *burst, const char *filename) {
+	FILE *fptr;
+	int nchan = HSKP_NCHAN;
+
+	fptr = fopen(filename, "wb");
+	if (fptr == NULL) {
+		perror(filename);
+		return -1;
+	}
+	fwrite("HKB1", 4, 1, fptr);
+	fwrite(&burst->nsamples, sizeof(burst->nsamples), 1, fptr);
+	fwrite(&nchan, sizeof(nchan), 1, fptr);
+	fwrite(&burst->settle_us, sizeof(burst->settle_us), 1, fptr);
+	fwrite(burst->t_ns, sizeof(*burst->t_ns), burst->nsamples, fptr);
+	fwrite(burst->raw, sizeof(*burst->raw), (size_t) burst->nsamples * HSKP_NCHAN, fptr);
+	if (fclose(fptr) != 0) {
+		perror(filename);
+		return -1;
+	}
+	return 0;
+}
+
+/* In-place iterative radix-2 FFT, n must be a power of two. */
+static void fft(double *re, double *im, int n) {
+	int i, j, k, len;
+	double tr, ti, wr, wi, ur, ui, ang;
+
+	for (i = 1, j = 0; i < n; i++) {
+		k = n >> 1;
+		for (; j & k; k >>= 1)
+			j ^= k;
+		j ^= k;
+		if (i < j) {
+			tr = re[i]; re[i] = re[j]; re[j] = tr;
+			ti = im[i]; im[i] = im[j]; im[j] = ti;
+		}
+	}
+	for (len = 2; len <= n; len <<= 1) {
+		ang = -2 * M_PI / len;
+		for (i = 0; i < n; i += len) {
+			for (k = 0; k < len / 2; k++) {
+				wr = cos(ang * k);
+				wi = sin(ang * k);
+				ur = re[i+k+len/2] * wr - im[i+k+len/2] * wi;
+				ui = re[i+k+len/2] * wi + im[i+k+len/2] * wr;
+				re[i+k+len/2] = re[i+k] - ur;
+				im[i+k+len/2] = im[i+k] - ui;
+				re[i+k] += ur;
+				im[i+k] += ui;
+			}
+		}
+	}
+}
+
+/*
+	hskp_burst_analyze()
+
+	Print per-slot mean, RMS (about the mean, i.e. the ripple), min and max
+	in A and V, and write a Hann-windowed amplitude spectrum of every
+	channel over the largest power-of-two prefix of the burst. The sample
+	rate is taken from the recorded trigger times rather than assumed.
+*/
+int hskp_burst_analyze(const struct hskp_burst *burst, const char *spectrum_filename) {
+	int n, c, s, k, nfft, nbins;
+	double sum, sum2, v, scale, fs, wsum, peak;
+	double mean[HSKP_NCHAN], rms[HSKP_NCHAN], peak_f[HSKP_NCHAN];
+	unsigned short vmin[HSKP_NCHAN], vmax[HSKP_NCHAN];
+	double *re, *im, *win, *amp;
+	FILE *fptr;
+
+	if (burst->nsamples < 2)
+		return -1;
+	fs = (burst->nsamples - 1) * 1e9 / (double) (burst->t_ns[burst->nsamples-1] - burst->t_ns[0]);
+
+	for (c = 0; c < HSKP_NCHAN; c++) {
+		sum = sum2 = 0;
+		vmin[c] = 0xffff;
+		vmax[c] = 0;
+		for (n = 0; n < burst->nsamples; n++) {
+			v = burst->raw[(size_t) n * HSKP_NCHAN + c];
+			sum += v;
+			sum2 += v * v;
+			if (v < vmin[c]) vmin[c] = v;
+			if (v > vmax[c]) vmax[c] = v;
+		}
+		mean[c] = sum / burst->nsamples;
+		rms[c] = sqrt(fmax(sum2 / burst->nsamples - mean[c] * mean[c], 0));
+	}
+
+	for (nfft = 1; nfft * 2 <= burst->nsamples; nfft *= 2);
+	nbins = nfft / 2 + 1;
+	re = malloc(nfft * sizeof(double));
+	im = malloc(nfft * sizeof(double));
+	win = malloc(nfft * sizeof(double));
+	amp = malloc((size_t) nbins * HSKP_NCHAN * sizeof(double));
+	if (re == NULL || im == NULL || win == NULL || amp == NULL) {
+		free(re); free(im); free(win); free(amp);
+		return -1;
+	}
+	wsum = 0;
+	for (n = 0; n < nfft; n++) {
+		win[n] = nfft > 1 ? 0.5 - 0.5 * cos(2 * M_PI * n / (nfft - 1)) : 1;
+		wsum += win[n];
+	}
+	for (c = 0; c < HSKP_NCHAN; c++) {
+		for (n = 0; n < nfft; n++) {
+			re[n] = (burst->raw[(size_t) n * HSKP_NCHAN + c] - mean[c]) * win[n];
+			im[n] = 0;
+		}
+		fft(re, im, nfft);
+		scale = (c < HSKP_NSLOTS ? HSKP_AMPS_PER_LSB : HSKP_VOLTS_PER_LSB) * 2 / wsum;
+		peak = -1;
+		peak_f[c] = 0;
+		for (k = 0; k < nbins; k++) {
+			amp[(size_t) k * HSKP_NCHAN + c] = sqrt(re[k] * re[k] + im[k] * im[k]) * scale;
+			if (k > 0 && amp[(size_t) k * HSKP_NCHAN + c] > peak) {
+				peak = amp[(size_t) k * HSKP_NCHAN + c];
+				peak_f[c] = k * fs / nfft;
+			}
+		}
+	}
+
+	printf("\nBurst of %d samples at %.1f Hz (settle %d us), spectrum over %d samples\n\n",
+		burst->nsamples, fs, burst->settle_us, nfft);
+	printf("Slot  I mean   I rms   I min   I max  I peak Hz   V mean   V rms   V min   V max\n");
+	for (k = 0; k < 25; k++) {
+		s = fee_display_order[k];
+		printf(" j%-2d  %6.3f  %6.4f  %6.3f  %6.3f  %8.1f   %6.3f  %6.4f  %6.3f  %6.3f\n", s,
+			mean[s] * HSKP_AMPS_PER_LSB, rms[s] * HSKP_AMPS_PER_LSB,
+			vmin[s] * HSKP_AMPS_PER_LSB, vmax[s] * HSKP_AMPS_PER_LSB, peak_f[s],
+			mean[HSKP_NSLOTS+s] * HSKP_VOLTS_PER_LSB, rms[HSKP_NSLOTS+s] * HSKP_VOLTS_PER_LSB,
+			vmin[HSKP_NSLOTS+s] * HSKP_VOLTS_PER_LSB, vmax[HSKP_NSLOTS+s] * HSKP_VOLTS_PER_LSB);
+	}
+
+	fptr = fopen(spectrum_filename, "w");
+	if (fptr == NULL) {
+		perror(spectrum_filename);
+	} else {
+		fprintf(fptr, "# fs: %f Hz, nfft: %d, amplitude in A (I) and V (V)\n# freq_Hz", fs, nfft);
+		for (c = 0; c < HSKP_NCHAN; c++)
+			fprintf(fptr, " %s%d", c < HSKP_NSLOTS ? "I" : "V", c % HSKP_NSLOTS);
+		fprintf(fptr, "\n");
+		for (k = 0; k < nbins; k++) {
+			fprintf(fptr, "%.3f", k * fs / nfft);
+			for (c = 0; c < HSKP_NCHAN; c++)
+				fprintf(fptr, " %.6g", amp[(size_t) k * HSKP_NCHAN + c]);
+			fprintf(fptr, "\n");
+		}
+		fclose(fptr);
+	}
+
+	free(re); free(im); free(win); free(amp);
+	return 0;
+}
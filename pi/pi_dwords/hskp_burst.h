@@ -0,0 +1,42 @@
+/*
+ ============================================================================
+ Name        : hskp_burst.h
+ Description : Burst sampling of the HKFPGA FEE current/voltage ADCs
+ ============================================================================
+ */
+#ifndef HSKP_BURST_H
+#define HSKP_BURST_H
+
+#define HSKP_NSLOTS        32
+#define HSKP_NCHAN         (2 * HSKP_NSLOTS)   // FEE I for slots 0-31 then FEE V
+#define HSKP_AMPS_PER_LSB  0.00117
+#define HSKP_VOLTS_PER_LSB 0.006158
+#define HSKP_ENV_NCHAN     8                   // words of the CW_RD_ENV frame
+#define HSKP_SETTLE_US     100000              // CW_TRG_ADCS to the reads, trig_adcs()'s delay(100)
+
+/* Slot each data word of the CW_RD_FEE{0,8,16,24}_{I,V} frames belongs to.
+   Row n is the n-th frame, column k is data[k+2]. */
+extern const unsigned short fee_hskp_slot[4][8];
+
+/* The 25 populated slots in the order display_currents() prints them,
+   five rows of five. Slot j32 is jumpered to j22. */
+extern const unsigned short fee_display_order[25];
+
+/* Raw burst: t_ns[n] is the CLOCK_MONOTONIC time of the ADC trigger for
+   sample n, raw[n*HSKP_NCHAN + c] the ADC count for channel c. */
+struct hskp_burst {
+	int nsamples;
+	int settle_us;
+	unsigned long long *t_ns;
+	unsigned short *raw;
+};
+
+int hskp_trigger_adcs(void);
+int hskp_read_adcs(unsigned short *row);
+int hskp_read_env(unsigned short *row);
+int hskp_burst_acquire(struct hskp_burst *burst, int nsamples, int settle_us);
+void hskp_burst_free(struct hskp_burst *burst);
+int hskp_burst_write_raw(const struct hskp_burst *burst, const char *filename);
+int hskp_burst_analyze(const struct hskp_burst *burst, const char *spectrum_filename);
+
+#endif
@@ -0,0 +1,194 @@
+/*
+ ============================================================================
+ Name        : hskp_deadband.c
+ Description : Change-only housekeeping for slow control. Every sweep of
+               the FEE currents and voltages and the ENV frame goes
+               through a deadband per channel: a value is passed on only
+               when it has moved more than the deadband of its class from
+               the last value passed on, so ADC noise on a steady channel
+               is suppressed and a slow drift still comes through once it
+               adds up. A channel nothing was passed for in heartbeat_s is
+               passed anyway, so a client can tell a steady value from a
+               dead link.
+
+               Alarm limits bypass the deadband: crossing one passes the
+               value at once, however small the step, and so does coming
+               back, once the value is inside the limit by hysteresis times
+               the deadband (no chatter on a value sitting at the limit).
+               The voltage limits of a slot only apply while it draws more
+               than fee_i_on, an unpowered slot reads 0 V.
+
+               Passed values go to the log as well, with a line on the
+               suppression ratio every report_s.
+ ============================================================================
+ */
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+
+#include "bp_config.h"
+#include "hskp_deadband.h"
+
+static const char *const reason_name[HSKP_PASS_NREASONS] = {
+	"suppressed", "first", "change", "heartbeat", "alarm", "clear"
+};
+
+/*
+	hskp_deadband_load()
+
+	Defaults if config_file does not exist: about 17 ADC counts of FEE
+	current, 8 of FEE voltage and 10 of ENV, a heartbeat a minute, no
+	alarms and no log. Limits are fee_i_max, fee_v_min and fee_v_max for
+	all slots, <channel>_min and <channel>_max (I05_max, ENV1_max) for one.
+*/
+int hskp_deadband_load(struct hskp_deadband_config *cfg, const char *config_file) {
+	struct bp_config c;
+	char name[16], key[48];
+	double lo, hi;
+	int status = 0, ch;
+
+	memset(cfg, 0, sizeof(*cfg));
+	memset(&c, 0, sizeof(c));
+	if (access(config_file, R_OK) == 0)
+		status = bp_config_load(&c, config_file);
+	cfg->fee_i_deadband = bp_config_double(&c, "fee_i_deadband", 0.02);
+	cfg->fee_v_deadband = bp_config_double(&c, "fee_v_deadband", 0.05);
+	cfg->env_deadband = bp_config_double(&c, "env_deadband", 0.01);
+	cfg->heartbeat_s = bp_config_double(&c, "heartbeat_s", 60);
+	cfg->hysteresis = bp_config_double(&c, "hysteresis", 1);
+	cfg->fee_i_on = bp_config_double(&c, "fee_i_on", 0.1);
+	cfg->report_s = bp_config_double(&c, "report_s", 600);
+	snprintf(cfg->log_file, sizeof(cfg->log_file), "%s", bp_config_string(&c, "log_file", ""));
+	for (ch = 0; ch < HSKP_DEADBAND_NCHAN; ch++) {
+		lo = hi = NAN;
+		if (ch < HSKP_NSLOTS) {
+			hi = bp_config_double(&c, "fee_i_max", NAN);
+		} else if (ch < HSKP_NCHAN) {
+			lo = bp_config_double(&c, "fee_v_min", NAN);
+			hi = bp_config_double(&c, "fee_v_max", NAN);
+		}
+		hskp_archive_name(ch, name, sizeof(name));
+		snprintf(key, sizeof(key), "%s_min", name);
+		cfg->lo[ch] = bp_config_double(&c, key, lo);
+		snprintf(key, sizeof(key), "%s_max", name);
+		cfg->hi[ch] = bp_config_double(&c, key, hi);
+	}
+	return status;
+}
+
+int hskp_deadband_init(struct hskp_deadband *d, const struct hskp_deadband_config *cfg) {
+	int c;
+
+	memset(d, 0, sizeof(*d));
+	d->cfg = *cfg;
+	for (c = 0; c < HSKP_DEADBAND_NCHAN; c++) {
+		hskp_archive_name(c, d->name[c], sizeof(d->name[c]));
+		d->band[c] = c < HSKP_NSLOTS ? cfg->fee_i_deadband : c < HSKP_NCHAN ? cfg->fee_v_deadband : cfg->env_deadband;
+	}
+	if (cfg->log_file[0] != '\0') {
+		d->log = fopen(cfg->log_file, "a");
+		if (d->log == NULL) {
+			perror(cfg->log_file);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+void hskp_deadband_close(struct hskp_deadband *d) {
+	if (d->log != NULL) {
+		hskp_deadband_report(d, d->log);
+		fclose(d->log);
+	}
+	d->log = NULL;
+}
+
+/* Whether channel c is outside its limits, given whether it was before */
+static int in_alarm(const struct hskp_deadband *d, int c, const float *v) {
+	double lo = d->cfg.lo[c], hi = d->cfg.hi[c], h = 0;
+
+	if (c >= HSKP_NSLOTS && c < HSKP_NCHAN && !(v[c - HSKP_NSLOTS] > d->cfg.fee_i_on))
+		return 0;
+	if (d->alarm[c])
+		h = d->cfg.hysteresis * d->band[c];
+	return v[c] < lo + h || v[c] > hi - h;   // false against NaN
+}
+
+/* Sample time in UTC with milliseconds */
+static void log_time(FILE *f, int64_t t_ns) {
+	time_t t = t_ns / 1000000000LL;
+	struct tm tm;
+	char s[32];
+
+	gmtime_r(&t, &tm);
+	strftime(s, sizeof(s), "%Y-%m-%d %H:%M:%S", &tm);
+	fprintf(f, "%s.%03d", s, (int) (t_ns / 1000000 % 1000));
+}
+
+/*
+	hskp_deadband_filter()
+
+	One sweep of values in hskp_archive_values() order at t_ns
+	(CLOCK_REALTIME). reason[c] is why channel c is passed on,
+	HSKP_PASS_NONE if it is suppressed. Returns how many are passed on.
+*/
+int hskp_deadband_filter(struct hskp_deadband *d, int64_t t_ns, const float *v, unsigned char *reason) {
+	int c, alarm, n = 0;
+
+	for (c = 0; c < HSKP_DEADBAND_NCHAN; c++) {
+		alarm = in_alarm(d, c, v);
+		if (d->sent_ns[c] == 0)
+			reason[c] = alarm ? HSKP_PASS_ALARM : HSKP_PASS_FIRST;
+		else if (alarm != d->alarm[c])
+			reason[c] = alarm ? HSKP_PASS_ALARM : HSKP_PASS_CLEAR;
+		else if (fabs(v[c] - d->sent[c]) > d->band[c])
+			reason[c] = HSKP_PASS_CHANGE;
+		else if (d->cfg.heartbeat_s > 0 && t_ns - d->sent_ns[c] >= d->cfg.heartbeat_s * 1e9)
+			reason[c] = HSKP_PASS_HEARTBEAT;
+		else
+			reason[c] = HSKP_PASS_NONE;
+		d->alarm[c] = alarm;
+		d->passed[reason[c]]++;
+		if (reason[c] == HSKP_PASS_NONE)
+			continue;
+		d->sent[c] = v[c];
+		d->sent_ns[c] = t_ns;
+		n++;
+		if (d->log != NULL) {
+			log_time(d->log, t_ns);
+			fprintf(d->log, " %s %g %s\n", d->name[c], v[c], reason_name[reason[c]]);
+		}
+	}
+	d->values += HSKP_DEADBAND_NCHAN;
+
+	if (d->log != NULL && d->cfg.report_s > 0) {
+		if (d->next_report_ns == 0)
+			d->next_report_ns = t_ns + d->cfg.report_s * 1e9;
+		if (t_ns >= d->next_report_ns) {
+			hskp_deadband_report(d, d->log);
+			d->next_report_ns += d->cfg.report_s * 1e9;
+		}
+		fflush(d->log);
+	}
+	return n;
+}
+
+/* Fraction of the values filtered so far that were not passed on */
+double hskp_deadband_suppression(const struct hskp_deadband *d) {
+	return d->values > 0 ? (double) d->passed[HSKP_PASS_NONE] / d->values : 0;
+}
+
+void hskp_deadband_report(const struct hskp_deadband *d, FILE *f) {
+	int r;
+
+	fprintf(f, "# %llu values, %.1f %% suppressed;", d->values, 100 * hskp_deadband_suppression(d));
+	for (r = 1; r < HSKP_PASS_NREASONS; r++)
+		fprintf(f, " %llu %s", d->passed[r], reason_name[r]);
+	fprintf(f, "\n");
+}
+
+const char *hskp_deadband_reason(int reason) {
+	return reason >= 0 && reason < HSKP_PASS_NREASONS ? reason_name[reason] : "?";
+}
@@ -0,0 +1,60 @@
+/*
+ ============================================================================
+ Name        : hskp_deadband.h
+ Description : Per-channel deadband and alarm filter for the housekeeping
+               values sent to slow control, with a heartbeat
+ ============================================================================
+ */
+#ifndef HSKP_DEADBAND_H
+#define HSKP_DEADBAND_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "hskp_archive.h"
+
+#define HSKP_DEADBAND_NCHAN HSKP_ARCHIVE_NCHAN   // channels and names as the archive
+
+/* Why a value was passed on, 0 if it was suppressed */
+#define HSKP_PASS_NONE      0
+#define HSKP_PASS_FIRST     1   // nothing sent for the channel yet
+#define HSKP_PASS_CHANGE    2   // moved more than the deadband from the last one sent
+#define HSKP_PASS_HEARTBEAT 3   // nothing sent for heartbeat_s
+#define HSKP_PASS_ALARM     4   // crossed a limit
+#define HSKP_PASS_CLEAR     5   // back inside the limits by the hysteresis
+#define HSKP_PASS_NREASONS  6
+
+struct hskp_deadband_config {
+	double fee_i_deadband;       // A
+	double fee_v_deadband;       // V
+	double env_deadband;         // in the units of display_env_hskp()
+	double heartbeat_s;          // longest silence of a channel, 0 for none
+	double hysteresis;           // fraction of the deadband inside a limit to clear an alarm
+	double fee_i_on;             // A, a slot drawing more is powered and its voltage alarms apply
+	double report_s;             // between suppression lines in the log
+	char log_file[208];          // passed values, "" for none
+	double lo[HSKP_DEADBAND_NCHAN], hi[HSKP_DEADBAND_NCHAN];   // alarm limits, NaN for none
+};
+
+struct hskp_deadband {
+	struct hskp_deadband_config cfg;
+	char name[HSKP_DEADBAND_NCHAN][16];
+	double band[HSKP_DEADBAND_NCHAN];
+	float sent[HSKP_DEADBAND_NCHAN];
+	int64_t sent_ns[HSKP_DEADBAND_NCHAN];   // 0 before the first
+	unsigned char alarm[HSKP_DEADBAND_NCHAN];
+	unsigned long long values;              // filtered
+	unsigned long long passed[HSKP_PASS_NREASONS];
+	int64_t next_report_ns;
+	FILE *log;
+};
+
+int hskp_deadband_load(struct hskp_deadband_config *cfg, const char *config_file);
+int hskp_deadband_init(struct hskp_deadband *d, const struct hskp_deadband_config *cfg);
+void hskp_deadband_close(struct hskp_deadband *d);
+int hskp_deadband_filter(struct hskp_deadband *d, int64_t t_ns, const float *v, unsigned char *reason);
+double hskp_deadband_suppression(const struct hskp_deadband *d);
+void hskp_deadband_report(const struct hskp_deadband *d, FILE *f);
+const char *hskp_deadband_reason(int reason);
+
+#endif
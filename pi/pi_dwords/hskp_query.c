@@ -0,0 +1,150 @@
+/*
+ ============================================================================
+ Name        : hskp_query.c
+ Description : Range queries on a housekeeping archive (menu 'H').
+
+               hskp_query [-t raw|minute|hour] [-c channel] [-i]
+                          archive.hka [from [until]]
+
+               from/until: "YYYY-mm-dd HH:MM:SS" UTC, or a negative number
+               of seconds before now; default the last hour until now.
+               Without -t the finest tier that reaches back to from is
+               used. Prints CSV, time (UTC), samples, then min, max and
+               mean of the channel named with -c (I00..I31, V00..V31,
+               DACQ1_I, DACQ2_I, FEE33_I, FEE33_V, ENV1..ENV4), or the
+               mean of every channel. -i lists the tiers instead.
+ ============================================================================
+ */
+#define _GNU_SOURCE // timegm
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "hskp_archive.h"
+
+#define CHUNK 4096
+
+static const char *const tier_name[HSKP_ARCHIVE_NTIERS] = { "raw", "minute", "hour" };
+
+/* Seconds from a date or, if negative, before now */
+static int parse_time(const char *s, time_t now, int64_t *t_ns) {
+	struct tm tm;
+	char *end;
+	double back;
+
+	back = strtod(s, &end);
+	if (*end == '\0' && back <= 0) {
+		*t_ns = (int64_t) ((now + back) * 1e9);
+		return 0;
+	}
+	memset(&tm, 0, sizeof(tm));
+	end = strptime(s, "%Y-%m-%d %H:%M:%S", &tm);
+	if (end == NULL || *end != '\0')
+		return -1;
+	*t_ns = (int64_t) timegm(&tm) * 1000000000LL;
+	return 0;
+}
+
+/* UTC, with milliseconds for raw samples */
+static void print_time(int64_t t_ns, int ms) {
+	time_t t = t_ns / 1000000000LL;
+	struct tm tm;
+	char s[32];
+
+	gmtime_r(&t, &tm);
+	strftime(s, sizeof(s), "%Y-%m-%d %H:%M:%S", &tm);
+	printf("%s", s);
+	if (ms)
+		printf(".%03d", (int) (t_ns / 1000000 % 1000));
+}
+
+int main(int argc, char **argv) {
+	struct hskp_archive a;
+	struct hskp_archive_record *r;
+	const struct hskp_archive_tier *tier;
+	const char *channel = NULL;
+	int64_t t0, t1, oldest;
+	time_t now = time(NULL);
+	int opt, t, c, ch = -1, tier_asked = -1, info = 0;
+	long n, k;
+
+	while ((opt = getopt(argc, argv, "+t:c:i")) != -1) {
+		switch (opt) {
+		case 't':
+			for (t = 0; t < HSKP_ARCHIVE_NTIERS && strcmp(optarg, tier_name[t]) != 0; t++)
+				;
+			tier_asked = t < HSKP_ARCHIVE_NTIERS ? t : -2;
+			break;
+		case 'c': channel = optarg; break;
+		case 'i': info = 1; break;
+		default: optind = argc + 1;
+		}
+	}
+	if (optind >= argc || argc - optind > 3 || tier_asked == -2) {
+		fprintf(stderr, "usage: %s [-t raw|minute|hour] [-c channel] [-i] archive.hka [from [until]]\n", argv[0]);
+		return 1;
+	}
+	if (hskp_archive_open(&a, argv[optind], NULL) != 0)
+		return 1;
+
+	if (info) {
+		for (t = 0; t < HSKP_ARCHIVE_NTIERS; t++) {
+			tier = &a.header.tier[t];
+			printf("%-6s %10lld of %10lld records", tier_name[t], (long long) tier->count,
+				(long long) (t == HSKP_ARCHIVE_RAW ? tier->capacity : tier->capacity - 1));
+			if ((oldest = hskp_archive_oldest(&a, t)) >= 0) {
+				printf(", from ");
+				print_time(oldest, 0);
+			}
+			printf("\n");
+		}
+		hskp_archive_close(&a);
+		return 0;
+	}
+
+	t1 = (int64_t) now * 1000000000LL;
+	t0 = t1 - 3600000000000LL;
+	if ((argc - optind > 1 && parse_time(argv[optind + 1], now, &t0) != 0) ||
+	    (argc - optind > 2 && parse_time(argv[optind + 2], now, &t1) != 0)) {
+		fprintf(stderr, "times are \"YYYY-mm-dd HH:MM:SS\" UTC or seconds before now (-3600)\n");
+		return 1;
+	}
+	if (channel != NULL && (ch = hskp_archive_channel(&a, channel)) < 0) {
+		fprintf(stderr, "no channel %s\n", channel);
+		return 1;
+	}
+	t = tier_asked >= 0 ? tier_asked : hskp_archive_tier_for(&a, t0);
+	fprintf(stderr, "%s tier\n", tier_name[t]);
+
+	r = malloc(CHUNK * sizeof(*r));
+	if (r == NULL)
+		return 1;
+	printf("time,samples");
+	if (ch >= 0)
+		printf(",%s_min,%s_max,%s_mean", channel, channel, channel);
+	else
+		for (c = 0; c < a.header.nchan; c++)
+			printf(",%s", a.header.names[c]);
+	printf("\n");
+	do {
+		n = hskp_archive_query(&a, t, t0, t1, r, CHUNK);
+		for (k = 0; k < n; k++) {
+			print_time(r[k].t_ns, t == HSKP_ARCHIVE_RAW);
+			printf(",%u", r[k].count);
+			if (ch >= 0)
+				printf(",%g,%g,%g", r[k].min[ch], r[k].max[ch], r[k].mean[ch]);
+			else
+				for (c = 0; c < a.header.nchan; c++)
+					printf(",%g", r[k].mean[c]);
+			printf("\n");
+		}
+		// carry on after the last one
+		if (n > 0)
+			t0 = r[n - 1].t_ns + (a.header.tier[t].interval_ns > 0 ? a.header.tier[t].interval_ns : 1);
+	} while (n == CHUNK);
+	free(r);
+	hskp_archive_close(&a);
+	return n < 0;
+}
@@ -48,3 +48,10 @@
 #define  SPI_READ_DIAT_WORDS 0x1300 /* cmd */
 
 #define  DWnull     0x0000   /* zero word */
+
+/* Functions shared by the modules linked into bp_test_pi */
+void transfer_message(unsigned short *message, unsigned short *data) ;
+void us_sleep(int us);
+void ms_sleep(int ms);
+void s_sleep(int s);
+unsigned long long monotonic_ns(void);
@@ -0,0 +1,49 @@
+/*
+ ============================================================================
+ Name        : trigger_mask.c
+ Description : TFPGA trigger mask state. The mask is sent as four frames of
+               eight words; keeping the last written mask lets a single word
+               be changed by resending only the frame that holds it.
+ ============================================================================
+ */
+#include <string.h>
+
+#include "spicomms.h"
+#include "bp_fault.h"
+#include "trigger_mask.h"
+
+unsigned short trigger_mask[TRIGGER_MASK_NWORDS];
+int trigger_mask_valid = 0;
+
+static const unsigned short trigger_mask_cw[4] = {
+	SPI_TRIGGERMASK_TFPGA, SPI_TRIGGERMASK1_TFPGA, SPI_TRIGGERMASK2_TFPGA, SPI_TRIGGERMASK3_TFPGA
+};
+
+/* Record a mask that has been written to the TFPGA elsewhere. */
+void trigger_mask_set(const unsigned short *mask) {
+	memcpy(trigger_mask, mask, sizeof(trigger_mask));
+	trigger_mask_valid = 1;
+}
+
+/* Send words 8*frame to 8*frame+7 of trigger_mask[], frame 0-3.
+   Returns -1 if the TFPGA never acknowledged the frame. */
+int trigger_mask_write_frame(int frame) {
+	unsigned short spi_message[11], data[11];
+	int i;
+
+	spi_message[0] = SPI_SOM_TFPGA; //som
+	spi_message[1] = trigger_mask_cw[frame]; //cw
+	for (i = 0; i < 8; i++)
+		spi_message[i+2] = trigger_mask[8*frame + i];
+	spi_message[10] = SPI_EOM_TFPGA; //not used
+	return transfer_checked("trigger_mask", spi_message, data);
+}
+
+int trigger_mask_write(void) {
+	int frame;
+	for (frame = 0; frame < 4; frame++)
+		if (trigger_mask_write_frame(frame) != 0)
+			return -1;
+	trigger_mask_valid = 1;
+	return 0;
+}
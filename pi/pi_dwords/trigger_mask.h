@@ -0,0 +1,22 @@
+/*
+ ============================================================================
+ Name        : trigger_mask.h
+ Description : TFPGA trigger mask state and SPI_TRIGGERMASK*_TFPGA writes
+ ============================================================================
+ */
+#ifndef TRIGGER_MASK_H
+#define TRIGGER_MASK_H
+
+#define TRIGGER_MASK_NWORDS 32
+
+/* Last mask written to the TFPGA, one word per trigger mask position as in
+   the trigger_mask file read by case 'j'. A set bit masks the group.
+   trigger_mask_valid is 0 until a complete mask has been written. */
+extern unsigned short trigger_mask[TRIGGER_MASK_NWORDS];
+extern int trigger_mask_valid;
+
+void trigger_mask_set(const unsigned short *mask);
+int trigger_mask_write_frame(int frame);
+int trigger_mask_write(void);
+
+#endif
@@ -0,0 +1,233 @@
+/*
+ ============================================================================
+ Name        : ws_pool.c
+ Description : Work-stealing thread pool for the offline tools.
+               Every worker owns a deque: it takes its own work newest
+               first, which keeps the chunks of a file it just loaded warm
+               in its cache, and an idle worker steals the oldest task of
+               another. Tasks are coarse (a file, a few thousand samples),
+               so each deque is guarded by its own mutex rather than being
+               lock free.
+ ============================================================================
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "ws_pool.h"
+
+struct ws_task {
+	ws_task_fn fn;
+	void *arg;
+	long begin;
+	long end;
+};
+
+struct ws_deque {
+	pthread_mutex_t lock;
+	struct ws_task *task;  // ring of capacity entries, tasks in [head, tail)
+	long capacity;
+	long head;
+	long tail;
+};
+
+struct ws_worker {
+	struct ws_pool *pool;
+	int id;
+	pthread_t thread;
+};
+
+struct ws_pool {
+	int nthreads;
+	struct ws_worker *worker;
+	struct ws_deque *deque;
+	pthread_mutex_t lock;
+	pthread_cond_t work;   // a task was queued or the pool is stopping
+	pthread_cond_t done;   // pending dropped to zero
+	long pending;          // queued or running tasks
+	long queued;           // tasks sitting in deques
+	long steals;
+	unsigned int next;     // deque for pushes from outside the pool
+	int stop;
+};
+
+static void deque_push_front(struct ws_deque *dq, const struct ws_task *task) {
+	struct ws_task *ring;
+	long i;
+
+	pthread_mutex_lock(&dq->lock);
+	if (dq->tail - dq->head == dq->capacity) {
+		ring = malloc(2 * dq->capacity * sizeof(*ring));
+		if (ring == NULL) {
+			fprintf(stderr, "ws_pool: out of memory\n");
+			exit(1);
+		}
+		for (i = dq->head; i < dq->tail; i++)
+			ring[i % (2 * dq->capacity)] = dq->task[i % dq->capacity];
+		free(dq->task);
+		dq->task = ring;
+		dq->capacity *= 2;
+	}
+	dq->task[dq->tail % dq->capacity] = *task;
+	dq->tail++;
+	pthread_mutex_unlock(&dq->lock);
+}
+
+/* Owner end: newest task */
+static int deque_pop_front(struct ws_deque *dq, struct ws_task *task) {
+	int ok = 0;
+
+	pthread_mutex_lock(&dq->lock);
+	if (dq->tail > dq->head) {
+		dq->tail--;
+		*task = dq->task[dq->tail % dq->capacity];
+		ok = 1;
+	}
+	pthread_mutex_unlock(&dq->lock);
+	return ok;
+}
+
+/* Thief end: oldest task */
+static int deque_pop_back(struct ws_deque *dq, struct ws_task *task) {
+	int ok = 0;
+
+	pthread_mutex_lock(&dq->lock);
+	if (dq->tail > dq->head) {
+		*task = dq->task[dq->head % dq->capacity];
+		dq->head++;
+		ok = 1;
+	}
+	pthread_mutex_unlock(&dq->lock);
+	return ok;
+}
+
+static int take_task(struct ws_pool *pool, int id, struct ws_task *task) {
+	int i, victim, stolen = 0;
+
+	if (!deque_pop_front(&pool->deque[id], task)) {
+		for (i = 1; i < pool->nthreads && !stolen; i++) {
+			victim = (id + i) % pool->nthreads;
+			stolen = deque_pop_back(&pool->deque[victim], task);
+		}
+		if (!stolen)
+			return 0;
+	}
+	pthread_mutex_lock(&pool->lock);
+	pool->queued--;
+	pool->steals += stolen;
+	pthread_mutex_unlock(&pool->lock);
+	return 1;
+}
+
+static void *worker_main(void *p) {
+	struct ws_worker *self = p;
+	struct ws_pool *pool = self->pool;
+	struct ws_task task;
+
+	for (;;) {
+		if (take_task(pool, self->id, &task)) {
+			task.fn(pool, self->id, task.arg, task.begin, task.end);
+			pthread_mutex_lock(&pool->lock);
+			if (--pool->pending == 0)
+				pthread_cond_broadcast(&pool->done);
+			pthread_mutex_unlock(&pool->lock);
+			continue;
+		}
+		pthread_mutex_lock(&pool->lock);
+		while (!pool->stop && pool->queued <= 0)
+			pthread_cond_wait(&pool->work, &pool->lock);
+		if (pool->stop && pool->queued <= 0) {
+			pthread_mutex_unlock(&pool->lock);
+			return NULL;
+		}
+		pthread_mutex_unlock(&pool->lock);
+	}
+}
+
+struct ws_pool *ws_pool_create(int nthreads) {
+	struct ws_pool *pool;
+	int i;
+
+	if (nthreads < 1)
+		nthreads = 1;
+	pool = calloc(1, sizeof(*pool));
+	if (pool == NULL)
+		return NULL;
+	pool->nthreads = nthreads;
+	pool->worker = calloc(nthreads, sizeof(*pool->worker));
+	pool->deque = calloc(nthreads, sizeof(*pool->deque));
+	if (pool->worker == NULL || pool->deque == NULL) {
+		free(pool->worker);
+		free(pool->deque);
+		free(pool);
+		return NULL;
+	}
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->work, NULL);
+	pthread_cond_init(&pool->done, NULL);
+	for (i = 0; i < nthreads; i++) {
+		pthread_mutex_init(&pool->deque[i].lock, NULL);
+		pool->deque[i].capacity = 64;
+		pool->deque[i].task = malloc(64 * sizeof(struct ws_task));
+		pool->worker[i].pool = pool;
+		pool->worker[i].id = i;
+	}
+	for (i = 0; i < nthreads; i++)
+		pthread_create(&pool->worker[i].thread, NULL, worker_main, &pool->worker[i]);
+	return pool;
+}
+
+/*
+	ws_pool_push()
+
+	Queue a task on worker's deque, worker < 0 spreads tasks pushed from
+	outside the pool round robin. Counted as pending before it becomes
+	visible, so ws_pool_wait() cannot see zero while it is in flight.
+*/
+void ws_pool_push(struct ws_pool *pool, int worker, ws_task_fn fn, void *arg, long begin, long end) {
+	struct ws_task task = {fn, arg, begin, end};
+
+	pthread_mutex_lock(&pool->lock);
+	if (worker < 0)
+		worker = pool->next++ % pool->nthreads;
+	pool->pending++;
+	pool->queued++;
+	pthread_mutex_unlock(&pool->lock);
+	deque_push_front(&pool->deque[worker], &task);
+	pthread_mutex_lock(&pool->lock);
+	pthread_cond_broadcast(&pool->work);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/* Block until every pushed task, and every task those pushed, has run */
+void ws_pool_wait(struct ws_pool *pool) {
+	pthread_mutex_lock(&pool->lock);
+	while (pool->pending > 0)
+		pthread_cond_wait(&pool->done, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+long ws_pool_steals(const struct ws_pool *pool) {
+	return pool->steals;
+}
+
+void ws_pool_destroy(struct ws_pool *pool) {
+	int i;
+
+	ws_pool_wait(pool);
+	pthread_mutex_lock(&pool->lock);
+	pool->stop = 1;
+	pthread_cond_broadcast(&pool->work);
+	pthread_mutex_unlock(&pool->lock);
+	for (i = 0; i < pool->nthreads; i++) {
+		pthread_join(pool->worker[i].thread, NULL);
+		pthread_mutex_destroy(&pool->deque[i].lock);
+		free(pool->deque[i].task);
+	}
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->work);
+	pthread_cond_destroy(&pool->done);
+	free(pool->worker);
+	free(pool->deque);
+	free(pool);
+}
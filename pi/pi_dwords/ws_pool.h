@@ -0,0 +1,22 @@
+/*
+ ============================================================================
+ Name        : ws_pool.h
+ Description : Work-stealing thread pool for the offline tools
+ ============================================================================
+ */
+#ifndef WS_POOL_H
+#define WS_POOL_H
+
+struct ws_pool;
+
+/* A task runs fn(pool, worker, arg, begin, end) on one of the workers and
+   may push further tasks, which go to the front of that worker's queue. */
+typedef void (*ws_task_fn)(struct ws_pool *pool, int worker, void *arg, long begin, long end);
+
+struct ws_pool *ws_pool_create(int nthreads);
+void ws_pool_push(struct ws_pool *pool, int worker, ws_task_fn fn, void *arg, long begin, long end);
+void ws_pool_wait(struct ws_pool *pool);
+long ws_pool_steals(const struct ws_pool *pool);
+void ws_pool_destroy(struct ws_pool *pool);
+
+#endif
@@ -0,0 +1,243 @@
+# asyncio client for the native backplane protocol of the Raspberry Pi
+# (bp_test_pi menu 'P', pi/pi_dwords/bp_pubsub.c and bp_request.c)
+
+__all__ = ['BackplaneClient', 'BackplaneError',
+           'HIT_PATTERN_DTYPE', 'RATE_DTYPE', 'HSKP_DTYPE']
+
+import asyncio
+import struct
+
+import numpy as np
+
+TOPICS = {'hp': 0, 'rate': 1, 'hskp': 2, 'event': 3}
+_TOPIC_NAMES = {n: t for t, n in TOPICS.items()}
+TOPIC_REPLY = 15
+DEFAULT_PORT = 5700
+
+# struct bp_pub_header, then the payload of each topic (bp_pubsub.h)
+_HEADER = [('topic', '<u2'), ('len', '<u2'), ('seq', '<u4'), ('t_ns', '<u8')]
+HIT_PATTERN_DTYPE = np.dtype(_HEADER + [
+    ('nstime', '<u8'), ('hwtriggers', '<u4'), ('pad', '<u4'),
+    ('hit_pattern', '<u2', (32,))])
+RATE_DTYPE = np.dtype(_HEADER + [
+    ('nstime', '<u8'), ('tacks', '<u4'), ('hwtriggers', '<u4'),
+    ('tack_rate_hz', '<f4'), ('hw_rate_hz', '<f4'),
+    ('spi_failed', '<u4'), ('pad', '<u4')])
+HSKP_DTYPE = np.dtype(_HEADER + [
+    ('nsweeps', '<u4'), ('spi_failed', '<u4'),
+    ('current', '<f4', (32,)), ('voltage', '<f4', (32,))])
+_DTYPES = {TOPICS['hp']: HIT_PATTERN_DTYPE, TOPICS['rate']: RATE_DTYPE,
+           TOPICS['hskp']: HSKP_DTYPE}
+_header = struct.Struct('<HHIQ')
+
+
+class BackplaneError(Exception):
+    """A request answered with ERR, or the connection to the Pi is gone."""
+
+
+class BackplaneClient():
+    """Non-blocking client for one backplane Pi, for use from asyncio.
+
+    One TCP connection carries both the live streams the client subscribed
+    to and any number of requests in flight, so a slow control server can
+    query the backplane hundreds of times a second without waiting on an
+    ssh session:
+
+        client = await BackplaneClient.connect('pi1', topics=['hp', 'rate'])
+        state = await client.trigger()
+        async for batch in client.stream('hp'):
+            print(batch['hwtriggers'], batch['hit_pattern'].shape)
+
+    Stream records arrive as numpy structured arrays (HIT_PATTERN_DTYPE,
+    RATE_DTYPE, HSKP_DTYPE), one array per topic for everything read from
+    the socket at once, decoded by numpy straight from the wire bytes.
+    Events arrive as lists of (seq, t_ns, text). Gaps in 'seq' are
+    messages the Pi skipped for this client under its policy.
+
+    The reader never waits for a consumer: if a subscribed topic is not
+    iterated, its oldest batches are dropped past max_batches and counted
+    in `dropped`, so requests keep being answered.
+    """
+
+    def __init__(self, reader, writer, topics, max_batches):
+        self._reader = reader
+        self._writer = writer
+        self._pending = {}
+        self._next_id = 0
+        self._queues = {TOPICS[t]: asyncio.Queue(maxsize=max_batches)
+                        for t in topics}
+        self.dropped = {t: 0 for t in topics}
+        self._task = None
+        self._closed = None
+
+    @classmethod
+    async def connect(cls, host, port=DEFAULT_PORT, topics=(),
+                      policy='block', queue=None, interval_ms=0,
+                      max_batches=256):
+        """Connect and subscribe.
+
+        Args:
+            host: The Pi running bp_test_pi menu 'P'. It listens on
+                127.0.0.1 unless bind is set in its bp_pubsub.yml, so
+                from elsewhere go through an ssh tunnel
+                (ssh -L 5700:localhost:5700 pi) and connect to localhost.
+            topics: Any of 'hp', 'rate', 'hskp', 'event'; none for a
+                connection that only sends requests.
+            policy: 'block' (nothing skipped, cut off a whole queue
+                behind), 'drop' (oldest skipped) or 'conflate' (latest of
+                each topic, at most every interval_ms).
+            queue: Messages the Pi may hold back for this client, default
+                its bp_pubsub.yml default_queue.
+        """
+        for topic in topics:
+            if topic not in TOPICS:
+                raise ValueError("unknown topic {}".format(topic))
+        reader, writer = await asyncio.open_connection(host, port)
+        line = "SUB {} {}".format(','.join(topics) or 'none', policy)
+        if queue is not None or interval_ms:
+            line += " {}".format(queue if queue is not None else 1)
+        if interval_ms:
+            line += " {}".format(int(interval_ms))
+        writer.write(line.encode() + b"\n")
+        answer = (await reader.readline()).decode().strip()
+        if not answer.startswith("OK"):
+            writer.close()
+            raise BackplaneError(answer or "connection closed")
+        client = cls(reader, writer, topics, max_batches)
+        client._task = asyncio.ensure_future(client._read())
+        return client
+
+    async def __aenter__(self):
+        return self
+
+    async def __aexit__(self, *exc):
+        await self.close()
+
+    async def close(self):
+        self._writer.close()
+        if self._task is not None:
+            await asyncio.gather(self._task, return_exceptions=True)
+
+    # Reading
+
+    def _put(self, topic, batch):
+        queue = self._queues.get(topic)
+        if queue is None:
+            return
+        if queue.full():
+            queue.get_nowait()
+            self.dropped[_TOPIC_NAMES[topic]] += 1
+        queue.put_nowait(batch)
+
+    def _dispatch(self, buf):
+        """Hand on every complete message in buf, return the bytes used."""
+        pos, end_of_data = 0, len(buf)
+        records = {}
+        events = []
+        while pos + _header.size <= end_of_data:
+            topic, length, seq, t_ns = _header.unpack_from(buf, pos)
+            end = pos + _header.size + length
+            if end > end_of_data:
+                break
+            if topic == TOPIC_REPLY:
+                future = self._pending.pop(seq, None)
+                if future is not None and not future.done():
+                    future.set_result(bytes(buf[pos + _header.size:end]).decode())
+            elif topic == TOPICS['event']:
+                events.append((seq, t_ns, bytes(buf[pos + _header.size:end]).decode()))
+            elif topic in _DTYPES and end - pos == _DTYPES[topic].itemsize:
+                records.setdefault(topic, []).append(buf[pos:end])
+            pos = end
+        for topic, parts in records.items():
+            self._put(topic, np.frombuffer(b''.join(parts), dtype=_DTYPES[topic]))
+        if events:
+            self._put(TOPICS['event'], events)
+        return pos
+
+    async def _read(self):
+        buf = bytearray()
+        try:
+            while True:
+                chunk = await self._reader.read(1 << 16)
+                if not chunk:
+                    break
+                buf += chunk
+                del buf[:self._dispatch(buf)]
+        except (ConnectionError, asyncio.CancelledError):
+            pass
+        finally:
+            self._closed = BackplaneError("connection to the backplane closed")
+            for future in self._pending.values():
+                if not future.done():
+                    future.set_exception(self._closed)
+            self._pending.clear()
+            for topic in self._queues:
+                self._put(topic, None)
+
+    async def stream(self, topic):
+        """Batches of one subscribed topic until the connection closes."""
+        queue = self._queues[TOPICS[topic]]
+        while True:
+            batch = await queue.get()
+            if batch is None:
+                queue.put_nowait(None)   # for any other iterator
+                return
+            yield batch
+
+    # Requests
+
+    async def request(self, text, timeout=5.0):
+        """Send 'REQ <id> text', return what follows OK in the answer."""
+        if self._closed is not None:
+            raise self._closed
+        self._next_id = (self._next_id + 1) & 0xffffffff
+        request_id = self._next_id
+        future = asyncio.get_event_loop().create_future()
+        self._pending[request_id] = future
+        self._writer.write("REQ {} {}\n".format(request_id, text).encode())
+        try:
+            await self._writer.drain()
+            answer = await asyncio.wait_for(future, timeout)
+        finally:
+            self._pending.pop(request_id, None)
+        status, _, rest = answer.partition(' ')
+        if status != "OK":
+            raise BackplaneError(rest or answer)
+        return rest
+
+    async def ping(self):
+        await self.request("ping")
+
+    async def trigger(self):
+        """TFPGA counters and rates of the latest read."""
+        values = (await self.request("trigger")).split()
+        names = ('nstime', 'tacks', 'hwtriggers', 'tack_rate_hz',
+                 'hw_rate_hz', 'nreads', 'ntriggers', 'spi_failed')
+        return {name: (float(v) if '.' in v else int(v))
+                for name, v in zip(names, values)}
+
+    async def hit_pattern(self):
+        """(nstime, hwtriggers, 32 uint16 words) of the latest read."""
+        nstime, hwtriggers, words = (await self.request("hit_pattern")).split(' ', 2)
+        return int(nstime), int(hwtriggers), _hex_words(words)
+
+    async def hskp(self):
+        """Latest FEE sweep: nsweeps, spi_failed, current [A] and voltage
+        [V] of slots 0-31 as float arrays."""
+        values = np.array((await self.request("hskp")).split(), dtype=float)
+        return {'nsweeps': int(values[0]), 'spi_failed': int(values[1]),
+                'current': values[2:34], 'voltage': values[34:66]}
+
+    async def frame(self, *words):
+        """One SPI frame, SOM and CW first, the 11 words read back.
+
+        Sent once, never retried. Refused unless allow_frames is set in
+        the Pi's bp_pubsub.yml.
+        """
+        text = ' '.join('{:04x}'.format(w) for w in words)
+        return _hex_words(await self.request("frame " + text))
+
+
+def _hex_words(text):
+    """'0123 abcd ...' to a uint16 array without a Python loop."""
+    return np.frombuffer(bytes.fromhex(text.replace(' ', '')), dtype='>u2').astype(np.uint16)
@@ -212,6 +212,19 @@ class BackplaneController(DeviceController):
             voltage = self._read_modules()
             # print("voltage:", voltage)
             update = self.write_multiple_update('voltage', voltage)
+        elif cmd == "read_changed_housekeeping":
+            # Only the FEE I/V and ENV channels that moved past their
+            # deadband on the Pi (hskp_deadband.yml), keyed by channel
+            # name (I00..I31, V00..V31, DACQ1_I..ENV4)
+            self._ssh.sendline('C')
+            changed = {}
+            while True:
+                self._ssh.expect(r"HK (\S+) (\S+) [^\r\n]*\r\n")
+                channel, value = self._ssh.match.groups()
+                if channel == "end":
+                    break
+                changed[channel] = value
+            update = self.write_multiple_update('housekeeping', changed)
         elif cmd == "read_hit_pattern":
             display = command.args.get('display', False)
             hit_pattern = self._read_hit_pattern(display=display)